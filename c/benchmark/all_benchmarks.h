@@ -8,6 +8,7 @@ extern "C" {
 #include "benchmark.h"
 
 void bm_vint_io(BenchMark *bm);
+void bm_vint_decoding(BenchMark *bm);
 void bm_strcmp_when_length_is_known(BenchMark *bm);
 void bm_snprintf_vs_strncat(BenchMark *bm);
 void bm_hash_implementations(BenchMark *bm);
@@ -20,6 +21,7 @@ const struct BenchMarkList
     char *name;
 } all_benchmarks[] = {
     {bm_vint_io, "vint_io"},
+    {bm_vint_decoding, "vint_decoding"},
     {bm_strcmp_when_length_is_known, "strcmp_when_length_is_known"},
     {bm_snprintf_vs_strncat, "snprintf_vs_strncat"},
     {bm_hash_implementations, "hash_implementations"},
@@ -91,3 +91,77 @@ BENCH(vint_io)
     BM_ADD(unrolled_vint_out);
     //BM_ADD(high_bit_vint_in);
 }
+
+#define VINT_CNT 10000000
+#define VINT_BLOCK 128
+
+static Store *vint_store = NULL;
+
+/*
+ * Write vints shaped like a postings list. Mostly small doc deltas with the
+ * freq=1 bit set, with the occasional freq or long gap.
+ */
+static void vint_in_setup()
+{
+    int i;
+    unsigned int r = 1;
+    OutStream *os;
+
+    vint_store = open_ram_store();
+    os = vint_store->new_output(vint_store, "vints");
+    for (i = 0; i < VINT_CNT; i++) {
+        r = r * 1103515245 + 12345;
+        switch ((r >> 16) % 32) {
+            case 0:  os_write_vint(os, (r >> 8) & 0xffff); break;
+            case 1:
+            case 2:  os_write_vint(os, (r >> 8) & 0x3fff); break;
+            default: os_write_vint(os, (r >> 8) & 0x7f);   break;
+        }
+    }
+    os_close(os);
+}
+
+static void vint_in_teardown()
+{
+    store_deref(vint_store);
+    vint_store = NULL;
+}
+
+static void vint_in()
+{
+    int i;
+    unsigned int sum = 0;
+    InStream *is = vint_store->open_input(vint_store, "vints");
+
+    for (i = 0; i < VINT_CNT; i++) {
+        sum += is_read_vint(is);
+    }
+    is_close(is);
+    if (sum == 1) printf("unlikely\n"); /* don't let the loop be optimized away */
+}
+
+static void bulk_vint_in()
+{
+    int i, j;
+    unsigned int sum = 0;
+    unsigned int vints[VINT_BLOCK];
+    InStream *is = vint_store->open_input(vint_store, "vints");
+
+    for (i = 0; i < VINT_CNT; i += VINT_BLOCK) {
+        int n = VINT_CNT - i < VINT_BLOCK ? VINT_CNT - i : VINT_BLOCK;
+        is_read_vints(is, vints, n);
+        for (j = 0; j < n; j++) {
+            sum += vints[j];
+        }
+    }
+    is_close(is);
+    if (sum == 1) printf("unlikely\n");
+}
+
+BENCH(vint_decoding)
+{
+    BM_SETUP(vint_in_setup);
+    BM_TEARDOWN(vint_in_teardown);
+    BM_ADD(vint_in);
+    BM_ADD(bulk_vint_in);
+}
@@ -21,11 +21,19 @@ typedef struct FrtStringIndex {
     int v_capa;
 } FrtStringIndex;
 
+/*
+ * +handle_term+ fills in the index for the documents +tde+ has for the term
+ * +text+ when the field is un-inverted. +handle_docs+ does the same for the
+ * +doc_cnt+ documents in +docs+ when the index is loaded from the field's
+ * doc values. Either way the terms are handled in sorted order.
+ */
 typedef struct FrtFieldIndexClass {
     const char *type;
     void *(*create_index)(int size);
     void  (*destroy_index)(void *p);
     void  (*handle_term)(void *index, FrtTermDocEnum *tde, const char *text);
+    void  (*handle_docs)(void *index, const int *docs, int doc_cnt,
+                         const char *text);
 } FrtFieldIndexClass;
 
 typedef struct FrtFieldIndex {
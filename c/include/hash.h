@@ -482,8 +482,9 @@ extern FrtHash *frt_h_clone(FrtHash *self,
 /**
  * This is the lookup function for a hash table with non-string keys. The
  * hash() and eq() methods used are stored in the hash table. This method will
- * always return a HashEntry. If there is no entry with the given key then an
- * empty entry will be returned with the key set to the key that was passed.
+ * always return a HashEntry. If there is no entry with the given key then the
+ * empty entry it would go in is returned. The table isn't written to so
+ * threads can share a Hash they only read.
  *
  * @param ht the hash table to look in
  * @param key the key to lookup
@@ -8,6 +8,7 @@ extern "C" {
 #include "search.h"
 #include "index.h"
 #include "symbol.h"
+#include <time.h>
 
 /***************************************************************************
  *
@@ -15,6 +16,20 @@ extern "C" {
  *
  ***************************************************************************/
 
+/*
+ * Normally the Index has either an IndexWriter or an IndexReader open and
+ * closes one to open the other, so interleaved writes and searches flush a
+ * segment and drop the reader's caches every time they alternate.
+ *
+ * With +keep_writer+ set the IndexWriter stays open alongside the reader.
+ * Adds and deletes by term, id or query go through the writer, which buffers
+ * them, and the reader is refreshed from the writer with iw_get_reader,
+ * without a commit, once +refresh_writes+ writes have been made (if it is
+ * greater than 0) or at most every +refresh_interval+ seconds. Searches may
+ * not see the latest writes until then; index_flush commits the writer and
+ * refreshes the reader at once. Deletes by document number still need the
+ * reader to hold the write lock so they close the writer.
+ */
 typedef struct FrtIndex
 {
     FrtConfig config;
@@ -28,10 +43,15 @@ typedef struct FrtIndex
     FrtHashSet *key;
     FrtSymbol id_field;
     FrtSymbol def_field;
+    int refresh_writes;
+    int refresh_interval;
+    int write_cnt;
+    time_t refreshed_at;
     /* for FrtIndexWriter */
     bool auto_flush : 1;
     bool has_writes : 1;
     bool check_latest : 1;
+    bool keep_writer : 1;
 } FrtIndex;
 
 extern FrtIndex *frt_index_new(FrtStore *store, FrtAnalyzer *analyzer,
@@ -15,6 +15,7 @@ extern "C" {
 #include "similarity.h"
 #include "bitvector.h"
 #include "priorityqueue.h"
+#include "thread_pool.h"
 
 typedef struct FrtIndexReader FrtIndexReader;
 typedef struct FrtMultiReader FrtMultiReader;
@@ -28,6 +29,30 @@ extern bool frt_file_name_filter_is_index_file(const char *file_name, bool inclu
  *
  ****************************************************************************/
 
+/*
+ * The encoding of the postings in the .frq file. FRT_POSTINGS_FORMAT_VINT
+ * writes each document delta and frequency as a VInt.
+ * FRT_POSTINGS_FORMAT_BLOCK bit-packs them in blocks of
+ * FRT_POSTINGS_BLOCK_SIZE documents with patched exceptions, which is
+ * smaller and much faster to decode and skip through for high frequency
+ * terms.
+ */
+typedef enum
+{
+    FRT_POSTINGS_FORMAT_VINT = 0,
+    FRT_POSTINGS_FORMAT_BLOCK = 1
+} FrtPostingsFormat;
+
+#define FRT_POSTINGS_BLOCK_SIZE 128
+
+/*
+ * The maximum number of levels in a term's skip list. Level 0 has an entry
+ * every skip interval documents (every block for FRT_POSTINGS_FORMAT_BLOCK)
+ * and each level above it has an entry for every skip_interval entries of
+ * the level below.
+ */
+#define FRT_MAX_SKIP_LEVELS 10
+
 typedef struct FrtConfig
 {
     int chunk_size;
@@ -39,6 +64,13 @@ typedef struct FrtConfig
     int max_merge_docs;
     int max_field_length;
     bool use_compound_file;
+    FrtPostingsFormat postings_format;
+    int max_doc_writers;
+    int max_merge_threads;
+    int max_pending_merges;
+    int merge_rate_limit;
+    int merge_stage_threads;
+    int analysis_threads;
 } FrtConfig;
 
 extern const FrtConfig frt_default_config;
@@ -103,6 +135,16 @@ typedef enum
 #define FRT_FI_STORE_TERM_VECTOR_BM 0x020
 #define FRT_FI_STORE_POSITIONS_BM   0x040
 #define FRT_FI_STORE_OFFSETS_BM     0x080
+/* keep a bloom filter of the field's terms in each segment so lookups of
+ * terms a segment doesn't have can skip it without touching its dictionary.
+ * Set it in a field's bits before the field is added to the FieldInfos. */
+#define FRT_FI_BLOOM_FILTER_BM      0x100
+/* write the field's value for each document to a column in the segment's
+ * .dvs file (see "Doc Values" in index.c) so sorting by the field can load
+ * the column rather than un-invert the field. Only indexed fields have doc
+ * values and, like FRT_FI_BLOOM_FILTER_BM, it has to be set before the field
+ * is added to the FieldInfos. */
+#define FRT_FI_DOC_VALUES_BM        0x200
 
 typedef struct FrtFieldInfo
 {
@@ -128,6 +170,8 @@ extern void frt_fi_deref(FrtFieldInfo *fi);
 #define fi_store_term_vector(fi) (((fi)->bits & FRT_FI_STORE_TERM_VECTOR_BM) != 0)
 #define fi_store_positions(fi)   (((fi)->bits & FRT_FI_STORE_POSITIONS_BM) != 0)
 #define fi_store_offsets(fi)     (((fi)->bits & FRT_FI_STORE_OFFSETS_BM) != 0)
+#define fi_has_bloom_filter(fi)  (((fi)->bits & FRT_FI_BLOOM_FILTER_BM) != 0)
+#define fi_has_doc_values(fi)    (((fi)->bits & FRT_FI_DOC_VALUES_BM) != 0)
 #define fi_has_norms(fi)\
     (((fi)->bits & (FRT_FI_OMIT_NORMS_BM|FRT_FI_IS_INDEXED_BM)) == FRT_FI_IS_INDEXED_BM)
 
@@ -183,6 +227,14 @@ typedef struct FrtSegmentInfo
     int *norm_gens;
     int norm_gens_size;
     bool use_compound_file;
+    FrtPostingsFormat postings_format;
+    int max_skip_levels;
+    bool has_max_freqs;
+    /* cached for the merge policy, valid while del_gen == stats_del_gen */
+    bool has_stats;
+    int stats_del_gen;
+    int del_cnt;
+    off_t size;
 } FrtSegmentInfo;
 
 extern FrtSegmentInfo *frt_si_new(char *name, int doc_cnt, FrtStore *store);
@@ -233,12 +285,19 @@ extern void frt_sis_put(FrtSegmentInfos *sis, FILE *stream);
  *
  ****************************************************************************/
 
+/* A term which occurs once in a single document is +pulsed+. Its document
+ * and position are stored in its term dictionary entry instead of the .frq
+ * and .prx files so reading its postings needs no seek. The pointers of a
+ * pulsed term are still valid, they just have nothing behind them. */
 typedef struct FrtTermInfo
 {
     int doc_freq;
     off_t frq_ptr;
     off_t prx_ptr;
     off_t skip_offset;
+    bool pulsed;
+    int pulsed_doc;
+    int pulsed_pos;
 } FrtTermInfo;
 
 #define frt_ti_set(ti, mdf, mfp, mpp, mso) do {\
@@ -246,6 +305,7 @@ typedef struct FrtTermInfo
     (ti).frq_ptr = mfp;\
     (ti).prx_ptr = mpp;\
     (ti).skip_offset = mso;\
+    (ti).pulsed = false;\
 } while (0)
 
 /****************************************************************************
@@ -281,14 +341,25 @@ FrtTermInfo *frt_te_get_ti(struct FrtTermEnum *te);
 
 /* * FrtSegmentTermIndex * */
 
+/* The index terms of a field are held in a minimal FST (see the "Term Index
+ * FST" section of index.c) rather than as an array of strings. +fst_ptr+ is
+ * the position of the field's FST in the segment's .fst file or -1 for
+ * segments written before the file existed, in which case the FST is built
+ * from the .tix terms when the index is first read. +bloom+ is the field's
+ * bloom filter (see "Term Bloom Filters" in index.c) or NULL if it has none.
+ */
 typedef struct FrtSegmentTermIndex
 {
     off_t       index_ptr;
     off_t       ptr;
+    off_t       fst_ptr;
     int         index_cnt;
     int         size;
-    char      **index_terms;
-    int        *index_term_lens;
+    int         fst_root;
+    frt_uchar  *fst;
+    frt_uchar  *bloom;
+    frt_u32     bloom_mask;
+    int         bloom_hash_cnt;
     FrtTermInfo   *index_term_infos;
     off_t      *index_ptrs;
 } FrtSegmentTermIndex;
@@ -302,8 +373,12 @@ typedef struct FrtSegmentFieldIndex
     frt_mutex_t     mutex;
     int         skip_interval;
     int         index_interval;
+    bool        term_blocks;
+    bool        pulsed;
+    bool        bloom_filters;
     off_t       index_ptr;
     FrtTermEnum   *index_te;
+    FrtInStream   *fst_in;
     FrtHash  *field_dict;
 } FrtSegmentFieldIndex;
 
@@ -312,6 +387,10 @@ extern void frt_sfi_close(FrtSegmentFieldIndex *sfi);
 
 
 /* * FrtSegmentTermEnum * */
+
+/* When +term_blocks+ is set the terms are read a block at a time (see "Term
+ * Blocks" in index.c). +block+ holds the current block, which starts at term
+ * +block_start+, and +suffixes+ and +stats+ are offsets into it. */
 struct FrtSegmentTermEnum
 {
     FrtTermEnum    te;
@@ -320,6 +399,18 @@ struct FrtSegmentTermEnum
     int         pos;
     int         skip_interval;
     FrtSegmentFieldIndex *sfi;
+    bool        term_blocks;
+    bool        pulsed;
+    frt_uchar  *block;
+    int         block_capa;
+    int         block_start;
+    int         block_cnt;
+    int         block_width;
+    int         prefix_len;
+    int         suffixes;
+    int         suffixes_len;
+    int         stats;
+    FrtTermInfo    block_base;
 };
 
 extern void frt_ste_close(FrtTermEnum *te);
@@ -344,6 +435,7 @@ typedef struct FrtTermInfosReader
     void       **te_bucket;
     FrtTermEnum     *orig_te;
     int          field_num;
+    int          lookup_buffer_size;
 } FrtTermInfosReader;
 
 extern FrtTermInfosReader *frt_tir_open(FrtStore *store,
@@ -371,6 +463,10 @@ typedef struct FrtTermWriter
     FrtOutStream *os;
 } FrtTermWriter;
 
+typedef struct FrtFstBuilder FrtFstBuilder;
+typedef struct FrtTermBlockWriter FrtTermBlockWriter;
+typedef struct FrtBloomFilterWriter FrtBloomFilterWriter;
+
 typedef struct FrtTermInfosWriter
 {
     int field_count;
@@ -378,12 +474,20 @@ typedef struct FrtTermInfosWriter
     int skip_interval;
     off_t last_index_ptr;
     FrtOutStream *tfx_out;
+    FrtOutStream *fst_out;
     FrtTermWriter *tix_writer;
     FrtTermWriter *tis_writer;
+    FrtFstBuilder *fst_builder;
+    FrtTermBlockWriter *block;
+    FrtFieldInfos *fis;
+    FrtBloomFilterWriter *bloom;
 } FrtTermInfosWriter;
 
+/* +fis+ is only used to find the fields which want bloom filters and may be
+ * NULL */
 extern FrtTermInfosWriter *frt_tiw_open(FrtStore *store,
                                  const char *segment,
+                                 FrtFieldInfos *fis,
                                  int index_interval,
                                  int skip_interval);
 extern void frt_tiw_start_field(FrtTermInfosWriter *tiw, int field_num);
@@ -412,8 +516,25 @@ struct FrtTermDocEnum
     bool (*skip_to)(FrtTermDocEnum *tde, int target);
     int  (*next_position)(FrtTermDocEnum *tde);
     void (*close)(FrtTermDocEnum *tde);
+    /* Optional. An upper bound on the freq of every document for the current
+     * term, or INT_MAX if there is no better bound */
+    int  (*max_freq)(FrtTermDocEnum *tde);
 };
 
+/* * FrtSkipLevel * */
+
+typedef struct FrtSkipLevel
+{
+    FrtInStream *is;
+    off_t start;             /* start of the level in the .frq file */
+    int   entry_cnt;         /* number of entries in the level */
+    int   entry_num;         /* number of the entry last read, 1 based */
+    int   doc;               /* values of the entry last read */
+    off_t frq_ptr;
+    off_t prx_ptr;
+    off_t child_ptr;         /* matching entry's position in the level below */
+} FrtSkipLevel;
+
 /* * FrtSegmentTermDocEnum * */
 
 typedef struct FrtSegmentTermDocEnum FrtSegmentTermDocEnum;
@@ -422,34 +543,48 @@ struct FrtSegmentTermDocEnum
     FrtTermDocEnum tde;
     void (*seek_prox)(FrtSegmentTermDocEnum *stde, off_t prx_ptr);
     void (*skip_prox)(FrtSegmentTermDocEnum *stde);
+    int  (*read_postings)(FrtSegmentTermDocEnum *stde, int *docs, int *freqs,
+                          int n);
     FrtTermInfosReader *tir;
     FrtInStream        *frq_in;
     FrtInStream        *prx_in;
-    FrtInStream        *skip_in;
     FrtBitVector       *deleted_docs;
     int count;               /* number of docs for this term  skipped */
     int doc_freq;            /* number of doc this term appears in */
     int doc_num;
     int freq;
-    int num_skips;
-    int skip_interval;
-    int skip_count;
-    int skip_doc;
+    int skip_interval;       /* documents per level 0 skip entry */
+    int skip_multiplier;     /* entries per entry of the level above */
+    int max_skip_levels;
+    int skip_level_cnt;      /* number of skip levels for this term */
+    int max_freq;            /* cached max_freq of this term or -1 */
     int prx_cnt;
     int position;
     off_t frq_ptr;
     off_t prx_ptr;
     off_t skip_ptr;
+    int *doc_buf;            /* decoded block for FRT_POSTINGS_FORMAT_BLOCK */
+    int *freq_buf;
+    int buf_pos;
+    int buf_cnt;
+    int pulsed_doc;          /* the posting of a pulsed term */
+    int pulsed_pos;
+    FrtSkipLevel skip_levels[FRT_MAX_SKIP_LEVELS];
+    FrtSkipLevel skipped[FRT_MAX_SKIP_LEVELS]; /* last entry skipped to in
+                                                * each level */
     bool have_skipped : 1;
+    bool has_max_freqs : 1;
+    bool pulsed : 1;
 };
 
 extern FrtTermDocEnum *frt_stde_new(FrtTermInfosReader *tir, FrtInStream *frq_in,
-                             FrtBitVector *deleted_docs, int skip_interval);
+                             FrtBitVector *deleted_docs, int skip_interval,
+                             FrtSegmentInfo *si);
 
 /* * FrtSegmentTermDocEnum * */
 extern FrtTermDocEnum *frt_stpe_new(FrtTermInfosReader *tir, FrtInStream *frq_in,
                              FrtInStream *prx_in, FrtBitVector *deleted_docs,
-                             int skip_interval);
+                             int skip_interval, FrtSegmentInfo *si);
 
 /****************************************************************************
  * MultipleTermDocPosEnum
@@ -474,31 +609,75 @@ extern FrtOffset *frt_offset_new(off_t start, off_t end);
 
 /****************************************************************************
  *
- * FrtOccurence
+ * FrtByteBlockPool
  *
  ****************************************************************************/
 
-typedef struct FrtOccurence
+/*
+ * Holds the postings of the documents buffered by a DocWriter as byte
+ * slices. A slice is a growable stream of bytes addressed by an int offset
+ * into the pool. It starts out a few bytes long and when it fills up, its
+ * last four bytes are replaced by the offset of a bigger slice it continues
+ * in. Blocks are kept, cleared, when the pool is reset so that they can be
+ * reused.
+ */
+#define FRT_BYTE_BLOCK_SHIFT 15
+#define FRT_BYTE_BLOCK_SIZE (1 << FRT_BYTE_BLOCK_SHIFT)
+#define FRT_BYTE_BLOCK_MASK (FRT_BYTE_BLOCK_SIZE - 1)
+
+typedef struct FrtByteBlockPool
 {
-    struct FrtOccurence *next;
-    int pos;
-} FrtOccurence;
-
-/****************************************************************************
- *
- * FrtPosting
- *
- ****************************************************************************/
-
-typedef struct FrtPosting
+    frt_uchar **blocks;
+    int block_cnt;
+    int block_alloc;
+    int block_capa;
+    int upto;
+} FrtByteBlockPool;
+
+extern FrtByteBlockPool *frt_bbp_new();
+extern void frt_bbp_reset(FrtByteBlockPool *bbp);
+extern void frt_bbp_destroy(FrtByteBlockPool *bbp);
+extern int frt_bbp_used(FrtByteBlockPool *bbp);
+
+/**
+ * Start a new slice in the pool and return its offset, which is where the
+ * first byte will be written.
+ */
+extern int frt_bbp_new_slice(FrtByteBlockPool *bbp);
+
+/**
+ * Write +num+ in VINT format to the slice whose next byte is at +*upto+,
+ * moving the slice on to a new one if it is full. +*upto+ is left pointing
+ * at the byte after the VINT.
+ */
+extern void frt_bbp_write_vint(FrtByteBlockPool *bbp, int *upto,
+                               unsigned int num);
+
+typedef struct FrtByteSliceReader
 {
-    int freq;
-    int doc_num;
-    FrtOccurence *first_occ;
-    struct FrtPosting *next;
-} FrtPosting;
-
-extern FrtPosting *frt_p_new(FrtMemoryPool *mp, int doc_num, int pos);
+    FrtByteBlockPool *bbp;
+    frt_uchar *buf;
+    int buf_offset;
+    int level;
+    int upto;
+    int limit;
+    int end;
+} FrtByteSliceReader;
+
+/**
+ * Read the bytes written to a slice from offset +start+ up to, but not
+ * including, offset +end+.
+ */
+extern void frt_bsr_init(FrtByteSliceReader *bsr, FrtByteBlockPool *bbp,
+                         int start, int end);
+extern bool frt_bsr_eof(FrtByteSliceReader *bsr);
+extern unsigned int frt_bsr_read_vint(FrtByteSliceReader *bsr);
+
+/**
+ * Copy the next +cnt+ VINTs from the slice to +os+ without decoding them.
+ */
+extern void frt_bsr_copy_vints(FrtByteSliceReader *bsr, FrtOutStream *os,
+                               int cnt);
 
 /****************************************************************************
  *
@@ -506,20 +685,50 @@ extern FrtPosting *frt_p_new(FrtMemoryPool *mp, int doc_num, int pos);
  *
  ****************************************************************************/
 
+/*
+ * The postings of a term in the documents buffered by a DocWriter, encoded
+ * the way they are written to the .frq and .prx files. The frq slice holds
+ * a VINT encoded doc delta and freq for every document but the last, whose
+ * freq is still being counted. The prx slice holds the delta encoded
+ * positions of every document.
+ *
+ * If the field stores term vector positions, the positions of +last_doc+
+ * are also written to a slice in +tv_bbp+, a pool which is reset after
+ * every document, so that they can be copied to the term vectors.
+ * +tv_bbp+ is NULL for every other field.
+ */
 typedef struct FrtPostingList
 {
     const char *term;
     int term_len;
-    FrtPosting *first;
-    FrtPosting *last;
-    FrtOccurence *last_occ;
+    int prev_doc;
+    int last_doc;
+    int freq;
+    int last_pos;
+    int frq_start;
+    int frq_upto;
+    int prx_start;
+    int prx_upto;
+    int tv_start;
+    int tv_upto;
 } FrtPostingList;
 
-extern FrtPostingList *frt_pl_new(FrtMemoryPool *mp, const char *term,
-                           int term_len, FrtPosting *p);
-extern void frt_pl_add_occ(FrtMemoryPool *mp, FrtPostingList *pl, int pos);
+extern FrtPostingList *frt_pl_new(FrtMemoryPool *mp, FrtByteBlockPool *bbp,
+                                  FrtByteBlockPool *tv_bbp, const char *term,
+                                  int term_len, int doc_num);
+extern void frt_pl_add_doc(FrtByteBlockPool *bbp, FrtByteBlockPool *tv_bbp,
+                           FrtPostingList *pl, int doc_num);
+extern void frt_pl_add_pos(FrtByteBlockPool *bbp, FrtByteBlockPool *tv_bbp,
+                           FrtPostingList *pl, int pos);
 extern int frt_pl_cmp(const FrtPostingList **pl1, const FrtPostingList **pl2);
 
+/**
+ * Sort an array of PostingLists by term. This gives the same order as
+ * qsorting with frt_pl_cmp but it is a radix sort on the term bytes which
+ * is a lot quicker for the large arrays sorted when a segment is flushed.
+ */
+extern void frt_pl_sort(FrtPostingList **pls, int cnt);
+
 /****************************************************************************
  *
  * FrtTVField
@@ -655,6 +864,7 @@ extern void frt_fw_close(FrtFieldsWriter *fw);
 extern void frt_fw_add_doc(FrtFieldsWriter *fw, FrtDocument *doc);
 extern void frt_fw_add_postings(FrtFieldsWriter *fw,
                             int field_num,
+                            FrtByteBlockPool *tv_bbp,
                             FrtPostingList **plists,
                             int posting_count,
                             FrtOffset *offsets,
@@ -686,6 +896,61 @@ extern void frt_deleter_find_deletable_files(FrtDeleter *dlr);
 extern void frt_deleter_commit_pending_files(FrtDeleter *dlr);
 extern void frt_deleter_delete_files(FrtDeleter *dlr, char **files, int file_cnt);
 
+/****************************************************************************
+ *
+ * FrtDocValues
+ *
+ ****************************************************************************/
+
+/*
+ * The values of a field for each of +size+ documents. +terms+ holds the
+ * field's distinct values in sorted order and +ords+ each document's value
+ * as an index into +terms+ plus one, so 0 means the document has no value.
+ * A document with more than one term in the field gets the greatest, which
+ * is the value un-inverting the field gives it. The term strings belong to
+ * +term_buf+ if it is set, otherwise to whatever the DocValues were made
+ * from.
+ *
+ * DocValues read from a segment's .dvs file have no +ords+. Theirs are
+ * packed +ord_bits+ to an ord in +packed_ords+ instead, which, like the
+ * terms, lie in the file's mapping if the store is memory-mapped. Use
+ * frt_dv_get_ord to read an ord either way.
+ */
+typedef struct FrtDocValues
+{
+    int size;
+    int term_cnt;
+    char **terms;
+    int *ords;
+    const frt_uchar *packed_ords;
+    int ord_bits;
+    char *term_buf;
+} FrtDocValues;
+
+extern void frt_dv_destroy(FrtDocValues *dv);
+extern int frt_dv_get_ord(FrtDocValues *dv, int doc_num);
+
+/*
+ * Returns the DocValues of +dv_cnt+ DocValues laid end to end, with their
+ * terms merged so the ords of the result are in the same order as the
+ * terms. The terms are shared with +dvs+ which must outlive the result.
+ */
+extern FrtDocValues *frt_dv_merge(FrtDocValues **dvs, int dv_cnt);
+
+/*
+ * Returns the doc values written for field +field_num+ of the segment +ir+
+ * reads, or NULL if +ir+ isn't a segment reader or the segment has none for
+ * the field. They include deleted documents and belong to the reader.
+ */
+extern FrtDocValues *frt_ir_get_doc_values(FrtIndexReader *ir, int field_num);
+
+/*
+ * Builds the doc values of field +field_num+ from its terms, leaving out
+ * deleted documents. They belong to the caller.
+ */
+extern FrtDocValues *frt_ir_uninvert_doc_values(FrtIndexReader *ir,
+                                                int field_num);
+
 /****************************************************************************
  *
  * FrtIndexReader
@@ -735,6 +1000,7 @@ struct FrtIndexReader
     FrtHash    *field_index_cache;
     frt_mutex_t             field_index_mutex;
     frt_uchar              *fake_norms;
+    FrtHash    *used_norms;
     frt_mutex_t             mutex;
     bool                has_changes : 1;
     bool                is_stale    : 1;
@@ -743,6 +1009,19 @@ struct FrtIndexReader
 
 extern FrtIndexReader *frt_ir_create(FrtStore *store, FrtSegmentInfos *sis, int is_owner);
 extern FrtIndexReader *frt_ir_open(FrtStore *store);
+
+/*
+ * Opens a reader on the latest version of the index +ir+ was opened on. The
+ * open files of segments +ir+ already has are shared with it, along with any
+ * deletions and norms which haven't been rewritten since, so only new
+ * segments and changed deletions and norms are read.
+ *
+ * If +ir+ is already the latest version it is returned as is. Otherwise +ir+
+ * is left open and still has to be closed by the caller. Uncommitted changes
+ * made through +ir+ are not carried over to the new reader. Only readers
+ * opened with frt_ir_open can be reopened.
+ */
+extern FrtIndexReader *frt_ir_reopen(FrtIndexReader *ir);
 extern int frt_ir_get_field_num(FrtIndexReader *ir, FrtSymbol field);
 extern bool frt_ir_index_exists(FrtStore *store);
 extern void frt_ir_close(FrtIndexReader *ir);
@@ -755,6 +1034,8 @@ extern void frt_ir_set_norm(FrtIndexReader *ir, int doc_num, FrtSymbol field,
 extern frt_uchar *frt_ir_get_norms_i(FrtIndexReader *ir, int field_num);
 extern frt_uchar *frt_ir_get_norms(FrtIndexReader *ir, FrtSymbol field);
 extern frt_uchar *frt_ir_get_norms_into(FrtIndexReader *ir, FrtSymbol field, frt_uchar *buf);
+extern float frt_ir_get_max_norm(FrtIndexReader *ir, FrtSymbol field,
+                                 FrtSimilarity *sim);
 extern void frt_ir_destroy(FrtIndexReader *self);
 extern FrtDocument *frt_ir_get_doc_with_term(FrtIndexReader *ir, FrtSymbol field,
                                       const char *term);
@@ -769,6 +1050,15 @@ extern FrtTermDocEnum *frt_ir_term_positions_for(FrtIndexReader *ir,
 extern void frt_ir_add_cache(FrtIndexReader *ir);
 extern bool frt_ir_is_latest(FrtIndexReader *ir);
 
+/*
+ * Points +leaves+ at the segment level readers that make up +ir+, flattening
+ * nested MultiReaders, and +starts+ at the document number each one starts
+ * at within +ir+. Both arrays belong to +ir+. Returns the number of leaves,
+ * or 0, leaving +leaves+ and +starts+ untouched, if +ir+ is a leaf itself.
+ */
+extern int frt_ir_get_leaves(FrtIndexReader *ir, FrtIndexReader ***leaves,
+                             int **starts);
+
 /****************************************************************************
  * FrtMultiReader
  ****************************************************************************/
@@ -783,6 +1073,9 @@ struct FrtMultiReader {
     FrtHash *norms_cache;
     bool has_deletions : 1;
     int **field_num_map;
+    int leaf_cnt;
+    int *leaf_starts;
+    FrtIndexReader **leaves;
 };
 
 extern int frt_mr_get_field_num(FrtMultiReader *mr, int ir_num, int f_num);
@@ -827,6 +1120,7 @@ typedef struct FrtFieldInverter
  ****************************************************************************/
 
 #define DW_OFFSET_INIT_CAPA 512
+#define DW_PLISTS_INIT_CAPA 512
 typedef struct FrtIndexWriter FrtIndexWriter;
 
 typedef struct FrtDocWriter
@@ -836,8 +1130,12 @@ typedef struct FrtDocWriter
     FrtFieldInfos *fis;
     FrtFieldsWriter *fw;
     FrtMemoryPool *mp;
+    FrtByteBlockPool *bbp;
+    FrtByteBlockPool *tv_bbp;
     FrtAnalyzer *analyzer;
     FrtHash *curr_plists;
+    FrtPostingList **doc_plists;
+    int doc_plists_capa;
     FrtHash *fields;
     FrtSimilarity *similarity;
     FrtOffset *offsets;
@@ -848,6 +1146,7 @@ typedef struct FrtDocWriter
     int skip_interval;
     int max_field_length;
     int max_buffered_docs;
+    frt_mutex_t *analyzer_mutex;
 } FrtDocWriter;
 
 extern FrtDocWriter *frt_dw_open(FrtIndexWriter *is, FrtSegmentInfo *si);
@@ -861,6 +1160,100 @@ extern FrtHash *frt_dw_invert_field(FrtDocWriter *dw,
 extern FrtFieldInverter *frt_dw_get_fld_inv(FrtDocWriter *dw, FrtFieldInfo *fi);
 extern void frt_dw_reset_postings(FrtHash *postings);
 
+/****************************************************************************
+ *
+ * FrtMergePolicy
+ *
+ ****************************************************************************/
+
+/*
+ * What a MergePolicy knows about each segment. +doc_cnt+ includes the
+ * +del_cnt+ deleted documents and +size+ is the number of bytes used by the
+ * segment's files. +merging+ is set for segments which are already being
+ * merged and mustn't be part of another merge.
+ */
+typedef struct FrtSegmentStats
+{
+    FrtSegmentInfo *si;
+    int doc_cnt;
+    int del_cnt;
+    off_t size;
+    bool merging;
+} FrtSegmentStats;
+
+/* a merge of segments +min_seg+ up to but not including +max_seg+ */
+typedef struct FrtMergeSpec
+{
+    int min_seg;
+    int max_seg;
+} FrtMergeSpec;
+
+/*
+ * A MergePolicy decides which segments the IndexWriter merges. Each method
+ * is given the stats for all +seg_cnt+ segments in the index, in order,
+ * and adds the merges it wants to +merges+, which has room for +seg_cnt+
+ * merges, returning the number of merges added. The merges must be in
+ * segment order, mustn't overlap and only merge consecutive segments so
+ * that documents keep their order.
+ *
+ * find_merges is called after segments are flushed or merged and is called
+ * again until it returns no merges.
+ * find_forced_merges is called by frt_iw_force_merge until it returns no
+ * merges and must leave at most +max_seg_cnt+ segments.
+ * find_deletes_merges is called by frt_iw_expunge_deletes until it returns
+ * no merges and should merge away the segments with many deletions.
+ * The last two are only called once all background merges have finished.
+ */
+typedef struct FrtMergePolicy FrtMergePolicy;
+struct FrtMergePolicy
+{
+    int (*find_merges)(FrtMergePolicy *mp, const FrtConfig *config,
+                       FrtSegmentStats *stats, int seg_cnt,
+                       FrtMergeSpec *merges);
+    int (*find_forced_merges)(FrtMergePolicy *mp, const FrtConfig *config,
+                              FrtSegmentStats *stats, int seg_cnt,
+                              int max_seg_cnt, FrtMergeSpec *merges);
+    int (*find_deletes_merges)(FrtMergePolicy *mp, const FrtConfig *config,
+                               FrtSegmentStats *stats, int seg_cnt,
+                               FrtMergeSpec *merges);
+    void (*destroy_i)(FrtMergePolicy *mp);
+};
+
+/*
+ * The default policy. Whenever the trailing segments with fewer than
+ * config->merge_factor^k documents add up to at least that many documents
+ * they are merged, up to config->max_merge_docs.
+ */
+extern FrtMergePolicy *frt_log_doc_merge_policy_new();
+
+/*
+ * Merges segments of roughly equal size in bytes, allowing
+ * +segs_per_tier+ segments per tier of size. Segments smaller than
+ * +floor_segment_size+ are treated as being that size. Of the possible
+ * merges of up to +max_merge_at_once+ consecutive segments it picks the
+ * one with the most evenly sized segments, favouring small merges and
+ * ones which reclaim a lot of deleted documents (weighted by
+ * +reclaim_deletes_weight+). Merges never produce segments of more than
+ * +max_merged_segment_size+ bytes, apart from forced merges down to a
+ * given number of segments. frt_iw_expunge_deletes merges the segments
+ * with more than +deletes_pct_allowed+ percent of their documents deleted.
+ */
+typedef struct FrtTieredMergePolicy
+{
+    FrtMergePolicy super;
+    int segs_per_tier;
+    int max_merge_at_once;
+    off_t max_merged_segment_size;
+    off_t floor_segment_size;
+    double deletes_pct_allowed;
+    double reclaim_deletes_weight;
+} FrtTieredMergePolicy;
+
+#define FRT_TIERED_MP(mp) ((FrtTieredMergePolicy *)(mp))
+
+extern FrtMergePolicy *frt_tiered_merge_policy_new();
+extern void frt_merge_policy_destroy(FrtMergePolicy *mp);
+
 /****************************************************************************
  *
  * FrtIndexWriter
@@ -873,6 +1266,52 @@ typedef struct FrtDelTerm
     char *term;
 } FrtDelTerm;
 
+/*
+ * When config.max_doc_writers is greater than 1, iw_add_doc may be called
+ * from several threads at once. Each calling thread takes an idle
+ * DocWriter from +dws+ (opening a new one while there are fewer than
+ * max_doc_writers) and analyzes, inverts and flushes the document without
+ * holding +mutex+. Each DocWriter has its own memory pool and pending
+ * segment so max_buffer_memory and max_buffered_docs apply to each
+ * DocWriter separately. Segments are added to the index in the order they
+ * are flushed so document numbers won't follow the order documents were
+ * added in.
+ *
+ * When config.max_merge_threads is greater than 0, merges are queued in
+ * +merges+ and run by that many background threads instead of by whichever
+ * call triggered them. A merge works on a copy of the FieldInfos and only
+ * takes +mutex+ to swap the merged segment into the SegmentInfos, so adds
+ * and flushes carry on while it runs. iw_add_doc only blocks while more
+ * than config.max_pending_merges merges are waiting for a thread. Merges
+ * write at most config.merge_rate_limit bytes per second when it is
+ * greater than 0.
+ *
+ * When config.merge_stage_threads is greater than 1, each merge copies the
+ * stored fields, merges the norms and merges the terms at the same time,
+ * with the terms split by field into partitions, using up to that many
+ * threads from +merge_pool+.
+ *
+ * When config.analysis_threads is greater than 1, iw_add_docs analyzes the
+ * documents' tokenized fields on +analysis_pool+ into token buffers while
+ * the calling thread inverts the documents already analyzed, in order.
+ *
+ * Deletes by term or query are buffered in +deletes+ and applied at the next
+ * flush or commit, with one pass over each segment's terms. Each delete
+ * remembers how many documents every DocWriter had buffered when it was
+ * made so documents added after it, such as the replacement in a
+ * delete-then-add update, survive it. Documents deleted from segments while
+ * they are being merged are deleted from the merged segment when it is
+ * swapped in.
+ *
+ * iw_get_reader flushes the DocWriters and applies the buffered deletes
+ * without writing the segments file, so a reader can see them without a
+ * commit. +has_uncommitted+ is set until the segments file is next written.
+ * Documents still buffered in a DocWriter are only visible once flushed.
+ */
+typedef struct FrtMergeJob FrtMergeJob;
+typedef struct FrtBufferedDelete FrtBufferedDelete;
+struct FrtQuery;
+
 struct FrtIndexWriter
 {
     FrtConfig config;
@@ -882,6 +1321,29 @@ struct FrtIndexWriter
     FrtSegmentInfos *sis;
     FrtFieldInfos *fis;
     FrtDocWriter *dw;
+    FrtDocWriter **dws;
+    int dw_cnt;
+    FrtDocWriter **idle_dws;
+    int idle_dw_cnt;
+    int drain_cnt;
+    frt_cond_t dw_cond;
+    frt_mutex_t analyzer_mutex;
+    FrtMergeJob *merges;
+    int merge_cnt;
+    int pending_merge_cnt;
+    frt_thread_t *merge_threads;
+    int merge_thread_cnt;
+    bool merge_stopping;
+    frt_cond_t merge_cond;
+    int merge_excode;
+    char *merge_msg;
+    FrtThreadPool *merge_pool;
+    FrtThreadPool *analysis_pool;
+    FrtMergePolicy *merge_policy;
+    FrtBufferedDelete **deletes;
+    int del_cnt;
+    int del_capa;
+    bool has_uncommitted;
     FrtSimilarity *similarity;
     FrtLock *write_lock;
     FrtDeleter *deleter;
@@ -895,11 +1357,25 @@ extern void frt_iw_delete_term(FrtIndexWriter *iw, FrtSymbol field,
                            const char *term);
 extern void frt_iw_delete_terms(FrtIndexWriter *iw, FrtSymbol field,
                             char **terms, const int term_cnt);
+extern void frt_iw_delete_query(FrtIndexWriter *iw, struct FrtQuery *query);
 extern void frt_iw_close(FrtIndexWriter *iw);
 extern void frt_iw_add_doc(FrtIndexWriter *iw, FrtDocument *doc);
+extern void frt_iw_add_docs(FrtIndexWriter *iw, FrtDocument **docs,
+                            const int doc_cnt);
 extern int frt_iw_doc_count(FrtIndexWriter *iw);
 extern void frt_iw_commit(FrtIndexWriter *iw);
+/*
+ * Open a read-only reader on everything added to and deleted from +iw+ so
+ * far, without committing. Pass the last reader returned as +prev_ir+ to
+ * share the segments which haven't changed since; it stays open and must
+ * still be closed.
+ */
+extern FrtIndexReader *frt_iw_get_reader(FrtIndexWriter *iw,
+                                         FrtIndexReader *prev_ir);
 extern void frt_iw_optimize(FrtIndexWriter *iw);
+extern void frt_iw_force_merge(FrtIndexWriter *iw, int max_seg_cnt);
+extern void frt_iw_expunge_deletes(FrtIndexWriter *iw);
+extern void frt_iw_set_merge_policy(FrtIndexWriter *iw, FrtMergePolicy *mp);
 extern void frt_iw_add_readers(FrtIndexWriter *iw, FrtIndexReader **readers,
                            const int r_cnt);
 
@@ -23,6 +23,9 @@
 #define BUFFER_SIZE                        FRT_BUFFER_SIZE
 #define BV_INIT_CAPA                       FRT_BV_INIT_CAPA
 #define BV_OP                              FRT_BV_OP
+#define BYTE_BLOCK_MASK                    FRT_BYTE_BLOCK_MASK
+#define BYTE_BLOCK_SHIFT                   FRT_BYTE_BLOCK_SHIFT
+#define BYTE_BLOCK_SIZE                    FRT_BYTE_BLOCK_SIZE
 #define BYTE_FIELD_INDEX_CLASS             FRT_BYTE_FIELD_INDEX_CLASS
 #define COMMIT_LOCK_NAME                   FRT_COMMIT_LOCK_NAME
 #define CONSTANT_QUERY                     FRT_CONSTANT_QUERY
@@ -48,6 +51,8 @@
 #define FILE_NOT_FOUND_ERROR               FRT_FILE_NOT_FOUND_ERROR
 #define FILTERED_QUERY                     FRT_FILTERED_QUERY
 #define FINALLY                            FRT_FINALLY
+#define FI_BLOOM_FILTER_BM                 FRT_FI_BLOOM_FILTER_BM
+#define FI_DOC_VALUES_BM                   FRT_FI_DOC_VALUES_BM
 #define FI_IS_COMPRESSED_BM                FRT_FI_IS_COMPRESSED_BM
 #define FI_IS_INDEXED_BM                   FRT_FI_IS_INDEXED_BM
 #define FI_IS_STORED_BM                    FRT_FI_IS_STORED_BM
@@ -93,6 +98,10 @@
 #define INTEGER_FIELD_INDEX_CLASS          FRT_INTEGER_FIELD_INDEX_CLASS
 #define IO_ERROR                           FRT_IO_ERROR
 #define IS_C99                             FRT_IS_C99
+#define IS_NORMAL                          FRT_IS_NORMAL
+#define IS_RANDOM                          FRT_IS_RANDOM
+#define IS_SEQUENTIAL                      FRT_IS_SEQUENTIAL
+#define LARGE_BUFFER_SIZE                  FRT_LARGE_BUFFER_SIZE
 #define LOCK_ERROR                         FRT_LOCK_ERROR
 #define LOCK_EXT                           FRT_LOCK_EXT
 #define LOCK_PREFIX                        FRT_LOCK_PREFIX
@@ -101,6 +110,7 @@
 #define MAX                                FRT_MAX
 #define MAX3                               FRT_MAX3
 #define MAX_FILE_PATH                      FRT_MAX_FILE_PATH
+#define MAX_SKIP_LEVELS                    FRT_MAX_SKIP_LEVELS
 #define MAX_WORD_SIZE                      FRT_MAX_WORD_SIZE
 #define MEM_ERROR                          FRT_MEM_ERROR
 #define MIN                                FRT_MIN
@@ -121,6 +131,10 @@
 #define PARSE_ERROR                        FRT_PARSE_ERROR
 #define PHQ_INIT_CAPA                      FRT_PHQ_INIT_CAPA
 #define PHRASE_QUERY                       FRT_PHRASE_QUERY
+#define POSTINGS_BLOCK_SIZE                FRT_POSTINGS_BLOCK_SIZE
+#define POSTINGS_BUFFER_SIZE               FRT_POSTINGS_BUFFER_SIZE
+#define POSTINGS_FORMAT_BLOCK              FRT_POSTINGS_FORMAT_BLOCK
+#define POSTINGS_FORMAT_VINT               FRT_POSTINGS_FORMAT_VINT
 #define PQ_ADDED                           FRT_PQ_ADDED
 #define PQ_DROPPED                         FRT_PQ_DROPPED
 #define PQ_INSERTED                        FRT_PQ_INSERTED
@@ -143,6 +157,7 @@
 #define SEGMENT_NAME_MAX_LENGTH            FRT_SEGMENT_NAME_MAX_LENGTH
 #define SKIP_INTERVAL                      FRT_SKIP_INTERVAL
 #define SLOW_DOWN                          FRT_SLOW_DOWN
+#define SMALL_BUFFER_SIZE                  FRT_SMALL_BUFFER_SIZE
 #define SORT_FIELD_DOC                     FRT_SORT_FIELD_DOC
 #define SORT_FIELD_DOC_REV                 FRT_SORT_FIELD_DOC_REV
 #define SORT_FIELD_SCORE                   FRT_SORT_FIELD_SCORE
@@ -179,6 +194,7 @@
 #define TERM_VECTOR_YES                    FRT_TERM_VECTOR_YES
 #define TE_BUCKET_INIT_CAPA                FRT_TE_BUCKET_INIT_CAPA
 #define THREAD_ONCE_INIT                   FRT_THREAD_ONCE_INIT
+#define TIERED_MP                          FRT_TIERED_MP
 #define TO_WORD                            FRT_TO_WORD
 #define TRY                                FRT_TRY
 #define TV_FIELD_INIT_CAPA                 FRT_TV_FIELD_INIT_CAPA
@@ -204,10 +220,14 @@
 #define Analyzer                FrtAnalyzer
 #define BCType                  FrtBCType
 #define BitVector               FrtBitVector
+#define BloomFilterWriter       FrtBloomFilterWriter
 #define BooleanClause           FrtBooleanClause
 #define BooleanQuery            FrtBooleanQuery
 #define Boost                   FrtBoost
 #define Buffer                  FrtBuffer
+#define BufferedDelete          FrtBufferedDelete
+#define ByteBlockPool           FrtByteBlockPool
+#define ByteSliceReader         FrtByteSliceReader
 #define CWFileEntry             FrtCWFileEntry
 #define CacheObject             FrtCacheObject
 #define CachedTokenStream       FrtCachedTokenStream
@@ -221,6 +241,7 @@
 #define Deleter                 FrtDeleter
 #define DeterministicState      FrtDeterministicState
 #define DocField                FrtDocField
+#define DocValues               FrtDocValues
 #define DocWriter               FrtDocWriter
 #define Document                FrtDocument
 #define Explanation             FrtExplanation
@@ -235,6 +256,7 @@
 #define FieldsWriter            FrtFieldsWriter
 #define Filter                  FrtFilter
 #define FilteredQuery           FrtFilteredQuery
+#define FstBuilder              FrtFstBuilder
 #define FuzzyQuery              FrtFuzzyQuery
 #define Hash                    FrtHash
 #define HashEntry               FrtHashEntry
@@ -244,6 +266,8 @@
 #define Hit                     FrtHit
 #define HyphenFilter            FrtHyphenFilter
 #define InStream                FrtInStream
+#define InStreamAdvice          FrtInStreamAdvice
+#define InStreamRef             FrtInStreamRef
 #define InStreamMethods         FrtInStreamMethods
 #define Index                   FrtIndex
 #define IndexReader             FrtIndexReader
@@ -263,12 +287,14 @@
 #define MatchRange              FrtMatchRange
 #define MatchVector             FrtMatchVector
 #define MemoryPool              FrtMemoryPool
+#define MergeJob                FrtMergeJob
+#define MergePolicy             FrtMergePolicy
+#define MergeSpec               FrtMergeSpec
 #define MultiByteTokenStream    FrtMultiByteTokenStream
 #define MultiMapper             FrtMultiMapper
 #define MultiReader             FrtMultiReader
 #define MultiSearcher           FrtMultiSearcher
 #define MultiTermQuery          FrtMultiTermQuery
-#define Occurence               FrtOccurence
 #define Offset                  FrtOffset
 #define OutStream               FrtOutStream
 #define OutStreamMethods        FrtOutStreamMethods
@@ -276,8 +302,8 @@
 #define PhrasePosition          FrtPhrasePosition
 #define PhraseQuery             FrtPhraseQuery
 #define PostFilter              FrtPostFilter
-#define Posting                 FrtPosting
 #define PostingList             FrtPostingList
+#define PostingsFormat          FrtPostingsFormat
 #define PrefixQuery             FrtPrefixQuery
 #define PriorityQueue           FrtPriorityQueue
 #define PriorityQueueInsertEnum FrtPriorityQueueInsertEnum
@@ -292,10 +318,12 @@
 #define SegmentFieldIndex       FrtSegmentFieldIndex
 #define SegmentInfo             FrtSegmentInfo
 #define SegmentInfos            FrtSegmentInfos
+#define SegmentStats            FrtSegmentStats
 #define SegmentTermDocEnum      FrtSegmentTermDocEnum
 #define SegmentTermEnum         FrtSegmentTermEnum
 #define SegmentTermIndex        FrtSegmentTermIndex
 #define Similarity              FrtSimilarity
+#define SkipLevel               FrtSkipLevel
 #define Sort                    FrtSort
 #define SortField               FrtSortField
 #define SpanEnum                FrtSpanEnum
@@ -319,6 +347,7 @@
 #define TVField                 FrtTVField
 #define TVTerm                  FrtTVTerm
 #define Term                    FrtTerm
+#define TermBlockWriter         FrtTermBlockWriter
 #define TermDocEnum             FrtTermDocEnum
 #define TermEnum                FrtTermEnum
 #define TermInfo                FrtTermInfo
@@ -328,6 +357,8 @@
 #define TermVector              FrtTermVector
 #define TermVectorValue         FrtTermVectorValue
 #define TermWriter              FrtTermWriter
+#define ThreadPool              FrtThreadPool
+#define TieredMergePolicy       FrtTieredMergePolicy
 #define Token                   FrtToken
 #define TokenFilter             FrtTokenFilter
 #define TokenStream             FrtTokenStream
@@ -379,6 +410,12 @@
 #define ary_type_size                                  frt_ary_type_size
 #define ary_unshift                                    frt_ary_unshift
 #define ary_unshift_i                                  frt_ary_unshift_i
+#define bbp_destroy                                    frt_bbp_destroy
+#define bbp_new                                        frt_bbp_new
+#define bbp_new_slice                                  frt_bbp_new_slice
+#define bbp_reset                                      frt_bbp_reset
+#define bbp_used                                       frt_bbp_used
+#define bbp_write_vint                                 frt_bbp_write_vint
 #define bc_deref                                       frt_bc_deref
 #define bc_new                                         frt_bc_new
 #define bc_set_occur                                   frt_bc_set_occur
@@ -388,6 +425,10 @@
 #define bq_add_query_nr                                frt_bq_add_query_nr
 #define bq_new                                         frt_bq_new
 #define bq_new_max                                     frt_bq_new_max
+#define bsr_copy_vints                                 frt_bsr_copy_vints
+#define bsr_eof                                        frt_bsr_eof
+#define bsr_init                                       frt_bsr_init
+#define bsr_read_vint                                  frt_bsr_read_vint
 #define bv_and                                         frt_bv_and
 #define bv_and_ext                                     frt_bv_and_ext
 #define bv_and_i                                       frt_bv_and_i
@@ -427,6 +468,12 @@
 #define close_lock                                     frt_close_lock
 #define co_create                                      frt_co_create
 #define co_hash_create                                 frt_co_hash_create
+#define cond_broadcast                                 frt_cond_broadcast
+#define cond_destroy                                   frt_cond_destroy
+#define cond_init                                      frt_cond_init
+#define cond_signal                                    frt_cond_signal
+#define cond_t                                         frt_cond_t
+#define cond_wait                                      frt_cond_wait
 #define count_leading_ones                             frt_count_leading_ones
 #define count_leading_zeros                            frt_count_leading_zeros
 #define count_ones                                     frt_count_ones
@@ -458,6 +505,9 @@
 #define doc_new                                        frt_doc_new
 #define doc_to_s                                       frt_doc_to_s
 #define dummy_free                                     frt_dummy_free
+#define dv_destroy                                     frt_dv_destroy
+#define dv_get_ord                                     frt_dv_get_ord
+#define dv_merge                                       frt_dv_merge
 #define dw_add_doc                                     frt_dw_add_doc
 #define dw_close                                       frt_dw_close
 #define dw_get_fld_inv                                 frt_dw_get_fld_inv
@@ -487,6 +537,7 @@
 #define fi_new                                         frt_fi_new
 #define fi_to_s                                        frt_fi_to_s
 #define field_index_get                                frt_field_index_get
+#define file_buffer_size                               frt_file_buffer_size
 #define file_is_lock                                   frt_file_is_lock
 #define file_name_filter_is_index_file                 frt_file_name_filter_is_index_file
 #define filt_create                                    frt_filt_create
@@ -624,24 +675,32 @@
 #define ir_delete_doc                                  frt_ir_delete_doc
 #define ir_destroy                                     frt_ir_destroy
 #define ir_doc_freq                                    frt_ir_doc_freq
+#define ir_get_doc_values                              frt_ir_get_doc_values
 #define ir_get_doc_with_term                           frt_ir_get_doc_with_term
 #define ir_get_field_num                               frt_ir_get_field_num
+#define ir_get_leaves                                  frt_ir_get_leaves
+#define ir_get_max_norm                                frt_ir_get_max_norm
 #define ir_get_norms                                   frt_ir_get_norms
 #define ir_get_norms_i                                 frt_ir_get_norms_i
 #define ir_get_norms_into                              frt_ir_get_norms_into
 #define ir_index_exists                                frt_ir_index_exists
 #define ir_is_latest                                   frt_ir_is_latest
 #define ir_open                                        frt_ir_open
+#define ir_reopen                                      frt_ir_reopen
 #define ir_set_norm                                    frt_ir_set_norm
 #define ir_term_docs_for                               frt_ir_term_docs_for
 #define ir_term_positions_for                          frt_ir_term_positions_for
 #define ir_terms                                       frt_ir_terms
 #define ir_terms_from                                  frt_ir_terms_from
 #define ir_undelete_all                                frt_ir_undelete_all
+#define ir_uninvert_doc_values                         frt_ir_uninvert_doc_values
 #define is2os_copy_bytes                               frt_is2os_copy_bytes
 #define is2os_copy_vints                               frt_is2os_copy_vints
+#define is_advise                                      frt_is_advise
 #define is_clone                                       frt_is_clone
 #define is_close                                       frt_is_close
+#define is_map_bytes                                   frt_is_map_bytes
+#define is_mapped                                      frt_is_mapped
 #define is_new                                         frt_is_new
 #define is_pos                                         frt_is_pos
 #define is_read_byte                                   frt_is_read_byte
@@ -653,21 +712,30 @@
 #define is_read_u32                                    frt_is_read_u32
 #define is_read_u64                                    frt_is_read_u64
 #define is_read_vint                                   frt_is_read_vint
+#define is_read_vints                                  frt_is_read_vints
 #define is_read_vll                                    frt_is_read_vll
 #define is_read_voff_t                                 frt_is_read_voff_t
 #define is_seek                                        frt_is_seek
+#define is_set_buffer_size                             frt_is_set_buffer_size
 #define is_skip_vints                                  frt_is_skip_vints
 #define isea_doc_freq                                  frt_isea_doc_freq
 #define isea_new                                       frt_isea_new
+#define isea_set_thread_pool                           frt_isea_set_thread_pool
 #define iw_add_doc                                     frt_iw_add_doc
+#define iw_add_docs                                    frt_iw_add_docs
 #define iw_add_readers                                 frt_iw_add_readers
 #define iw_close                                       frt_iw_close
 #define iw_commit                                      frt_iw_commit
+#define iw_delete_query                                frt_iw_delete_query
 #define iw_delete_term                                 frt_iw_delete_term
 #define iw_delete_terms                                frt_iw_delete_terms
 #define iw_doc_count                                   frt_iw_doc_count
+#define iw_expunge_deletes                             frt_iw_expunge_deletes
+#define iw_force_merge                                 frt_iw_force_merge
+#define iw_get_reader                                  frt_iw_get_reader
 #define iw_open                                        frt_iw_open
 #define iw_optimize                                    frt_iw_optimize
+#define iw_set_merge_policy                            frt_iw_set_merge_policy
 #define lazy_df_get_bytes                              frt_lazy_df_get_bytes
 #define lazy_df_get_data                               frt_lazy_df_get_data
 #define lazy_doc_close                                 frt_lazy_doc_close
@@ -679,6 +747,7 @@
 #define letter_analyzer_new                            frt_letter_analyzer_new
 #define letter_tokenizer_new                           frt_letter_tokenizer_new
 #define lmalloc                                        frt_lmalloc
+#define log_doc_merge_policy_new                       frt_log_doc_merge_policy_new
 #define lowercase_filter_new                           frt_lowercase_filter_new
 #define lt_ft                                          frt_lt_ft
 #define mapping_filter_add                             frt_mapping_filter_add
@@ -705,6 +774,7 @@
 #define mb_standard_tokenizer_new                      frt_mb_standard_tokenizer_new
 #define mb_whitespace_analyzer_new                     frt_mb_whitespace_analyzer_new
 #define mb_whitespace_tokenizer_new                    frt_mb_whitespace_tokenizer_new
+#define merge_policy_destroy                           frt_merge_policy_destroy
 #define micro_sleep                                    frt_micro_sleep
 #define min2                                           frt_min2
 #define min3                                           frt_min3
@@ -720,6 +790,7 @@
 #define mr_get_field_num                               frt_mr_get_field_num
 #define mr_open                                        frt_mr_open
 #define msea_new                                       frt_msea_new
+#define msea_set_thread_pool                           frt_msea_set_thread_pool
 #define mtdpe_new                                      frt_mtdpe_new
 #define mte_new                                        frt_mte_new
 #define mulmap_add_mapping                             frt_mulmap_add_mapping
@@ -746,6 +817,7 @@
 #define open_cw                                        frt_open_cw
 #define open_fs_store                                  frt_open_fs_store
 #define open_lock                                      frt_open_lock
+#define open_mmap_store                                frt_open_mmap_store
 #define open_ram_store                                 frt_open_ram_store
 #define open_ram_store_and_copy                        frt_open_ram_store_and_copy
 #define os_close                                       frt_os_close
@@ -764,7 +836,6 @@
 #define os_write_vint                                  frt_os_write_vint
 #define os_write_vll                                   frt_os_write_vll
 #define os_write_voff_t                                frt_os_write_voff_t
-#define p_new                                          frt_p_new
 #define per_field_analyzer_new                         frt_per_field_analyzer_new
 #define pfa_add_field                                  frt_pfa_add_field
 #define phq_add_term                                   frt_phq_add_term
@@ -772,9 +843,11 @@
 #define phq_append_multi_term                          frt_phq_append_multi_term
 #define phq_new                                        frt_phq_new
 #define phq_set_slop                                   frt_phq_set_slop
-#define pl_add_occ                                     frt_pl_add_occ
+#define pl_add_doc                                     frt_pl_add_doc
+#define pl_add_pos                                     frt_pl_add_pos
 #define pl_cmp                                         frt_pl_cmp
 #define pl_new                                         frt_pl_new
+#define pl_sort                                        frt_pl_sort
 #define pq_clear                                       frt_pq_clear
 #define pq_clone                                       frt_pq_clone
 #define pq_destroy                                     frt_pq_destroy
@@ -934,6 +1007,7 @@
 #define sym_hash                                       frt_sym_hash
 #define sym_len                                        frt_sym_len
 #define symbol_init                                    frt_symbol_init
+#define task_ft                                        frt_task_ft
 #define td_destroy                                     frt_td_destroy
 #define td_new                                         frt_td_new
 #define td_to_s                                        frt_td_to_s
@@ -944,15 +1018,19 @@
 #define term_hash                                      frt_term_hash
 #define term_new                                       frt_term_new
 #define tf_new_i                                       frt_tf_new_i
+#define thread_create                                  frt_thread_create
 #define thread_exit                                    frt_thread_exit
 #define thread_getspecific                             frt_thread_getspecific
+#define thread_join                                    frt_thread_join
 #define thread_key_create                              frt_thread_key_create
 #define thread_key_delete                              frt_thread_key_delete
 #define thread_key_t                                   frt_thread_key_t
 #define thread_once                                    frt_thread_once
 #define thread_once_t                                  frt_thread_once_t
 #define thread_setspecific                             frt_thread_setspecific
+#define thread_t                                       frt_thread_t
 #define ti_set                                         frt_ti_set
+#define tiered_merge_policy_new                        frt_tiered_merge_policy_new
 #define tir_close                                      frt_tir_close
 #define tir_get_term                                   frt_tir_get_term
 #define tir_get_ti                                     frt_tir_get_ti
@@ -968,6 +1046,10 @@
 #define tk_new                                         frt_tk_new
 #define tk_set                                         frt_tk_set
 #define tk_set_no_len                                  frt_tk_set_no_len
+#define tp_destroy                                     frt_tp_destroy
+#define tp_new                                         frt_tp_new
+#define tp_run                                         frt_tp_run
+#define tp_thread_cnt                                  frt_tp_thread_cnt
 #define tq_new                                         frt_tq_new
 #define trfilt_new                                     frt_trfilt_new
 #define trq_new                                        frt_trq_new
@@ -13,6 +13,7 @@ typedef struct FrtScorer FrtScorer;
 #include "bitvector.h"
 #include "similarity.h"
 #include "field_index.h"
+#include "thread_pool.h"
 
 /***************************************************************************
  *
@@ -630,6 +631,13 @@ struct FrtScorer
     bool         (*skip_to)(FrtScorer *self, int doc_num);
     FrtExplanation *(*explain)(FrtScorer *self, int doc_num);
     void         (*destroy)(FrtScorer *self);
+    /* Optional. An upper bound on the score of any document, or a negative
+     * number if the scorer can't bound its scores. */
+    float        (*max_score)(FrtScorer *self);
+    /* Optional. Tells the scorer that documents scoring no more than
+     * +min_score+ are no longer wanted so it may skip them. The scorer can
+     * only make the most of this if it is first called before +next+. */
+    void         (*set_min_score)(FrtScorer *self, float min_score);
 };
 
 #define frt_scorer_new(type, similarity) frt_scorer_create(sizeof(type), similarity)
@@ -864,9 +872,30 @@ typedef struct FrtIndexSearcher {
     FrtSearcher        super;
     FrtIndexReader    *ir;
     bool            close_ir : 1;
+    /* when set, searches without a Sort or PostFilter may skip documents
+     * that can't make it into the requested hits, so TopDocs.total_hits is
+     * only a lower bound */
+    bool            approx_total_hits : 1;
+    /* when set, the segments of a multi-segment index are scored in this
+     * pool, at most +parallelism+ at a time (0 for no limit) */
+    FrtThreadPool  *pool;
+    int             parallelism;
 } FrtIndexSearcher;
 
 extern FrtSearcher *frt_isea_new(FrtIndexReader *ir);
+
+/**
+ * Score the segments of the searcher's index concurrently in +pool+, each
+ * into its own hit queue, and merge the results. At most +parallelism+
+ * threads, including the calling one, work on a single search; 0 means no
+ * limit. Pass a NULL +pool+ to go back to searching one segment at a time.
+ *
+ * The pool is not owned by the searcher so it can be shared between
+ * searchers. Any PostFilter used with a pooled searcher must be safe to call
+ * from several threads at once.
+ */
+extern void frt_isea_set_thread_pool(FrtSearcher *self, FrtThreadPool *pool,
+                                     int parallelism);
 extern int frt_isea_doc_freq(FrtSearcher *self, FrtSymbol field, const char *term);
 
 
@@ -885,10 +914,20 @@ typedef struct FrtMultiSearcher
     int        *starts;
     int         max_doc;
     bool        close_subs : 1;
+    FrtThreadPool *pool;
+    int         parallelism;
 } FrtMultiSearcher;
 
 extern FrtSearcher *frt_msea_new(FrtSearcher **searchers, int s_cnt, bool close_subs);
 
+/**
+ * Search the MultiSearcher's sub-searchers concurrently in +pool+ and merge
+ * their hits. +parallelism+ and ownership of the pool are as for
+ * frt_isea_set_thread_pool.
+ */
+extern void frt_msea_set_thread_pool(FrtSearcher *self, FrtThreadPool *pool,
+                                     int parallelism);
+
 /***************************************************************************
  *
  * FrtQParser
@@ -10,14 +10,36 @@
 #define FRT_LOCK_PREFIX "ferret-"
 #define FRT_LOCK_EXT ".lck"
 
+/* InStream buffer sizes. See frt_is_set_buffer_size and frt_is_advise */
+#define FRT_SMALL_BUFFER_SIZE 128
+#define FRT_POSTINGS_BUFFER_SIZE 0x1000
+#define FRT_LARGE_BUFFER_SIZE 0x10000
+
 typedef struct FrtBuffer
 {
-    frt_uchar buf[FRT_BUFFER_SIZE];
+    frt_uchar *buf;             /* +data+, a larger allocated buffer or a
+                                 * memory-mapped file */
     off_t start;
     off_t pos;
     off_t len;
+    int size;                   /* bytes to buffer, 0 if memory-mapped */
+    frt_uchar data[FRT_BUFFER_SIZE];
 } FrtBuffer;
 
+/**
+ * Advice on how an FrtInStream is going to be read. It is used to size the
+ * stream's buffer and it is passed on to the operating system where possible
+ * so that it can tune readahead.
+ */
+typedef enum
+{
+    FRT_IS_NORMAL = 0,          /* no particular pattern */
+    FRT_IS_RANDOM,              /* short reads at random positions, eg.
+                                 * term lookups or stored field fetches */
+    FRT_IS_SEQUENTIAL           /* read most of the file in order, eg.
+                                 * while merging segments */
+} FrtInStreamAdvice;
+
 typedef struct FrtOutStream FrtOutStream;
 struct FrtOutStreamMethods {
     /* internal functions for the FrtInStream */
@@ -77,33 +99,40 @@ typedef struct FrtInStream FrtInStream;
 struct FrtInStreamMethods
 {
     /**
-     * Read +len+ characters from the input stream into the +offset+ position in
-     * +buf+, an array of unsigned characters.
+     * Read +len+ characters starting at position +pos+ in the input stream
+     * into +buf+, an array of unsigned characters. Implementations must not
+     * rely on or change any file position shared between clones of the
+     * stream so that clones can be read concurrently from different threads.
      *
      * @param is self
-     * @param buf an array of characters which must be allocated with  at least
-     *          +offset+ + +len+ bytes
+     * @param pos the position in the input stream to start reading from
+     * @param buf an array of characters which must be allocated with at least
+     *          +len+ bytes
      * @param len the number of bytes to read
      * @raise FRT_IO_ERROR if there is an error reading from the input stream
      */
-    void (*read_i)(struct FrtInStream *is, frt_uchar *buf, int len);
+    void (*read_i)(struct FrtInStream *is, off_t pos, frt_uchar *buf, int len);
 
     /**
-     * Seek position +pos+ in input stream +is+
+     * Returns the length of the input stream +is+
      *
      * @param is self
-     * @param pos the position to seek
-     * @raise FRT_IO_ERROR if the seek fails
+     * @raise FRT_IO_ERROR if there is an error getting the file length
      */
-    void (*seek_i)(struct FrtInStream *is, off_t pos);
+    off_t (*length_i)(struct FrtInStream *is);
 
     /**
-     * Returns the length of the input stream +is+
+     * Pass +advice+ on how the +len+ bytes starting at +offset+ will be read
+     * on to the operating system. A +len+ of 0 means to the end of the
+     * stream. This method is optional and may be NULL.
      *
      * @param is self
-     * @raise FRT_IO_ERROR if there is an error getting the file length
+     * @param offset the start of the region of the stream being advised on
+     * @param len the length of the region or 0 for the rest of the stream
+     * @param advice how the region is going to be read
      */
-    off_t (*length_i)(struct FrtInStream *is);
+    void (*advise_i)(struct FrtInStream *is, off_t offset, off_t len,
+                     FrtInStreamAdvice advice);
 
     /**
      * Close the resources allocated to the inputstream +is+
@@ -114,6 +143,17 @@ struct FrtInStreamMethods
     void (*close_i)(struct FrtInStream *is);
 };
 
+/*
+ * The reference count of a file shared by an InStream and its clones. Clones
+ * are opened and closed by several search threads at once so each file's
+ * count has its own mutex.
+ */
+typedef struct FrtInStreamRef
+{
+    int cnt;
+    frt_mutex_t mutex;
+} FrtInStreamRef;
+
 struct FrtInStream
 {
     FrtBuffer buf;
@@ -124,11 +164,14 @@ struct FrtInStream
     } file;
     union
     {
-        off_t pointer;           /* only used by RAMIn */
-        char *path;             /* only used by FSIn */
+        struct
+        {
+            char *path;
+            off_t length;       /* cached when the file is opened */
+        } fs;                   /* only used by FSIn */
         FrtCompoundInStream *cis;
     } d;
-    int *ref_cnt_ptr;
+    FrtInStreamRef *ref;
     const struct FrtInStreamMethods *m;
 };
 
@@ -141,6 +184,14 @@ struct FrtCompoundInStream
 
 #define is_length(mis) mis->m->length_i(mis)
 
+/**
+ * Returns true if the FrtInStream +is+ reads directly from a memory-mapped
+ * file rather than from its own buffer. The whole file (or compound file
+ * entry) is then the buffer, so +buf.start+ is always 0 and +buf.len+ is the
+ * length of the file.
+ */
+#define frt_is_mapped(is) ((is)->buf.size == 0)
+
 typedef struct FrtStore FrtStore;
 typedef struct FrtLock FrtLock;
 struct FrtLock
@@ -331,6 +382,22 @@ struct FrtStore
  */
 extern FrtStore *frt_open_fs_store(const char *pathname);
 
+/**
+ * Create a newly allocated memory-mapped file-system FrtStore at the pathname
+ * designated. The pathname must be the name of an existing directory.
+ *
+ * This store behaves exactly like a file-system store except that input
+ * streams map the whole file into memory. Reads come straight from the
+ * mapping (and hence from the page cache) without an intermediate copy or a
+ * system call, and clones share the mapping. This is the store to use for
+ * read-mostly search indexes. On platforms without mmap this is the same as
+ * frt_open_fs_store.
+ *
+ * @param pathname the pathname of the directory to be used by the index
+ * @return a newly allocated memory-mapped file-system FrtStore.
+ */
+extern FrtStore *frt_open_mmap_store(const char *pathname);
+
 /**
  * Create a newly allocated in-memory or RAM FrtStore.
  *
@@ -623,6 +690,39 @@ extern void frt_is_close(FrtInStream *is);
  */
 extern FrtInStream *frt_is_clone(FrtInStream *is);
 
+/**
+ * Set the number of bytes the FrtInStream +is+ reads into its buffer at a
+ * time. The contents of the current buffer are discarded if the size
+ * changes. Memory-mapped streams have no buffer so this does nothing.
+ *
+ * @param is the FrtInStream to resize the buffer of
+ * @param size the new buffer size in bytes
+ */
+extern void frt_is_set_buffer_size(FrtInStream *is, int size);
+
+/**
+ * Tell FrtInStream +is+ how it is going to be read. Random access shrinks
+ * the buffer to FRT_SMALL_BUFFER_SIZE, sequential access grows it to
+ * FRT_LARGE_BUFFER_SIZE (or the length of the stream if that is smaller)
+ * and FRT_IS_NORMAL leaves the buffer as it is. The advice is also passed
+ * on to the operating system where supported. Note that the operating
+ * system's advice applies to all clones of the stream.
+ *
+ * @param is the FrtInStream to advise
+ * @param advice how +is+ is going to be read
+ */
+extern void frt_is_advise(FrtInStream *is, FrtInStreamAdvice advice);
+
+/**
+ * Return the buffer size an FrtInStream should start with when reading the
+ * file +filename+. This is chosen by the file's extension and is used by
+ * FrtStore implementations when opening a file.
+ *
+ * @param filename the name of the file being opened
+ * @return the buffer size to use in bytes
+ */
+extern int frt_file_buffer_size(const char *filename);
+
 /**
  * Read a singly byte (unsigned char) from the FrtInStream +is+.
  *
@@ -645,6 +745,18 @@ extern FRT_INLINE frt_uchar frt_is_read_byte(FrtInStream *is);
  */
 extern frt_uchar *frt_is_read_bytes(FrtInStream *is, frt_uchar *buf, int len);
 
+/**
+ * Skip the next +len+ bytes of the memory-mapped FrtInStream +is+ (see
+ * frt_is_mapped) and return where they lie in the mapping, so they can be
+ * used without being copied. They are valid until +is+ is closed.
+ *
+ * @param is     the memory-mapped FrtInStream to read from
+ * @param len    the number of bytes to skip
+ * @return       the +len+ bytes in the mapping
+ * @raise FRT_EOF_ERROR if there is an attempt to read past the end of the file
+ */
+extern const frt_uchar *frt_is_map_bytes(FrtInStream *is, int len);
+
 /**
  * Read a 32-bit unsigned integer from the FrtInStream.
  *
@@ -696,6 +808,21 @@ extern frt_u64 frt_is_read_u64(FrtInStream *is);
  */
 extern FRT_INLINE unsigned int frt_is_read_vint(FrtInStream *is);
 
+/**
+ * Read +n+ compressed (VINT) unsigned integers from the FrtInStream into
+ * +out+. This gives the same result as calling frt_is_read_vint +n+ times but
+ * decodes straight from the buffer, using SIMD instructions where available.
+ * It is used to decode postings in bulk.
+ *
+ * @param is the FrtInStream to read from
+ * @param out the array to read the integers into. It must have room for +n+
+ *   integers
+ * @param n the number of integers to read
+ * @raise FRT_IO_ERROR if there is a error reading from the file-system
+ * @raise FRT_EOF_ERROR if there is an attempt to read past the end of the file
+ */
+extern void frt_is_read_vints(FrtInStream *is, unsigned int *out, int n);
+
 /**
  * Skip _cnt_ vints. This is a convenience method used for performance reasons
  * to skip large numbers of vints. It is mostly used by TermDocEnums. When
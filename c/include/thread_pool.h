@@ -0,0 +1,65 @@
+#ifndef FRT_THREAD_POOL_H
+#define FRT_THREAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "global.h"
+
+typedef void (*frt_task_ft)(void *arg);
+
+/**
+ * A ThreadPool keeps a fixed number of worker threads around to run the
+ * tasks handed to it with frt_tp_run. A single pool can be shared by any
+ * number of callers, including tasks already running in the pool.
+ */
+typedef struct FrtThreadPool FrtThreadPool;
+
+/**
+ * Create a new ThreadPool and start its worker threads.
+ *
+ * @param thread_cnt the number of worker threads to start. With 0 threads
+ *   every task is run by the thread calling frt_tp_run.
+ * @return a newly allocated ThreadPool
+ */
+extern FrtThreadPool *frt_tp_new(int thread_cnt);
+
+/**
+ * Stop the worker threads and free the ThreadPool. No frt_tp_run calls may be
+ * in progress.
+ *
+ * @param pool the ThreadPool to destroy
+ */
+extern void frt_tp_destroy(FrtThreadPool *pool);
+
+/**
+ * The number of worker threads in the ThreadPool.
+ *
+ * @param pool the ThreadPool
+ * @return the number of worker threads
+ */
+extern int frt_tp_thread_cnt(FrtThreadPool *pool);
+
+/**
+ * Run +task+ once for each of +args+ and wait for all of them to finish. The
+ * calling thread runs tasks too, so this can safely be called from within a
+ * task. If any of the tasks raises an exception, the first one is re-raised
+ * in the calling thread once every task is done.
+ *
+ * @param pool the ThreadPool to run the tasks in. If it is NULL the tasks are
+ *   all run by the calling thread
+ * @param task the function to call with each argument
+ * @param args the arguments to call +task+ with
+ * @param arg_cnt the number of arguments in +args+
+ * @param max_threads the most threads, counting the calling thread, which may
+ *   work on these tasks at the same time. 0 means no limit
+ */
+extern void frt_tp_run(FrtThreadPool *pool, frt_task_ft task, void **args,
+                       int arg_cnt, int max_threads);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
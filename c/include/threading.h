@@ -10,6 +10,8 @@ extern "C" {
 typedef pthread_mutex_t frt_mutex_t;
 typedef pthread_key_t frt_thread_key_t;
 typedef pthread_once_t frt_thread_once_t;
+typedef pthread_t frt_thread_t;
+typedef pthread_cond_t frt_cond_t;
 #define FRT_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 #define FRT_MUTEX_RECURSIVE_INITIALIZER PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
 #define FRT_THREAD_ONCE_INIT PTHREAD_ONCE_INIT
@@ -24,6 +26,13 @@ typedef pthread_once_t frt_thread_once_t;
 #define frt_thread_getspecific(a) pthread_getspecific(a)
 #define frt_thread_exit(a) pthread_exit(a)
 #define frt_thread_once(a, b) pthread_once(a, b)
+#define frt_thread_create(a, b, c) pthread_create(a, NULL, b, c)
+#define frt_thread_join(a) pthread_join(a, NULL)
+#define frt_cond_init(a, b) pthread_cond_init(a, b)
+#define frt_cond_wait(a, b) pthread_cond_wait(a, b)
+#define frt_cond_signal(a) pthread_cond_signal(a)
+#define frt_cond_broadcast(a) pthread_cond_broadcast(a)
+#define frt_cond_destroy(a) pthread_cond_destroy(a)
 
 #ifdef __cplusplus
 } // extern "C"
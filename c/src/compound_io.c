@@ -108,12 +108,6 @@ static off_t cmpd_length(Store *store, const char *file_name)
     }
 }
 
-static void cmpdi_seek_i(InStream *is, off_t pos)
-{
-    (void)is;
-    (void)pos;
-}
-
 static void cmpdi_close_i(InStream *is)
 {
     free(is->d.cis);
@@ -127,10 +121,9 @@ static off_t cmpdi_length_i(InStream *is)
 /*
  * raises: EOF_ERROR
  */
-static void cmpdi_read_i(InStream *is, uchar *b, int len)
+static void cmpdi_read_i(InStream *is, off_t start, uchar *b, int len)
 {
     CompoundInStream *cis = is->d.cis;
-    off_t start = is_pos(is);
 
     if ((start + len) > cis->length) {
         RAISE(EOF_ERROR, "Tried to read past end of file. File length is "
@@ -138,18 +131,32 @@ static void cmpdi_read_i(InStream *is, uchar *b, int len)
               cis->length, start + len);
     }
 
-    is_seek(cis->sub, cis->offset + start);
-    is_read_bytes(cis->sub, b, len);
+    /* read straight from the compound file so that all the entries (and
+     * their clones) can share it without sharing a file position */
+    cis->sub->m->read_i(cis->sub, cis->offset + start, b, len);
+}
+
+static void cmpdi_advise_i(InStream *is, off_t offset, off_t len,
+                           InStreamAdvice advice)
+{
+    CompoundInStream *cis = is->d.cis;
+    if (cis->sub->m->advise_i) {
+        if (len == 0 || offset + len > cis->length) {
+            len = cis->length - offset;
+        }
+        cis->sub->m->advise_i(cis->sub, cis->offset + offset, len, advice);
+    }
 }
 
 static const struct InStreamMethods CMPD_IN_STREAM_METHODS = {
     cmpdi_read_i,
-    cmpdi_seek_i,
     cmpdi_length_i,
+    cmpdi_advise_i,
     cmpdi_close_i
 };
 
-static InStream *cmpd_create_input(InStream *sub_is, off_t offset, off_t length)
+static InStream *cmpd_create_input(InStream *sub_is, off_t offset, off_t length,
+                                   const char *file_name)
 {
     InStream *is = is_new();
     CompoundInStream *cis = ALLOC(CompoundInStream);
@@ -160,6 +167,16 @@ static InStream *cmpd_create_input(InStream *sub_is, off_t offset, off_t length)
     is->d.cis = cis;
     is->m = &CMPD_IN_STREAM_METHODS;
 
+    /* read memory-mapped compound files in place */
+    if (is_mapped(sub_is)) {
+        is->buf.buf = sub_is->buf.buf + offset;
+        is->buf.size = 0;
+        is->buf.len = length;
+    }
+    else {
+        is_set_buffer_size(is, file_buffer_size(file_name));
+    }
+
     return is;
 }
 
@@ -182,7 +199,8 @@ static InStream *cmpd_open_input(Store *store, const char *file_name)
         RAISE(IO_ERROR, "File %s does not exist: ", file_name);
     }
 
-    is = cmpd_create_input(cmpd->stream, entry->offset, entry->length);
+    is = cmpd_create_input(cmpd->stream, entry->offset, entry->length,
+                           file_name);
     mutex_unlock(&store->mutex);
 
     return is;
@@ -31,6 +31,78 @@ static void field_index_destroy(void *p)
     free(self);
 }
 
+/*
+ * Build the index of a field with doc values from the column of each of
+ * +ir+'s segments, only un-inverting the segments which don't have one.
+ */
+static void *field_index_load_doc_values(IndexReader *ir, int field_num,
+                                         const FieldIndexClass *klass,
+                                         int length)
+{
+    IndexReader **leaves = &ir;
+    int i, *starts, leaf_cnt = ir_get_leaves(ir, &leaves, &starts);
+    DocValues **dvs, *volatile dv = NULL;
+    bool *owned;
+    int *volatile ends = NULL, *volatile docs = NULL;
+    void *volatile index = NULL;
+    const bool has_deletions = ir->has_deletions(ir);
+
+    if (0 == leaf_cnt) {
+        leaf_cnt = 1;
+    }
+    dvs = ALLOC_AND_ZERO_N(DocValues *, leaf_cnt);
+    owned = ALLOC_AND_ZERO_N(bool, leaf_cnt);
+    TRY
+        for (i = 0; i < leaf_cnt; i++) {
+            dvs[i] = ir_get_doc_values(leaves[i], field_num);
+            if (NULL == dvs[i]) {
+                owned[i] = true;
+                dvs[i] = ir_uninvert_doc_values(leaves[i], field_num);
+            }
+        }
+        dv = leaf_cnt > 1 ? dv_merge(dvs, leaf_cnt) : dvs[0];
+
+        /* sort the documents by ord so each term's are handled together */
+        ends = ALLOC_AND_ZERO_N(int, dv->term_cnt + 2);
+        docs = ALLOC_N(int, length);
+        for (i = 0; i < length; i++) {
+            if (!has_deletions || !ir->is_deleted(ir, i)) {
+                ends[dv_get_ord(dv, i) + 1]++;
+            }
+        }
+        for (i = 1; i <= dv->term_cnt; i++) {
+            ends[i] += ends[i - 1];
+        }
+        for (i = 0; i < length; i++) {
+            if (!has_deletions || !ir->is_deleted(ir, i)) {
+                docs[ends[dv_get_ord(dv, i)]++] = i;
+            }
+        }
+
+        index = klass->create_index(length);
+        for (i = 1; i <= dv->term_cnt; i++) {
+            if (ends[i] > ends[i - 1]) {
+                klass->handle_docs(index, docs + ends[i - 1],
+                                   ends[i] - ends[i - 1], dv->terms[i - 1]);
+            }
+        }
+    XFINALLY
+        free(ends);
+        free(docs);
+        if (leaf_cnt > 1 && dv) {
+            dv_destroy(dv);
+        }
+        for (i = 0; i < leaf_cnt; i++) {
+            if (owned[i] && dvs[i]) {
+                dv_destroy(dvs[i]);
+            }
+        }
+        free(owned);
+        free(dvs);
+    XENDTRY
+    return index;
+}
+
 FieldIndex *field_index_get(IndexReader *ir, Symbol field,
                             const FieldIndexClass *klass)
 {
@@ -65,7 +137,11 @@ FieldIndex *field_index_get(IndexReader *ir, Symbol field,
         self->field = fi->name;
 
         length = ir->max_doc(ir);
-        if (length > 0) {
+        if (length > 0 && fi_has_doc_values(fi)) {
+            self->index = field_index_load_doc_values(ir, field_num, klass,
+                                                      length);
+        }
+        else if (length > 0) {
             TRY
             {
                 void *index;
@@ -121,11 +197,24 @@ static void byte_destroy_index(void *p)
     free(&index[-1]);
 }
 
+static void byte_handle_docs(void *index_ptr, const int *docs, int doc_cnt,
+                             const char *text)
+{
+    long *index = (long *)index_ptr;
+    long val = index[-1]++;
+    int i;
+    (void)text;
+    for (i = 0; i < doc_cnt; i++) {
+        index[docs[i]] = val;
+    }
+}
+
 const FieldIndexClass BYTE_FIELD_INDEX_CLASS = {
     "byte",
     &byte_create_index,
     &byte_destroy_index,
-    &byte_handle_term
+    &byte_handle_term,
+    &byte_handle_docs
 };
 
 /******************************************************************************
@@ -148,11 +237,24 @@ static void integer_handle_term(void *index_ptr,
     }
 }
 
+static void integer_handle_docs(void *index_ptr, const int *docs,
+                                int doc_cnt, const char *text)
+{
+    long *index = (long *)index_ptr;
+    long val;
+    int i;
+    sscanf(text, "%ld", &val);
+    for (i = 0; i < doc_cnt; i++) {
+        index[docs[i]] = val;
+    }
+}
+
 const FieldIndexClass INTEGER_FIELD_INDEX_CLASS = {
     "integer",
     &integer_create_index,
     &free,
-    &integer_handle_term
+    &integer_handle_term,
+    &integer_handle_docs
 };
 
 long get_integer_value(FieldIndex *field_index, long doc_num)
@@ -185,11 +287,24 @@ static void float_handle_term(void *index_ptr,
     }
 }
 
+static void float_handle_docs(void *index_ptr, const int *docs, int doc_cnt,
+                              const char *text)
+{
+    float *index = (float *)index_ptr;
+    float val;
+    int i;
+    sscanf(text, "%g", &val);
+    for (i = 0; i < doc_cnt; i++) {
+        index[docs[i]] = val;
+    }
+}
+
 const FieldIndexClass FLOAT_FIELD_INDEX_CLASS = {
     "float",
     &float_create_index,
     &free,
-    &float_handle_term
+    &float_handle_term,
+    &float_handle_docs
 };
 
 float get_float_value(FieldIndex *field_index, long doc_num)
@@ -227,27 +342,45 @@ static void string_destroy_index(void *p)
     free(self);
 }
 
-static void string_handle_term(void *index_ptr,
-                               TermDocEnum *tde,
-                               const char *text)
+static void string_add_value(StringIndex *index, const char *text)
 {
-    StringIndex *index = (StringIndex *)index_ptr;
     if (index->v_size >= index->v_capa) {
         index->v_capa *= 2;
         index->values = REALLOC_N(index->values, char *, index->v_capa);
     }
     index->values[index->v_size] = estrdup(text);
+}
+
+static void string_handle_term(void *index_ptr,
+                               TermDocEnum *tde,
+                               const char *text)
+{
+    StringIndex *index = (StringIndex *)index_ptr;
+    string_add_value(index, text);
     while (tde->next(tde)) {
         index->index[tde->doc_num(tde)] = index->v_size;
     }
     index->v_size++;
 }
 
+static void string_handle_docs(void *index_ptr, const int *docs, int doc_cnt,
+                               const char *text)
+{
+    StringIndex *index = (StringIndex *)index_ptr;
+    int i;
+    string_add_value(index, text);
+    for (i = 0; i < doc_cnt; i++) {
+        index->index[docs[i]] = index->v_size;
+    }
+    index->v_size++;
+}
+
 const FieldIndexClass STRING_FIELD_INDEX_CLASS = {
     "string",
     &string_create_index,
     &string_destroy_index,
-    &string_handle_term
+    &string_handle_term,
+    &string_handle_docs
 };
 
 const char *get_string_value(FieldIndex *field_index, long doc_num)
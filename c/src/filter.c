@@ -21,18 +21,34 @@ void filt_deref(Filter *filt)
     }
 }
 
+/* guards the filter and reader caches as sub-searchers may be searched in
+ * parallel. It isn't held while the bits are built as that can re-enter
+ * filt_get_bv through nested filters. */
+static mutex_t filter_cache_mutex = MUTEX_INITIALIZER;
+
 BitVector *filt_get_bv(Filter *filt, IndexReader *ir)
 {
-    CacheObject *co = (CacheObject *)h_get(filt->cache, ir);
+    CacheObject *co;
+
+    mutex_lock(&filter_cache_mutex);
+    co = (CacheObject *)h_get(filt->cache, ir);
+    if (!co && !ir->cache) {
+        ir_add_cache(ir);
+    }
+    mutex_unlock(&filter_cache_mutex);
 
     if (!co) {
-        BitVector *bv;
-        if (!ir->cache) {
-            ir_add_cache(ir);
+        BitVector *bv = filt->get_bv_i(filt, ir);
+        mutex_lock(&filter_cache_mutex);
+        /* another thread may have built the same bits in the meantime */
+        if ((co = (CacheObject *)h_get(filt->cache, ir)) != NULL) {
+            bv_destroy(bv);
+        }
+        else {
+            co = co_create(filt->cache, ir->cache, filt, ir,
+                           (free_ft)&bv_destroy, (void *)bv);
         }
-        bv = filt->get_bv_i(filt, ir);
-        co = co_create(filt->cache, ir->cache, filt, ir,
-                       (free_ft)&bv_destroy, (void *)bv);
+        mutex_unlock(&filter_cache_mutex);
     }
     return (BitVector *)co->obj;
 }
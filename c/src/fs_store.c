@@ -28,6 +28,7 @@
 # define DIR_SEPARATOR_CHAR '/'
 # include <unistd.h>
 # include <dirent.h>
+# include <sys/mman.h>
 #endif
 #ifndef O_BINARY
 # define O_BINARY 0
@@ -276,28 +277,41 @@ static OutStream *fs_new_output(Store *store, const char *filename)
     return os;
 }
 
-static void fsi_read_i(InStream *is, uchar *path, int len)
+/*
+ * Read using pread so that the file descriptor's offset is never used. This
+ * means clones of the InStream, which share the file descriptor, can be read
+ * from multiple threads without any locking.
+ */
+static void fsi_read_i(InStream *is, off_t pos, uchar *buf, int len)
 {
     int fd = is->file.fd;
-    off_t pos = is_pos(is);
+#ifndef POSH_OS_WIN32
+    ssize_t cnt;
+    while (len > 0) {
+        if ((cnt = pread(fd, buf, len, pos)) <= 0) {
+            if (cnt < 0 && errno == EINTR) {
+                continue;
+            }
+            RAISE(IO_ERROR, "couldn't read %d chars at %"OFF_T_PFX"d from "
+                  "%s: <%s>", len, pos, is->d.fs.path,
+                  cnt < 0 ? strerror(errno) : "unexpected end of file");
+        }
+        buf += cnt;
+        pos += cnt;
+        len -= (int)cnt;
+    }
+#else
     if (pos != lseek(fd, 0, SEEK_CUR)) {
         lseek(fd, pos, SEEK_SET);
     }
-    if (read(fd, path, len) != len) {
+    if (read(fd, buf, len) != len) {
         /* win: the wrong value can be returned for some reason so double check */
         if (lseek(fd, 0, SEEK_CUR) != (pos + len)) {
             RAISE(IO_ERROR, "couldn't read %d chars from %s: <%s>",
-                  len, path, strerror(errno));
+                  len, is->d.fs.path, strerror(errno));
         }
     }
-}
-
-static void fsi_seek_i(InStream *is, off_t pos)
-{
-    if (lseek(is->file.fd, pos, SEEK_SET) < 0) {
-        RAISE(IO_ERROR, "seeking pos %"OFF_T_PFX"d: <%s>",
-              pos, strerror(errno));
-    }
+#endif
 }
 
 static void fsi_close_i(InStream *is)
@@ -305,28 +319,42 @@ static void fsi_close_i(InStream *is)
     if (close(is->file.fd)) {
         RAISE(IO_ERROR, "%s", strerror(errno));
     }
-    free(is->d.path);
+    free(is->d.fs.path);
 }
 
 static off_t fsi_length_i(InStream *is)
 {
-    struct stat stt;
-    if (fstat(is->file.fd, &stt)) {
-        RAISE(IO_ERROR, "fstat failed: <%s>", strerror(errno));
-    }
-    return stt.st_size;
+    return is->d.fs.length;
+}
+
+static void fsi_advise_i(InStream *is, off_t offset, off_t len,
+                         InStreamAdvice advice)
+{
+#if !defined(POSH_OS_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    int fadv = advice == IS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+             : advice == IS_RANDOM     ? POSIX_FADV_RANDOM
+             :                           POSIX_FADV_NORMAL;
+    /* this is only a hint so failure is harmless */
+    (void)posix_fadvise(is->file.fd, offset, len, fadv);
+#else
+    (void)is;
+    (void)offset;
+    (void)len;
+    (void)advice;
+#endif
 }
 
 static const struct InStreamMethods FS_IN_STREAM_METHODS = {
     fsi_read_i,
-    fsi_seek_i,
     fsi_length_i,
+    fsi_advise_i,
     fsi_close_i
 };
 
 static InStream *fs_open_input(Store *store, const char *filename)
 {
     InStream *is;
+    struct stat stt;
     char path[MAX_FILE_PATH];
     int fd = open(join_path(path, store->dir.path, filename), O_RDONLY | O_BINARY);
     if (fd < 0) {
@@ -334,13 +362,119 @@ static InStream *fs_open_input(Store *store, const char *filename)
               "tried to open \"%s\" but it doesn't exist: <%s>",
               path, strerror(errno));
     }
+    if (fstat(fd, &stt)) {
+        close(fd);
+        RAISE(IO_ERROR, "fstat of %s failed: <%s>", path, strerror(errno));
+    }
     is = is_new();
     is->file.fd = fd;
-    is->d.path = estrdup(path);
+    is->d.fs.path = estrdup(path);
+    is->d.fs.length = stt.st_size;
     is->m = &FS_IN_STREAM_METHODS;
+    is_set_buffer_size(is, file_buffer_size(filename));
     return is;
 }
 
+#ifndef POSH_OS_WIN32
+/*
+ * Memory-mapped InStreams map the whole file and use the mapping as the
+ * stream's buffer (see is_mapped) so the read functions in store.c never
+ * need to call read_i. It is still used by compound file entries.
+ */
+static void mmapi_read_i(InStream *is, off_t pos, uchar *buf, int len)
+{
+    if ((pos + len) > is->buf.len) {
+        RAISE(EOF_ERROR, "couldn't read %d chars from %s, file length is "
+              "<%"OFF_T_PFX"d>", len, is->d.fs.path, is->buf.len);
+    }
+    memcpy(buf, is->buf.buf + pos, len);
+}
+
+static void mmapi_close_i(InStream *is)
+{
+    if (is->buf.len > 0 && munmap(is->buf.buf, is->buf.len)) {
+        RAISE(IO_ERROR, "couldn't unmap %s: <%s>", is->d.fs.path,
+              strerror(errno));
+    }
+    free(is->d.fs.path);
+}
+
+static off_t mmapi_length_i(InStream *is)
+{
+    return is->buf.len;
+}
+
+static void mmapi_advise_i(InStream *is, off_t offset, off_t len,
+                           InStreamAdvice advice)
+{
+#ifdef POSIX_MADV_SEQUENTIAL
+    /* madvise needs a page aligned address */
+    off_t page_offset = offset % sysconf(_SC_PAGESIZE);
+    int madv = advice == IS_SEQUENTIAL ? POSIX_MADV_SEQUENTIAL
+             : advice == IS_RANDOM     ? POSIX_MADV_RANDOM
+             :                           POSIX_MADV_NORMAL;
+    if (is->buf.len == 0) {
+        return;
+    }
+    if (len == 0 || offset + len > is->buf.len) {
+        len = is->buf.len - offset;
+    }
+    /* this is only a hint so failure is harmless */
+    (void)posix_madvise(is->buf.buf + offset - page_offset,
+                        len + page_offset, madv);
+#else
+    (void)is;
+    (void)offset;
+    (void)len;
+    (void)advice;
+#endif
+}
+
+static const struct InStreamMethods MMAP_IN_STREAM_METHODS = {
+    mmapi_read_i,
+    mmapi_length_i,
+    mmapi_advise_i,
+    mmapi_close_i
+};
+
+static InStream *mmap_open_input(Store *store, const char *filename)
+{
+    InStream *is;
+    struct stat stt;
+    void *map = NULL;
+    char path[MAX_FILE_PATH];
+    int fd = open(join_path(path, store->dir.path, filename), O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        RAISE(FILE_NOT_FOUND_ERROR,
+              "tried to open \"%s\" but it doesn't exist: <%s>",
+              path, strerror(errno));
+    }
+    if (fstat(fd, &stt)) {
+        close(fd);
+        RAISE(IO_ERROR, "fstat of %s failed: <%s>", path, strerror(errno));
+    }
+    /* mmap can't map empty files so leave the buffer NULL */
+    if (stt.st_size > 0) {
+        map = mmap(NULL, stt.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            RAISE(IO_ERROR, "couldn't mmap %s: <%s>", path, strerror(errno));
+        }
+    }
+    /* the mapping stays valid after the file descriptor is closed */
+    close(fd);
+
+    is = is_new();
+    is->buf.buf = (uchar *)map;
+    is->buf.size = 0;
+    is->buf.len = stt.st_size;
+    is->file.fd = -1;
+    is->d.fs.path = estrdup(path);
+    is->m = &MMAP_IN_STREAM_METHODS;
+    return is;
+}
+#endif
+
 #define LOCK_OBTAIN_TIMEOUT 10
 
 static int fs_lock_obtain(Lock *lock)
@@ -406,6 +540,9 @@ static void fs_close_lock_i(Lock *lock)
 }
 
 static Hash *stores = NULL;
+#ifndef POSH_OS_WIN32
+static Hash *mmap_stores = NULL;
+#endif
 
 #ifndef UNTHREADED
 static mutex_t stores_mutex = MUTEX_INITIALIZER;
@@ -418,6 +555,15 @@ static void fs_close_i(Store *store)
     mutex_unlock(&stores_mutex);
 }
 
+#ifndef POSH_OS_WIN32
+static void mmap_close_i(Store *store)
+{
+    mutex_lock(&stores_mutex);
+    h_del(mmap_stores, store->dir.path);
+    mutex_unlock(&stores_mutex);
+}
+#endif
+
 static Store *fs_store_new(const char *pathname)
 {
     struct stat stt;
@@ -467,17 +613,23 @@ static Store *fs_store_new(const char *pathname)
     return new_store;
 }
 
-Store *open_fs_store(const char *pathname)
+/**
+ * Get the store for +pathname+ from the +*stores_p+ cache, creating it (and
+ * the cache) if necessary. If +use_mmap+ is set, the newly created store
+ * will open memory-mapped InStreams.
+ */
+static Store *fs_store_open_i(Hash **stores_p, const char *pathname,
+                              bool use_mmap)
 {
     Store *store = NULL;
 
-    if (!stores) {
-        stores = h_new_str(NULL, (free_ft)fs_destroy);
-        register_for_cleanup(stores, (free_ft)h_destroy);
+    if (!*stores_p) {
+        *stores_p = h_new_str(NULL, (free_ft)fs_destroy);
+        register_for_cleanup(*stores_p, (free_ft)h_destroy);
     }
 
     mutex_lock(&stores_mutex);
-    store = (Store *)h_get(stores, pathname);
+    store = (Store *)h_get(*stores_p, pathname);
     if (store) {
         mutex_lock(&store->mutex);
         store->ref_cnt++;
@@ -485,9 +637,31 @@ Store *open_fs_store(const char *pathname)
     }
     else {
         store = fs_store_new(pathname);
-        h_set(stores, store->dir.path, store);
+#ifndef POSH_OS_WIN32
+        if (use_mmap) {
+            store->open_input = &mmap_open_input;
+            store->close_i    = &mmap_close_i;
+        }
+#else
+        (void)use_mmap;
+#endif
+        h_set(*stores_p, store->dir.path, store);
     }
     mutex_unlock(&stores_mutex);
 
     return store;
 }
+
+Store *open_fs_store(const char *pathname)
+{
+    return fs_store_open_i(&stores, pathname, false);
+}
+
+Store *open_mmap_store(const char *pathname)
+{
+#ifndef POSH_OS_WIN32
+    return fs_store_open_i(&mmap_stores, pathname, true);
+#else
+    return open_fs_store(pathname);
+#endif
+}
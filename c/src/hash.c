@@ -1,5 +1,6 @@
 #include "hash.h"
 #include "global.h"
+#include "threading.h"
 #include <string.h>
 #include "internal.h"
 
@@ -18,8 +19,11 @@ static char *dummy_int_key = "i";
 #define PERTURB_SHIFT 5
 #define MAX_FREE_HASH_TABLES 80
 
+/* Hashes are created and destroyed by indexing and search threads so the
+ * free list needs a lock */
 static Hash *free_hts[MAX_FREE_HASH_TABLES];
 static int num_free_hts = 0;
+static mutex_t free_hts_mutex = MUTEX_INITIALIZER;
 
 unsigned long str_hash(const char *const str)
 {
@@ -91,8 +95,12 @@ static HashEntry *h_lookup_ptr(Hash *self, const void *key)
     register HashEntry *he = &he0[i];
     register HashEntry *freeslot = NULL;
 
-    if (he->key == NULL || he->hash == hash) {
-        he->hash = hash;
+    /* no writes so that threads can share a Hash they only read. h_set_ext
+     * sets the hash of new entries */
+    if (he->key == NULL) {
+        return he;
+    }
+    if (he->hash == hash) {
         return he;
     }
     if (he->key == dummy_key) {
@@ -106,7 +114,6 @@ static HashEntry *h_lookup_ptr(Hash *self, const void *key)
             if (freeslot != NULL) {
                 he = freeslot;
             }
-            he->hash = hash;
             return he;
         }
         if (he->hash == hash) {
@@ -130,7 +137,6 @@ HashEntry *h_lookup(Hash *self, register const void *key)
     eq_ft eq = self->eq_i;
 
     if (he->key == NULL || he->key == key) {
-        he->hash = hash;
         return he;
     }
     if (he->key == dummy_key) {
@@ -149,7 +155,6 @@ HashEntry *h_lookup(Hash *self, register const void *key)
             if (freeslot != NULL) {
                 he = freeslot;
             }
-            he->hash = hash;
             return he;
         }
         if (he->key == key
@@ -165,11 +170,13 @@ HashEntry *h_lookup(Hash *self, register const void *key)
 
 Hash *h_new_str(free_ft free_key, free_ft free_value)
 {
-    Hash *self;
+    Hash *self = NULL;
+    mutex_lock(&free_hts_mutex);
     if (num_free_hts > 0) {
         self = free_hts[--num_free_hts];
     }
-    else {
+    mutex_unlock(&free_hts_mutex);
+    if (NULL == self) {
         self = ALLOC(Hash);
     }
     self->fill = 0;
@@ -242,12 +249,13 @@ void h_destroy(Hash *self)
             free(self->table);
         }
 
+        mutex_lock(&free_hts_mutex);
         if (num_free_hts < MAX_FREE_HASH_TABLES) {
             free_hts[num_free_hts++] = self;
+            self = NULL;
         }
-        else {
-            free(self);
-        }
+        mutex_unlock(&free_hts_mutex);
+        free(self);
     }
 }
 
@@ -348,11 +356,13 @@ INLINE bool h_set_ext(Hash *self, const void *key, HashEntry **he)
             h_resize(self, self->size * ((self->size > SLOW_DOWN) ? 4 : 2));
             *he = self->lookup_i(self, key);
         }
+        (*he)->hash = self->hash_i ? self->hash_i(key) : (unsigned long)key;
         self->fill++;
         self->size++;
         return true;
     }
     else if ((*he)->key == dummy_key) {
+        (*he)->hash = self->hash_i ? self->hash_i(key) : (unsigned long)key;
         self->size++;
         return true;
     }
@@ -518,7 +528,12 @@ void h_str_print_keys(Hash *self, FILE *out)
 
 void hash_finalize()
 {
-    while (num_free_hts > 0) {
-        free(free_hts[--num_free_hts]);
+    /* this is also called when exiting on a signal so don't wait on a lock
+     * which may never be released */
+    if (0 == mutex_trylock(&free_hts_mutex)) {
+        while (num_free_hts > 0) {
+            free(free_hts[--num_free_hts]);
+        }
+        mutex_unlock(&free_hts_mutex);
     }
 }
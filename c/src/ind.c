@@ -25,11 +25,23 @@ static const char *NON_UNIQUE_KEY_ERROR_MSG =
 
 #define AUTOFLUSH_IW(self) do {  \
     if (self->auto_flush) {      \
-        iw_close(self->iw);      \
-        self->iw = NULL;         \
+        if (self->keep_writer) { \
+            iw_commit(self->iw); \
+        } else {                 \
+            iw_close(self->iw);  \
+            self->iw = NULL;     \
+        }                        \
     } else {                     \
         self->has_writes = true; \
     }                            \
+    self->write_cnt++;           \
+} while (0)
+
+#define INDEX_CLOSE_WRITER(self) do { \
+    if (self->iw) {                   \
+        iw_close(self->iw);           \
+        self->iw = NULL;              \
+    }                                 \
 } while (0)
 
 void index_auto_flush_ir(Index *self)
@@ -79,6 +91,9 @@ Index *index_new(Store *store, Analyzer *analyzer, HashSet *def_fields,
     self->def_field = intern("id");
     self->auto_flush = false;
     self->check_latest = true;
+    self->keep_writer = false;
+    self->refresh_writes = 1000;
+    self->refresh_interval = 1;
 
     REF(self->analyzer);
     self->qp = qp_new(self->analyzer);
@@ -105,8 +120,17 @@ void index_destroy(Index *self)
     free(self);
 }
 
+static void index_refresh_reader(Index *self, bool force);
+
 void index_flush(Index *self)
 {
+    if (self->keep_writer) {
+        if (self->ir) ir_commit(self->ir);
+        if (self->iw) iw_commit(self->iw);
+        if (self->ir) index_refresh_reader(self, true);
+        self->has_writes = false;
+        return;
+    }
     if (self->ir) {
         ir_commit(self->ir);
     } else if (self->iw) {
@@ -119,21 +143,76 @@ void index_flush(Index *self)
 INLINE void ensure_writer_open(Index *self)
 {
     if (!self->iw) {
-        INDEX_CLOSE_READER(self);
+        if (self->keep_writer) {
+            /* commit any deletes so the reader gives up the write lock */
+            if (self->ir) ir_commit(self->ir);
+        } else {
+            INDEX_CLOSE_READER(self);
+        }
 
         /* make sure the analzyer isn't deleted by the IndexWriter */
         REF(self->analyzer);
         self->iw = iw_open(self->store, self->analyzer, false);
         self->iw->config.use_compound_file = self->config.use_compound_file;
+        self->iw->config.postings_format = self->config.postings_format;
+    }
+}
+
+/*
+ * In keep_writer mode, reopen the reader to see the writer's changes once
+ * it's due or if +force+ is set.
+ */
+static void index_refresh_reader(Index *self, bool force)
+{
+    time_t now = time(NULL);
+    if (self->ir && !force
+        && !(self->refresh_writes > 0
+             && self->write_cnt >= self->refresh_writes)
+        && now - self->refreshed_at < self->refresh_interval) {
+        return;
+    }
+    if (self->iw) {
+        /* read the writer's flushed segments without committing them */
+        if (!self->ir || force || self->write_cnt > 0) {
+            IndexReader *ir = iw_get_reader(self->iw, self->ir);
+            INDEX_CLOSE_READER(self);
+            self->ir = ir;
+        }
+    } else if (!self->ir) {
+        self->ir = ir_open(self->store);
+    } else if ((force || self->check_latest) && !ir_is_latest(self->ir)) {
+        IndexReader *ir = ir_reopen(self->ir);
+        INDEX_CLOSE_READER(self);
+        self->ir = ir;
+    }
+    self->write_cnt = 0;
+    self->refreshed_at = now;
+}
+
+/*
+ * In keep_writer mode, close the writer so the reader can take the write
+ * lock to delete by document number. The reader is reopened if the writer
+ * committed anything as it couldn't take the lock otherwise.
+ */
+static void index_release_writer(Index *self)
+{
+    if (self->iw) {
+        INDEX_CLOSE_WRITER(self);
+        index_refresh_reader(self, true);
     }
 }
 
 INLINE void ensure_reader_open(Index *self)
 {
+    if (self->keep_writer) {
+        index_refresh_reader(self, false);
+        return;
+    }
     if (self->ir) {
         if (self->check_latest && !ir_is_latest(self->ir)) {
+            IndexReader *ir = ir_reopen(self->ir);
             INDEX_CLOSE_READER(self);
-            self->ir = ir_open(self->store);
+            self->ir = ir;
         }
         return;
     }
@@ -230,6 +309,10 @@ static INLINE void index_del_doc_with_key_i(Index *self, Document *doc,
     if (td->total_hits > 1) {
         td_destroy(td);
         RAISE(ARG_ERROR, "%s", NON_UNIQUE_KEY_ERROR_MSG);
+    } else if (self->keep_writer) {
+        /* the writer also finds documents the reader can't see yet */
+        ensure_writer_open(self);
+        iw_delete_query(self->iw, q);
     } else if (td->total_hits == 1) {
         ir_delete_doc(self->ir, td->hits[0]->doc);
     }
@@ -360,6 +443,7 @@ void index_delete(Index *self, int doc_num)
 {
     mutex_lock(&self->mutex);
     {
+        if (self->keep_writer) index_release_writer(self);
         ensure_reader_open(self);
         ir_delete_doc(self->ir, doc_num);
         AUTOFLUSH_IR(self);
@@ -372,7 +456,7 @@ void index_delete_term(Index *self, Symbol field, const char *term)
     TermDocEnum *tde;
     mutex_lock(&self->mutex);
     {
-        if (self->ir) {
+        if (self->ir && !self->keep_writer) {
             tde = ir_term_docs_for(self->ir, field, term);
             TRY
                 while (tde->next(tde)) {
@@ -385,6 +469,7 @@ void index_delete_term(Index *self, Symbol field, const char *term)
         } else {
             ensure_writer_open(self);
             iw_delete_term(self->iw, field, term);
+            AUTOFLUSH_IW(self);
         }
     }
     mutex_unlock(&self->mutex);
@@ -406,9 +491,25 @@ void index_delete_query(Index *self, Query *q, Filter *f,
 {
     mutex_lock(&self->mutex);
     {
-        ensure_searcher_open(self);
-        searcher_search_each(self->sea, q, f, post_filter, &index_qdel_i, 0);
-        AUTOFLUSH_IR(self);
+        /* the writer buffers the delete unless it needs a searcher */
+        if (!post_filter && (self->keep_writer || (!self->ir && !f))) {
+            Query *del_q = q;
+            if (f) {
+                REF(q);
+                REF(f);
+                del_q = fq_new(q, f);
+            }
+            ensure_writer_open(self);
+            iw_delete_query(self->iw, del_q);
+            if (f) q_deref(del_q);
+            AUTOFLUSH_IW(self);
+        } else {
+            if (self->keep_writer) index_release_writer(self);
+            ensure_searcher_open(self);
+            searcher_search_each(self->sea, q, f, post_filter, &index_qdel_i,
+                                 0);
+            AUTOFLUSH_IR(self);
+        }
     }
     mutex_unlock(&self->mutex);
 }
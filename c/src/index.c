@@ -1,4 +1,5 @@
 #include "index.h"
+#include "search.h"
 #include "symbol.h"
 #include "similarity.h"
 #include "helper.h"
@@ -6,6 +7,7 @@
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <math.h>
 #ifdef USE_ZLIB
 # include <zlib.h>
 #else
@@ -34,13 +36,33 @@ const Config default_config = {
     10000,          /* max_buffered_docs */
     INT_MAX,        /* max_merge_docs */
     10000,          /* maximum field length (number of terms) */
-    true            /* use compound file by default */
+    true,           /* use compound file by default */
+    POSTINGS_FORMAT_VINT, /* VInt encoded postings by default */
+    1,              /* a single DocWriter, ie no concurrent adds */
+    0,              /* merge in the thread which triggers the merge */
+    2,              /* max_pending_merges */
+    0,              /* don't throttle merges */
+    1,              /* run the merge stages one after the other */
+    1               /* analyze documents in the thread which adds them */
 };
 
 static void ste_reset(TermEnum *te);
 static char *ste_next(TermEnum *te);
 
-#define FORMAT 0
+/* FORMAT 1 adds the postings format to each SegmentInfo, FORMAT 2 the
+ * maximum number of skip levels and FORMAT 3 whether skip data starts with
+ * the term's maximum freq. Segments from earlier formats have single level
+ * skip data without max freqs */
+#define FORMAT 3
+#define FORMAT_POSTINGS 1
+#define FORMAT_SKIP_LEVELS 2
+#define FORMAT_MAX_FREQS 3
+
+/* .tfx files written since terms were stored in blocks start with a zero,
+ * which can't be an index interval, followed by the term dictionary format */
+#define TERM_DICT_FORMAT_BLOCKS 1
+#define TERM_DICT_FORMAT_PULSED 2
+
 #define SEGMENTS_GEN_FILE_NAME "segments"
 #define MAX_EXT_LEN 10
 #define ZIP_BUFFER_SIZE 16348
@@ -48,12 +70,13 @@ static char *ste_next(TermEnum *te);
 
 /* *** Must be three characters *** */
 static const char *INDEX_EXTENSIONS[] = {
-    "frq", "prx", "fdx", "fdt", "tfx", "tix", "tis", "del", "gen", "cfs"
+    "frq", "prx", "fdx", "fdt", "tfx", "tix", "tis", "fst", "blm", "dvs",
+    "del", "gen", "cfs"
 };
 
 /* *** Must be three characters *** */
 static const char *COMPOUND_EXTENSIONS[] = {
-    "frq", "prx", "fdx", "fdt", "tfx", "tix", "tis"
+    "frq", "prx", "fdx", "fdt", "tfx", "tix", "tis", "fst", "blm", "dvs"
 };
 
 static const char BASE36_DIGITMAP[] = "0123456789abcdefghijklmnopqrstuvwxyz";
@@ -307,7 +330,7 @@ char *fi_to_s(FieldInfo *fi)
 {
     char *str = ALLOC_N(char, strlen((char *)fi->name) + 200);
     char *s = str;
-    s += sprintf(str, "[\"%s\":(%s%s%s%s%s%s%s%s", (char *)fi->name,
+    s += sprintf(str, "[\"%s\":(%s%s%s%s%s%s%s%s%s%s", (char *)fi->name,
                  fi_is_stored(fi) ? "is_stored, " : "",
                  fi_is_compressed(fi) ? "is_compressed, " : "",
                  fi_is_indexed(fi) ? "is_indexed, " : "",
@@ -315,7 +338,9 @@ char *fi_to_s(FieldInfo *fi)
                  fi_omit_norms(fi) ? "omit_norms, " : "",
                  fi_store_term_vector(fi) ? "store_term_vector, " : "",
                  fi_store_positions(fi) ? "store_positions, " : "",
-                 fi_store_offsets(fi) ? "store_offsets, " : "");
+                 fi_store_offsets(fi) ? "store_offsets, " : "",
+                 fi_has_bloom_filter(fi) ? "bloom_filter, " : "",
+                 fi_has_doc_values(fi) ? "doc_values, " : "");
     s -= 2;
     if (*s != ',') {
         s += 2;
@@ -399,6 +424,20 @@ FieldInfo *fis_by_number(FieldInfos *fis, int num)
     }
 }
 
+/* copy +fis+ for a reader which mustn't see fields added after it opens */
+static FieldInfos *fis_clone(FieldInfos *fis)
+{
+    int i;
+    FieldInfos *clone = fis_new(fis->store, fis->index, fis->term_vector);
+    for (i = 0; i < fis->size; i++) {
+        FieldInfo *fi = ALLOC(FieldInfo);
+        memcpy(fi, fis->fields[i], sizeof(FieldInfo));
+        fi->ref_cnt = 1;
+        fis_add_field(clone, fi);
+    }
+    return clone;
+}
+
 FieldInfos *fis_read(InStream *is)
 {
     FieldInfos *volatile fis;
@@ -570,10 +609,29 @@ SegmentInfo *si_new(char *name, int doc_cnt, Store *store)
     si->norm_gens_size = 0;
     si->ref_cnt = 1;
     si->use_compound_file = false;
+    si->postings_format = POSTINGS_FORMAT_VINT;
+    si->max_skip_levels = MAX_SKIP_LEVELS;
+    si->has_max_freqs = true;
+    si->has_stats = false;
     return si;
 }
 
-static SegmentInfo *si_read(Store *store, InStream *is)
+/* copy +si+ for a reader which mustn't see the writer's later changes */
+static SegmentInfo *si_clone(SegmentInfo *si)
+{
+    SegmentInfo *clone = ALLOC(SegmentInfo);
+    memcpy(clone, si, sizeof(SegmentInfo));
+    clone->ref_cnt = 1;
+    clone->name = estrdup(si->name);
+    if (0 < si->norm_gens_size) {
+        clone->norm_gens = ALLOC_N(int, si->norm_gens_size);
+        memcpy(clone->norm_gens, si->norm_gens,
+               si->norm_gens_size * sizeof(int));
+    }
+    return clone;
+}
+
+static SegmentInfo *si_read(Store *store, InStream *is, int format)
 {
     SegmentInfo *volatile si = ALLOC_AND_ZERO(SegmentInfo);
     TRY
@@ -591,6 +649,20 @@ static SegmentInfo *si_read(Store *store, InStream *is)
             }
         }
         si->use_compound_file = (bool)is_read_byte(is);
+        if (format >= FORMAT_POSTINGS) {
+            si->postings_format = (PostingsFormat)is_read_byte(is);
+        }
+        else {
+            si->postings_format = POSTINGS_FORMAT_VINT;
+        }
+        if (format >= FORMAT_SKIP_LEVELS) {
+            si->max_skip_levels = is_read_vint(is);
+        }
+        else {
+            si->max_skip_levels = 1;
+        }
+        si->has_max_freqs = (format >= FORMAT_MAX_FREQS)
+            ? (bool)is_read_byte(is) : false;
     XCATCHALL
         free(si->name);
         free(si);
@@ -611,6 +683,9 @@ static void si_write(SegmentInfo *si, OutStream *os)
         }
     }
     os_write_byte(os, (uchar)si->use_compound_file);
+    os_write_byte(os, (uchar)si->postings_format);
+    os_write_vint(os, si->max_skip_levels);
+    os_write_byte(os, (uchar)si->has_max_freqs);
 }
 
 void si_deref(SegmentInfo *si)
@@ -734,6 +809,7 @@ static char *new_segment(i64 generation)
 
 typedef struct FindSegmentsFile {
     i64  generation;
+    IndexReader *prev_ir; /* the reader ir_reopen is reopening */
     union {
       SegmentInfos *sis;
       IndexReader  *ir;
@@ -1022,6 +1098,24 @@ SegmentInfo *sis_new_segment(SegmentInfos *sis, int doc_cnt, Store *store)
     return sis_add_si(sis, si_new(new_segment(sis->counter++), doc_cnt, store));
 }
 
+/* copy +sis+ along with its segments and fields */
+static SegmentInfos *sis_clone(SegmentInfos *sis)
+{
+    int i;
+    FieldInfos *fis = fis_clone(sis->fis);
+    SegmentInfos *clone = sis_new(fis);
+    fis_deref(fis);
+    clone->counter = sis->counter;
+    clone->version = sis->version;
+    clone->generation = sis->generation;
+    clone->format = sis->format;
+    clone->store = sis->store;
+    for (i = 0; i < sis->size; i++) {
+        sis_add_si(clone, si_clone(sis->segs[i]));
+    }
+    return clone;
+}
+
 void sis_destroy(SegmentInfos *sis)
 {
     int i;
@@ -1091,7 +1185,12 @@ static void sis_read_i(Store *store, FindSegmentsFile *fsf)
         sis->store = store;
 
         sis->generation = fsf->generation;
-        sis->format = is_read_u32(is); /* do nothing. it's the first version */
+        sis->format = is_read_u32(is);
+        if (sis->format > FORMAT) {
+            RAISE(UNSUPPORTED_ERROR, "Unknown segments file format %d. "
+                  "The index was written by a newer version of Ferret.",
+                  (int)sis->format);
+        }
         sis->version = is_read_u64(is);
         sis->counter = is_read_u64(is);
         seg_cnt = is_read_vint(is);
@@ -1103,7 +1202,7 @@ static void sis_read_i(Store *store, FindSegmentsFile *fsf)
         sis->segs = ALLOC_N(SegmentInfo *, sis->capa);
 
         for (i = 0; i < seg_cnt; i++) {
-            sis_add_si(sis, si_read(store, is));
+            sis_add_si(sis, si_read(store, is, sis->format));
         }
         sis->fis = fis_read(is);
         success = true;
@@ -1520,6 +1619,9 @@ FieldsReader *fr_open(Store *store, const char *segment, FieldInfos *fis)
     strcpy(file_name + segment_len, ".fdx");
     fdx_in = fr->fdx_in = store->open_input(store, file_name);
     fr->size = is_length(fdx_in) / FIELDS_IDX_PTR_SIZE;
+    /* documents are fetched one at a time by document number */
+    is_advise(fr->fdt_in, IS_RANDOM);
+    is_advise(fdx_in, IS_RANDOM);
     fr->store = store;
 
     return fr;
@@ -1956,6 +2058,7 @@ void fw_write_tv_index(FieldsWriter *fw)
 
 void fw_add_postings(FieldsWriter *fw,
                      int field_num,
+                     ByteBlockPool *tv_bbp,
                      PostingList **plists,
                      int posting_count,
                      Offset *offsets,
@@ -1966,8 +2069,6 @@ void fw_add_postings(FieldsWriter *fw,
     OutStream *fdt_out = fw->fdt_out;
     off_t fdt_start_pos = os_pos(fdt_out);
     PostingList *plist;
-    Posting *posting;
-    Occurence *occ;
     FieldInfo *fi = fw->fis->fields[field_num];
     int store_positions = fi_store_positions(fi);
 
@@ -1977,7 +2078,6 @@ void fw_add_postings(FieldsWriter *fw,
     os_write_vint(fdt_out, posting_count);
     for (i = 0; i < posting_count; i++) {
         plist = plists[i];
-        posting = plist->last;
         delta_start = hlp_string_diff(last_term, plist->term);
         delta_length = plist->term_len - delta_start;
 
@@ -1987,16 +2087,14 @@ void fw_add_postings(FieldsWriter *fw,
         os_write_bytes(fdt_out,
                        (uchar *)(plist->term + delta_start),
                        delta_length);
-        os_write_vint(fdt_out, posting->freq);
+        os_write_vint(fdt_out, plist->freq);
         last_term = plist->term;
 
         if (store_positions) {
-            /* use delta encoding for positions */
-            int last_pos = 0;
-            for (occ = posting->first_occ; occ; occ = occ->next) {
-                os_write_vint(fdt_out, occ->pos - last_pos);
-                last_pos = occ->pos;
-            }
+            /* the positions are already delta encoded */
+            ByteSliceReader tv_reader;
+            bsr_init(&tv_reader, tv_bbp, plist->tv_start, plist->tv_upto);
+            bsr_copy_vints(&tv_reader, fdt_out, plist->freq);
         }
 
     }
@@ -2046,6 +2144,534 @@ static char *te_skip_to(TermEnum *te, const char *term)
     return curr_term;
 }
 
+/****************************************************************************
+ *
+ * Byte Buffers
+ *
+ * Decode values written with os_write_vint and friends from memory, along
+ * with little-endian numbers of +width+ bytes.
+ *
+ ****************************************************************************/
+
+static INLINE int bytes_read_vint(const uchar **p)
+{
+    const uchar *q = *p;
+    uchar b = *q++;
+    int res = b & 0x7F;
+    int shift = 7;
+    while ((b & 0x80) != 0) {
+        b = *q++;
+        res |= (b & 0x7F) << shift;
+        shift += 7;
+    }
+    *p = q;
+    return res;
+}
+
+static INLINE off_t bytes_read_voff_t(const uchar **p)
+{
+    const uchar *q = *p;
+    uchar b = *q++;
+    off_t res = b & 0x7F;
+    int shift = 7;
+    while ((b & 0x80) != 0) {
+        b = *q++;
+        res |= (off_t)(b & 0x7F) << shift;
+        shift += 7;
+    }
+    *p = q;
+    return res;
+}
+
+static INLINE int bytes_read_num(const uchar *p, const int width)
+{
+    int res = 0;
+    int i;
+    for (i = width - 1; i >= 0; i--) {
+        res = (res << 8) | p[i];
+    }
+    return res;
+}
+
+/****************************************************************************
+ *
+ * Term Index FST
+ *
+ * The index terms of each field are stored as a minimal acyclic automaton so
+ * the prefixes and suffixes they share are only stored once. Each node also
+ * records how many index terms can be reached from it which lets us map a
+ * term to the ordinal of the index term at or before it, and an ordinal back
+ * to its index term, in a single walk from the root. Nodes are written
+ * children first so every target points back into the buffer. Each node is
+ * written as;
+ *
+ *   Byte  Flags              # bit 0 is set on final nodes, bits 1-2 hold
+ *                            # Width - 1
+ *   VInt  ArcCount
+ *   VInt  TermCount          # the index terms reachable from this node
+ *   Bytes Labels             # ArcCount bytes in ascending order
+ *   {
+ *     Bytes Output           # Width bytes, the index terms under lesser arcs
+ *     Bytes Target           # Width bytes, the position of the target node
+ *   } * ArcCount
+ *
+ * and each field's FST is written to the .fst file as;
+ *
+ *   VInt  Root
+ *   VInt  Length
+ *   Bytes Nodes              # Length bytes
+ *
+ * in the order the fields appear in the .tfx file.
+ *
+ ****************************************************************************/
+
+#define FST_FINAL 0x01
+#define FST_MAX_NODE_SIZE (1 + 2 * 5 + 256 * 9)
+
+/*
+ * Return the ordinal of the greatest index term less than or equal to +term+.
+ * The first index term of a field is always the empty string so this is -1
+ * only for an empty FST.
+ */
+static int fst_floor(const uchar *fst, const int root, const char *term)
+{
+    const uchar *node = fst + root;
+    const uchar *t = (const uchar *)term;
+    int less = 0;
+
+    while (true) {
+        const uchar flags = *node++;
+        const int width = ((flags >> 1) & 0x03) + 1;
+        const int is_final = flags & FST_FINAL;
+        const int arc_cnt = bytes_read_vint(&node);
+        const int cnt = bytes_read_vint(&node);
+        const uchar *labels = node;
+        const uchar *arc;
+        int lo = 0, hi = arc_cnt;
+
+        if (*t == '\0') {
+            return less + is_final - 1;
+        }
+        /* find the first arc whose label is not less than *t */
+        while (lo < hi) {
+            const int mid = (lo + hi) >> 1;
+            if (labels[mid] < *t) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        if (lo == arc_cnt) {
+            /* every term under this node is less than +term+ */
+            return less + cnt - 1;
+        }
+        arc = labels + arc_cnt + lo * 2 * width;
+        less += is_final + bytes_read_num(arc, width);
+        if (labels[lo] != *t) {
+            return less - 1;
+        }
+        node = fst + bytes_read_num(arc + width, width);
+        t++;
+    }
+}
+
+/*
+ * Write the index term with ordinal +ord+ into +buf+ and return its length.
+ */
+static int fst_get_term(const uchar *fst, const int root, int ord, char *buf)
+{
+    const uchar *node = fst + root;
+    int len = 0;
+
+    while (true) {
+        const uchar flags = *node++;
+        const int width = ((flags >> 1) & 0x03) + 1;
+        const int arc_cnt = bytes_read_vint(&node);
+        const uchar *labels, *arcs;
+        int lo = 0, hi = arc_cnt - 1;
+
+        (void)bytes_read_vint(&node); /* term count */
+        if (flags & FST_FINAL) {
+            if (ord == 0) {
+                break;
+            }
+            ord--;
+        }
+        labels = node;
+        arcs = labels + arc_cnt;
+        /* find the last arc whose output is not greater than ord */
+        while (lo < hi) {
+            const int mid = (lo + hi + 1) >> 1;
+            if (bytes_read_num(arcs + mid * 2 * width, width) <= ord) {
+                lo = mid;
+            }
+            else {
+                hi = mid - 1;
+            }
+        }
+        buf[len++] = (char)labels[lo];
+        ord -= bytes_read_num(arcs + lo * 2 * width, width);
+        node = fst + bytes_read_num(arcs + lo * 2 * width + width, width);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* * FstBuilder * */
+
+typedef struct FstArc
+{
+    int   target;
+    int   cnt;
+    uchar label;
+} FstArc;
+
+typedef struct FstNode
+{
+    bool    is_final;
+    int     arc_cnt;
+    FstArc  arcs[256];
+} FstNode;
+
+typedef struct FstNodeKey
+{
+    FstBuilder *fb;
+    int         pos;
+    int         len;
+} FstNodeKey;
+
+/* Index terms are added in order, so only the nodes along the path of the
+ * last term added can still change. Every other node has been frozen into
+ * +buf+ and registered so that equivalent nodes are only written once. */
+struct FrtFstBuilder
+{
+    uchar      *buf;
+    int         size;
+    int         capa;
+    int         depth;
+    char        last_term[MAX_WORD_SIZE];
+    Hash       *registry;
+    FstNode    *nodes[MAX_WORD_SIZE + 1];
+};
+
+static unsigned long fst_node_hash(const void *key)
+{
+    const FstNodeKey *nk = (const FstNodeKey *)key;
+    const uchar *p = nk->fb->buf + nk->pos;
+    const uchar *end = p + nk->len;
+    unsigned long h = 0;
+    for (; p < end; p++) {
+        h = 37 * h + *p;
+    }
+    return h;
+}
+
+static int fst_node_eq(const void *key1, const void *key2)
+{
+    const FstNodeKey *nk1 = (const FstNodeKey *)key1;
+    const FstNodeKey *nk2 = (const FstNodeKey *)key2;
+    return nk1->len == nk2->len
+        && 0 == memcmp(nk1->fb->buf + nk1->pos, nk2->fb->buf + nk2->pos,
+                       nk1->len);
+}
+
+static FstBuilder *fb_new()
+{
+    FstBuilder *fb = ALLOC_AND_ZERO(FstBuilder);
+    fb->capa = 1024;
+    fb->buf = ALLOC_N(uchar, fb->capa);
+    fb->registry = h_new(&fst_node_hash, &fst_node_eq,
+                         (free_ft)&free, (free_ft)NULL);
+    fb->nodes[0] = ALLOC_AND_ZERO(FstNode);
+    return fb;
+}
+
+static void fb_destroy(FstBuilder *fb)
+{
+    int i;
+    for (i = 0; i <= MAX_WORD_SIZE && fb->nodes[i]; i++) {
+        free(fb->nodes[i]);
+    }
+    h_destroy(fb->registry);
+    free(fb->buf);
+    free(fb);
+}
+
+static void fb_reset(FstBuilder *fb)
+{
+    h_clear(fb->registry);
+    fb->size = 0;
+    fb->depth = 0;
+    fb->last_term[0] = '\0';
+    fb->nodes[0]->is_final = false;
+    fb->nodes[0]->arc_cnt = 0;
+}
+
+static INLINE void fb_write_vint(FstBuilder *fb, unsigned int i)
+{
+    while (i > 127) {
+        fb->buf[fb->size++] = (uchar)((i & 0x7f) | 0x80);
+        i >>= 7;
+    }
+    fb->buf[fb->size++] = (uchar)i;
+}
+
+static INLINE void fb_write_num(FstBuilder *fb, int num, const int width)
+{
+    int i;
+    for (i = 0; i < width; i++) {
+        fb->buf[fb->size++] = (uchar)(num & 0xFF);
+        num >>= 8;
+    }
+}
+
+/*
+ * Write +node+ to the buffer, or find the equivalent node already written,
+ * and return its position. +cnt+ is set to the number of terms reachable from
+ * the node.
+ */
+static int fb_freeze(FstBuilder *fb, FstNode *node, int *cnt)
+{
+    FstNodeKey key, *found;
+    int i, width, max = 0, output = 0;
+    const int arc_cnt = node->arc_cnt;
+
+    for (i = 0; i < arc_cnt; i++) {
+        if (output > max) max = output;
+        if (node->arcs[i].target > max) max = node->arcs[i].target;
+        output += node->arcs[i].cnt;
+    }
+    for (width = 1; width < 4 && (max >> (8 * width)) != 0; width++) {
+    }
+    *cnt = output + (node->is_final ? 1 : 0);
+
+    if (fb->size + FST_MAX_NODE_SIZE > fb->capa) {
+        while (fb->size + FST_MAX_NODE_SIZE > fb->capa) {
+            fb->capa <<= 1;
+        }
+        REALLOC_N(fb->buf, uchar, fb->capa);
+    }
+    key.fb = fb;
+    key.pos = fb->size;
+    fb->buf[fb->size++] = (uchar)((node->is_final ? FST_FINAL : 0)
+                                  | ((width - 1) << 1));
+    fb_write_vint(fb, arc_cnt);
+    fb_write_vint(fb, *cnt);
+    for (i = 0; i < arc_cnt; i++) {
+        fb->buf[fb->size++] = node->arcs[i].label;
+    }
+    for (output = 0, i = 0; i < arc_cnt; i++) {
+        fb_write_num(fb, output, width);
+        fb_write_num(fb, node->arcs[i].target, width);
+        output += node->arcs[i].cnt;
+    }
+    key.len = fb->size - key.pos;
+
+    if (NULL != (found = (FstNodeKey *)h_get(fb->registry, &key))) {
+        fb->size = key.pos;
+        return found->pos;
+    }
+    found = ALLOC(FstNodeKey);
+    *found = key;
+    h_set(fb->registry, found, found);
+    return key.pos;
+}
+
+/* freeze the nodes on the path of the last term below +depth+ */
+static void fb_freeze_to(FstBuilder *fb, const int depth)
+{
+    int d;
+    for (d = fb->depth; d > depth; d--) {
+        FstArc *arc = &fb->nodes[d - 1]->arcs[fb->nodes[d - 1]->arc_cnt - 1];
+        arc->target = fb_freeze(fb, fb->nodes[d], &arc->cnt);
+    }
+}
+
+/*
+ * Add +term+ to the FST. Terms must be added in ascending order.
+ */
+static void fb_add(FstBuilder *fb, const char *term, const int term_len)
+{
+    const int prefix_len = hlp_string_diff(fb->last_term, term);
+    int d;
+
+    fb_freeze_to(fb, prefix_len);
+    for (d = prefix_len; d < term_len; d++) {
+        FstNode *node = fb->nodes[d];
+        FstArc *arc = &node->arcs[node->arc_cnt++];
+        arc->label = (uchar)term[d];
+        arc->target = -1;
+        if (NULL == fb->nodes[d + 1]) {
+            fb->nodes[d + 1] = ALLOC(FstNode);
+        }
+        fb->nodes[d + 1]->is_final = false;
+        fb->nodes[d + 1]->arc_cnt = 0;
+    }
+    fb->nodes[term_len]->is_final = true;
+    memcpy(fb->last_term, term, term_len + 1);
+    fb->depth = term_len;
+}
+
+/*
+ * Freeze the rest of the FST and return the position of its root. The FST
+ * is left in +fb->buf+ until the builder is reset.
+ */
+static int fb_finish(FstBuilder *fb)
+{
+    int cnt;
+    fb_freeze_to(fb, 0);
+    fb->depth = 0;
+    return fb_freeze(fb, fb->nodes[0], &cnt);
+}
+
+/****************************************************************************
+ *
+ * Term Bloom Filters
+ *
+ * Fields with FI_BLOOM_FILTER_BM set get a bloom filter of their terms so
+ * that a lookup of a term which isn't in a segment can usually skip the
+ * segment without seeking in its term dictionary. Each filter is a power of
+ * two bits, about BLOOM_BITS_PER_TERM per term, and a term sets
+ * BLOOM_HASH_CNT of them picked by double hashing a 64-bit hash of the term.
+ * The filters are written to the .blm file as;
+ *
+ *   {
+ *     VInt  HashCount        # 0 if the field has no filter
+ *     VInt  Length           # only if HashCount > 0
+ *     Bytes Bits             # Length bytes
+ *   } * FieldCount
+ *
+ * in the order the fields appear in the .tfx file. Trailing fields without
+ * a filter may be left out and the file is only written if at least one
+ * field has a filter.
+ *
+ ****************************************************************************/
+
+#define BLOOM_BITS_PER_TERM 10
+#define BLOOM_HASH_CNT 7
+#define BLOOM_MIN_BITS 64
+#define BLOOM_MAX_BITS ((u64)1 << 32)
+
+/* FNV-1a finished with a 64-bit mixer so both halves are usable */
+static INLINE u64 bloom_hash(const char *term, int term_len)
+{
+    u64 h = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < term_len; i++) {
+        h ^= (uchar)term[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static INLINE bool bloom_may_contain(const uchar *bloom, u32 mask,
+                                     int hash_cnt, const char *term)
+{
+    const u64 h = bloom_hash(term, (int)strlen(term));
+    const u32 h1 = (u32)h, h2 = (u32)(h >> 32) | 1;
+    int i;
+    for (i = 0; i < hash_cnt; i++) {
+        const u32 bit = (h1 + (u32)i * h2) & mask;
+        if (0 == (bloom[bit >> 3] & (1 << (bit & 7)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct FrtBloomFilterWriter
+{
+    Store *store;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    OutStream *os;
+    int skipped;            /* fields finished before +os+ was opened */
+    bool active;
+    u64 *hashes;
+    int cnt;
+    int capa;
+};
+
+static BloomFilterWriter *bfw_new(Store *store, const char *segment)
+{
+    BloomFilterWriter *bfw = ALLOC_AND_ZERO(BloomFilterWriter);
+    bfw->store = store;
+    sprintf(bfw->file_name, "%s.blm", segment);
+    bfw->capa = 1024;
+    bfw->hashes = ALLOC_N(u64, bfw->capa);
+    return bfw;
+}
+
+static INLINE void bfw_add(BloomFilterWriter *bfw, const char *term,
+                           int term_len)
+{
+    if (bfw->cnt >= bfw->capa) {
+        bfw->capa <<= 1;
+        REALLOC_N(bfw->hashes, u64, bfw->capa);
+    }
+    bfw->hashes[bfw->cnt++] = bloom_hash(term, term_len);
+}
+
+/* write the filter of the field just finished */
+static void bfw_write(BloomFilterWriter *bfw)
+{
+    if (bfw->active && bfw->cnt > 0) {
+        const u64 wanted = (u64)bfw->cnt * BLOOM_BITS_PER_TERM;
+        u64 bits = BLOOM_MIN_BITS;
+        size_t len;
+        uchar *bloom;
+        u32 mask;
+        int i, j;
+
+        while (bits < wanted && bits < BLOOM_MAX_BITS) {
+            bits <<= 1;
+        }
+        len = (size_t)(bits >> 3);
+        mask = (u32)(bits - 1);
+        bloom = ALLOC_AND_ZERO_N(uchar, len);
+        for (i = 0; i < bfw->cnt; i++) {
+            const u32 h1 = (u32)bfw->hashes[i];
+            const u32 h2 = (u32)(bfw->hashes[i] >> 32) | 1;
+            for (j = 0; j < BLOOM_HASH_CNT; j++) {
+                const u32 bit = (h1 + (u32)j * h2) & mask;
+                bloom[bit >> 3] |= 1 << (bit & 7);
+            }
+        }
+
+        if (NULL == bfw->os) {
+            bfw->os = bfw->store->new_output(bfw->store, bfw->file_name);
+            for (; bfw->skipped > 0; bfw->skipped--) {
+                os_write_vint(bfw->os, 0);
+            }
+        }
+        os_write_vint(bfw->os, BLOOM_HASH_CNT);
+        os_write_vint(bfw->os, (unsigned int)len);
+        os_write_bytes(bfw->os, bloom, (int)len);
+        free(bloom);
+    }
+    else if (bfw->os) {
+        os_write_vint(bfw->os, 0);
+    }
+    else {
+        bfw->skipped++;
+    }
+    bfw->cnt = 0;
+}
+
+static void bfw_close(BloomFilterWriter *bfw)
+{
+    if (bfw->os) {
+        os_close(bfw->os);
+    }
+    free(bfw->hashes);
+    free(bfw);
+}
+
 /****************************************************************************
  *
  * SegmentTermEnum
@@ -2060,35 +2686,35 @@ static char *te_skip_to(TermEnum *te, const char *term)
 
 static void sti_destroy(SegmentTermIndex *sti)
 {
-    if (sti->index_terms) {
-        int i;
-        const int sti_index_cnt = sti->index_cnt;
-        for (i = 0; i < sti_index_cnt; i++) {
-            free(sti->index_terms[i]);
-        }
-        free(sti->index_terms);
-        free(sti->index_term_lens);
+    if (sti->index_ptrs) {
+        free(sti->fst);
         free(sti->index_term_infos);
         free(sti->index_ptrs);
     }
+    free(sti->bloom);
     free(sti);
 }
 
 static void sti_ensure_index_is_read(SegmentTermIndex *sti,
-                                     TermEnum *index_te)
+                                     SegmentFieldIndex *sfi)
 {
-    if (NULL == sti->index_terms) {
+    if (NULL == sti->index_ptrs) {
         int i;
         int index_cnt = sti->index_cnt;
         off_t index_ptr = 0;
+        off_t *index_ptrs = ALLOC_N(off_t, index_cnt);
+        TermEnum *index_te = sfi->index_te;
+        FstBuilder *fb = NULL;
         ste_reset(index_te);
         is_seek(STE(index_te)->is, sti->index_ptr);
         STE(index_te)->size = sti->index_cnt;
 
-        sti->index_terms = ALLOC_N(char *, index_cnt);
-        sti->index_term_lens = ALLOC_N(int, index_cnt);
+        if (sti->fst_ptr < 0) {
+            /* the segment has no .fst file so build the FST from the index
+             * terms as we read them */
+            fb = fb_new();
+        }
         sti->index_term_infos = ALLOC_N(TermInfo, index_cnt);
-        sti->index_ptrs = ALLOC_N(off_t, index_cnt);
 
         for (i = 0; NULL != ste_next(index_te); i++) {
 #ifdef DEBUG
@@ -2096,36 +2722,31 @@ static void sti_ensure_index_is_read(SegmentTermIndex *sti,
                 RAISE(FERRET_ERROR, "index term enum read too many terms");
             }
 #endif
-            sti->index_terms[i] = te_get_term(index_te);
-            sti->index_term_lens[i] = index_te->curr_term_len;
+            if (fb) {
+                fb_add(fb, index_te->curr_term, index_te->curr_term_len);
+            }
             sti->index_term_infos[i] = index_te->curr_ti;
             index_ptr += is_read_voff_t(STE(index_te)->is);
-            sti->index_ptrs[i] = index_ptr;
+            index_ptrs[i] = index_ptr;
         }
-    }
-}
 
-static int sti_get_index_offset(SegmentTermIndex *sti, const char *term)
-{
-    int lo = 0;
-    int hi = sti->index_cnt - 1;
-    int mid, delta;
-    char **index_terms = sti->index_terms;
-
-    while (hi >= lo) {
-        mid = (lo + hi) >> 1;
-        delta = strcmp(term, index_terms[mid]);
-        if (delta < 0) {
-            hi = mid - 1;
-        }
-        else if (delta > 0) {
-            lo = mid + 1;
+        if (fb) {
+            sti->fst_root = fb_finish(fb);
+            sti->fst = ALLOC_N(uchar, fb->size);
+            memcpy(sti->fst, fb->buf, fb->size);
+            fb_destroy(fb);
         }
         else {
-            return mid;
+            InStream *fst_in = sfi->fst_in;
+            int fst_len;
+            is_seek(fst_in, sti->fst_ptr);
+            sti->fst_root = is_read_vint(fst_in);
+            fst_len = is_read_vint(fst_in);
+            sti->fst = ALLOC_N(uchar, fst_len);
+            is_read_bytes(fst_in, sti->fst, fst_len);
         }
+        sti->index_ptrs = index_ptrs;
     }
-    return hi;
 }
 
 /****************************************************************************
@@ -2133,9 +2754,9 @@ static int sti_get_index_offset(SegmentTermIndex *sti, const char *term)
  ****************************************************************************/
 
 #define SFI_ENSURE_INDEX_IS_READ(sfi, sti) do {\
-    if (NULL == sti->index_terms) {\
+    if (NULL == sti->index_ptrs) {\
         mutex_lock(&sfi->mutex);\
-        sti_ensure_index_is_read(sti, sfi->index_te);\
+        sti_ensure_index_is_read(sti, sfi);\
         mutex_unlock(&sfi->mutex);\
     }\
 } while (0)
@@ -2145,7 +2766,7 @@ SegmentFieldIndex *sfi_open(Store *store, const char *segment)
     int field_count;
     SegmentFieldIndex *sfi = ALLOC(SegmentFieldIndex);
     char file_name[SEGMENT_NAME_MAX_LENGTH];
-    InStream *is;
+    InStream *is, *blm_in;
 
     mutex_init(&sfi->mutex, NULL);
 
@@ -2153,10 +2774,28 @@ SegmentFieldIndex *sfi_open(Store *store, const char *segment)
     is = store->open_input(store, file_name);
     field_count = (int)is_read_u32(is);
     sfi->index_interval = is_read_vint(is);
+    sfi->term_blocks = false;
+    sfi->pulsed = false;
+    if (0 == sfi->index_interval) {
+        const int format = is_read_vint(is);
+        sfi->term_blocks = format >= TERM_DICT_FORMAT_BLOCKS;
+        sfi->pulsed = format >= TERM_DICT_FORMAT_PULSED;
+        sfi->index_interval = is_read_vint(is);
+    }
     sfi->skip_interval = is_read_vint(is);
 
     sfi->field_dict = h_new_int((free_ft)&sti_destroy);
 
+    sprintf(file_name, "%s.fst", segment);
+    sfi->fst_in = store->exists(store, file_name)
+        ? store->open_input(store, file_name)
+        : NULL;
+    sprintf(file_name, "%s.blm", segment);
+    blm_in = store->exists(store, file_name)
+        ? store->open_input(store, file_name)
+        : NULL;
+    sfi->bloom_filters = false;
+
     for (; field_count > 0; field_count--) {
         int field_num = is_read_vint(is);
         SegmentTermIndex *sti = ALLOC_AND_ZERO(SegmentTermIndex);
@@ -2164,13 +2803,40 @@ SegmentFieldIndex *sfi_open(Store *store, const char *segment)
         sti->ptr = is_read_voff_t(is);
         sti->index_cnt = is_read_vint(is);
         sti->size = is_read_vint(is);
+        sti->fst_ptr = -1;
+        if (sfi->fst_in) {
+            /* the FSTs are written in the same order as the fields */
+            InStream *fst_in = sfi->fst_in;
+            int fst_len;
+            sti->fst_ptr = is_pos(fst_in);
+            is_read_vint(fst_in); /* root */
+            fst_len = is_read_vint(fst_in);
+            is_seek(fst_in, is_pos(fst_in) + fst_len);
+        }
+        /* so are the bloom filters but trailing fields may be left out */
+        if (blm_in && is_pos(blm_in) < is_length(blm_in)) {
+            int hash_cnt = is_read_vint(blm_in);
+            if (hash_cnt > 0) {
+                int len = is_read_vint(blm_in);
+                sti->bloom = ALLOC_N(uchar, len);
+                is_read_bytes(blm_in, sti->bloom, len);
+                sti->bloom_mask = (u32)((u64)len * 8 - 1);
+                sti->bloom_hash_cnt = hash_cnt;
+                sfi->bloom_filters = true;
+            }
+        }
         h_set_int(sfi->field_dict, field_num, sti);
     }
     is_close(is);
+    if (blm_in) {
+        is_close(blm_in);
+    }
 
     sprintf(file_name, "%s.tix", segment);
     is = store->open_input(store, file_name);
     sfi->index_te = ste_new(is, sfi);
+    /* the index terms are always written one after the other */
+    STE(sfi->index_te)->term_blocks = false;
     return sfi;
 }
 
@@ -2178,6 +2844,9 @@ void sfi_close(SegmentFieldIndex *sfi)
 {
     mutex_destroy(&sfi->mutex);
     ste_close(sfi->index_te);
+    if (sfi->fst_in) {
+        is_close(sfi->fst_in);
+    }
     h_destroy(sfi->field_dict);
     free(sfi);
 }
@@ -2196,35 +2865,235 @@ static INLINE int term_read(char *buf, InStream *is)
     return total_length;
 }
 
-static char *ste_next(TermEnum *te)
-{
-    TermInfo *ti;
-    InStream *is = STE(te)->is;
-
-    STE(te)->pos++;
-    if (STE(te)->pos >= STE(te)->size) {
-        te->curr_term[0] = '\0';
-        te->curr_term_len = 0;
-        return NULL;
-    }
+/****************************************************************************
+ * Term Blocks
+ *
+ * The terms of each field are written to the .tis file in blocks of
+ * +index_interval+ terms, each starting at an index term's pointer, so a
+ * lookup can binary search the block the index points it to and decode only
+ * the TermInfo it needs. Each block is written as;
+ *
+ *   VInt  TermCount
+ *   VInt  PrefixLength       # the prefix shared by every term in the block
+ *   VInt  SuffixesLength
+ *   VInt  StatsLength
+ *   Byte  Width
+ *   Bytes Prefix
+ *   {
+ *     Bytes SuffixStart      # Width bytes, offset into Suffixes
+ *     Bytes StatsStart       # Width bytes, offset into Stats
+ *   } * TermCount
+ *   Bytes Suffixes           # each term with the prefix removed
+ *   {                        # Stats
+ *     VInt  DocFreq
+ *     VLong FreqDelta        # from the term before the block
+ *     VLong ProxDelta        # from the term before the block
+ *     VLong SkipOffset       # only if DocFreq >= SkipInterval
+ *     VInt  PulsedDoc        # only for pulsed terms
+ *     VInt  PulsedPosition   # only for pulsed terms
+ *   } * TermCount
+ *
+ * Since TERM_DICT_FORMAT_PULSED the DocFreq is shifted left one bit with the
+ * low bit set for pulsed terms, as it is in the .tix entries.
+ *
+ * Segments written before blocks were introduced store each term after the
+ * last, prefix compressed against it, as the .tix file still does.
+ ****************************************************************************/
 
-    memcpy(te->prev_term, te->curr_term, te->curr_term_len + 1);
-    te->curr_term_len = term_read(te->curr_term, is);
+/* read the block whose first term is at +start+ */
+static void ste_read_block(SegmentTermEnum *ste, int start)
+{
+    InStream *is = ste->is;
+    int stats_len, size;
 
-    ti = &(te->curr_ti);
-    ti->doc_freq = is_read_vint(is);     /* read doc freq */
-    ti->frq_ptr += is_read_voff_t(is);   /* read freq ptr */
-    ti->prx_ptr += is_read_voff_t(is);   /* read prox ptr */
-    if (ti->doc_freq >= STE(te)->skip_interval) {
-        ti->skip_offset = is_read_voff_t(is);
+    ste->block_cnt = is_read_vint(is);
+    ste->prefix_len = is_read_vint(is);
+    ste->suffixes_len = is_read_vint(is);
+    stats_len = is_read_vint(is);
+    ste->block_width = is_read_byte(is);
+    ste->suffixes = ste->prefix_len + 2 * ste->block_cnt * ste->block_width;
+    ste->stats = ste->suffixes + ste->suffixes_len;
+    size = ste->stats + stats_len;
+    if (size > ste->block_capa) {
+        ste->block_capa = size;
+        REALLOC_N(ste->block, uchar, size);
     }
-
-    return te->curr_term;
+    is_read_bytes(is, ste->block, size);
+    ste->block_start = start;
+    ste->block_base = TE(ste)->curr_ti;
+}
+
+/* forget the current block so the next one is read from the stream */
+static INLINE void ste_clear_block(SegmentTermEnum *ste)
+{
+    ste->block_start = ste->pos + 1;
+    ste->block_cnt = 0;
+}
+
+static INLINE const uchar *ste_block_suffix(SegmentTermEnum *ste, int i,
+                                            int *len)
+{
+    const int width = ste->block_width;
+    const uchar *offset = ste->block + ste->prefix_len + 2 * i * width;
+    const int start = bytes_read_num(offset, width);
+    const int end = (i + 1 < ste->block_cnt)
+        ? bytes_read_num(offset + 2 * width, width)
+        : ste->suffixes_len;
+    *len = end - start;
+    return ste->block + ste->suffixes + start;
+}
+
+/* write term +i+ of the current block to +buf+ and return its length */
+static int ste_block_term(SegmentTermEnum *ste, int i, char *buf)
+{
+    int suffix_len;
+    const uchar *suffix = ste_block_suffix(ste, i, &suffix_len);
+    memcpy(buf, ste->block, ste->prefix_len);
+    memcpy(buf + ste->prefix_len, suffix, suffix_len);
+    buf[ste->prefix_len + suffix_len] = '\0';
+    return ste->prefix_len + suffix_len;
+}
+
+/* compare term +i+ of the current block with +term+ like strcmp would */
+static int ste_block_cmp(SegmentTermEnum *ste, int i,
+                         const char *term, int term_len)
+{
+    const int prefix_len = ste->prefix_len;
+    int suffix_len, cmp;
+    const uchar *suffix;
+
+    cmp = memcmp(ste->block, term, MIN(prefix_len, term_len));
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (term_len < prefix_len) {
+        return 1;
+    }
+    term += prefix_len;
+    term_len -= prefix_len;
+    suffix = ste_block_suffix(ste, i, &suffix_len);
+    cmp = memcmp(suffix, term, MIN(suffix_len, term_len));
+    return cmp != 0 ? cmp : suffix_len - term_len;
+}
+
+/* move to term +i+ of the current block */
+static void ste_block_move(SegmentTermEnum *ste, int i)
+{
+    TermEnum *te = TE(ste);
+    TermInfo *ti = &(te->curr_ti);
+    const int width = ste->block_width;
+    const uchar *offset = ste->block + ste->prefix_len + 2 * i * width;
+    const uchar *stats = ste->block + ste->stats
+        + bytes_read_num(offset + width, width);
+
+    if (ste->block_start + i <= ste->pos + 1) {
+        /* moving to the next term, or ste_next has already moved pos */
+        memcpy(te->prev_term, te->curr_term, te->curr_term_len + 1);
+    }
+    else {
+        ste_block_term(ste, i - 1, te->prev_term);
+    }
+    te->curr_term_len = ste_block_term(ste, i, te->curr_term);
+    ti->doc_freq = bytes_read_vint(&stats);
+    ti->pulsed = false;
+    if (ste->pulsed) {
+        ti->pulsed = (ti->doc_freq & 1) != 0;
+        ti->doc_freq >>= 1;
+    }
+    ti->frq_ptr = ste->block_base.frq_ptr + bytes_read_voff_t(&stats);
+    ti->prx_ptr = ste->block_base.prx_ptr + bytes_read_voff_t(&stats);
+    ti->skip_offset = (ti->doc_freq >= ste->skip_interval)
+        ? bytes_read_voff_t(&stats) : 0;
+    if (ti->pulsed) {
+        ti->pulsed_doc = bytes_read_vint(&stats);
+        ti->pulsed_pos = bytes_read_vint(&stats);
+    }
+    ste->pos = ste->block_start + i;
+}
+
+/*
+ * Skip to the first term not less than +term+, binary searching each block
+ * rather than decoding every term on the way.
+ */
+static char *ste_block_skip_to(TermEnum *te, const char *term)
+{
+    SegmentTermEnum *ste = STE(te);
+    const int term_len = (int)strlen(term);
+
+    while (ste->pos < 0 || strcmp(te->curr_term, term) < 0) {
+        int lo, hi;
+        if (ste->pos + 1 >= ste->size) {
+            return ste_next(te);
+        }
+        if (ste->pos + 1 == ste->block_start + ste->block_cnt) {
+            ste_read_block(ste, ste->pos + 1);
+        }
+        lo = ste->pos + 1 - ste->block_start;
+        hi = ste->block_cnt;
+        while (lo < hi) {
+            const int mid = (lo + hi) >> 1;
+            if (ste_block_cmp(ste, mid, term, term_len) < 0) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        /* if every term in the block is less, move to the last one and carry
+         * on into the next block */
+        ste_block_move(ste, MIN(lo, ste->block_cnt - 1));
+    }
+    return te->curr_term;
+}
+
+static char *ste_next(TermEnum *te)
+{
+    TermInfo *ti;
+    InStream *is = STE(te)->is;
+
+    STE(te)->pos++;
+    if (STE(te)->pos >= STE(te)->size) {
+        te->curr_term[0] = '\0';
+        te->curr_term_len = 0;
+        return NULL;
+    }
+
+    if (STE(te)->term_blocks) {
+        SegmentTermEnum *ste = STE(te);
+        if (ste->pos == ste->block_start + ste->block_cnt) {
+            ste_read_block(ste, ste->pos);
+        }
+        ste_block_move(ste, ste->pos - ste->block_start);
+        return te->curr_term;
+    }
+
+    memcpy(te->prev_term, te->curr_term, te->curr_term_len + 1);
+    te->curr_term_len = term_read(te->curr_term, is);
+
+    ti = &(te->curr_ti);
+    ti->doc_freq = is_read_vint(is);     /* read doc freq */
+    ti->pulsed = false;
+    if (STE(te)->pulsed) {
+        ti->pulsed = (ti->doc_freq & 1) != 0;
+        ti->doc_freq >>= 1;
+    }
+    ti->frq_ptr += is_read_voff_t(is);   /* read freq ptr */
+    ti->prx_ptr += is_read_voff_t(is);   /* read prox ptr */
+    if (ti->doc_freq >= STE(te)->skip_interval) {
+        ti->skip_offset = is_read_voff_t(is);
+    }
+    if (ti->pulsed) {
+        ti->pulsed_doc = is_read_vint(is);
+        ti->pulsed_pos = is_read_vint(is);
+    }
+
+    return te->curr_term;
 }
 
 static void ste_reset(TermEnum *te)
 {
     STE(te)->pos = -1;
+    ste_clear_block(STE(te));
     te->curr_term[0] = '\0';
     te->curr_term_len = 0;
     ZEROSET(&(te->curr_ti), TermInfo);
@@ -2248,13 +3117,11 @@ static TermEnum *ste_set_field(TermEnum *te, int field_num)
 
 static void ste_index_seek(TermEnum *te, SegmentTermIndex *sti, int idx_offset)
 {
-    int term_len = sti->index_term_lens[idx_offset];
     is_seek(STE(te)->is, sti->index_ptrs[idx_offset]);
     STE(te)->pos = STE(te)->sfi->index_interval * idx_offset - 1;
-    memcpy(te->curr_term,
-           sti->index_terms[idx_offset],
-           term_len + 1);
-    te->curr_term_len = term_len;
+    ste_clear_block(STE(te));
+    te->curr_term_len = fst_get_term(sti->fst, sti->fst_root, idx_offset,
+                                     te->curr_term);
     te->curr_ti = sti->index_term_infos[idx_offset];
 }
 
@@ -2264,23 +3131,28 @@ static char *ste_scan_to(TermEnum *te, const char *term)
     SegmentTermIndex *sti
         = (SegmentTermIndex *)h_get_int(sfi->field_dict, te->field_num);
     if (sti && sti->size > 0) {
+        int idx_offset;
         SFI_ENSURE_INDEX_IS_READ(sfi, sti);
         if (term[0] == '\0') {
             ste_index_seek(te, sti, 0);
             return ste_next(te);;
         }
+        idx_offset = fst_floor(sti->fst, sti->fst_root, term);
         /* if current term is less than seek term */
         if (STE(te)->pos < STE(te)->size && strcmp(te->curr_term, term) <= 0) {
             int enum_offset = (int)(STE(te)->pos / sfi->index_interval) + 1;
-            /* if we are at the end of the index or before the next index
-             * ptr then a simple scan suffices */
-            if (sti->index_cnt == enum_offset ||
-                strcmp(term, sti->index_terms[enum_offset]) < 0) {
-                return te_skip_to(te, term);
+            /* if the seek term comes before the next index term then a
+             * simple scan suffices */
+            if (idx_offset < enum_offset) {
+                return STE(te)->term_blocks
+                    ? ste_block_skip_to(te, term)
+                    : te_skip_to(te, term);
             }
         }
-        ste_index_seek(te, sti, sti_get_index_offset(sti, term));
-        return te_skip_to(te, term);
+        ste_index_seek(te, sti, idx_offset);
+        return STE(te)->term_blocks
+            ? ste_block_skip_to(te, term)
+            : te_skip_to(te, term);
     }
     else {
         return NULL;
@@ -2304,12 +3176,17 @@ TermEnum *ste_clone(TermEnum *other_te)
 
     memcpy(ste, other_te, sizeof(SegmentTermEnum));
     ste->is = is_clone(STE(other_te)->is);
+    if (ste->block) {
+        ste->block = ALLOC_N(uchar, ste->block_capa);
+        memcpy(ste->block, STE(other_te)->block, ste->block_capa);
+    }
     return TE(ste);
 }
 
 void ste_close(TermEnum *te)
 {
     is_close(STE(te)->is);
+    free(STE(te)->block);
     free(te);
 }
 
@@ -2342,6 +3219,11 @@ static char *ste_get_term(TermEnum *te, int pos)
             ste_index_seek(te, sti, pos / idx_int);
         }
         while (ste->pos < pos) {
+            if (ste->term_blocks
+                && pos < ste->block_start + ste->block_cnt) {
+                ste_block_move(ste, pos - ste->block_start);
+                break;
+            }
             if (NULL == ste_next(te)) {
                 return NULL;
             }
@@ -2361,6 +3243,8 @@ TermEnum *ste_new(InStream *is, SegmentFieldIndex *sfi)
     ste->pos = -1;
     ste->sfi = sfi;
     ste->skip_interval = sfi ? sfi->skip_interval : INT_MAX;
+    ste->term_blocks = sfi ? sfi->term_blocks : false;
+    ste->pulsed = sfi ? sfi->pulsed : false;
 
     return TE(ste);
 }
@@ -2608,14 +3492,38 @@ TermEnum *mte_new(MultiReader *mr, int field_num, const char *term)
  *
  ****************************************************************************/
 
+static void sti_add_index_cnt(void *key, void *value, void *arg)
+{
+    (void)key;
+    *(int *)arg += ((SegmentTermIndex *)value)->index_cnt;
+}
+
 TermInfosReader *tir_open(Store *store,
                           SegmentFieldIndex *sfi, const char *segment)
 {
     TermInfosReader *tir = ALLOC(TermInfosReader);
     char file_name[SEGMENT_NAME_MAX_LENGTH];
+    InStream *is;
+    int index_cnt = 0;
 
     sprintf(file_name, "%s.tis", segment);
-    tir->orig_te = ste_new(store->open_input(store, file_name), sfi);
+    is = store->open_input(store, file_name);
+
+    /* Lookups seek to an index term and scan forward from there so size the
+     * lookup buffer to hold the average run of terms between index terms.
+     * That way a lookup needs one refill and doesn't read terms it won't
+     * use. */
+    h_each(sfi->field_dict, &sti_add_index_cnt, &index_cnt);
+    if (index_cnt > 0) {
+        off_t block_size = is_length(is) / index_cnt;
+        tir->lookup_buffer_size = (int)MIN(MAX(block_size, SMALL_BUFFER_SIZE),
+                                           LARGE_BUFFER_SIZE);
+    }
+    else {
+        tir->lookup_buffer_size = BUFFER_SIZE;
+    }
+
+    tir->orig_te = ste_new(is, sfi);
     thread_key_create(&tir->thread_te, NULL);
     tir->te_bucket = ary_new();
     tir->field_num = -1;
@@ -2628,6 +3536,7 @@ static INLINE TermEnum *tir_enum(TermInfosReader *tir)
     TermEnum *te;
     if (NULL == (te = (TermEnum *)thread_getspecific(tir->thread_te))) {
         te = ste_clone(tir->orig_te);
+        is_set_buffer_size(STE(te)->is, tir->lookup_buffer_size);
         ste_set_field(te, tir->field_num);
         ary_push(tir->te_bucket, te);
         thread_setspecific(tir->thread_te, te);
@@ -2644,11 +3553,30 @@ TermInfosReader *tir_set_field(TermInfosReader *tir, int field_num)
     return tir;
 }
 
+/* false if the field's bloom filter says +term+ isn't in the segment */
+static INLINE bool tir_may_contain(TermInfosReader *tir, int field_num,
+                                   const char *term)
+{
+    SegmentFieldIndex *sfi = STE(tir->orig_te)->sfi;
+    SegmentTermIndex *sti;
+    if (!sfi->bloom_filters) {
+        return true;
+    }
+    sti = (SegmentTermIndex *)h_get_int(sfi->field_dict, field_num);
+    return NULL == sti || NULL == sti->bloom
+        || bloom_may_contain(sti->bloom, sti->bloom_mask,
+                             sti->bloom_hash_cnt, term);
+}
+
 TermInfo *tir_get_ti(TermInfosReader *tir, const char *term)
 {
-    TermEnum *te = tir_enum(tir);
+    TermEnum *te;
     char *match;
 
+    if (!tir_may_contain(tir, tir->field_num, term)) {
+        return NULL;
+    }
+    te = tir_enum(tir);
     if (NULL != (match = ste_scan_to(te, term))
         && 0 == strcmp(match, term)) {
         return &(te->curr_ti);
@@ -2659,9 +3587,13 @@ TermInfo *tir_get_ti(TermInfosReader *tir, const char *term)
 static TermInfo *tir_get_ti_field(TermInfosReader *tir, int field_num,
                                   const char *term)
 {
-    TermEnum *te = tir_enum(tir);
+    TermEnum *te;
     char *match;
 
+    if (!tir_may_contain(tir, field_num, term)) {
+        return NULL;
+    }
+    te = tir_enum(tir);
     if (field_num != tir->field_num) {
         ste_set_field(te, field_num);
         tir->field_num = field_num;
@@ -2716,8 +3648,148 @@ static void tw_close(TermWriter *tw)
     free(tw);
 }
 
+/* * TermBlockWriter * */
+
+/* The terms of the block being written, see "Term Blocks" above */
+struct FrtTermBlockWriter
+{
+    char       *text;       /* the terms one after the other */
+    int         text_size;
+    int         text_capa;
+    int         cnt;
+    int        *ends;       /* the end of each term in +text+ */
+    int        *stats_starts;
+    TermInfo   *tis;
+    TermInfo    base;       /* the info of the term before the block */
+    OutStream  *stats;
+};
+
+static TermBlockWriter *tbw_new(int capa)
+{
+    TermBlockWriter *tbw = ALLOC_AND_ZERO(TermBlockWriter);
+    tbw->text_capa = 1024;
+    tbw->text = ALLOC_N(char, tbw->text_capa);
+    tbw->ends = ALLOC_N(int, capa);
+    tbw->stats_starts = ALLOC_N(int, capa);
+    tbw->tis = ALLOC_N(TermInfo, capa);
+    tbw->stats = ram_new_buffer();
+    return tbw;
+}
+
+static void tbw_destroy(TermBlockWriter *tbw)
+{
+    ram_destroy_buffer(tbw->stats);
+    free(tbw->tis);
+    free(tbw->stats_starts);
+    free(tbw->ends);
+    free(tbw->text);
+    free(tbw);
+}
+
+static void tbw_add(TermBlockWriter *tbw, const char *term, int term_len,
+                    TermInfo *ti)
+{
+    if (tbw->text_size + term_len > tbw->text_capa) {
+        do {
+            tbw->text_capa <<= 1;
+        } while (tbw->text_size + term_len > tbw->text_capa);
+        REALLOC_N(tbw->text, char, tbw->text_capa);
+    }
+    memcpy(tbw->text + tbw->text_size, term, term_len);
+    tbw->text_size += term_len;
+    tbw->ends[tbw->cnt] = tbw->text_size;
+    tbw->tis[tbw->cnt] = *ti;
+    tbw->cnt++;
+}
+
+/* write the doc freq of +ti+ with the low bit flagging a pulsed term */
+static INLINE void ti_write_doc_code(OutStream *os, TermInfo *ti)
+{
+    os_write_vint(os, (ti->doc_freq << 1) | (ti->pulsed ? 1 : 0));
+}
+
+/* write the posting of a pulsed term, which ends its entry */
+static INLINE void ti_write_pulsed(OutStream *os, TermInfo *ti)
+{
+    if (ti->pulsed) {
+        os_write_vint(os, ti->pulsed_doc);
+        os_write_vint(os, ti->pulsed_pos);
+    }
+}
+
+static INLINE void tbw_write_num(OutStream *os, int num, const int width)
+{
+    int i;
+    for (i = 0; i < width; i++) {
+        os_write_byte(os, (uchar)(num & 0xFF));
+        num >>= 8;
+    }
+}
+
+static void tbw_write(TermBlockWriter *tbw, OutStream *os,
+                      int skip_interval)
+{
+    const int cnt = tbw->cnt;
+    const char *last;
+    int i, prefix_len, last_len, suffixes_len, stats_len, width, start;
+
+    if (0 == cnt) {
+        return;
+    }
+    /* the terms are sorted so the first and last share the shortest prefix */
+    last = tbw->text + (cnt > 1 ? tbw->ends[cnt - 2] : 0);
+    last_len = tbw->ends[cnt - 1] - (int)(last - tbw->text);
+    for (prefix_len = 0;
+         prefix_len < tbw->ends[0] && prefix_len < last_len
+         && tbw->text[prefix_len] == last[prefix_len];
+         prefix_len++) {
+    }
+    suffixes_len = tbw->text_size - cnt * prefix_len;
+
+    ramo_reset(tbw->stats);
+    for (i = 0; i < cnt; i++) {
+        TermInfo *ti = &tbw->tis[i];
+        tbw->stats_starts[i] = (int)os_pos(tbw->stats);
+        ti_write_doc_code(tbw->stats, ti);
+        os_write_voff_t(tbw->stats, ti->frq_ptr - tbw->base.frq_ptr);
+        os_write_voff_t(tbw->stats, ti->prx_ptr - tbw->base.prx_ptr);
+        if (ti->doc_freq >= skip_interval) {
+            os_write_voff_t(tbw->stats, ti->skip_offset);
+        }
+        ti_write_pulsed(tbw->stats, ti);
+    }
+    stats_len = (int)os_pos(tbw->stats);
+    for (width = 1;
+         width < 4 && (MAX(suffixes_len, stats_len) >> (8 * width)) != 0;
+         width++) {
+    }
+
+    os_write_vint(os, cnt);
+    os_write_vint(os, prefix_len);
+    os_write_vint(os, suffixes_len);
+    os_write_vint(os, stats_len);
+    os_write_byte(os, (uchar)width);
+    os_write_bytes(os, (uchar *)tbw->text, prefix_len);
+    for (start = 0, i = 0; i < cnt; i++) {
+        const int term_start = i > 0 ? tbw->ends[i - 1] : 0;
+        tbw_write_num(os, start, width);
+        tbw_write_num(os, tbw->stats_starts[i], width);
+        start += tbw->ends[i] - term_start - prefix_len;
+    }
+    for (i = 0; i < cnt; i++) {
+        const int term_start = (i > 0 ? tbw->ends[i - 1] : 0) + prefix_len;
+        os_write_bytes(os, (uchar *)tbw->text + term_start,
+                       tbw->ends[i] - term_start);
+    }
+    ramo_write_to(tbw->stats, os);
+
+    tbw->cnt = 0;
+    tbw->text_size = 0;
+}
+
 TermInfosWriter *tiw_open(Store *store,
                           const char *segment,
+                          FieldInfos *fis,
                           int index_interval,
                           int skip_interval)
 {
@@ -2739,6 +3811,23 @@ TermInfosWriter *tiw_open(Store *store,
     strcpy(file_name + segment_len, ".tfx");
     tiw->tfx_out = store->new_output(store, file_name);
     os_write_u32(tiw->tfx_out, 0); /* make space for field_count */
+    os_write_vint(tiw->tfx_out, 0);
+    os_write_vint(tiw->tfx_out, TERM_DICT_FORMAT_PULSED);
+    tiw->block = tbw_new(index_interval);
+    strcpy(file_name + segment_len, ".fst");
+    tiw->fst_out = store->new_output(store, file_name);
+    tiw->fst_builder = fb_new();
+    tiw->fis = fis;
+    tiw->bloom = NULL;
+    if (fis) {
+        int i;
+        for (i = 0; i < fis->size; i++) {
+            if (fi_has_bloom_filter(fis->fields[i])) {
+                tiw->bloom = bfw_new(store, segment);
+                break;
+            }
+        }
+    }
 
     /* The following two numbers are the first numbers written to the field
      * index when tiw_start_field is called. But they'll be zero to start with
@@ -2764,15 +3853,9 @@ static INLINE void tw_write_term(TermWriter *tw,
     tw->last_term = term;
 }
 
-static void tw_add(TermWriter *tw,
-                   const char *term,
-                   int term_len,
-                   TermInfo *ti,
-                   int skip_interval)
-{
-    OutStream *os = tw->os;
-
 #ifdef DEBUG
+static void tw_check_order(TermWriter *tw, const char *term, TermInfo *ti)
+{
     if (strcmp(tw->last_term, term) > 0) {
         RAISE(STATE_ERROR, "\"%s\" > \"%s\" %d > %d",
               tw->last_term, term, *tw->last_term, *term);
@@ -2785,15 +3868,29 @@ static void tw_add(TermWriter *tw,
         RAISE(STATE_ERROR, "%"OFF_T_PFX"d > %"OFF_T_PFX"d", ti->prx_ptr,
               tw->last_term_info.prx_ptr);
     }
+}
+#endif
+
+static void tw_add(TermWriter *tw,
+                   const char *term,
+                   int term_len,
+                   TermInfo *ti,
+                   int skip_interval)
+{
+    OutStream *os = tw->os;
+
+#ifdef DEBUG
+    tw_check_order(tw, term, ti);
 #endif
 
     tw_write_term(tw, os, term, term_len);  /* write term */
-    os_write_vint(os, ti->doc_freq);        /* write doc freq */
+    ti_write_doc_code(os, ti);              /* write doc freq */
     os_write_voff_t(os, ti->frq_ptr - tw->last_term_info.frq_ptr);
     os_write_voff_t(os, ti->prx_ptr - tw->last_term_info.prx_ptr);
     if (ti->doc_freq >= skip_interval) {
         os_write_voff_t(os, ti->skip_offset);
     }
+    ti_write_pulsed(os, ti);
 
     tw->last_term_info = *ti;
     tw->counter++;
@@ -2804,25 +3901,39 @@ void tiw_add(TermInfosWriter *tiw,
              int term_len,
              TermInfo *ti)
 {
+    TermWriter *tis_writer = tiw->tis_writer;
     off_t tis_pos;
 
     /*
     printf("%s:%d:%d:%d:%d\n", term, term_len, ti->doc_freq,
            ti->frq_ptr, ti->prx_ptr);
     */
-    if (0 == (tiw->tis_writer->counter % tiw->index_interval)) {
-        /* add an index term */
+#ifdef DEBUG
+    tw_check_order(tis_writer, term, ti);
+#endif
+    if (0 == (tis_writer->counter % tiw->index_interval)) {
+        /* finish the last block and add an index term pointing to the next */
+        tbw_write(tiw->block, tis_writer->os, tiw->skip_interval);
         tw_add(tiw->tix_writer,
-               tiw->tis_writer->last_term,
-               strlen(tiw->tis_writer->last_term),
-               &(tiw->tis_writer->last_term_info),
+               tis_writer->last_term,
+               strlen(tis_writer->last_term),
+               &(tis_writer->last_term_info),
                tiw->skip_interval);
-        tis_pos = os_pos(tiw->tis_writer->os);
+        tis_pos = os_pos(tis_writer->os);
         os_write_voff_t(tiw->tix_writer->os, tis_pos - tiw->last_index_ptr);
         tiw->last_index_ptr = tis_pos;  /* write ptr */
+        fb_add(tiw->fst_builder, tiw->tix_writer->last_term,
+               strlen(tiw->tix_writer->last_term));
+        tiw->block->base = tis_writer->last_term_info;
+    }
+    if (tiw->bloom && tiw->bloom->active) {
+        bfw_add(tiw->bloom, term, term_len);
     }
 
-    tw_add(tiw->tis_writer, term, term_len, ti, tiw->skip_interval);
+    tbw_add(tiw->block, term, term_len, ti);
+    tis_writer->last_term = term;
+    tis_writer->last_term_info = *ti;
+    tis_writer->counter++;
 }
 
 static INLINE void tw_reset(TermWriter *tw)
@@ -2832,9 +3943,30 @@ static INLINE void tw_reset(TermWriter *tw)
     ZEROSET(&(tw->last_term_info), TermInfo);
 }
 
+/* write the index FST of the field just finished */
+static void tiw_write_fst(TermInfosWriter *tiw)
+{
+    FstBuilder *fb = tiw->fst_builder;
+    os_write_vint(tiw->fst_out, fb_finish(fb));
+    os_write_vint(tiw->fst_out, fb->size);
+    os_write_bytes(tiw->fst_out, fb->buf, fb->size);
+    fb_reset(fb);
+}
+
 void tiw_start_field(TermInfosWriter *tiw, int field_num)
 {
     OutStream *tfx_out = tiw->tfx_out;
+    tbw_write(tiw->block, tiw->tis_writer->os, tiw->skip_interval);
+    if (tiw->field_count > 0) {
+        tiw_write_fst(tiw);
+        if (tiw->bloom) {
+            bfw_write(tiw->bloom);
+        }
+    }
+    if (tiw->bloom) {
+        FieldInfo *fi = fis_by_number(tiw->fis, field_num);
+        tiw->bloom->active = fi && fi_has_bloom_filter(fi);
+    }
     os_write_vint(tfx_out, tiw->tix_writer->counter);    /* write tix size */
     os_write_vint(tfx_out, tiw->tis_writer->counter);    /* write tis size */
     os_write_vint(tfx_out, field_num);
@@ -2849,11 +3981,24 @@ void tiw_start_field(TermInfosWriter *tiw, int field_num)
 void tiw_close(TermInfosWriter *tiw)
 {
     OutStream *tfx_out = tiw->tfx_out;
+    tbw_write(tiw->block, tiw->tis_writer->os, tiw->skip_interval);
+    if (tiw->field_count > 0) {
+        tiw_write_fst(tiw);
+        if (tiw->bloom) {
+            bfw_write(tiw->bloom);
+        }
+    }
+    if (tiw->bloom) {
+        bfw_close(tiw->bloom);
+    }
     os_write_vint(tfx_out, tiw->tix_writer->counter);
     os_write_vint(tfx_out, tiw->tis_writer->counter);
     os_seek(tfx_out, 0);
     os_write_u32(tfx_out, tiw->field_count);
     os_close(tfx_out);
+    os_close(tiw->fst_out);
+    fb_destroy(tiw->fst_builder);
+    tbw_destroy(tiw->block);
 
     tw_close(tiw->tix_writer);
     tw_close(tiw->tis_writer);
@@ -2863,3576 +4008,7325 @@ void tiw_close(TermInfosWriter *tiw)
 
 /****************************************************************************
  *
- * TermDocEnum
+ * Block Postings Codec
+ *
+ * POSTINGS_FORMAT_BLOCK packs POSTINGS_BLOCK_SIZE values at a time using the
+ * smallest bit width that, after counting the cost of the values that don't
+ * fit, gives the smallest block (PFOR). Each block is written as;
+ *
+ *   Byte  BitWidth
+ *   Byte  ExceptionCount
+ *   Bytes PackedValues       # BitWidth * POSTINGS_BLOCK_SIZE / 8 bytes
+ *   {
+ *     Byte Index
+ *     VInt HighBits          # the bits above BitWidth
+ *   } * ExceptionCount
  *
  ****************************************************************************/
 
-/****************************************************************************
- * SegmentTermDocEnum
- ****************************************************************************/
+#define PFOR_PACKED_MAX (POSTINGS_BLOCK_SIZE * 4)
 
-#define STDE(tde) ((SegmentTermDocEnum *)(tde))
-#define TDE(stde) ((TermDocEnum *)(stde))
+static void pfor_write_block(OutStream *os, const unsigned int *vals)
+{
+    int i, b, width = 32, exception_cnt = 0;
+    int bit_cnts[33];
+    int size, min_size = INT_MAX;
+    uchar packed[PFOR_PACKED_MAX];
+    uchar *p = packed;
+    u64 acc = 0, mask;
+    int bits = 0;
 
-#define CHECK_STATE(method) do {\
-    if (0 == STDE(tde)->count) {\
-        RAISE(STATE_ERROR, "Illegal state of TermDocEnum. You must call #next "\
-              "before you call #"method);\
-    }\
-} while (0)
+    /* a value with bit length L costs a byte index and a VInt of L - b bits
+     * for every b less than L */
+    memset(bit_cnts, 0, sizeof(bit_cnts));
+    for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+        bit_cnts[vals[i] ? 32 - count_leading_zeros(vals[i]) : 0]++;
+    }
+    for (b = 0; b <= 32; b++) {
+        int l;
+        size = b * (POSTINGS_BLOCK_SIZE / 8);
+        for (l = b + 1; l <= 32; l++) {
+            size += bit_cnts[l] * (1 + (l - b + 6) / 7);
+        }
+        if (size < min_size) {
+            min_size = size;
+            width = b;
+        }
+    }
 
-static void stde_seek_ti(SegmentTermDocEnum *stde, TermInfo *ti)
+    mask = ((u64)1 << width) - 1;
+    for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+        if ((u64)vals[i] > mask) {
+            exception_cnt++;
+        }
+        acc |= ((u64)vals[i] & mask) << bits;
+        bits += width;
+        while (bits >= 8) {
+            *p++ = (uchar)acc;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+
+    os_write_byte(os, (uchar)width);
+    os_write_byte(os, (uchar)exception_cnt);
+    os_write_bytes(os, packed, (int)(p - packed));
+    if (exception_cnt > 0) {
+        for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+            if ((u64)vals[i] > mask) {
+                os_write_byte(os, (uchar)i);
+                os_write_vint(os, (unsigned int)((u64)vals[i] >> width));
+            }
+        }
+    }
+}
+
+static void pfor_read_block(InStream *is, unsigned int *vals)
 {
-    if (NULL == ti) {
-        stde->doc_freq = 0;
+    int i, width = is_read_byte(is);
+    int exception_cnt = is_read_byte(is);
+    uchar packed[PFOR_PACKED_MAX];
+    const uchar *p = packed;
+    u64 acc = 0, mask = ((u64)1 << width) - 1;
+    int bits = 0;
+
+    if (width > 32) {
+        RAISE(IO_ERROR, "corrupt postings block with bit width %d", width);
     }
-    else {
-        stde->count = 0;
-        stde->doc_freq = ti->doc_freq;
-        stde->doc_num = 0;
-        stde->skip_doc = 0;
-        stde->skip_count = 0;
-        stde->num_skips = stde->doc_freq / stde->skip_interval;
-        stde->frq_ptr = ti->frq_ptr;
-        stde->prx_ptr = ti->prx_ptr;
-        stde->skip_ptr = ti->frq_ptr + ti->skip_offset;
-        is_seek(stde->frq_in, ti->frq_ptr);
-        stde->have_skipped = false;
+    is_read_bytes(is, packed, width * (POSTINGS_BLOCK_SIZE / 8));
+    for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+        while (bits < width) {
+            acc |= (u64)*p++ << bits;
+            bits += 8;
+        }
+        vals[i] = (unsigned int)(acc & mask);
+        acc >>= width;
+        bits -= width;
+    }
+    for (i = 0; i < exception_cnt; i++) {
+        int idx = is_read_byte(is) & (POSTINGS_BLOCK_SIZE - 1);
+        vals[idx] |= (unsigned int)((u64)is_read_vint(is) << width);
     }
 }
 
-static void stde_seek(TermDocEnum *tde, int field_num, const char *term)
+/****************************************************************************
+ *
+ * Doc Values
+ *
+ * Fields with FI_DOC_VALUES_BM set have a column of each document's value
+ * written to the segment's .dvs file so that a FieldIndex can be loaded from
+ * it rather than built by walking the postings of every term in the field.
+ * Each column is written as;
+ *
+ *   VInt  DocCount
+ *   VInt  TermCount
+ *   VInt  OrdBits          # bits needed to hold TermCount
+ *   VInt  TermBytes
+ *   Bytes Terms            # each term followed by a 0 byte
+ *   Bytes Ords             # (DocCount * OrdBits + 7) / 8 bytes
+ *
+ * where each document's ord takes OrdBits bits, starting from the low bit
+ * of the first byte. Neither block needs decoding so when the store is
+ * memory-mapped a column is used where it lies in the mapping. Loading it
+ * only finds the start of each term. The columns are followed by a
+ * directory of them;
+ *
+ *   VInt  FieldCount
+ *   {
+ *     VInt  FieldNum
+ *     VOff  ColumnPtr
+ *   } * FieldCount
+ *   U64   DirectoryPtr
+ *
+ * A field with no column is un-inverted as before. The file is only written
+ * if at least one field has a column.
+ *
+ ****************************************************************************/
+
+#define DV_TERM_BUF_INIT_CAPA 256
+
+static DocValues *dv_new(int size, int term_cnt)
 {
-    TermInfo *ti = tir_get_ti_field(STDE(tde)->tir, field_num, term);
-    stde_seek_ti(STDE(tde), ti);
+    DocValues *dv = ALLOC_AND_ZERO(DocValues);
+    dv->size = size;
+    dv->term_cnt = term_cnt;
+    dv->terms = ALLOC_N(char *, term_cnt + 1);
+    dv->ords = ALLOC_AND_ZERO_N(int, size + 1);
+    return dv;
 }
 
-static void stde_seek_te(TermDocEnum *tde, TermEnum *te)
+void dv_destroy(DocValues *dv)
 {
-#ifdef DEBUG
-    if (te->set_field != &ste_set_field) {
-        RAISE(ARG_ERROR, "Passed an incorrect TermEnum type");
-    }
-#endif
-    stde_seek_ti(STDE(tde), &(te->curr_ti));
+    free(dv->terms);
+    free(dv->ords);
+    free(dv->term_buf);
+    free(dv);
 }
 
-static int stde_doc_num(TermDocEnum *tde)
+int dv_get_ord(DocValues *dv, int doc_num)
 {
-    CHECK_STATE("doc_num");
-    return STDE(tde)->doc_num;
+    if (dv->ords) {
+        return dv->ords[doc_num];
+    }
+    else {
+        const u64 bit = (u64)doc_num * dv->ord_bits;
+        const uchar *bytes = dv->packed_ords + (bit >> 3);
+        const int shift = (int)(bit & 7);
+        u64 acc = 0;
+        int i;
+        for (i = 0; (i << 3) < shift + dv->ord_bits; i++) {
+            acc |= (u64)bytes[i] << (i << 3);
+        }
+        return (int)((acc >> shift) & ((1ULL << dv->ord_bits) - 1));
+    }
 }
 
-static int stde_freq(TermDocEnum *tde)
+/* make room for +needed+ bytes in +dv+'s term_buf, which may move it */
+static void dv_grow_term_buf(DocValues *dv, int *capa, int needed)
 {
-    CHECK_STATE("freq");
-    return STDE(tde)->freq;
+    if (needed > *capa) {
+        do {
+            *capa <<= 1;
+        } while (needed > *capa);
+        REALLOC_N(dv->term_buf, char, *capa);
+    }
 }
 
-static bool stde_next(TermDocEnum *tde)
+/* point the terms at their offsets in term_buf once it has stopped moving */
+static void dv_set_terms(DocValues *dv, const int *offs)
 {
-    int doc_code;
-    SegmentTermDocEnum *stde = STDE(tde);
+    int i;
+    for (i = 0; i < dv->term_cnt; i++) {
+        dv->terms[i] = dv->term_buf + offs[i];
+    }
+}
 
-    while (true) {
-        if (stde->count >= stde->doc_freq) {
-            return false;
+/* drop the terms which aren't the value of any document */
+static void dv_drop_unused_terms(DocValues *dv)
+{
+    int i, j;
+    int *map = ALLOC_AND_ZERO_N(int, dv->term_cnt + 1);
+    for (i = 0; i < dv->size; i++) {
+        map[dv->ords[i]] = 1;
+    }
+    map[0] = 0;
+    for (i = 1, j = 0; i <= dv->term_cnt; i++) {
+        if (map[i]) {
+            dv->terms[j] = dv->terms[i - 1];
+            map[i] = ++j;
         }
+    }
+    dv->term_cnt = j;
+    for (i = 0; i < dv->size; i++) {
+        dv->ords[i] = map[dv->ords[i]];
+    }
+    free(map);
+}
 
-        doc_code = is_read_vint(stde->frq_in);
-        stde->doc_num += doc_code >> 1;    /* shift off low bit */
-        if (0 != (doc_code & 1)) {         /* if low bit is set */
-            stde->freq = 1;                /* freq is one */
-        }
-        else {
-            stde->freq = (int)is_read_vint(stde->frq_in); /* read freq */
+static void dv_write(OutStream *os, DocValues *dv)
+{
+    int i, ord_bits = 0, term_bytes = 0, bits = 0;
+    u64 acc = 0;
+    while ((1 << ord_bits) <= dv->term_cnt) {
+        ord_bits++;
+    }
+    for (i = 0; i < dv->term_cnt; i++) {
+        term_bytes += (int)strlen(dv->terms[i]) + 1;
+    }
+    os_write_vint(os, dv->size);
+    os_write_vint(os, dv->term_cnt);
+    os_write_vint(os, ord_bits);
+    os_write_vint(os, term_bytes);
+    for (i = 0; i < dv->term_cnt; i++) {
+        os_write_bytes(os, (uchar *)dv->terms[i],
+                       (int)strlen(dv->terms[i]) + 1);
+    }
+    for (i = 0; i < dv->size; i++) {
+        acc |= (u64)dv->ords[i] << bits;
+        for (bits += ord_bits; bits >= 8; bits -= 8) {
+            os_write_byte(os, (uchar)acc);
+            acc >>= 8;
         }
+    }
+    if (bits > 0) {
+        os_write_byte(os, (uchar)acc);
+    }
+}
 
-        stde->count++;
+/* the column is read into term_buf unless +is+ is memory-mapped */
+static DocValues *dv_read(InStream *is)
+{
+    int i;
+    const char *term;
+    DocValues *dv = ALLOC_AND_ZERO(DocValues);
+    int term_bytes, ord_bytes;
+
+    dv->size = is_read_vint(is);
+    dv->term_cnt = is_read_vint(is);
+    dv->ord_bits = is_read_vint(is);
+    term_bytes = is_read_vint(is);
+    ord_bytes = (int)(((u64)dv->size * dv->ord_bits + 7) >> 3);
+    dv->terms = ALLOC_N(char *, dv->term_cnt + 1);
+    if (is_mapped(is)) {
+        term = (const char *)is_map_bytes(is, term_bytes);
+        dv->packed_ords = is_map_bytes(is, ord_bytes);
+    }
+    else {
+        dv->term_buf = ALLOC_N(char, term_bytes + ord_bytes + 1);
+        is_read_bytes(is, (uchar *)dv->term_buf, term_bytes + ord_bytes);
+        term = dv->term_buf;
+        dv->packed_ords = (uchar *)dv->term_buf + term_bytes;
+    }
+    for (i = 0; i < dv->term_cnt; i++) {
+        dv->terms[i] = (char *)term;
+        term += strlen(term) + 1;
+    }
+    return dv;
+}
 
-        if (NULL == stde->deleted_docs
-            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
-            break; /* We found an undeleted doc so return */
-        }
+typedef struct DocValuesMergeTerm {
+    const char *term;
+    int dv_num;
+    int ord;
+} DocValuesMergeTerm;
 
-        stde->skip_prox(stde);
-    }
-    return true;
+static int dv_merge_term_cmp(const void *p1, const void *p2)
+{
+    const DocValuesMergeTerm *t1 = (const DocValuesMergeTerm *)p1;
+    const DocValuesMergeTerm *t2 = (const DocValuesMergeTerm *)p2;
+    int cmp = strcmp(t1->term, t2->term);
+    return cmp ? cmp : t1->dv_num - t2->dv_num;
 }
 
-static int stde_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+DocValues *dv_merge(DocValues **dvs, int dv_cnt)
 {
-    SegmentTermDocEnum *stde = STDE(tde);
-    int i = 0;
-    int doc_code;
+    int i, j, k, size = 0, entry_cnt = 0, term_cnt = 0;
+    DocValues *dv;
+    DocValuesMergeTerm *entries;
+    int **maps = ALLOC_N(int *, dv_cnt);
 
-    while (i < req_num && stde->count < stde->doc_freq) {
-        /* manually inlined call to next() for speed */
-        doc_code = is_read_vint(stde->frq_in);
-        stde->doc_num += (doc_code >> 1);            /* shift off low bit */
-        if (0 != (doc_code & 1)) {                   /* if low bit is set */
-            stde->freq = 1;                            /* freq is one */
-        }
-        else {
-            stde->freq = is_read_vint(stde->frq_in);  /* else read freq */
+    for (i = 0; i < dv_cnt; i++) {
+        size += dvs[i]->size;
+        entry_cnt += dvs[i]->term_cnt;
+    }
+    entries = ALLOC_N(DocValuesMergeTerm, entry_cnt + 1);
+    for (i = 0, k = 0; i < dv_cnt; i++) {
+        maps[i] = ALLOC_N(int, dvs[i]->term_cnt + 1);
+        maps[i][0] = 0;
+        for (j = 0; j < dvs[i]->term_cnt; j++, k++) {
+            entries[k].term = dvs[i]->terms[j];
+            entries[k].dv_num = i;
+            entries[k].ord = j + 1;
         }
+    }
+    qsort(entries, entry_cnt, sizeof(DocValuesMergeTerm), &dv_merge_term_cmp);
 
-        stde->count++;
+    dv = dv_new(size, entry_cnt);
+    for (i = 0; i < entry_cnt; i++) {
+        if (0 == term_cnt
+            || 0 != strcmp(entries[i].term, dv->terms[term_cnt - 1])) {
+            dv->terms[term_cnt++] = (char *)entries[i].term;
+        }
+        maps[entries[i].dv_num][entries[i].ord] = term_cnt;
+    }
+    dv->term_cnt = term_cnt;
 
-        if (NULL == stde->deleted_docs
-            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
-            docs[i] = stde->doc_num;
-            freqs[i] = stde->freq;
-            i++;
+    for (i = 0, k = 0; i < dv_cnt; i++) {
+        const int *map = maps[i];
+        for (j = 0; j < dvs[i]->size; j++) {
+            dv->ords[k++] = map[dv_get_ord(dvs[i], j)];
         }
+        free(maps[i]);
     }
-    return i;
+    free(maps);
+    free(entries);
+    return dv;
 }
 
-static bool stde_skip_to(TermDocEnum *tde, int target_doc_num)
+static void dv_write_directory(OutStream *os, int field_cnt,
+                               const int *field_nums, const off_t *ptrs)
 {
-    SegmentTermDocEnum *stde = STDE(tde);
-
-    if (stde->doc_freq >= stde->skip_interval
-        && target_doc_num > stde->doc_num) {       /* optimized case */
-        int last_skip_doc;
-        off_t last_frq_ptr;
-        off_t last_prx_ptr;
-        int num_skipped;
-
-        if (NULL == stde->skip_in) {
-            stde->skip_in = is_clone(stde->frq_in);/* lazily clone */
-        }
-
-        //printf("skip_ptr = %lld\n", stde->skip_ptr);
-        if (!stde->have_skipped) {                 /* lazily seek skip stream */
-            is_seek(stde->skip_in, stde->skip_ptr);
-            stde->have_skipped = true;
-        }
+    int i;
+    off_t dir_ptr = os_pos(os);
+    os_write_vint(os, field_cnt);
+    for (i = 0; i < field_cnt; i++) {
+        os_write_vint(os, field_nums[i]);
+        os_write_voff_t(os, ptrs[i]);
+    }
+    os_write_u64(os, (u64)dir_ptr);
+}
 
-        /* scan skip data */
-        last_skip_doc = stde->skip_doc;
-        last_frq_ptr = is_pos(stde->frq_in);
-        last_prx_ptr = -1;
-        num_skipped = -1 - (stde->count % stde->skip_interval);
-        //printf("%d, %d, %d, %d\n", last_skip_doc, last_frq_ptr, last_prx_ptr, num_skipped);
+/****************************************************************************
+ * DocValuesWriter
+ ****************************************************************************/
 
-        while (target_doc_num > stde->skip_doc) {
-            last_skip_doc = stde->skip_doc;
-            last_frq_ptr = stde->frq_ptr;
-            last_prx_ptr = stde->prx_ptr;
+typedef struct DocValuesWriter {
+    Store *store;
+    char *segment;
+    OutStream *os;
+    int field_cnt;
+    int field_capa;
+    int *field_nums;
+    off_t *ptrs;
+} DocValuesWriter;
 
-            if (0 != stde->skip_doc && stde->skip_doc >= stde->doc_num) {
-                num_skipped += stde->skip_interval;
-            }
+/* the .dvs file isn't created until the first column is added */
+static DocValuesWriter *dvw_new(Store *store, const char *segment)
+{
+    DocValuesWriter *dvw = ALLOC_AND_ZERO(DocValuesWriter);
+    dvw->store = store;
+    dvw->segment = estrdup(segment);
+    return dvw;
+}
 
-            if (stde->skip_count >= stde->num_skips) {
-                break;
-            }
+static void dvw_add(DocValuesWriter *dvw, int field_num, DocValues *dv)
+{
+    if (NULL == dvw->os) {
+        char file_name[SEGMENT_NAME_MAX_LENGTH];
+        sprintf(file_name, "%s.dvs", dvw->segment);
+        dvw->os = dvw->store->new_output(dvw->store, file_name);
+    }
+    if (dvw->field_cnt == dvw->field_capa) {
+        dvw->field_capa = dvw->field_capa ? dvw->field_capa * 2 : 4;
+        REALLOC_N(dvw->field_nums, int, dvw->field_capa);
+        REALLOC_N(dvw->ptrs, off_t, dvw->field_capa);
+    }
+    dvw->field_nums[dvw->field_cnt] = field_num;
+    dvw->ptrs[dvw->field_cnt] = os_pos(dvw->os);
+    dvw->field_cnt++;
+    dv_write(dvw->os, dv);
+}
 
-            stde->skip_doc += is_read_vint(stde->skip_in);
-            stde->frq_ptr  += is_read_vint(stde->skip_in);
-            stde->prx_ptr  += is_read_vint(stde->skip_in);
-            //printf("inner-> skip_doc:%d, frq_ptr:%d, prx_ptr:%d\n", stde->skip_doc, stde->frq_ptr, stde->prx_ptr);
+static void dvw_close(DocValuesWriter *dvw)
+{
+    if (dvw->os) {
+        dv_write_directory(dvw->os, dvw->field_cnt, dvw->field_nums,
+                           dvw->ptrs);
+        os_close(dvw->os);
+    }
+    free(dvw->segment);
+    free(dvw->field_nums);
+    free(dvw->ptrs);
+    free(dvw);
+}
 
-            stde->skip_count++;
-        }
+/****************************************************************************
+ * DocValuesReader
+ ****************************************************************************/
 
-        /* if we found something to skip, skip it */
-        if (last_frq_ptr > is_pos(stde->frq_in)) {
-            is_seek(stde->frq_in, last_frq_ptr);
-            stde->seek_prox(stde, last_prx_ptr);
+typedef struct DocValuesReader {
+    mutex_t mutex;
+    InStream *is;
+    int field_cnt;
+    int *field_nums;
+    off_t *ptrs;
+    DocValues **values;
+} DocValuesReader;
 
-            stde->doc_num = last_skip_doc;
-            stde->count += num_skipped;
-        }
+/* returns NULL if the segment has no .dvs file */
+static DocValuesReader *dvr_open(Store *store, const char *segment)
+{
+    int i;
+    DocValuesReader *dvr;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    sprintf(file_name, "%s.dvs", segment);
+    if (!store->exists(store, file_name)) {
+        return NULL;
     }
-
-    /* done skipping, now just scan */
-    do {
-        if (!tde->next(tde)) {
-            return false;
-        }
-    } while (target_doc_num > stde->doc_num);
-    return true;
+    dvr = ALLOC(DocValuesReader);
+    mutex_init(&dvr->mutex, NULL);
+    dvr->is = store->open_input(store, file_name);
+    is_seek(dvr->is, is_length(dvr->is) - 8);
+    is_seek(dvr->is, (off_t)is_read_u64(dvr->is));
+    dvr->field_cnt = is_read_vint(dvr->is);
+    dvr->field_nums = ALLOC_N(int, dvr->field_cnt + 1);
+    dvr->ptrs = ALLOC_N(off_t, dvr->field_cnt + 1);
+    dvr->values = ALLOC_AND_ZERO_N(DocValues *, dvr->field_cnt + 1);
+    for (i = 0; i < dvr->field_cnt; i++) {
+        dvr->field_nums[i] = is_read_vint(dvr->is);
+        dvr->ptrs[i] = is_read_voff_t(dvr->is);
+    }
+    return dvr;
 }
 
-static void stde_close(TermDocEnum *tde)
+static int dvr_find(DocValuesReader *dvr, int field_num)
 {
-    is_close(STDE(tde)->frq_in);
-
-    if (NULL != STDE(tde)->skip_in) {
-        is_close(STDE(tde)->skip_in);
+    int i;
+    for (i = 0; i < dvr->field_cnt; i++) {
+        if (dvr->field_nums[i] == field_num) {
+            return i;
+        }
     }
-
-    free(tde);
+    return -1;
 }
 
-static void stde_skip_prox(SegmentTermDocEnum *stde)
+/* read field +field_num+'s column afresh, or return NULL if it has none. The
+ * caller must hold the mutex if the reader is shared. */
+static DocValues *dvr_read(DocValuesReader *dvr, int field_num)
 {
-    (void)stde;
+    int i = dvr_find(dvr, field_num);
+    if (i < 0) {
+        return NULL;
+    }
+    is_seek(dvr->is, dvr->ptrs[i]);
+    return dv_read(dvr->is);
 }
 
-static void stde_seek_prox(SegmentTermDocEnum *stde, off_t prx_ptr)
+/* field +field_num+'s column, read the first time it is asked for and kept
+ * until the reader is closed */
+static DocValues *dvr_get(DocValuesReader *dvr, int field_num)
 {
-    (void)stde;
-    (void)prx_ptr;
+    DocValues *dv = NULL;
+    int i = dvr_find(dvr, field_num);
+    if (i >= 0) {
+        mutex_lock(&dvr->mutex);
+        TRY
+            if (NULL == dvr->values[i]) {
+                dvr->values[i] = dvr_read(dvr, field_num);
+            }
+            dv = dvr->values[i];
+        XFINALLY
+            mutex_unlock(&dvr->mutex);
+        XENDTRY
+    }
+    return dv;
 }
 
-
-TermDocEnum *stde_new(TermInfosReader *tir,
-                      InStream *frq_in,
-                      BitVector *deleted_docs,
-                      int skip_interval)
+static void dvr_close(DocValuesReader *dvr)
 {
-    SegmentTermDocEnum *stde = ALLOC_AND_ZERO(SegmentTermDocEnum);
-    TermDocEnum *tde         = (TermDocEnum *)stde;
-
-    /* TermDocEnum methods */
-    tde->seek                = &stde_seek;
-    tde->seek_te             = &stde_seek_te;
-    tde->doc_num             = &stde_doc_num;
-    tde->freq                = &stde_freq;
-    tde->next                = &stde_next;
-    tde->read                = &stde_read;
-    tde->skip_to             = &stde_skip_to;
-    tde->next_position       = NULL;
-    tde->close               = &stde_close;
-
-    /* SegmentTermDocEnum methods */
-    stde->skip_prox          = &stde_skip_prox;
-    stde->seek_prox          = &stde_seek_prox;
-
-    /* Attributes */
-    stde->tir                = tir;
-    stde->frq_in             = is_clone(frq_in);
-    stde->deleted_docs       = deleted_docs;
-    stde->skip_interval      = skip_interval;
-
-    return tde;
+    int i;
+    for (i = 0; i < dvr->field_cnt; i++) {
+        if (dvr->values[i]) {
+            dv_destroy(dvr->values[i]);
+        }
+    }
+    mutex_destroy(&dvr->mutex);
+    is_close(dvr->is);
+    free(dvr->field_nums);
+    free(dvr->ptrs);
+    free(dvr->values);
+    free(dvr);
 }
 
 /****************************************************************************
- * SegmentTermPosEnum
+ *
+ * TermDocEnum
+ *
  ****************************************************************************/
 
-static void stpe_seek_ti(SegmentTermDocEnum *stde, TermInfo *ti)
+/****************************************************************************
+ * SegmentTermDocEnum
+ ****************************************************************************/
+
+#define STDE(tde) ((SegmentTermDocEnum *)(tde))
+#define TDE(stde) ((TermDocEnum *)(stde))
+
+#define CHECK_STATE(method) do {\
+    if (0 == STDE(tde)->count) {\
+        RAISE(STATE_ERROR, "Illegal state of TermDocEnum. You must call #next "\
+              "before you call #"method);\
+    }\
+} while (0)
+
+static void stde_seek_ti(SegmentTermDocEnum *stde, TermInfo *ti)
 {
+    stde->max_freq = -1;
     if (NULL == ti) {
         stde->doc_freq = 0;
+        stde->pulsed = false;
     }
     else {
-        stde_seek_ti(stde, ti);
-        is_seek(stde->prx_in, ti->prx_ptr);
+        stde->count = 0;
+        stde->doc_freq = ti->doc_freq;
+        stde->doc_num = 0;
+        stde->frq_ptr = ti->frq_ptr;
+        stde->prx_ptr = ti->prx_ptr;
+        stde->skip_ptr = ti->frq_ptr + ti->skip_offset;
+        stde->pulsed = ti->pulsed;
+        if (ti->pulsed) {
+            stde->pulsed_doc = ti->pulsed_doc;
+            stde->pulsed_pos = ti->pulsed_pos;
+        }
+        else {
+            is_seek(stde->frq_in, ti->frq_ptr);
+        }
+        stde->have_skipped = false;
+        stde->buf_pos = stde->buf_cnt = 0;
     }
 }
 
-static void stpe_seek(TermDocEnum *tde, int field_num, const char *term)
-{
-    SegmentTermDocEnum *stde = STDE(tde);
-    TermInfo *ti = tir_get_ti_field(stde->tir, field_num, term);
-    stpe_seek_ti(stde, ti);
-    stde->prx_cnt = 0;
-}
-
-static bool stpe_next(TermDocEnum *tde)
+/* the only posting of a pulsed term comes from its TermInfo */
+static bool stde_next_pulsed(SegmentTermDocEnum *stde)
 {
-    SegmentTermDocEnum *stde = STDE(tde);
-    is_skip_vints(stde->prx_in, stde->prx_cnt);
-
-    /* if super */
-    if (stde_next(tde)) {
-        stde->prx_cnt = stde->freq;
-        stde->position = 0;
-        return true;
-    }
-    else {
-        stde->prx_cnt = stde->position = 0;
+    if (stde->count >= stde->doc_freq) {
         return false;
     }
+    stde->count++;
+    stde->doc_num = stde->pulsed_doc;
+    stde->freq = 1;
+    return NULL == stde->deleted_docs
+        || 0 == bv_get(stde->deleted_docs, stde->doc_num);
 }
 
-static int stpe_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+static int stde_read_pulsed(SegmentTermDocEnum *stde, int *docs, int *freqs,
+                            int n)
 {
-    (void)tde; (void)docs; (void)freqs; (void)req_num;
-    RAISE(ARG_ERROR, "TermPosEnum does not handle processing multiple documents"
-                     " in one call. Use TermDocEnum instead.");
-    return -1;
+    if (stde->count >= stde->doc_freq || n <= 0) {
+        return 0;
+    }
+    stde->count++;
+    docs[0] = stde->doc_num = stde->pulsed_doc;
+    freqs[0] = stde->freq = 1;
+    return 1;
 }
 
-static int stpe_next_position(TermDocEnum *tde)
+static void stde_seek(TermDocEnum *tde, int field_num, const char *term)
 {
-    SegmentTermDocEnum *stde = STDE(tde);
-    return (stde->prx_cnt-- > 0) ? stde->position += is_read_vint(stde->prx_in)
-                                 : -1;
+    TermInfo *ti = tir_get_ti_field(STDE(tde)->tir, field_num, term);
+    stde_seek_ti(STDE(tde), ti);
 }
 
-static void stpe_close(TermDocEnum *tde)
+static void stde_seek_te(TermDocEnum *tde, TermEnum *te)
 {
-    is_close(STDE(tde)->prx_in);
-    STDE(tde)->prx_in = NULL;
-    stde_close(tde);
+#ifdef DEBUG
+    if (te->set_field != &ste_set_field) {
+        RAISE(ARG_ERROR, "Passed an incorrect TermEnum type");
+    }
+#endif
+    stde_seek_ti(STDE(tde), &(te->curr_ti));
 }
 
-static void stpe_skip_prox(SegmentTermDocEnum *stde)
+static int stde_doc_num(TermDocEnum *tde)
 {
-    is_skip_vints(stde->prx_in, stde->freq);
+    CHECK_STATE("doc_num");
+    return STDE(tde)->doc_num;
 }
 
-static void stpe_seek_prox(SegmentTermDocEnum *stde, off_t prx_ptr)
+static int stde_freq(TermDocEnum *tde)
 {
-    is_seek(stde->prx_in, prx_ptr);
-    stde->prx_cnt = 0;
+    CHECK_STATE("freq");
+    return STDE(tde)->freq;
 }
 
-TermDocEnum *stpe_new(TermInfosReader *tir,
-                      InStream *frq_in,
-                      InStream *prx_in,
-                      BitVector *del_docs,
-                      int skip_interval)
+static bool stde_next(TermDocEnum *tde)
 {
-    TermDocEnum *tde         = stde_new(tir, frq_in, del_docs, skip_interval);
+    int doc_code;
     SegmentTermDocEnum *stde = STDE(tde);
 
-    /* TermDocEnum methods */
-    tde->seek                = &stpe_seek;
-    tde->next                = &stpe_next;
-    tde->read                = &stpe_read;
-    tde->next_position       = &stpe_next_position;
-    tde->close               = &stpe_close;
+    if (stde->pulsed) {
+        return stde_next_pulsed(stde);
+    }
+    while (true) {
+        if (stde->count >= stde->doc_freq) {
+            return false;
+        }
 
-    /* SegmentTermDocEnum methods */
-    stde->skip_prox          = &stpe_skip_prox;
-    stde->seek_prox          = &stpe_seek_prox;
+        doc_code = is_read_vint(stde->frq_in);
+        stde->doc_num += doc_code >> 1;    /* shift off low bit */
+        if (0 != (doc_code & 1)) {         /* if low bit is set */
+            stde->freq = 1;                /* freq is one */
+        }
+        else {
+            stde->freq = (int)is_read_vint(stde->frq_in); /* read freq */
+        }
 
-    /* Attributes */
-    stde->prx_in             = is_clone(prx_in);
-    stde->prx_cnt            = 0;
-    stde->position           = 0;
+        stde->count++;
 
-    return tde;
+        if (NULL == stde->deleted_docs
+            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
+            break; /* We found an undeleted doc so return */
+        }
+
+        stde->skip_prox(stde);
+    }
+    return true;
 }
 
-/****************************************************************************
- * MultiTermDocEnum
- ****************************************************************************/
+#define STDE_READ_BLOCK 128
 
-#define MTDE(tde) ((MultiTermDocEnum *)(tde))
+/*
+ * Decode +n+ VInt encoded postings following +doc_num+ into +docs+ and
+ * +freqs+. Every posting takes at least one vint so reading vints in bulk,
+ * never more than there are postings left to decode, can't run past the
+ * postings for the current term. A document whose freq didn't make it into a
+ * block reads it separately.
+ */
+static void postings_read_vints(InStream *frq_in, int doc_num,
+                                int *docs, int *freqs, int n)
+{
+    unsigned int codes[STDE_READ_BLOCK];
+    unsigned int doc_code;
+    int i = 0, j, cnt;
+
+    while (i < n) {
+        cnt = MIN(n - i, STDE_READ_BLOCK);
+        is_read_vints(frq_in, codes, cnt);
+        for (j = 0; j < cnt; i++) {
+            doc_code = codes[j++];
+            doc_num += (int)(doc_code >> 1);       /* shift off low bit */
+            docs[i] = doc_num;
+            if (0 != (doc_code & 1)) {             /* if low bit is set */
+                freqs[i] = 1;                        /* freq is one */
+            }
+            else if (j < cnt) {
+                freqs[i] = (int)codes[j++];          /* else read freq */
+            }
+            else {
+                freqs[i] = (int)is_read_vint(frq_in);
+            }
+        }
+    }
+}
 
-typedef struct MultiTermDocEnum
+/*
+ * Decode up to +n+ postings, deleted or not, into +docs+ and +freqs+ and
+ * return the number decoded.
+ */
+static int stde_read_postings(SegmentTermDocEnum *stde, int *docs, int *freqs,
+                              int n)
 {
-    TermDocEnum tde;
-    int *starts;
-    int base;
-    int ptr;
-    int ir_cnt;
-    char *state;
-    TermEnum *te;
-    IndexReader **irs;
-    TermDocEnum **irs_tde;
-    TermDocEnum *curr_tde;
-} MultiTermDocEnum;
+    if (stde->pulsed) {
+        return stde_read_pulsed(stde, docs, freqs, n);
+    }
+    n = MIN(n, stde->doc_freq - stde->count);
+    if (n > 0) {
+        postings_read_vints(stde->frq_in, stde->doc_num, docs, freqs, n);
+        stde->doc_num = docs[n - 1];
+        stde->freq = freqs[n - 1];
+        stde->count += n;
+    }
+    return MAX(n, 0);
+}
 
-static TermDocEnum *mtde_next_tde(MultiTermDocEnum *mtde)
+static int stde_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
 {
-    mtde->ptr++;
-    while (mtde->ptr < mtde->ir_cnt && !mtde->state[mtde->ptr]) {
-        mtde->ptr++;
+    SegmentTermDocEnum *stde = STDE(tde);
+    BitVector *deleted_docs = stde->deleted_docs;
+    int i = 0, j, cnt;
+
+    while (i < req_num && stde->count < stde->doc_freq) {
+        cnt = stde->read_postings(stde, docs + i, freqs + i, req_num - i);
+        if (NULL == deleted_docs) {
+            i += cnt;
+        }
+        else {                                 /* compact out deleted docs */
+            for (j = i, cnt += i; j < cnt; j++) {
+                if (0 == bv_get(deleted_docs, docs[j])) {
+                    docs[i] = docs[j];
+                    freqs[i] = freqs[j];
+                    i++;
+                }
+            }
+        }
     }
-    if (mtde->ptr >= mtde->ir_cnt) {
-        return mtde->curr_tde = NULL;
+    return i;
+}
+
+static void skip_level_next(SkipLevel *level, int level_num)
+{
+    InStream *is = level->is;
+    if (++level->entry_num > level->entry_cnt) {
+        return;
+    }
+    level->doc += is_read_vint(is);
+    if (0 == level_num) {
+        level->frq_ptr += is_read_vint(is);
+        level->prx_ptr += is_read_vint(is);
     }
     else {
-        TermDocEnum *tde = mtde->irs_tde[mtde->ptr];
-        mtde->base = mtde->starts[mtde->ptr];
-        return mtde->curr_tde = tde;
+        level->frq_ptr += is_read_voff_t(is);
+        level->prx_ptr += is_read_voff_t(is);
+        level->child_ptr = is_read_voff_t(is);
     }
 }
 
-#define CHECK_CURR_TDE(method) do {\
-    if (NULL == MTDE(tde)->curr_tde) {\
-        RAISE(STATE_ERROR, "Illegal state of TermDocEnum. You must call #next "\
-              "before you call #"method);\
-    }\
-} while (0)
-
-static void mtde_seek_te(TermDocEnum *tde, TermEnum *te)
+/*
+ * Lazily load the skip list for the current term. Level k has an entry for
+ * every skip_multiplier entries of level k - 1 so the number of entries in
+ * each level follows from the doc_freq. Only the lengths of the levels above
+ * level 0 need to be read, after the term's max freq if the segment has them.
+ */
+static void stde_load_skip_levels(SegmentTermDocEnum *stde)
 {
-    int i;
-    MultiTermDocEnum *mtde = MTDE(tde);
-    memset(mtde->state, 0, mtde->ir_cnt);
-    for (i = MTE(te)->ti_cnt - 1; i >= 0; i--) {
-        int index = MTE(te)->ti_indexes[i];
-        TermDocEnum *tde = mtde->irs_tde[index];
-        mtde->state[index] = 1;
-        if (tde->close == stde_close) {
-            stde_seek_ti(STDE(tde), MTE(te)->tis + i);
-        }
-        else if (tde->close == stpe_close) {
-            stpe_seek_ti(STDE(tde), MTE(te)->tis + i);
+    int i, entry_cnt = stde->doc_freq / stde->skip_interval;
+    off_t pos = stde->skip_ptr, level_len;
+
+    stde->skip_level_cnt = 0;
+    while (entry_cnt > 0 && stde->skip_level_cnt < stde->max_skip_levels) {
+        stde->skip_levels[stde->skip_level_cnt++].entry_cnt = entry_cnt;
+        entry_cnt /= stde->skip_multiplier;
+    }
+
+    for (i = stde->skip_level_cnt - 1; i >= 0; i--) {
+        SkipLevel *level = &stde->skip_levels[i];
+        if (NULL == level->is) {
+            level->is = is_clone(stde->frq_in);
         }
-        else {
-            tde->seek(tde, MTE(te)->tews[index].te->field_num, te->curr_term);
+        is_seek(level->is, pos);
+        if (stde->has_max_freqs && i == stde->skip_level_cnt - 1) {
+            stde->max_freq = is_read_vint(level->is);
         }
+        level_len = (i > 0) ? is_read_voff_t(level->is) : 0;
+        level->start = is_pos(level->is);
+        pos = level->start + level_len;
+        level->entry_num = 0;
+        level->doc = 0;
+        level->frq_ptr = stde->frq_ptr;
+        level->prx_ptr = stde->prx_ptr;
+        stde->skipped[i] = *level;
+        skip_level_next(level, i);
     }
-    mtde->base = 0;
-    mtde->ptr = -1;
-    mtde_next_tde(mtde);
 }
 
-static void mtde_seek(TermDocEnum *tde, int field_num, const char *term)
+/*
+ * Move +level+ to the entry matching +parent+, the entry skipped to in the
+ * level above. The entry's deltas are relative to an entry we haven't read
+ * so its values are taken from +parent+. It becomes the level's skipped
+ * entry and the one after it is read.
+ */
+static void stde_skip_level_seek(SegmentTermDocEnum *stde, int level_num,
+                                 const SkipLevel *parent)
 {
-    MultiTermDocEnum *mtde = MTDE(tde);
-    TermEnum *te = mtde->te;
-    char *t;
-    te->set_field(te, field_num);
-    if (NULL != (t = te->skip_to(te, term)) && 0 == strcmp(term, t)) {
-        mtde_seek_te(tde, te);
-    }
-    else {
-        memset(mtde->state, 0, mtde->ir_cnt);
-    }
+    SkipLevel *level = &stde->skip_levels[level_num];
+    is_seek(level->is, level->start + parent->child_ptr);
+    level->entry_num = parent->entry_num * stde->skip_multiplier - 1;
+    skip_level_next(level, level_num);
+    level->doc = parent->doc;
+    level->frq_ptr = parent->frq_ptr;
+    level->prx_ptr = parent->prx_ptr;
+    stde->skipped[level_num] = *level;
+    skip_level_next(level, level_num);
 }
 
-static int mtde_doc_num(TermDocEnum *tde)
+/*
+ * Find the last skip entry before +target_doc_num+, starting at the top
+ * level of the skip list and dropping a level whenever the next entry is past
+ * the target. Each level below starts from the entry skipped to in the level
+ * above unless it is already past it, so no level reads more than
+ * skip_multiplier entries. The entry is copied into +skip+. Returns the
+ * number of the entry in level 0 or 0 if there were no entries to skip.
+ */
+static int stde_skip_levels(SegmentTermDocEnum *stde, int target_doc_num,
+                            SkipLevel *skip)
 {
-    CHECK_CURR_TDE("doc_num");
-    return MTDE(tde)->base + MTDE(tde)->curr_tde->doc_num(MTDE(tde)->curr_tde);
+    int i;
+
+    if (!stde->have_skipped) {
+        stde_load_skip_levels(stde);
+        stde->have_skipped = true;
+    }
+
+    for (i = stde->skip_level_cnt - 1; i >= 0; i--) {
+        SkipLevel *level = &stde->skip_levels[i];
+        while (level->entry_num <= level->entry_cnt
+               && target_doc_num > level->doc) {
+            stde->skipped[i] = *level;
+            skip_level_next(level, i);
+        }
+        if (i > 0 && stde->skipped[i - 1].entry_num
+            < stde->skipped[i].entry_num * stde->skip_multiplier) {
+            stde_skip_level_seek(stde, i - 1, &stde->skipped[i]);
+        }
+    }
+    *skip = stde->skipped[0];
+    return skip->entry_num;
 }
 
-static int mtde_freq(TermDocEnum *tde)
+static bool stde_skip_to(TermDocEnum *tde, int target_doc_num)
 {
-    CHECK_CURR_TDE("freq");
-    return MTDE(tde)->curr_tde->freq(MTDE(tde)->curr_tde);
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    if (stde->doc_freq >= stde->skip_interval
+        && target_doc_num > stde->doc_num) {       /* optimized case */
+        SkipLevel skip;
+        int entry_num = stde_skip_levels(stde, target_doc_num, &skip);
+        /* skip entry n is written after skip_interval * n - 1 documents */
+        int skip_count = entry_num * stde->skip_interval - 1;
+
+        /* if we found something to skip, skip it */
+        if (entry_num > 0 && skip_count > stde->count) {
+            is_seek(stde->frq_in, skip.frq_ptr);
+            stde->seek_prox(stde, skip.prx_ptr);
+
+            stde->doc_num = skip.doc;
+            stde->count = skip_count;
+        }
+    }
+
+    /* done skipping, now just scan */
+    do {
+        if (!tde->next(tde)) {
+            return false;
+        }
+    } while (target_doc_num > stde->doc_num);
+    return true;
 }
 
-static bool mtde_next(TermDocEnum *tde)
+/*
+ * POSTINGS_FORMAT_BLOCK postings are decoded a block at a time into doc_buf
+ * and freq_buf. Full blocks are bit-packed while the last
+ * doc_freq % POSTINGS_BLOCK_SIZE postings of a term are VInt encoded just
+ * like POSTINGS_FORMAT_VINT. There is a skip entry at the end of every full
+ * block.
+ */
+static void stbe_refill(SegmentTermDocEnum *stde)
 {
-    MultiTermDocEnum *mtde = MTDE(tde);
-    if (NULL != mtde->curr_tde && mtde->curr_tde->next(mtde->curr_tde)) {
-        return true;
-    }
-    else if (mtde_next_tde(mtde)) {
-        return mtde_next(tde);
+    int i, doc_num = stde->doc_num;
+    int left = stde->doc_freq - stde->count;
+    int *doc_buf = stde->doc_buf, *freq_buf = stde->freq_buf;
+
+    if (left >= POSTINGS_BLOCK_SIZE) {
+        pfor_read_block(stde->frq_in, (unsigned int *)doc_buf);
+        pfor_read_block(stde->frq_in, (unsigned int *)freq_buf);
+        for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+            doc_buf[i] = doc_num += doc_buf[i];
+            freq_buf[i]++;
+        }
+        stde->buf_cnt = POSTINGS_BLOCK_SIZE;
     }
     else {
-        return false;
+        postings_read_vints(stde->frq_in, doc_num, doc_buf, freq_buf, left);
+        stde->buf_cnt = left;
     }
+    stde->buf_pos = 0;
 }
 
-static int mtde_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+static bool stbe_next(TermDocEnum *tde)
 {
-    int i, end = 0, last_end = 0, b;
-    MultiTermDocEnum *mtde = MTDE(tde);
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    if (stde->pulsed) {
+        return stde_next_pulsed(stde);
+    }
     while (true) {
-        if (NULL == mtde->curr_tde) return end;
-        end += mtde->curr_tde->read(mtde->curr_tde, docs + last_end,
-                                    freqs + last_end, req_num - last_end);
-        if (end == last_end) {              /* none left in segment */
-            if (!mtde_next_tde(mtde)) return end;
+        if (stde->count >= stde->doc_freq) {
+            return false;
         }
-        else {                            /* got some */
-            b = mtde->base;                 /* adjust doc numbers */
-            for (i = last_end; i < end; i++) {
-                docs[i] += b;
-            }
-            if (end == req_num) {
-                return end;
-            }
-            else {
-                last_end = end;
-            }
+        if (stde->buf_pos >= stde->buf_cnt) {
+            stbe_refill(stde);
         }
-    }
-}
+        stde->doc_num = stde->doc_buf[stde->buf_pos];
+        stde->freq = stde->freq_buf[stde->buf_pos];
+        stde->buf_pos++;
+        stde->count++;
 
-static bool mtde_skip_to(TermDocEnum *tde, int target_doc_num)
-{
-    MultiTermDocEnum *mtde = MTDE(tde);
-    TermDocEnum *curr_tde;
-    while (NULL != (curr_tde = mtde->curr_tde)) {
-        if (target_doc_num < mtde->starts[mtde->ptr + 1] &&
-            (curr_tde->skip_to(curr_tde, target_doc_num - mtde->base))) {
-            return true;
+        if (NULL == stde->deleted_docs
+            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
+            break; /* We found an undeleted doc so return */
         }
 
-        mtde_next_tde(mtde);
+        stde->skip_prox(stde);
     }
-    return false;
+    return true;
 }
 
-static void mtde_close(TermDocEnum *tde)
+static int stbe_read_postings(SegmentTermDocEnum *stde, int *docs, int *freqs,
+                              int n)
 {
-    MultiTermDocEnum *mtde = MTDE(tde);
-    TermDocEnum *tmp_tde;
-    int i = mtde->ir_cnt;
-    mtde->te->close(mtde->te);
-    while (i > 0) {
-        i--;
-        tmp_tde = mtde->irs_tde[i];
-        tmp_tde->close(tmp_tde);
+    if (stde->pulsed) {
+        return stde_read_pulsed(stde, docs, freqs, n);
     }
-    free(mtde->irs_tde);
-    free(mtde->state);
-    free(tde);
+    if (stde->count >= stde->doc_freq || n <= 0) {
+        return 0;
+    }
+    if (stde->buf_pos >= stde->buf_cnt) {
+        stbe_refill(stde);
+    }
+    n = MIN(n, stde->buf_cnt - stde->buf_pos);
+    memcpy(docs, stde->doc_buf + stde->buf_pos, n * sizeof(int));
+    memcpy(freqs, stde->freq_buf + stde->buf_pos, n * sizeof(int));
+    stde->buf_pos += n;
+    stde->count += n;
+    stde->doc_num = docs[n - 1];
+    stde->freq = freqs[n - 1];
+    return n;
 }
 
-static TermDocEnum *mtxe_new(MultiReader *mr)
+static bool stbe_skip_to(TermDocEnum *tde, int target_doc_num)
 {
-    MultiTermDocEnum *mtde  = ALLOC_AND_ZERO(MultiTermDocEnum);
-    TermDocEnum *tde        = TDE(mtde);
-    tde->seek               = &mtde_seek;
-    tde->seek_te            = &mtde_seek_te;
-    tde->doc_num            = &mtde_doc_num;
-    tde->freq               = &mtde_freq;
-    tde->next               = &mtde_next;
-    tde->read               = &mtde_read;
-    tde->skip_to            = &mtde_skip_to;
-    tde->close              = &mtde_close;
+    SegmentTermDocEnum *stde = STDE(tde);
 
-    mtde->state             = ALLOC_AND_ZERO_N(char, mr->r_cnt);
-    mtde->te                = ((IndexReader *)mr)->terms((IndexReader *)mr, 0);
-    mtde->starts            = mr->starts;
-    mtde->ir_cnt            = mr->r_cnt;
-    mtde->irs               = mr->sub_readers;
-    mtde->irs_tde           = ALLOC_AND_ZERO_N(TermDocEnum *, mr->r_cnt);
+    if (stde->doc_freq >= stde->skip_interval
+        && target_doc_num > stde->doc_num) {
+        /* skip entry n points to the start of block n which follows doc
+         * skip.doc */
+        SkipLevel skip;
+        int entry_num = stde_skip_levels(stde, target_doc_num, &skip);
 
-    return tde;
-}
+        /* only jump if that block hasn't already been decoded */
+        if (entry_num * POSTINGS_BLOCK_SIZE
+            > stde->count + stde->buf_cnt - stde->buf_pos) {
+            is_seek(stde->frq_in, skip.frq_ptr);
+            stde->seek_prox(stde, skip.prx_ptr);
 
-static TermDocEnum *mtde_new(MultiReader *mr)
-{
-    int i;
-    TermDocEnum *tde        = mtxe_new(mr);
-    tde->next_position      = NULL;
-    for (i = mr->r_cnt - 1; i >= 0; i--) {
-        IndexReader *ir = mr->sub_readers[i];
-        MTDE(tde)->irs_tde[i] = ir->term_docs(ir);
+            stde->doc_num = skip.doc;
+            stde->count = entry_num * POSTINGS_BLOCK_SIZE;
+            stde->buf_pos = stde->buf_cnt = 0;
+        }
     }
-    return tde;
-}
-
-/****************************************************************************
- * MultiTermPosEnum
- ****************************************************************************/
 
-static int mtpe_next_position(TermDocEnum *tde)
-{
-    CHECK_CURR_TDE("next_position");
-    return MTDE(tde)->curr_tde->next_position(MTDE(tde)->curr_tde);
+    /* done skipping, now just scan */
+    do {
+        if (!tde->next(tde)) {
+            return false;
+        }
+    } while (target_doc_num > stde->doc_num);
+    return true;
 }
 
-static TermDocEnum *mtpe_new(MultiReader *mr)
+/*
+ * Terms with skip data store their max freq at the start of it, in segments
+ * which have max freqs. Shorter postings are simply read. The level 0 skip
+ * stream is free to use here as it is only used once skip data has been
+ * loaded, which also loads the max freq.
+ */
+static InStream *stde_skip_in(SegmentTermDocEnum *stde)
 {
-    int i;
-    TermDocEnum *tde        = mtxe_new(mr);
-    tde->next_position      = &mtpe_next_position;
-    for (i = mr->r_cnt - 1; i >= 0; i--) {
-        IndexReader *ir = mr->sub_readers[i];
-        MTDE(tde)->irs_tde[i] = ir->term_positions(ir);
+    if (NULL == stde->skip_levels[0].is) {
+        stde->skip_levels[0].is = is_clone(stde->frq_in);
     }
-    return tde;
+    return stde->skip_levels[0].is;
 }
 
-/****************************************************************************
- * MultipleTermDocPosEnum
- *
- * This enumerator is used by MultiPhraseQuery
- ****************************************************************************/
-
-#define MTDPE(tde) ((MultipleTermDocPosEnum *)(tde))
-#define  MTDPE_POS_QUEUE_INIT_CAPA 8
-
-typedef struct
+static int stde_max_freq(TermDocEnum *tde)
 {
-    TermDocEnum tde;
-    int doc_num;
-    int freq;
-    PriorityQueue *pq;
-    int *pos_queue;
-    int pos_queue_index;
-    int pos_queue_capa;
-    int field_num;
-} MultipleTermDocPosEnum;
+    SegmentTermDocEnum *stde = STDE(tde);
 
-static void tde_destroy(TermDocEnum *tde) {
-    tde->close(tde);
+    if (stde->max_freq < 0) {
+        if (stde->pulsed) {             /* pulsed terms never read the .frq */
+            stde->max_freq = 1;
+        }
+        else if (stde->doc_freq < stde->skip_interval) {
+            int docs[STDE_READ_BLOCK], freqs[STDE_READ_BLOCK];
+            int i, cnt, left = stde->doc_freq, doc_num = 0;
+            InStream *is = stde_skip_in(stde);
+            stde->max_freq = 0;
+            is_seek(is, stde->frq_ptr);
+            while (left > 0) {
+                cnt = MIN(left, STDE_READ_BLOCK);
+                postings_read_vints(is, doc_num, docs, freqs, cnt);
+                for (i = 0; i < cnt; i++) {
+                    if (freqs[i] > stde->max_freq) {
+                        stde->max_freq = freqs[i];
+                    }
+                }
+                doc_num = docs[cnt - 1];
+                left -= cnt;
+            }
+        }
+        else if (stde->has_max_freqs) {
+            InStream *is = stde_skip_in(stde);
+            is_seek(is, stde->skip_ptr);
+            stde->max_freq = is_read_vint(is);
+        }
+        else {
+            stde->max_freq = INT_MAX;
+        }
+    }
+    return stde->max_freq;
 }
 
-static void mtdpe_seek(TermDocEnum *tde, int field_num, const char *term)
+static void stde_close(TermDocEnum *tde)
 {
-    (void)tde;
-    (void)field_num;
-    (void)term;
-    RAISE(UNSUPPORTED_ERROR, "MultipleTermDocPosEnum does not support "
-          " the #seek operation");
+    int i;
+    is_close(STDE(tde)->frq_in);
+
+    for (i = 0; i < MAX_SKIP_LEVELS; i++) {
+        if (NULL != STDE(tde)->skip_levels[i].is) {
+            is_close(STDE(tde)->skip_levels[i].is);
+        }
+    }
+
+    free(STDE(tde)->doc_buf);
+    free(STDE(tde)->freq_buf);
+    free(tde);
 }
 
-static int mtdpe_doc_num(TermDocEnum *tde)
+static void stde_skip_prox(SegmentTermDocEnum *stde)
 {
-    return MTDPE(tde)->doc_num;
+    (void)stde;
 }
 
-static int mtdpe_freq(TermDocEnum *tde)
+static void stde_seek_prox(SegmentTermDocEnum *stde, off_t prx_ptr)
 {
-    return MTDPE(tde)->freq;
+    (void)stde;
+    (void)prx_ptr;
 }
 
-static bool mtdpe_next(TermDocEnum *tde)
-{
-    TermDocEnum *sub_tde;
-    int pos = 0, freq = 0;
-    int doc;
-    MultipleTermDocPosEnum *mtdpe = MTDPE(tde);
 
-    if (0 == mtdpe->pq->size) {
-        return false;
-    }
+TermDocEnum *stde_new(TermInfosReader *tir,
+                      InStream *frq_in,
+                      BitVector *deleted_docs,
+                      int skip_interval,
+                      SegmentInfo *si)
+{
+    SegmentTermDocEnum *stde = ALLOC_AND_ZERO(SegmentTermDocEnum);
+    TermDocEnum *tde         = (TermDocEnum *)stde;
 
-    sub_tde = (TermDocEnum *)pq_top(mtdpe->pq);
-    doc = sub_tde->doc_num(sub_tde);
+    /* TermDocEnum methods */
+    tde->seek                = &stde_seek;
+    tde->seek_te             = &stde_seek_te;
+    tde->doc_num             = &stde_doc_num;
+    tde->freq                = &stde_freq;
+    tde->next                = &stde_next;
+    tde->read                = &stde_read;
+    tde->skip_to             = &stde_skip_to;
+    tde->next_position       = NULL;
+    tde->close               = &stde_close;
+    tde->max_freq            = &stde_max_freq;
 
-    do {
-        freq += sub_tde->freq(sub_tde);
-        if (freq > mtdpe->pos_queue_capa) {
-            do {
-                mtdpe->pos_queue_capa <<= 1;
-            } while (freq > mtdpe->pos_queue_capa);
-            REALLOC_N(mtdpe->pos_queue, int, mtdpe->pos_queue_capa);
-        }
+    /* SegmentTermDocEnum methods */
+    stde->skip_prox          = &stde_skip_prox;
+    stde->seek_prox          = &stde_seek_prox;
+    stde->read_postings      = &stde_read_postings;
 
-        /* pos starts from where it was up to last time */
-        for (; pos < freq; pos++) {
-            mtdpe->pos_queue[pos] = sub_tde->next_position(sub_tde);
-        }
+    /* Attributes */
+    stde->tir                = tir;
+    stde->frq_in             = is_clone(frq_in);
+    stde->deleted_docs       = deleted_docs;
+    stde->skip_interval      = skip_interval;
+    stde->skip_multiplier    = skip_interval;
+    stde->max_skip_levels    = skip_interval > 1
+        ? MAX(1, MIN(si->max_skip_levels, MAX_SKIP_LEVELS)) : 1;
+    stde->has_max_freqs      = si->has_max_freqs;
 
-        if (sub_tde->next(sub_tde)) {
-            pq_down(mtdpe->pq);
-        }
-        else {
-            sub_tde = (TermDocEnum *)pq_pop(mtdpe->pq);
-            sub_tde->close(sub_tde);
-        }
-        sub_tde = (TermDocEnum *)pq_top(mtdpe->pq);
-    } while ((mtdpe->pq->size > 0) && (sub_tde->doc_num(sub_tde) == doc));
+    if (POSTINGS_FORMAT_BLOCK == si->postings_format) {
+        tde->next            = &stbe_next;
+        tde->skip_to         = &stbe_skip_to;
+        stde->read_postings  = &stbe_read_postings;
+        stde->skip_interval  = POSTINGS_BLOCK_SIZE;
+        stde->doc_buf        = ALLOC_N(int, POSTINGS_BLOCK_SIZE);
+        stde->freq_buf       = ALLOC_N(int, POSTINGS_BLOCK_SIZE);
+    }
 
-    qsort(mtdpe->pos_queue, freq, sizeof(int), &icmp_risky);
+    return tde;
+}
 
-    mtdpe->pos_queue_index = 0;
-    mtdpe->freq = freq;
-    mtdpe->doc_num = doc;
+/****************************************************************************
+ * SegmentTermPosEnum
+ ****************************************************************************/
 
-    return true;
+static void stpe_seek_ti(SegmentTermDocEnum *stde, TermInfo *ti)
+{
+    if (NULL == ti) {
+        stde->doc_freq = 0;
+    }
+    else {
+        stde_seek_ti(stde, ti);
+        if (!ti->pulsed) {
+            is_seek(stde->prx_in, ti->prx_ptr);
+        }
+    }
 }
 
-static bool tdpe_less_than(TermDocEnum *p1, TermDocEnum *p2)
+static void stpe_seek(TermDocEnum *tde, int field_num, const char *term)
 {
-    return p1->doc_num(p1) < p2->doc_num(p2);
+    SegmentTermDocEnum *stde = STDE(tde);
+    TermInfo *ti = tir_get_ti_field(stde->tir, field_num, term);
+    stpe_seek_ti(stde, ti);
+    stde->prx_cnt = 0;
 }
 
-static bool mtdpe_skip_to(TermDocEnum *tde, int target_doc_num)
+static bool stpe_next(TermDocEnum *tde)
 {
-    TermDocEnum *sub_tde;
-    PriorityQueue *mtdpe_pq = MTDPE(tde)->pq;
+    SegmentTermDocEnum *stde = STDE(tde);
+    if (!stde->pulsed) {
+        is_skip_vints(stde->prx_in, stde->prx_cnt);
+    }
 
-    while (NULL != (sub_tde = (TermDocEnum *)pq_top(mtdpe_pq))
-           && (target_doc_num > sub_tde->doc_num(sub_tde))) {
-        if (sub_tde->skip_to(sub_tde, target_doc_num)) {
-            pq_down(mtdpe_pq);
-        }
-        else {
-            sub_tde = (TermDocEnum *)pq_pop(mtdpe_pq);
-            sub_tde->close(sub_tde);
-        }
+    /* if super */
+    if (NULL == stde->doc_buf ? stde_next(tde) : stbe_next(tde)) {
+        stde->prx_cnt = stde->freq;
+        stde->position = 0;
+        return true;
+    }
+    else {
+        stde->prx_cnt = stde->position = 0;
+        return false;
     }
-    return tde->next(tde);
 }
 
-static int mtdpe_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+static int stpe_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
 {
-    (void)tde;
-    (void)docs;
-    (void)freqs;
-    RAISE(UNSUPPORTED_ERROR, "MultipleTermDocPosEnum does not support "
-          " the #read operation");
-    return req_num;
+    (void)tde; (void)docs; (void)freqs; (void)req_num;
+    RAISE(ARG_ERROR, "TermPosEnum does not handle processing multiple documents"
+                     " in one call. Use TermDocEnum instead.");
+    return -1;
 }
 
-static int mtdpe_next_position(TermDocEnum *tde)
+static int stpe_next_position(TermDocEnum *tde)
 {
-    return MTDPE(tde)->pos_queue[MTDPE(tde)->pos_queue_index++];
+    SegmentTermDocEnum *stde = STDE(tde);
+    if (stde->pulsed) {
+        return (stde->prx_cnt-- > 0) ? stde->position = stde->pulsed_pos : -1;
+    }
+    return (stde->prx_cnt-- > 0) ? stde->position += is_read_vint(stde->prx_in)
+                                 : -1;
 }
 
-static void mtdpe_close(TermDocEnum *tde)
+static void stpe_close(TermDocEnum *tde)
 {
-    pq_clear(MTDPE(tde)->pq);
-    pq_destroy(MTDPE(tde)->pq);
-    free(MTDPE(tde)->pos_queue);
-    free(tde);
+    is_close(STDE(tde)->prx_in);
+    STDE(tde)->prx_in = NULL;
+    stde_close(tde);
 }
 
-TermDocEnum *mtdpe_new(IndexReader *ir, int field_num, char **terms, int t_cnt)
+static void stpe_skip_prox(SegmentTermDocEnum *stde)
 {
-    int i;
-    MultipleTermDocPosEnum *mtdpe = ALLOC_AND_ZERO(MultipleTermDocPosEnum);
-    TermDocEnum *tde = TDE(mtdpe);
-    PriorityQueue *pq;
-
-    pq = mtdpe->pq = pq_new(t_cnt, (lt_ft)&tdpe_less_than, (free_ft)&tde_destroy);
-    mtdpe->pos_queue_capa = MTDPE_POS_QUEUE_INIT_CAPA;
-    mtdpe->pos_queue = ALLOC_N(int, MTDPE_POS_QUEUE_INIT_CAPA);
-    mtdpe->field_num = field_num;
-    for (i = 0; i < t_cnt; i++) {
-        TermDocEnum *tpe = ir->term_positions(ir);
-        tpe->seek(tpe, field_num, terms[i]);
-        if (tpe->next(tpe)) {
-            pq_push(pq, tpe);
-        }
-        else {
-            tpe->close(tpe);
-        }
-    }
-    tde->close          = &mtdpe_close;
-    tde->seek           = &mtdpe_seek;
-    tde->next           = &mtdpe_next;
-    tde->doc_num        = &mtdpe_doc_num;
-    tde->freq           = &mtdpe_freq;
-    tde->skip_to        = &mtdpe_skip_to;
-    tde->read           = &mtdpe_read;
-    tde->next_position  = &mtdpe_next_position;
-
-    return tde;
+    is_skip_vints(stde->prx_in, stde->freq);
 }
 
-/****************************************************************************
- *
- * FileNameFilter
- *
- ****************************************************************************/
-
-static Hash *fn_extensions = NULL;
-static void file_name_filter_init()
+static void stpe_seek_prox(SegmentTermDocEnum *stde, off_t prx_ptr)
 {
-    int i;
-    fn_extensions = h_new_str((free_ft)NULL, (free_ft)NULL);
-    for (i = 0; i < NELEMS(INDEX_EXTENSIONS); i++) {
-      h_set(fn_extensions, INDEX_EXTENSIONS[i], (char *)INDEX_EXTENSIONS[i]);
+    is_seek(stde->prx_in, prx_ptr);
+    stde->prx_cnt = 0;
+}
+
+TermDocEnum *stpe_new(TermInfosReader *tir,
+                      InStream *frq_in,
+                      InStream *prx_in,
+                      BitVector *del_docs,
+                      int skip_interval,
+                      SegmentInfo *si)
+{
+    TermDocEnum *tde         = stde_new(tir, frq_in, del_docs, skip_interval,
+                                        si);
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    /* TermDocEnum methods */
+    tde->seek                = &stpe_seek;
+    tde->next                = &stpe_next;
+    tde->read                = &stpe_read;
+    tde->next_position       = &stpe_next_position;
+    tde->close               = &stpe_close;
+
+    /* SegmentTermDocEnum methods */
+    stde->skip_prox          = &stpe_skip_prox;
+    stde->seek_prox          = &stpe_seek_prox;
+
+    /* Attributes */
+    stde->prx_in             = is_clone(prx_in);
+    stde->prx_cnt            = 0;
+    stde->position           = 0;
+
+    return tde;
+}
+
+/****************************************************************************
+ * MultiTermDocEnum
+ ****************************************************************************/
+
+#define MTDE(tde) ((MultiTermDocEnum *)(tde))
+
+typedef struct MultiTermDocEnum
+{
+    TermDocEnum tde;
+    int *starts;
+    int base;
+    int ptr;
+    int ir_cnt;
+    char *state;
+    TermEnum *te;
+    IndexReader **irs;
+    TermDocEnum **irs_tde;
+    TermDocEnum *curr_tde;
+} MultiTermDocEnum;
+
+static TermDocEnum *mtde_next_tde(MultiTermDocEnum *mtde)
+{
+    mtde->ptr++;
+    while (mtde->ptr < mtde->ir_cnt && !mtde->state[mtde->ptr]) {
+        mtde->ptr++;
+    }
+    if (mtde->ptr >= mtde->ir_cnt) {
+        return mtde->curr_tde = NULL;
+    }
+    else {
+        TermDocEnum *tde = mtde->irs_tde[mtde->ptr];
+        mtde->base = mtde->starts[mtde->ptr];
+        return mtde->curr_tde = tde;
     }
-    register_for_cleanup(fn_extensions, (free_ft)&h_destroy);
 }
 
-bool file_name_filter_is_index_file(const char *file_name, bool include_locks)
+#define CHECK_CURR_TDE(method) do {\
+    if (NULL == MTDE(tde)->curr_tde) {\
+        RAISE(STATE_ERROR, "Illegal state of TermDocEnum. You must call #next "\
+              "before you call #"method);\
+    }\
+} while (0)
+
+static void mtde_seek_te(TermDocEnum *tde, TermEnum *te)
 {
-    char *p = strrchr(file_name, '.');
-    if (NULL == fn_extensions) file_name_filter_init();
-    if (NULL != p) {
-        char *extension = p + 1;
-        if (NULL != h_get(fn_extensions, extension)) {
-            return true;
+    int i;
+    MultiTermDocEnum *mtde = MTDE(tde);
+    memset(mtde->state, 0, mtde->ir_cnt);
+    for (i = MTE(te)->ti_cnt - 1; i >= 0; i--) {
+        int index = MTE(te)->ti_indexes[i];
+        TermDocEnum *tde = mtde->irs_tde[index];
+        mtde->state[index] = 1;
+        if (tde->close == stde_close) {
+            stde_seek_ti(STDE(tde), MTE(te)->tis + i);
         }
-        else if ((*extension == 'f' || *extension == 's')
-                 && *(extension + 1) >= '0'
-                 && *(extension + 1) <= '9') {
-            return true;
+        else if (tde->close == stpe_close) {
+            stpe_seek_ti(STDE(tde), MTE(te)->tis + i);
         }
-        else if (include_locks && (strcmp(extension, "lck") == 0)
-                               && (strncmp(file_name, "ferret", 6) == 0)) {
-            return true;
+        else {
+            tde->seek(tde, MTE(te)->tews[index].te->field_num, te->curr_term);
         }
     }
-    else if (0 == strncmp(SEGMENTS_FILE_NAME, file_name,
-                          sizeof(SEGMENTS_FILE_NAME) - 1)) {
+    mtde->base = 0;
+    mtde->ptr = -1;
+    mtde_next_tde(mtde);
+}
+
+static void mtde_seek(TermDocEnum *tde, int field_num, const char *term)
+{
+    MultiTermDocEnum *mtde = MTDE(tde);
+    TermEnum *te = mtde->te;
+    char *t;
+    te->set_field(te, field_num);
+    if (NULL != (t = te->skip_to(te, term)) && 0 == strcmp(term, t)) {
+        mtde_seek_te(tde, te);
+    }
+    else {
+        memset(mtde->state, 0, mtde->ir_cnt);
+    }
+}
+
+static int mtde_doc_num(TermDocEnum *tde)
+{
+    CHECK_CURR_TDE("doc_num");
+    return MTDE(tde)->base + MTDE(tde)->curr_tde->doc_num(MTDE(tde)->curr_tde);
+}
+
+static int mtde_freq(TermDocEnum *tde)
+{
+    CHECK_CURR_TDE("freq");
+    return MTDE(tde)->curr_tde->freq(MTDE(tde)->curr_tde);
+}
+
+static bool mtde_next(TermDocEnum *tde)
+{
+    MultiTermDocEnum *mtde = MTDE(tde);
+    if (NULL != mtde->curr_tde && mtde->curr_tde->next(mtde->curr_tde)) {
         return true;
     }
-    return false;
+    else if (mtde_next_tde(mtde)) {
+        return mtde_next(tde);
+    }
+    else {
+        return false;
+    }
 }
 
-/*
- * Returns true if this is a file that would be contained in a CFS file.  This
- * function should only be called on files that pass the above "accept" (ie,
- * are already known to be a Lucene index file).
- */
-static bool file_name_filter_is_cfs_file(const char *file_name) {
-    char *p = strrchr(file_name, '.');
-    if (NULL != p) {
-        char *extension = p + 1;
-        if (NULL != h_get(fn_extensions, extension)
-            && 0 != strcmp(extension, "del")
-            && 0 != strcmp(extension, "gen")
-            && 0 != strcmp(extension, "cfs")) {
-            return true;
+static int mtde_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+{
+    int i, end = 0, last_end = 0, b;
+    MultiTermDocEnum *mtde = MTDE(tde);
+    while (true) {
+        if (NULL == mtde->curr_tde) return end;
+        end += mtde->curr_tde->read(mtde->curr_tde, docs + last_end,
+                                    freqs + last_end, req_num - last_end);
+        if (end == last_end) {              /* none left in segment */
+            if (!mtde_next_tde(mtde)) return end;
         }
-        else if ('f' == *extension
-                 && '0' <= *(extension + 1)
-                 && '9' >= *(extension + 1)) {
+        else {                            /* got some */
+            b = mtde->base;                 /* adjust doc numbers */
+            for (i = last_end; i < end; i++) {
+                docs[i] += b;
+            }
+            if (end == req_num) {
+                return end;
+            }
+            else {
+                last_end = end;
+            }
+        }
+    }
+}
+
+static bool mtde_skip_to(TermDocEnum *tde, int target_doc_num)
+{
+    MultiTermDocEnum *mtde = MTDE(tde);
+    TermDocEnum *curr_tde;
+    while (NULL != (curr_tde = mtde->curr_tde)) {
+        if (target_doc_num < mtde->starts[mtde->ptr + 1] &&
+            (curr_tde->skip_to(curr_tde, target_doc_num - mtde->base))) {
             return true;
         }
+
+        mtde_next_tde(mtde);
     }
     return false;
 }
 
+static int mtde_max_freq(TermDocEnum *tde)
+{
+    MultiTermDocEnum *mtde = MTDE(tde);
+    int i, freq, max_freq = 0;
+    for (i = 0; i < mtde->ir_cnt; i++) {
+        if (mtde->state[i]) {
+            TermDocEnum *sub_tde = mtde->irs_tde[i];
+            freq = sub_tde->max_freq ? sub_tde->max_freq(sub_tde) : INT_MAX;
+            if (freq > max_freq) {
+                max_freq = freq;
+            }
+        }
+    }
+    return max_freq;
+}
+
+static void mtde_close(TermDocEnum *tde)
+{
+    MultiTermDocEnum *mtde = MTDE(tde);
+    TermDocEnum *tmp_tde;
+    int i = mtde->ir_cnt;
+    mtde->te->close(mtde->te);
+    while (i > 0) {
+        i--;
+        tmp_tde = mtde->irs_tde[i];
+        tmp_tde->close(tmp_tde);
+    }
+    free(mtde->irs_tde);
+    free(mtde->state);
+    free(tde);
+}
+
+static TermDocEnum *mtxe_new(MultiReader *mr)
+{
+    MultiTermDocEnum *mtde  = ALLOC_AND_ZERO(MultiTermDocEnum);
+    TermDocEnum *tde        = TDE(mtde);
+    tde->seek               = &mtde_seek;
+    tde->seek_te            = &mtde_seek_te;
+    tde->doc_num            = &mtde_doc_num;
+    tde->freq               = &mtde_freq;
+    tde->next               = &mtde_next;
+    tde->read               = &mtde_read;
+    tde->skip_to            = &mtde_skip_to;
+    tde->close              = &mtde_close;
+    tde->max_freq           = &mtde_max_freq;
+
+    mtde->state             = ALLOC_AND_ZERO_N(char, mr->r_cnt);
+    mtde->te                = ((IndexReader *)mr)->terms((IndexReader *)mr, 0);
+    mtde->starts            = mr->starts;
+    mtde->ir_cnt            = mr->r_cnt;
+    mtde->irs               = mr->sub_readers;
+    mtde->irs_tde           = ALLOC_AND_ZERO_N(TermDocEnum *, mr->r_cnt);
+
+    return tde;
+}
+
+static TermDocEnum *mtde_new(MultiReader *mr)
+{
+    int i;
+    TermDocEnum *tde        = mtxe_new(mr);
+    tde->next_position      = NULL;
+    for (i = mr->r_cnt - 1; i >= 0; i--) {
+        IndexReader *ir = mr->sub_readers[i];
+        MTDE(tde)->irs_tde[i] = ir->term_docs(ir);
+    }
+    return tde;
+}
+
+/****************************************************************************
+ * MultiTermPosEnum
+ ****************************************************************************/
+
+static int mtpe_next_position(TermDocEnum *tde)
+{
+    CHECK_CURR_TDE("next_position");
+    return MTDE(tde)->curr_tde->next_position(MTDE(tde)->curr_tde);
+}
+
+static TermDocEnum *mtpe_new(MultiReader *mr)
+{
+    int i;
+    TermDocEnum *tde        = mtxe_new(mr);
+    tde->next_position      = &mtpe_next_position;
+    for (i = mr->r_cnt - 1; i >= 0; i--) {
+        IndexReader *ir = mr->sub_readers[i];
+        MTDE(tde)->irs_tde[i] = ir->term_positions(ir);
+    }
+    return tde;
+}
+
+/****************************************************************************
+ * MultipleTermDocPosEnum
+ *
+ * This enumerator is used by MultiPhraseQuery
+ ****************************************************************************/
+
+#define MTDPE(tde) ((MultipleTermDocPosEnum *)(tde))
+#define  MTDPE_POS_QUEUE_INIT_CAPA 8
+
+typedef struct
+{
+    TermDocEnum tde;
+    int doc_num;
+    int freq;
+    PriorityQueue *pq;
+    int *pos_queue;
+    int pos_queue_index;
+    int pos_queue_capa;
+    int field_num;
+} MultipleTermDocPosEnum;
+
+static void tde_destroy(TermDocEnum *tde) {
+    tde->close(tde);
+}
+
+static void mtdpe_seek(TermDocEnum *tde, int field_num, const char *term)
+{
+    (void)tde;
+    (void)field_num;
+    (void)term;
+    RAISE(UNSUPPORTED_ERROR, "MultipleTermDocPosEnum does not support "
+          " the #seek operation");
+}
+
+static int mtdpe_doc_num(TermDocEnum *tde)
+{
+    return MTDPE(tde)->doc_num;
+}
+
+static int mtdpe_freq(TermDocEnum *tde)
+{
+    return MTDPE(tde)->freq;
+}
+
+static bool mtdpe_next(TermDocEnum *tde)
+{
+    TermDocEnum *sub_tde;
+    int pos = 0, freq = 0;
+    int doc;
+    MultipleTermDocPosEnum *mtdpe = MTDPE(tde);
+
+    if (0 == mtdpe->pq->size) {
+        return false;
+    }
+
+    sub_tde = (TermDocEnum *)pq_top(mtdpe->pq);
+    doc = sub_tde->doc_num(sub_tde);
+
+    do {
+        freq += sub_tde->freq(sub_tde);
+        if (freq > mtdpe->pos_queue_capa) {
+            do {
+                mtdpe->pos_queue_capa <<= 1;
+            } while (freq > mtdpe->pos_queue_capa);
+            REALLOC_N(mtdpe->pos_queue, int, mtdpe->pos_queue_capa);
+        }
+
+        /* pos starts from where it was up to last time */
+        for (; pos < freq; pos++) {
+            mtdpe->pos_queue[pos] = sub_tde->next_position(sub_tde);
+        }
+
+        if (sub_tde->next(sub_tde)) {
+            pq_down(mtdpe->pq);
+        }
+        else {
+            sub_tde = (TermDocEnum *)pq_pop(mtdpe->pq);
+            sub_tde->close(sub_tde);
+        }
+        sub_tde = (TermDocEnum *)pq_top(mtdpe->pq);
+    } while ((mtdpe->pq->size > 0) && (sub_tde->doc_num(sub_tde) == doc));
+
+    qsort(mtdpe->pos_queue, freq, sizeof(int), &icmp_risky);
+
+    mtdpe->pos_queue_index = 0;
+    mtdpe->freq = freq;
+    mtdpe->doc_num = doc;
+
+    return true;
+}
+
+static bool tdpe_less_than(TermDocEnum *p1, TermDocEnum *p2)
+{
+    return p1->doc_num(p1) < p2->doc_num(p2);
+}
+
+static bool mtdpe_skip_to(TermDocEnum *tde, int target_doc_num)
+{
+    TermDocEnum *sub_tde;
+    PriorityQueue *mtdpe_pq = MTDPE(tde)->pq;
+
+    while (NULL != (sub_tde = (TermDocEnum *)pq_top(mtdpe_pq))
+           && (target_doc_num > sub_tde->doc_num(sub_tde))) {
+        if (sub_tde->skip_to(sub_tde, target_doc_num)) {
+            pq_down(mtdpe_pq);
+        }
+        else {
+            sub_tde = (TermDocEnum *)pq_pop(mtdpe_pq);
+            sub_tde->close(sub_tde);
+        }
+    }
+    return tde->next(tde);
+}
+
+static int mtdpe_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+{
+    (void)tde;
+    (void)docs;
+    (void)freqs;
+    RAISE(UNSUPPORTED_ERROR, "MultipleTermDocPosEnum does not support "
+          " the #read operation");
+    return req_num;
+}
+
+static int mtdpe_next_position(TermDocEnum *tde)
+{
+    return MTDPE(tde)->pos_queue[MTDPE(tde)->pos_queue_index++];
+}
+
+static void mtdpe_close(TermDocEnum *tde)
+{
+    pq_clear(MTDPE(tde)->pq);
+    pq_destroy(MTDPE(tde)->pq);
+    free(MTDPE(tde)->pos_queue);
+    free(tde);
+}
+
+TermDocEnum *mtdpe_new(IndexReader *ir, int field_num, char **terms, int t_cnt)
+{
+    int i;
+    MultipleTermDocPosEnum *mtdpe = ALLOC_AND_ZERO(MultipleTermDocPosEnum);
+    TermDocEnum *tde = TDE(mtdpe);
+    PriorityQueue *pq;
+
+    pq = mtdpe->pq = pq_new(t_cnt, (lt_ft)&tdpe_less_than, (free_ft)&tde_destroy);
+    mtdpe->pos_queue_capa = MTDPE_POS_QUEUE_INIT_CAPA;
+    mtdpe->pos_queue = ALLOC_N(int, MTDPE_POS_QUEUE_INIT_CAPA);
+    mtdpe->field_num = field_num;
+    for (i = 0; i < t_cnt; i++) {
+        TermDocEnum *tpe = ir->term_positions(ir);
+        tpe->seek(tpe, field_num, terms[i]);
+        if (tpe->next(tpe)) {
+            pq_push(pq, tpe);
+        }
+        else {
+            tpe->close(tpe);
+        }
+    }
+    tde->close          = &mtdpe_close;
+    tde->seek           = &mtdpe_seek;
+    tde->next           = &mtdpe_next;
+    tde->doc_num        = &mtdpe_doc_num;
+    tde->freq           = &mtdpe_freq;
+    tde->skip_to        = &mtdpe_skip_to;
+    tde->read           = &mtdpe_read;
+    tde->next_position  = &mtdpe_next_position;
+
+    return tde;
+}
+
+/****************************************************************************
+ *
+ * FileNameFilter
+ *
+ ****************************************************************************/
+
+static Hash *fn_extensions = NULL;
+static void file_name_filter_init()
+{
+    int i;
+    fn_extensions = h_new_str((free_ft)NULL, (free_ft)NULL);
+    for (i = 0; i < NELEMS(INDEX_EXTENSIONS); i++) {
+      h_set(fn_extensions, INDEX_EXTENSIONS[i], (char *)INDEX_EXTENSIONS[i]);
+    }
+    register_for_cleanup(fn_extensions, (free_ft)&h_destroy);
+}
+
+bool file_name_filter_is_index_file(const char *file_name, bool include_locks)
+{
+    char *p = strrchr(file_name, '.');
+    if (NULL == fn_extensions) file_name_filter_init();
+    if (NULL != p) {
+        char *extension = p + 1;
+        if (NULL != h_get(fn_extensions, extension)) {
+            return true;
+        }
+        else if ((*extension == 'f' || *extension == 's')
+                 && *(extension + 1) >= '0'
+                 && *(extension + 1) <= '9') {
+            return true;
+        }
+        else if (include_locks && (strcmp(extension, "lck") == 0)
+                               && (strncmp(file_name, "ferret", 6) == 0)) {
+            return true;
+        }
+    }
+    else if (0 == strncmp(SEGMENTS_FILE_NAME, file_name,
+                          sizeof(SEGMENTS_FILE_NAME) - 1)) {
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Returns true if this is a file that would be contained in a CFS file.  This
+ * function should only be called on files that pass the above "accept" (ie,
+ * are already known to be a Lucene index file).
+ */
+static bool file_name_filter_is_cfs_file(const char *file_name) {
+    char *p = strrchr(file_name, '.');
+    if (NULL != p) {
+        char *extension = p + 1;
+        if (NULL != h_get(fn_extensions, extension)
+            && 0 != strcmp(extension, "del")
+            && 0 != strcmp(extension, "gen")
+            && 0 != strcmp(extension, "cfs")) {
+            return true;
+        }
+        else if ('f' == *extension
+                 && '0' <= *(extension + 1)
+                 && '9' >= *(extension + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/****************************************************************************
+ *
+ * Deleter
+ *
+ ****************************************************************************/
+
+#define DELETABLE_START_CAPA 8
+Deleter *deleter_new(SegmentInfos *sis, Store *store)
+{
+    Deleter *dlr = ALLOC(Deleter);
+    dlr->sis = sis;
+    dlr->store = store;
+    dlr->pending = hs_new_str(&free);
+    return dlr;
+}
+
+void deleter_destroy(Deleter *dlr)
+{
+    hs_destroy(dlr->pending);
+    free(dlr);
+}
+
+static void deleter_queue_file(Deleter *dlr, const char *file_name)
+{
+    hs_add(dlr->pending, estrdup(file_name));
+}
+
+void deleter_delete_file(Deleter *dlr, char *file_name)
+{
+    Store *store = dlr->store;
+    TRY
+        if (store->exists(store, file_name)) {
+            store->remove(store, file_name);
+        }
+        hs_del(dlr->pending, file_name);
+    XCATCHALL
+        hs_add(dlr->pending, estrdup(file_name));
+    XENDTRY
+}
+
+static void deleter_commit_pending_deletions(Deleter *dlr)
+{
+    HashSetEntry *hse, *hse_next = dlr->pending->first;
+    while ((hse = hse_next) != NULL) {
+        hse_next = hse->next;
+        deleter_delete_file(dlr, (char *)hse->elem);
+    }
+}
+
+void deleter_delete_files(Deleter *dlr, char **files, int file_cnt)
+{
+    int i;
+    for (i = file_cnt - 1; i >= 0; i--) {
+        deleter_queue_file(dlr, files[i]);
+    }
+    deleter_commit_pending_deletions(dlr);
+}
+
+struct DelFilesArg {
+    char  curr_seg_file_name[SEGMENT_NAME_MAX_LENGTH];
+    Deleter *dlr;
+    Hash *current;
+};
+
+static void deleter_find_deletable_files_i(const char *file_name, void *arg)
+{
+    struct DelFilesArg *dfa = (struct DelFilesArg *)arg;
+    Deleter *dlr = dfa->dlr;
+
+    if (file_name_filter_is_index_file(file_name, false)
+        && 0 != strcmp(file_name, dfa->curr_seg_file_name)
+        && 0 != strcmp(file_name, SEGMENTS_GEN_FILE_NAME)) {
+
+        bool do_delete = false;
+        SegmentInfo *si;
+        char segment_name[SEGMENT_NAME_MAX_LENGTH];
+        char *extension, *p;
+        strcpy(segment_name, file_name);
+
+        p = strrchr(segment_name, '.');
+
+        /* First remove any extension: */
+        if (NULL != p) {
+            *p = '\0';
+            extension = p + 1;
+        }
+        else {
+            extension = NULL;
+        }
+
+        /* Then, remove any generation count: */
+        p = strrchr(segment_name + 1, '_');
+        if (NULL != p) {
+            *p = '\0';
+        }
+
+        /* Delete this file if it's not a "current" segment, or, it is a
+         * single index file but there is now a corresponding compound file: */
+        if (NULL == (si = (SegmentInfo *)h_get(dfa->current, segment_name))) {
+            /* Delete if segment is not referenced: */
+            do_delete = true;
+        }
+        else {
+            char tmp_fn[SEGMENT_NAME_MAX_LENGTH];
+            /* OK, segment is referenced, but file may still be orphan'd: */
+            if (file_name_filter_is_cfs_file(file_name)
+                && si->use_compound_file) {
+                /* This file is stored in a CFS file for this segment: */
+                do_delete = true;
+            }
+            else if (0 == strcmp("del", extension)) {
+                /* This is a _segmentName_N.del file: */
+                if (!fn_for_generation(tmp_fn, segment_name, "del", si->del_gen)
+                    || 0 != strcmp(file_name, tmp_fn)) {
+                    /* If this is a seperate .del file, but it
+                     * doesn't match the current del file name for
+                     * this segment, then delete it: */
+                    do_delete = true;
+                }
+            }
+            else if (NULL != extension
+                     && ('s' == *extension || 'f' == *extension)
+                     && isdigit(extension[1])) {
+                si_norm_file_name(si, tmp_fn, atoi(extension + 1));
+                /* This is a _segmentName_N.sX file: */
+                if (0 != strcmp(tmp_fn, file_name)) {
+                    /* This is an orphan'd norms file: */
+                    do_delete = true;
+                }
+            }
+            else if (0 == strcmp("cfs", extension) && !si->use_compound_file) {
+                /* This is a partially written _segmentName.cfs: */
+                do_delete = true;
+            }
+        }
+
+        if (do_delete) {
+            deleter_queue_file(dlr, file_name);
+        }
+    }
+}
+
+/*
+ * Determine index files that are no longer referenced and therefore should be
+ * deleted.  This is called once (by the writer), and then subsequently we add
+ * onto deletable any files that are no longer needed at the point that we
+ * create the unused file (eg when merging segments), and we only remove from
+ * deletable when a file is successfully deleted.
+ */
+void deleter_find_deletable_files(Deleter *dlr)
+{
+    /* Gather all "current" segments: */
+    int i;
+    SegmentInfos *sis = dlr->sis;
+    Store *store = dlr->store;
+    struct DelFilesArg dfa;
+    Hash *current = dfa.current
+                       = h_new_str((free_ft)NULL, (free_ft)si_deref);
+    dfa.dlr = dlr;
+
+    for(i = 0; i < sis->size; i++) {
+        SegmentInfo *si = (SegmentInfo *)sis->segs[i];
+        REF(si);
+        h_set(current, si->name, si);
+    }
+
+    /* Then go through all files in the Directory that are Ferret index files,
+     * and add to deletable if they are not referenced by the current segments
+     * info: */
+    sis_curr_seg_file_name(dfa.curr_seg_file_name, store);
+
+    store->each(store, &deleter_find_deletable_files_i, &dfa);
+    h_destroy(dfa.current);
+}
+
+static void deleter_delete_deletable_files(Deleter *dlr)
+{
+    deleter_find_deletable_files(dlr);
+    deleter_commit_pending_deletions(dlr);
+}
+
+/*
+TODO: currently not used. Why not?
+static void deleter_clear_pending_deletions(Deleter *dlr)
+{
+    hs_clear(dlr->pending);
+}
+*/
+
+/****************************************************************************
+ *
+ * IndexReader
+ *
+ ****************************************************************************/
+
+static void ir_acquire_not_necessary(IndexReader *ir)
+{
+    (void)ir;
+}
+
+#define I64_PFX POSH_I64_PRINTF_PREFIX
+static void ir_acquire_write_lock(IndexReader *ir)
+{
+    if (ir->is_stale) {
+        RAISE(STATE_ERROR, "IndexReader out of date and no longer valid for "
+                           "delete, undelete, or set_norm operations. To "
+                           "perform any of these operations on the index you "
+                           "need to close and reopen the index");
+    }
+
+    if (NULL == ir->write_lock) {
+        ir->write_lock = open_lock(ir->store, WRITE_LOCK_NAME);
+        if (!ir->write_lock->obtain(ir->write_lock)) {/* obtain write lock */
+            RAISE(LOCK_ERROR, "Could not obtain write lock when trying to "
+                              "write changes to the index. Check that there "
+                              "are no stale locks in the index. Look for "
+                              "files with the \".lck\" prefix. If you know "
+                              "there are no processes writing to the index "
+                              "you can safely delete these files.");
+        }
+
+        /* we have to check whether index has changed since this reader was
+         * opened.  if so, this reader is no longer valid for deletion */
+        if (sis_read_current_version(ir->store) > ir->sis->version) {
+            ir->is_stale = true;
+            ir->write_lock->release(ir->write_lock);
+            close_lock(ir->write_lock);
+            ir->write_lock = NULL;
+            RAISE(STATE_ERROR, "IndexReader out of date and no longer valid "
+                               "for delete, undelete, or set_norm operations. "
+                               "The current version is <%"I64_PFX"d>, but this "
+                               "readers version is <%"I64_PFX"d>. To perform "
+                               "any of these operations on the index you need "
+                               "to close and reopen the index",
+                               sis_read_current_version(ir->store),
+                               ir->sis->version);
+        }
+    }
+}
+
+static IndexReader *ir_setup(IndexReader *ir, Store *store, SegmentInfos *sis,
+                      FieldInfos *fis, int is_owner)
+{
+    mutex_init(&ir->mutex, NULL);
+    mutex_init(&ir->field_index_mutex, NULL);
+
+    if (store) {
+        ir->store = store;
+        REF(store);
+    }
+    ir->sis = sis;
+    ir->fis = fis;
+    ir->ref_cnt = 1;
+
+    ir->is_owner = is_owner;
+    if (is_owner) {
+        ir->acquire_write_lock = &ir_acquire_write_lock;
+    }
+    else {
+        ir->acquire_write_lock = &ir_acquire_not_necessary;
+    }
+
+    return ir;
+}
+
+bool ir_index_exists(Store *store)
+{
+    return sis_current_segment_generation(store) != 1;
+}
+
+int ir_get_field_num(IndexReader *ir, Symbol field)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num < 0) {
+        RAISE(ARG_ERROR,
+              "Field :%s does not exist in this index", (char *)field);
+    }
+    return field_num;
+}
+
+int ir_doc_freq(IndexReader *ir, Symbol field, const char *term)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num >= 0) {
+        return ir->doc_freq(ir, field_num, term);
+    }
+    else {
+        return 0;
+    }
+}
+
+static void ir_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar val)
+{
+    mutex_lock(&ir->mutex);
+    ir->acquire_write_lock(ir);
+    ir->set_norm_i(ir, doc_num, field_num, val);
+    ir->has_changes = true;
+    if (NULL != ir->used_norms) {
+        u32 *used = (u32 *)h_get_int(ir->used_norms, field_num);
+        if (NULL != used) {
+            used[val >> 5] |= 1U << (val & 31);
+        }
+    }
+    mutex_unlock(&ir->mutex);
+}
+
+void ir_set_norm(IndexReader *ir, int doc_num, Symbol field, uchar val)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num >= 0) {
+        ir_set_norm_i(ir, doc_num, field_num, val);
+    }
+}
+
+uchar *ir_get_norms_i(IndexReader *ir, int field_num)
+{
+    uchar *norms = NULL;
+    if (field_num >= 0) {
+        norms = ir->get_norms(ir, field_num);
+    }
+    if (!norms) {
+        if (NULL == ir->fake_norms) {
+            ir->fake_norms = ALLOC_AND_ZERO_N(uchar, ir->max_doc(ir));
+        }
+        norms = ir->fake_norms;
+    }
+    return norms;
+}
+
+uchar *ir_get_norms(IndexReader *ir, Symbol field)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    return ir_get_norms_i(ir, field_num);
+}
+
+/*
+ * The norm bytes used by each field are cached as a 256 bit set, so that the
+ * maximum norm can be found for any Similarity without scanning the norms
+ * again.
+ */
+float ir_get_max_norm(IndexReader *ir, Symbol field, Similarity *sim)
+{
+    int i, field_num = fis_get_field_num(ir->fis, field);
+    float norm, max_norm = 0.0f;
+    u32 *used;
+
+    if (field_num < 0) {
+        return sim_decode_norm(sim, 0);
+    }
+    else {
+        const uchar *norms = ir_get_norms_i(ir, field_num);
+        mutex_lock(&ir->mutex);
+        if (NULL == ir->used_norms) {
+            ir->used_norms = h_new_int(&free);
+        }
+        used = (u32 *)h_get_int(ir->used_norms, field_num);
+        if (NULL == used) {
+            const int max_doc = ir->max_doc(ir);
+            used = ALLOC_AND_ZERO_N(u32, 8);
+            for (i = 0; i < max_doc; i++) {
+                used[norms[i] >> 5] |= 1U << (norms[i] & 31);
+            }
+            h_set_int(ir->used_norms, field_num, used);
+        }
+        for (i = 0; i < 256; i++) {
+            if (used[i >> 5] & (1U << (i & 31))
+                && (norm = sim_decode_norm(sim, (uchar)i)) > max_norm) {
+                max_norm = norm;
+            }
+        }
+        mutex_unlock(&ir->mutex);
+    }
+    return max_norm;
+}
+
+uchar *ir_get_norms_into(IndexReader *ir, Symbol field, uchar *buf)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num >= 0) {
+        ir->get_norms_into(ir, field_num, buf);
+    }
+    else {
+        memset(buf, 0, ir->max_doc(ir));
+    }
+    return buf;
+}
+
+void ir_undelete_all(IndexReader *ir)
+{
+    mutex_lock(&ir->mutex);
+    ir->acquire_write_lock(ir);
+    ir->undelete_all_i(ir);
+    ir->has_changes = true;
+    mutex_unlock(&ir->mutex);
+}
+
+void ir_delete_doc(IndexReader *ir, int doc_num)
+{
+    if (doc_num >= 0 && doc_num < ir->max_doc(ir)) {
+        mutex_lock(&ir->mutex);
+        ir->acquire_write_lock(ir);
+        ir->delete_doc_i(ir, doc_num);
+        ir->has_changes = true;
+        mutex_unlock(&ir->mutex);
+    }
+}
+
+Document *ir_get_doc_with_term(IndexReader *ir, Symbol field,
+                               const char *term)
+{
+    TermDocEnum *tde = ir_term_docs_for(ir, field, term);
+    Document *doc = NULL;
+
+    if (tde) {
+        if (tde->next(tde)) {
+            doc = ir->get_doc(ir, tde->doc_num(tde));
+        }
+        tde->close(tde);
+    }
+    return doc;
+}
+
+TermEnum *ir_terms(IndexReader *ir, Symbol field)
+{
+    TermEnum *te = NULL;
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num >= 0) {
+        te = ir->terms(ir, field_num);
+    }
+    return te;
+}
+
+TermEnum *ir_terms_from(IndexReader *ir, Symbol field,
+                           const char *term)
+{
+    TermEnum *te = NULL;
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num >= 0) {
+        te = ir->terms_from(ir, field_num, term);
+    }
+    return te;
+}
+
+TermDocEnum *ir_term_docs_for(IndexReader *ir, Symbol field,
+                              const char *term)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    TermDocEnum *tde = ir->term_docs(ir);
+    if (field_num >= 0) {
+        tde->seek(tde, field_num, term);
+    }
+    return tde;
+}
+
+TermDocEnum *ir_term_positions_for(IndexReader *ir, Symbol field,
+                                   const char *term)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    TermDocEnum *tde = ir->term_positions(ir);
+    if (field_num >= 0) {
+        tde->seek(tde, field_num, term);
+    }
+    return tde;
+}
+
+static void ir_commit_i(IndexReader *ir)
+{
+    if (ir->has_changes) {
+        if (NULL == ir->deleter && NULL != ir->store) {
+            /* In the MultiReader case, we share this deleter across all
+             * SegmentReaders: */
+            ir->set_deleter_i(ir, deleter_new(ir->sis, ir->store));
+        }
+        if (ir->is_owner) {
+            char curr_seg_fn[MAX_FILE_PATH];
+            mutex_lock(&ir->store->mutex);
+
+            sis_curr_seg_file_name(curr_seg_fn, ir->store);
+
+            ir->commit_i(ir);
+            sis_write(ir->sis, ir->store, ir->deleter);
+
+            if (ir->deleter) deleter_delete_file(ir->deleter, curr_seg_fn);
+
+            mutex_unlock(&ir->store->mutex);
+
+            if (NULL != ir->write_lock) {
+                /* release write lock */
+                ir->write_lock->release(ir->write_lock);
+                close_lock(ir->write_lock);
+                ir->write_lock = NULL;
+            }
+        }
+        else {
+            ir->commit_i(ir);
+        }
+    }
+    ir->has_changes = false;
+}
+
+void ir_commit(IndexReader *ir)
+{
+    mutex_lock(&ir->mutex);
+    ir_commit_i(ir);
+    mutex_unlock(&ir->mutex);
+}
+
+void ir_close(IndexReader *ir)
+{
+    mutex_lock(&ir->mutex);
+    if (0 == --(ir->ref_cnt)) {
+        ir_commit_i(ir);
+        ir->close_i(ir);
+        if (ir->store) {
+            store_deref(ir->store);
+        }
+        if (ir->is_owner && ir->sis) {
+            sis_destroy(ir->sis);
+        }
+        if (ir->cache) {
+            h_destroy(ir->cache);
+        }
+        if (ir->field_index_cache) {
+            h_destroy(ir->field_index_cache);
+        }
+        if (ir->used_norms) {
+            h_destroy(ir->used_norms);
+        }
+        if (ir->deleter && ir->is_owner) {
+            deleter_destroy(ir->deleter);
+        }
+        free(ir->fake_norms);
+
+        mutex_destroy(&ir->mutex);
+        mutex_destroy(&ir->field_index_mutex);
+        free(ir);
+    }
+    else {
+        mutex_unlock(&ir->mutex);
+    }
+
+}
+
+/**
+ * Don't call this method if the cache already exists
+ **/
+void ir_add_cache(IndexReader *ir)
+{
+    if (NULL == ir->cache) {
+        ir->cache = co_hash_create();
+    }
+}
+
+bool ir_is_latest(IndexReader *ir)
+{
+    return ir->is_latest_i(ir);
+}
+
+/****************************************************************************
+ * Norm
+ ****************************************************************************/
+
+typedef struct Norm {
+    int field_num;
+    InStream *is;
+    uchar *bytes;
+    int ref_cnt;
+    bool is_dirty : 1;
+} Norm;
+
+/* Guards the reference counts of everything SegmentReaders opened by
+ * ir_reopen share with each other; SegmentCores, Norms and deleted docs. */
+static mutex_t sr_share_mutex = MUTEX_INITIALIZER;
+
+static Norm *norm_create(InStream *is, int field_num)
+{
+    Norm *norm = ALLOC(Norm);
+
+    norm->is = is;
+    norm->field_num = field_num;
+    norm->bytes = NULL;
+    norm->ref_cnt = 1;
+    norm->is_dirty = false;
+
+    return norm;
+}
+
+static void norm_destroy(Norm *norm)
+{
+    bool destroy;
+    mutex_lock(&sr_share_mutex);
+    destroy = (0 == --(norm->ref_cnt));
+    mutex_unlock(&sr_share_mutex);
+    if (destroy) {
+        is_close(norm->is);
+        if (NULL != norm->bytes) {
+            free(norm->bytes);
+        }
+        free(norm);
+    }
+}
+
+static void norm_rewrite(Norm *norm, Store *store, Deleter *dlr,
+                         SegmentInfo *si, int doc_count)
+{
+    OutStream *os;
+    char norm_file_name[SEGMENT_NAME_MAX_LENGTH];
+    const int field_num = norm->field_num;
+
+    if (si_norm_file_name(si, norm_file_name, field_num)) {
+        deleter_queue_file(dlr, norm_file_name);
+    }
+    si_advance_norm_gen(si, field_num);
+    si_norm_file_name(si, norm_file_name, field_num);
+    os = store->new_output(store, norm_file_name);
+    os_write_bytes(os, norm->bytes, doc_count);
+    os_close(os);
+    norm->is_dirty = false;
+}
+
+/****************************************************************************
+ * SegmentReader
+ ****************************************************************************/
+
+/*
+ * The parts of a SegmentReader which never change once the segment has been
+ * written. They are shared by every SegmentReader ir_reopen opens on the
+ * segment, so the core holds its own reference to the FieldInfos the
+ * FieldsReader was opened with.
+ */
+typedef struct SegmentCore {
+    FieldInfos *fis;
+    Store *cfs_store;
+    FieldsReader *fr;
+    SegmentFieldIndex *sfi;
+    TermInfosReader *tir;
+    InStream *frq_in;
+    InStream *prx_in;
+    DocValuesReader *dvr;
+    int ref_cnt;
+} SegmentCore;
+
+typedef struct SegmentReader {
+    IndexReader ir;
+    SegmentInfo *si;
+    char *segment;
+    SegmentCore *core;
+    FieldsReader *fr;
+    BitVector *deleted_docs;
+    thread_key_t thread_fr;
+    void **fr_bucket;
+    Hash *norms;
+    bool deleted_docs_dirty : 1;
+    bool undelete_all : 1;
+    bool norms_dirty : 1;
+} SegmentReader;
+
+#define IR(ir) ((IndexReader *)(ir))
+
+#define SR(ir) ((SegmentReader *)(ir))
+#define SR_SIZE(ir) (SR(ir)->core->fr->size)
+
+static INLINE FieldsReader *sr_fr(SegmentReader *sr)
+{
+    FieldsReader *fr;
+
+    if (NULL == (fr = (FieldsReader *)thread_getspecific(sr->thread_fr))) {
+        fr = fr_clone(sr->core->fr);
+        ary_push(sr->fr_bucket, fr);
+        thread_setspecific(sr->thread_fr, fr);
+    }
+    return fr;
+}
+
+static INLINE bool sr_is_deleted_i(SegmentReader *sr, int doc_num)
+{
+    return (NULL != sr->deleted_docs && bv_get(sr->deleted_docs, doc_num));
+}
+
+static INLINE void sr_get_norms_into_i(SegmentReader *sr, int field_num,
+                                       uchar *buf)
+{
+    Norm *norm = (Norm *)h_get_int(sr->norms, field_num);
+    if (NULL == norm) {
+        memset(buf, 0, SR_SIZE(sr));
+    }
+    else if (NULL != norm->bytes) { /* can copy from cache */
+        memcpy(buf, norm->bytes, SR_SIZE(sr));
+    }
+    else {
+        InStream *norm_in = is_clone(norm->is);
+        /* read from disk */
+        is_seek(norm_in, 0);
+        is_read_bytes(norm_in, buf, SR_SIZE(sr));
+        is_close(norm_in);
+    }
+}
+
+static INLINE uchar *sr_get_norms_i(SegmentReader *sr, int field_num)
+{
+    Norm *norm = (Norm *)h_get_int(sr->norms, field_num);
+    if (NULL == norm) {                           /* not an indexed field */
+        return NULL;
+    }
+
+    if (NULL == norm->bytes) {                    /* value not yet read */
+        uchar *bytes = ALLOC_N(uchar, SR_SIZE(sr));
+        sr_get_norms_into_i(sr, field_num, bytes);
+        norm->bytes = bytes;                        /* cache it */
+    }
+    return norm->bytes;
+}
+
+static void sr_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar b)
+{
+    Norm *norm = (Norm *)h_get_int(SR(ir)->norms, field_num);
+    if (NULL != norm) { /* has_norms */
+        bool is_shared;
+        mutex_lock(&sr_share_mutex);
+        is_shared = norm->ref_cnt > 1;
+        mutex_unlock(&sr_share_mutex);
+        if (is_shared) { /* copy on write. Shared norms are always loaded */
+            Norm *copy = norm_create(is_clone(norm->is), field_num);
+            copy->bytes = ALLOC_N(uchar, SR_SIZE(ir));
+            memcpy(copy->bytes, norm->bytes, SR_SIZE(ir));
+            h_set_int(SR(ir)->norms, field_num, copy);
+            norm = copy;
+        }
+        ir->has_changes = true;
+        norm->is_dirty = true; /* mark it dirty */
+        SR(ir)->norms_dirty = true;
+        sr_get_norms_i(SR(ir), field_num)[doc_num] = b;
+    }
+}
+
+/* Drop this reader's reference to its deleted docs, which may be shared */
+static void sr_release_deleted_docs(SegmentReader *sr)
+{
+    if (NULL != sr->deleted_docs) {
+        mutex_lock(&sr_share_mutex);
+        bv_destroy(sr->deleted_docs);
+        mutex_unlock(&sr_share_mutex);
+        sr->deleted_docs = NULL;
+    }
+}
+
+static void sr_delete_doc_i(IndexReader *ir, int doc_num)
+{
+    BitVector *deleted_docs = SR(ir)->deleted_docs;
+    bool is_shared = false;
+    if (NULL != deleted_docs) {
+        mutex_lock(&sr_share_mutex);
+        is_shared = deleted_docs->ref_cnt > 1;
+        mutex_unlock(&sr_share_mutex);
+    }
+    if (NULL == deleted_docs) {
+        SR(ir)->deleted_docs = bv_new();
+    }
+    else if (is_shared) { /* copy on write */
+        BitVector *copy = bv_new_capa(deleted_docs->size);
+        memcpy(copy->bits, deleted_docs->bits,
+               TO_WORD(deleted_docs->size) * sizeof(u32));
+        copy->size = deleted_docs->size;
+        copy->count = deleted_docs->count;
+        sr_release_deleted_docs(SR(ir));
+        SR(ir)->deleted_docs = copy;
+    }
+
+    SR(ir)->deleted_docs_dirty = true;
+    SR(ir)->undelete_all = false;
+    ir->has_changes = true;
+    bv_set(SR(ir)->deleted_docs, doc_num);
+}
+
+static void sr_undelete_all_i(IndexReader *ir)
+{
+    SR(ir)->undelete_all = true;
+    SR(ir)->deleted_docs_dirty = false;
+    ir->has_changes = true;
+    sr_release_deleted_docs(SR(ir));
+}
+
+static void sr_set_deleter_i(IndexReader *ir, Deleter *deleter)
+{
+  ir->deleter = deleter;
+}
+
+static void bv_write(BitVector *bv, Store *store, char *name)
+{
+    int i;
+    OutStream *os = store->new_output(store, name);
+    os_write_vint(os, bv->size);
+    for (i = ((bv->size-1) >> 5); i >= 0; i--) {
+        os_write_u32(os, bv->bits[i]);
+    }
+    os_close(os);
+}
+
+static BitVector *bv_read(Store *store, char *name)
+{
+    int i;
+    bool success = false;
+    InStream *volatile is = store->open_input(store, name);
+    BitVector *volatile bv = ALLOC_AND_ZERO(BitVector);
+    bv->size = (int)is_read_vint(is);
+    bv->capa = (bv->size >> 5) + 1;
+    bv->bits = ALLOC_AND_ZERO_N(u32, bv->capa);
+    bv->ref_cnt = 1;
+    TRY
+        for (i = ((bv->size-1) >> 5); i >= 0; i--) {
+            bv->bits[i] = is_read_u32(is);
+        }
+        bv_recount(bv);
+        success = true;
+    XFINALLY
+        is_close(is);
+        if (!success && bv) bv_destroy(bv);
+    XENDTRY
+    return bv;
+}
+
+static bool sr_is_latest_i(IndexReader *ir)
+{
+    return (sis_read_current_version(ir->store) == ir->sis->version);
+}
+
+static void sr_commit_i(IndexReader *ir)
+{
+    SegmentInfo *si = SR(ir)->si;
+    char *segment = SR(ir)->si->name;
+    char tmp_file_name[SEGMENT_NAME_MAX_LENGTH];
+
+    if (SR(ir)->undelete_all || SR(ir)->deleted_docs_dirty) {
+        if (si->del_gen >= 0) {
+            fn_for_generation(tmp_file_name, segment, "del", si->del_gen);
+            deleter_queue_file(ir->deleter, tmp_file_name);
+        }
+        if (SR(ir)->undelete_all) {
+            si->del_gen = -1;
+            SR(ir)->undelete_all = false;
+        }
+        else {
+            /* (SR(ir)->deleted_docs_dirty) re-write deleted */
+            si->del_gen++;
+            fn_for_generation(tmp_file_name, segment, "del", si->del_gen);
+            bv_write(SR(ir)->deleted_docs, ir->store, tmp_file_name);
+            SR(ir)->deleted_docs_dirty = false;
+        }
+    }
+    if (SR(ir)->norms_dirty) { /* re-write norms */
+        int i;
+        const int field_cnt = ir->fis->size;
+        FieldInfo *fi;
+        for (i = field_cnt - 1; i >= 0; i--) {
+            fi = ir->fis->fields[i];
+            if (fi_is_indexed(fi)) {
+                Norm *norm = (Norm *)h_get_int(SR(ir)->norms, fi->number);
+                if (norm && norm->is_dirty) {
+                    norm_rewrite(norm, ir->store, ir->deleter, SR(ir)->si,
+                                 SR_SIZE(ir));
+                }
+            }
+        }
+        SR(ir)->norms_dirty = false;
+    }
+}
+
+static void sr_core_deref(SegmentCore *core)
+{
+    bool destroy;
+    mutex_lock(&sr_share_mutex);
+    destroy = (0 == --(core->ref_cnt));
+    mutex_unlock(&sr_share_mutex);
+    if (destroy) {
+        if (core->fr)        fr_close(core->fr);
+        if (core->tir)       tir_close(core->tir);
+        if (core->sfi)       sfi_close(core->sfi);
+        if (core->frq_in)    is_close(core->frq_in);
+        if (core->prx_in)    is_close(core->prx_in);
+        if (core->dvr)       dvr_close(core->dvr);
+        if (core->cfs_store) store_deref(core->cfs_store);
+        if (core->fis)       fis_deref(core->fis);
+        free(core);
+    }
+}
+
+static void sr_close_i(IndexReader *ir)
+{
+    SegmentReader *sr = SR(ir);
+
+    if (sr->norms)        h_destroy(sr->norms);
+    sr_release_deleted_docs(sr);
+    if (sr->fr)           fr_close(sr->fr);
+    if (sr->core)         sr_core_deref(sr->core);
+    if (sr->fr_bucket) {
+        thread_setspecific(sr->thread_fr, NULL);
+        thread_key_delete(sr->thread_fr);
+        ary_destroy(sr->fr_bucket, (free_ft)&fr_close);
+    }
+}
+
+static int sr_num_docs(IndexReader *ir)
+{
+    int num_docs;
+
+    mutex_lock(&ir->mutex);
+    num_docs = SR(ir)->core->fr->size;
+    if (NULL != SR(ir)->deleted_docs) {
+        num_docs -= SR(ir)->deleted_docs->count;
+    }
+    mutex_unlock(&ir->mutex);
+    return num_docs;
+}
+
+static int sr_max_doc(IndexReader *ir)
+{
+    return SR(ir)->core->fr->size;
+}
+
+static Document *sr_get_doc(IndexReader *ir, int doc_num)
+{
+    Document *doc;
+    mutex_lock(&ir->mutex);
+    if (sr_is_deleted_i(SR(ir), doc_num)) {
+        mutex_unlock(&ir->mutex);
+        RAISE(STATE_ERROR, "Document %d has already been deleted", doc_num);
+    }
+    doc = fr_get_doc(SR(ir)->fr, doc_num);
+    mutex_unlock(&ir->mutex);
+    return doc;
+}
+
+static LazyDoc *sr_get_lazy_doc(IndexReader *ir, int doc_num)
+{
+    LazyDoc *lazy_doc;
+    mutex_lock(&ir->mutex);
+    if (sr_is_deleted_i(SR(ir), doc_num)) {
+        mutex_unlock(&ir->mutex);
+        RAISE(STATE_ERROR, "Document %d has already been deleted", doc_num);
+    }
+    lazy_doc = fr_get_lazy_doc(SR(ir)->fr, doc_num);
+    mutex_unlock(&ir->mutex);
+    return lazy_doc;
+}
+
+static uchar *sr_get_norms(IndexReader *ir, int field_num)
+{
+    uchar *norms;
+    mutex_lock(&ir->mutex);
+    norms = sr_get_norms_i(SR(ir), field_num);
+    mutex_unlock(&ir->mutex);
+    return norms;
+}
+
+static uchar *sr_get_norms_into(IndexReader *ir, int field_num,
+                              uchar *buf)
+{
+    mutex_lock(&ir->mutex);
+    sr_get_norms_into_i(SR(ir), field_num, buf);
+    mutex_unlock(&ir->mutex);
+    return buf;
+}
+
+static TermEnum *sr_terms(IndexReader *ir, int field_num)
+{
+    TermEnum *te = SR(ir)->core->tir->orig_te;
+    te = ste_clone(te);
+    return ste_set_field(te, field_num);
+}
+
+static TermEnum *sr_terms_from(IndexReader *ir, int field_num, const char *term)
+{
+    TermEnum *te = SR(ir)->core->tir->orig_te;
+    te = ste_clone(te);
+    ste_set_field(te, field_num);
+    ste_scan_to(te, term);
+    return te;
+}
+
+static int sr_doc_freq(IndexReader *ir, int field_num, const char *term)
+{
+    TermInfo *ti = tir_get_ti(tir_set_field(SR(ir)->core->tir, field_num), term);
+    return ti ? ti->doc_freq : 0;
+}
+
+static TermDocEnum *sr_term_docs(IndexReader *ir)
+{
+    return stde_new(SR(ir)->core->tir, SR(ir)->core->frq_in, SR(ir)->deleted_docs,
+                    STE(SR(ir)->core->tir->orig_te)->skip_interval, SR(ir)->si);
+}
+
+static TermDocEnum *sr_term_positions(IndexReader *ir)
+{
+    SegmentReader *sr = SR(ir);
+    return stpe_new(sr->core->tir, sr->core->frq_in, sr->core->prx_in, sr->deleted_docs,
+                    STE(sr->core->tir->orig_te)->skip_interval, sr->si);
+}
+
+static TermVector *sr_term_vector(IndexReader *ir, int doc_num,
+                                  Symbol field)
+{
+    FieldInfo *fi = (FieldInfo *)h_get(ir->fis->field_dict, field);
+    FieldsReader *fr;
+
+    if (!fi || !fi_store_term_vector(fi) || !SR(ir)->core->fr ||
+        !(fr = sr_fr(SR(ir)))) {
+        return NULL;
+    }
+
+    return fr_get_field_tv(fr, doc_num, fi->number);
+}
+
+static Hash *sr_term_vectors(IndexReader *ir, int doc_num)
+{
+    FieldsReader *fr;
+    if (!SR(ir)->core->fr || NULL == (fr = sr_fr(SR(ir)))) {
+        return NULL;
+    }
+
+    return fr_get_tv(fr, doc_num);
+}
+
+static bool sr_is_deleted(IndexReader *ir, int doc_num)
+{
+    bool is_del;
+
+    mutex_lock(&ir->mutex);
+    is_del = sr_is_deleted_i(SR(ir), doc_num);
+    mutex_unlock(&ir->mutex);
+
+    return is_del;
+}
+
+static bool sr_has_deletions(IndexReader *ir)
+{
+    return NULL != SR(ir)->deleted_docs;
+}
+
+/*
+ * Returns +prev+'s norms for field +field_num+ if they are still current in
+ * segment +si+, or NULL if they have to be read again. Loaded norms are
+ * shared, otherwise only the open norms file is reused.
+ */
+static Norm *sr_reuse_norm(SegmentReader *prev, SegmentInfo *si,
+                           int field_num)
+{
+    Norm *norm = (Norm *)h_get_int(prev->norms, field_num);
+    if (NULL == norm || norm->is_dirty
+        || field_num >= prev->si->norm_gens_size
+        || prev->si->norm_gens[field_num] != si->norm_gens[field_num]) {
+        return NULL;
+    }
+    if (NULL != norm->bytes) {
+        mutex_lock(&sr_share_mutex);
+        norm->ref_cnt++;
+        mutex_unlock(&sr_share_mutex);
+        return norm;
+    }
+    return norm_create(is_clone(norm->is), field_num);
+}
+
+static void sr_open_norms(IndexReader *ir, Store *cfs_store,
+                          SegmentReader *prev)
+{
+    int i;
+    SegmentInfo *si = SR(ir)->si;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+
+    for (i = si->norm_gens_size - 1; i >= 0; i--) {
+        Store *store = (si->use_compound_file && si->norm_gens[i] == 0) ?
+            cfs_store : ir->store;
+        if (si_norm_file_name(si, file_name, i)) {
+            Norm *norm = prev ? sr_reuse_norm(prev, si, i) : NULL;
+            if (NULL == norm) {
+                norm = norm_create(store->open_input(store, file_name), i);
+            }
+            h_set_int(SR(ir)->norms, i, norm);
+        }
+    }
+    SR(ir)->norms_dirty = false;
+}
+
+/*
+ * Opens the files of +sr+'s segment, or shares them with +prev+, an open
+ * reader on the same segment, if there is one.
+ */
+static Store *sr_open_core(SegmentReader *sr, SegmentReader *prev)
+{
+    Store *store = sr->si->store;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    char *sr_segment = sr->si->name;
+    SegmentCore *core;
+
+    if (prev) {
+        core = sr->core = prev->core;
+        mutex_lock(&sr_share_mutex);
+        core->ref_cnt++;
+        mutex_unlock(&sr_share_mutex);
+        return core->cfs_store ? core->cfs_store : store;
+    }
+
+    core = sr->core = ALLOC_AND_ZERO(SegmentCore);
+    core->ref_cnt = 1;
+    core->fis = IR(sr)->fis;
+    REF(core->fis);
+    if (sr->si->use_compound_file) {
+        sprintf(file_name, "%s.cfs", sr_segment);
+        core->cfs_store = open_cmpd_store(store, file_name);
+        store = core->cfs_store;
+    }
+
+    core->fr = fr_open(store, sr_segment, core->fis);
+    core->sfi = sfi_open(store, sr_segment);
+    core->tir = tir_open(store, core->sfi, sr_segment);
+
+    sprintf(file_name, "%s.frq", sr_segment);
+    core->frq_in = store->open_input(store, file_name);
+    sprintf(file_name, "%s.prx", sr_segment);
+    core->prx_in = store->open_input(store, file_name);
+    core->dvr = dvr_open(store, sr_segment);
+    return store;
+}
+
+static IndexReader *sr_setup_i(SegmentReader *sr, SegmentReader *prev)
+{
+    Store *store;
+    IndexReader *ir = IR(sr);
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    char *sr_segment = sr->si->name;
+
+    ir->num_docs            = &sr_num_docs;
+    ir->max_doc             = &sr_max_doc;
+    ir->get_doc             = &sr_get_doc;
+    ir->get_lazy_doc        = &sr_get_lazy_doc;
+    ir->get_norms           = &sr_get_norms;
+    ir->get_norms_into      = &sr_get_norms_into;
+    ir->terms               = &sr_terms;
+    ir->terms_from          = &sr_terms_from;
+    ir->doc_freq            = &sr_doc_freq;
+    ir->term_docs           = &sr_term_docs;
+    ir->term_positions      = &sr_term_positions;
+    ir->term_vector         = &sr_term_vector;
+    ir->term_vectors        = &sr_term_vectors;
+    ir->is_deleted          = &sr_is_deleted;
+    ir->has_deletions       = &sr_has_deletions;
+
+    ir->set_norm_i          = &sr_set_norm_i;
+    ir->delete_doc_i        = &sr_delete_doc_i;
+    ir->undelete_all_i      = &sr_undelete_all_i;
+    ir->set_deleter_i       = &sr_set_deleter_i;
+    ir->is_latest_i         = &sr_is_latest_i;
+    ir->commit_i            = &sr_commit_i;
+    ir->close_i             = &sr_close_i;
+
+    TRY
+        store = sr_open_core(sr, prev);
+        /* the core's FieldsReader is shared with the readers ir_reopen
+         * opens on the segment so each reader seeks its own clone */
+        sr->fr = fr_clone(sr->core->fr);
+
+        sr->deleted_docs = NULL;
+        sr->deleted_docs_dirty = false;
+        sr->undelete_all = false;
+        if (prev && prev->si->del_gen == sr->si->del_gen
+            && !prev->deleted_docs_dirty && !prev->undelete_all) {
+            if ((sr->deleted_docs = prev->deleted_docs) != NULL) {
+                mutex_lock(&sr_share_mutex);
+                REF(sr->deleted_docs);
+                mutex_unlock(&sr_share_mutex);
+            }
+        }
+        else if (si_has_deletions(sr->si)) {
+            fn_for_generation(file_name, sr_segment, "del", sr->si->del_gen);
+            sr->deleted_docs = bv_read(sr->si->store, file_name);
+        }
+
+        sr->norms = h_new_int((free_ft)&norm_destroy);
+        sr_open_norms(ir, store, prev);
+        if (fis_has_vectors(ir->fis)) {
+            thread_key_create(&sr->thread_fr, NULL);
+            sr->fr_bucket = ary_new();
+        }
+    XCATCHALL
+        ir->sis = NULL;
+        ir_close(ir);
+    XENDTRY
+
+    return ir;
+}
+
+static IndexReader *sr_open(SegmentInfos *sis, FieldInfos *fis, int si_num,
+                            bool is_owner)
+{
+    SegmentReader *sr = ALLOC_AND_ZERO(SegmentReader);
+    sr->si = sis->segs[si_num];
+    ir_setup(IR(sr), sr->si->store, sis, fis, is_owner);
+    return sr_setup_i(sr, NULL);
+}
+
+/*
+ * Like sr_open but shares whatever is still current with +prev+, an open
+ * reader on an older version of the same segment. +prev+'s mutex must be
+ * held.
+ */
+static IndexReader *sr_reopen(SegmentInfos *sis, FieldInfos *fis, int si_num,
+                              bool is_owner, SegmentReader *prev)
+{
+    SegmentReader *sr = ALLOC_AND_ZERO(SegmentReader);
+    sr->si = sis->segs[si_num];
+    ir_setup(IR(sr), sr->si->store, sis, fis, is_owner);
+    return sr_setup_i(sr, prev);
+}
+
 /****************************************************************************
- *
- * Deleter
- *
+ * MultiReader
  ****************************************************************************/
 
-#define DELETABLE_START_CAPA 8
-Deleter *deleter_new(SegmentInfos *sis, Store *store)
+#define MR(ir) ((MultiReader *)(ir))
+
+static int mr_reader_index_i(MultiReader *mr, int doc_num)
 {
-    Deleter *dlr = ALLOC(Deleter);
-    dlr->sis = sis;
-    dlr->store = store;
-    dlr->pending = hs_new_str(&free);
-    return dlr;
+    int lo = 0;                       /* search @starts array */
+    int hi = mr->r_cnt - 1;            /* for first element less */
+    int mid;
+    int mid_value;
+
+    while (hi >= lo) {
+        mid = (lo + hi) >> 1;
+        mid_value = mr->starts[mid];
+        if (doc_num < mid_value) {
+            hi = mid - 1;
+        }
+        else if (doc_num > mid_value) {
+            lo = mid + 1;
+        }
+        else { /* found a match */
+            while ((mid+1 < mr->r_cnt) && (mr->starts[mid+1] == mid_value)) {
+                mid += 1; /* scan to last match in case we have empty segments */
+            }
+            return mid;
+        }
+    }
+    return hi;
 }
 
-void deleter_destroy(Deleter *dlr)
+static int mr_num_docs(IndexReader *ir)
 {
-    hs_destroy(dlr->pending);
-    free(dlr);
+    int i, num_docs;
+    mutex_lock(&ir->mutex);
+    if (MR(ir)->num_docs_cache == -1) {
+        const int mr_reader_cnt = MR(ir)->r_cnt;
+        MR(ir)->num_docs_cache = 0;
+        for (i = 0; i < mr_reader_cnt; i++) {
+            IndexReader *reader = MR(ir)->sub_readers[i];
+            MR(ir)->num_docs_cache += reader->num_docs(reader);
+        }
+    }
+    num_docs = MR(ir)->num_docs_cache;
+    mutex_unlock(&ir->mutex);
+
+    return num_docs;
 }
 
-static void deleter_queue_file(Deleter *dlr, const char *file_name)
+static int mr_max_doc(IndexReader *ir)
 {
-    hs_add(dlr->pending, estrdup(file_name));
+    return MR(ir)->max_doc;
 }
 
-void deleter_delete_file(Deleter *dlr, char *file_name)
+#define GET_READER()\
+    int i = mr_reader_index_i(MR(ir), doc_num);\
+    IndexReader *reader = MR(ir)->sub_readers[i]
+
+static Document *mr_get_doc(IndexReader *ir, int doc_num)
 {
-    Store *store = dlr->store;
-    TRY
-        if (store->exists(store, file_name)) {
-            store->remove(store, file_name);
-        }
-        hs_del(dlr->pending, file_name);
-    XCATCHALL
-        hs_add(dlr->pending, estrdup(file_name));
-    XENDTRY
+    GET_READER();
+    return reader->get_doc(reader, doc_num - MR(ir)->starts[i]);
 }
 
-static void deleter_commit_pending_deletions(Deleter *dlr)
+static LazyDoc *mr_get_lazy_doc(IndexReader *ir, int doc_num)
 {
-    HashSetEntry *hse, *hse_next = dlr->pending->first;
-    while ((hse = hse_next) != NULL) {
-        hse_next = hse->next;
-        deleter_delete_file(dlr, (char *)hse->elem);
-    }
+    GET_READER();
+    return reader->get_lazy_doc(reader, doc_num - MR(ir)->starts[i]);
 }
 
-void deleter_delete_files(Deleter *dlr, char **files, int file_cnt)
+int mr_get_field_num(MultiReader *mr, int ir_num, int f_num)
 {
-    int i;
-    for (i = file_cnt - 1; i >= 0; i--) {
-        deleter_queue_file(dlr, files[i]);
+    if (mr->field_num_map) {
+        return mr->field_num_map[ir_num][f_num];
+    }
+    else {
+        return f_num;
     }
-    deleter_commit_pending_deletions(dlr);
 }
 
-struct DelFilesArg {
-    char  curr_seg_file_name[SEGMENT_NAME_MAX_LENGTH];
-    Deleter *dlr;
-    Hash *current;
-};
-
-static void deleter_find_deletable_files_i(const char *file_name, void *arg)
+static uchar *mr_get_norms(IndexReader *ir, int field_num)
 {
-    struct DelFilesArg *dfa = (struct DelFilesArg *)arg;
-    Deleter *dlr = dfa->dlr;
-
-    if (file_name_filter_is_index_file(file_name, false)
-        && 0 != strcmp(file_name, dfa->curr_seg_file_name)
-        && 0 != strcmp(file_name, SEGMENTS_GEN_FILE_NAME)) {
+    uchar *bytes;
 
-        bool do_delete = false;
-        SegmentInfo *si;
-        char segment_name[SEGMENT_NAME_MAX_LENGTH];
-        char *extension, *p;
-        strcpy(segment_name, file_name);
+    mutex_lock(&ir->mutex);
+    bytes = (uchar *)h_get_int(MR(ir)->norms_cache, field_num);
+    if (NULL == bytes) {
+        int i;
+        const int mr_reader_cnt = MR(ir)->r_cnt;
 
-        p = strrchr(segment_name, '.');
+        bytes = ALLOC_AND_ZERO_N(uchar, MR(ir)->max_doc);
 
-        /* First remove any extension: */
-        if (NULL != p) {
-            *p = '\0';
-            extension = p + 1;
-        }
-        else {
-            extension = NULL;
+        for (i = 0; i < mr_reader_cnt; i++) {
+            int fnum = mr_get_field_num(MR(ir), i, field_num);
+            if (fnum >= 0) {
+                IndexReader *reader = MR(ir)->sub_readers[i];
+                reader->get_norms_into(reader, fnum, bytes + MR(ir)->starts[i]);
+            }
         }
+        h_set_int(MR(ir)->norms_cache, field_num, bytes); /* update cache */
+    }
+    mutex_unlock(&ir->mutex);
 
-        /* Then, remove any generation count: */
-        p = strrchr(segment_name + 1, '_');
-        if (NULL != p) {
-            *p = '\0';
-        }
+    return bytes;
+}
 
-        /* Delete this file if it's not a "current" segment, or, it is a
-         * single index file but there is now a corresponding compound file: */
-        if (NULL == (si = (SegmentInfo *)h_get(dfa->current, segment_name))) {
-            /* Delete if segment is not referenced: */
-            do_delete = true;
-        }
-        else {
-            char tmp_fn[SEGMENT_NAME_MAX_LENGTH];
-            /* OK, segment is referenced, but file may still be orphan'd: */
-            if (file_name_filter_is_cfs_file(file_name)
-                && si->use_compound_file) {
-                /* This file is stored in a CFS file for this segment: */
-                do_delete = true;
-            }
-            else if (0 == strcmp("del", extension)) {
-                /* This is a _segmentName_N.del file: */
-                if (!fn_for_generation(tmp_fn, segment_name, "del", si->del_gen)
-                    || 0 != strcmp(file_name, tmp_fn)) {
-                    /* If this is a seperate .del file, but it
-                     * doesn't match the current del file name for
-                     * this segment, then delete it: */
-                    do_delete = true;
-                }
-            }
-            else if (NULL != extension
-                     && ('s' == *extension || 'f' == *extension)
-                     && isdigit(extension[1])) {
-                si_norm_file_name(si, tmp_fn, atoi(extension + 1));
-                /* This is a _segmentName_N.sX file: */
-                if (0 != strcmp(tmp_fn, file_name)) {
-                    /* This is an orphan'd norms file: */
-                    do_delete = true;
-                }
-            }
-            else if (0 == strcmp("cfs", extension) && !si->use_compound_file) {
-                /* This is a partially written _segmentName.cfs: */
-                do_delete = true;
-            }
-        }
+static uchar *mr_get_norms_into(IndexReader *ir, int field_num, uchar *buf)
+{
+    uchar *bytes;
 
-        if (do_delete) {
-            deleter_queue_file(dlr, file_name);
+    mutex_lock(&ir->mutex);
+    bytes = (uchar *)h_get_int(MR(ir)->norms_cache, field_num);
+    if (NULL != bytes) {
+        memcpy(buf, bytes, MR(ir)->max_doc);
+    }
+    else {
+        int i;
+        const int mr_reader_cnt = MR(ir)->r_cnt;
+        for (i = 0; i < mr_reader_cnt; i++) {
+            int fnum = mr_get_field_num(MR(ir), i, field_num);
+            if (fnum >= 0) {
+                IndexReader *reader = MR(ir)->sub_readers[i];
+                reader->get_norms_into(reader, fnum, buf + MR(ir)->starts[i]);
+            }
         }
     }
+    mutex_unlock(&ir->mutex);
+    return buf;
 }
 
-/*
- * Determine index files that are no longer referenced and therefore should be
- * deleted.  This is called once (by the writer), and then subsequently we add
- * onto deletable any files that are no longer needed at the point that we
- * create the unused file (eg when merging segments), and we only remove from
- * deletable when a file is successfully deleted.
- */
-void deleter_find_deletable_files(Deleter *dlr)
+static TermEnum *mr_terms(IndexReader *ir, int field_num)
 {
-    /* Gather all "current" segments: */
-    int i;
-    SegmentInfos *sis = dlr->sis;
-    Store *store = dlr->store;
-    struct DelFilesArg dfa;
-    Hash *current = dfa.current
-                       = h_new_str((free_ft)NULL, (free_ft)si_deref);
-    dfa.dlr = dlr;
+    return mte_new(MR(ir), field_num, NULL);
+}
 
-    for(i = 0; i < sis->size; i++) {
-        SegmentInfo *si = (SegmentInfo *)sis->segs[i];
-        REF(si);
-        h_set(current, si->name, si);
+static TermEnum *mr_terms_from(IndexReader *ir, int field_num, const char *term)
+{
+    return mte_new(MR(ir), field_num, term);
+}
+
+static int mr_doc_freq(IndexReader *ir, int field_num, const char *t)
+{
+    int total = 0;          /* sum freqs in segments */
+    int i = MR(ir)->r_cnt;
+    for (i = MR(ir)->r_cnt - 1; i >= 0; i--) {
+        int fnum = mr_get_field_num(MR(ir), i, field_num);
+        if (fnum >= 0) {
+            IndexReader *reader = MR(ir)->sub_readers[i];
+            total += reader->doc_freq(reader, fnum, t);
+        }
     }
+    return total;
+}
 
-    /* Then go through all files in the Directory that are Ferret index files,
-     * and add to deletable if they are not referenced by the current segments
-     * info: */
-    sis_curr_seg_file_name(dfa.curr_seg_file_name, store);
+static TermDocEnum *mr_term_docs(IndexReader *ir)
+{
+    return mtde_new(MR(ir));
+}
 
-    store->each(store, &deleter_find_deletable_files_i, &dfa);
-    h_destroy(dfa.current);
+static TermDocEnum *mr_term_positions(IndexReader *ir)
+{
+    return mtpe_new(MR(ir));
 }
 
-static void deleter_delete_deletable_files(Deleter *dlr)
+static TermVector *mr_term_vector(IndexReader *ir, int doc_num,
+                                  Symbol field)
 {
-    deleter_find_deletable_files(dlr);
-    deleter_commit_pending_deletions(dlr);
+    GET_READER();
+    return reader->term_vector(reader, doc_num - MR(ir)->starts[i], field);
 }
 
-/*
-TODO: currently not used. Why not?
-static void deleter_clear_pending_deletions(Deleter *dlr)
+static Hash *mr_term_vectors(IndexReader *ir, int doc_num)
 {
-    hs_clear(dlr->pending);
+    GET_READER();
+    return reader->term_vectors(reader, doc_num - MR(ir)->starts[i]);
 }
-*/
 
-/****************************************************************************
- *
- * IndexReader
- *
- ****************************************************************************/
+static bool mr_is_deleted(IndexReader *ir, int doc_num)
+{
+    GET_READER();
+    return reader->is_deleted(reader, doc_num - MR(ir)->starts[i]);
+}
 
-static void ir_acquire_not_necessary(IndexReader *ir)
+static bool mr_has_deletions(IndexReader *ir)
 {
-    (void)ir;
+    return MR(ir)->has_deletions;
 }
 
-#define I64_PFX POSH_I64_PRINTF_PREFIX
-static void ir_acquire_write_lock(IndexReader *ir)
+static void mr_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar val)
 {
-    if (ir->is_stale) {
-        RAISE(STATE_ERROR, "IndexReader out of date and no longer valid for "
-                           "delete, undelete, or set_norm operations. To "
-                           "perform any of these operations on the index you "
-                           "need to close and reopen the index");
+    int i = mr_reader_index_i(MR(ir), doc_num);
+    int fnum = mr_get_field_num(MR(ir), i, field_num);
+    if (fnum >= 0) {
+        IndexReader *reader = MR(ir)->sub_readers[i];
+        ir->has_changes = true;
+        h_del_int(MR(ir)->norms_cache, fnum);/* clear cache */
+        ir_set_norm_i(reader, doc_num - MR(ir)->starts[i], fnum, val);
     }
+}
 
-    if (NULL == ir->write_lock) {
-        ir->write_lock = open_lock(ir->store, WRITE_LOCK_NAME);
-        if (!ir->write_lock->obtain(ir->write_lock)) {/* obtain write lock */
-            RAISE(LOCK_ERROR, "Could not obtain write lock when trying to "
-                              "write changes to the index. Check that there "
-                              "are no stale locks in the index. Look for "
-                              "files with the \".lck\" prefix. If you know "
-                              "there are no processes writing to the index "
-                              "you can safely delete these files.");
-        }
+static void mr_delete_doc_i(IndexReader *ir, int doc_num)
+{
+    GET_READER();
+    MR(ir)->num_docs_cache = -1; /* invalidate cache */
 
-        /* we have to check whether index has changed since this reader was
-         * opened.  if so, this reader is no longer valid for deletion */
-        if (sis_read_current_version(ir->store) > ir->sis->version) {
-            ir->is_stale = true;
-            ir->write_lock->release(ir->write_lock);
-            close_lock(ir->write_lock);
-            ir->write_lock = NULL;
-            RAISE(STATE_ERROR, "IndexReader out of date and no longer valid "
-                               "for delete, undelete, or set_norm operations. "
-                               "The current version is <%"I64_PFX"d>, but this "
-                               "readers version is <%"I64_PFX"d>. To perform "
-                               "any of these operations on the index you need "
-                               "to close and reopen the index",
-                               sis_read_current_version(ir->store),
-                               ir->sis->version);
-        }
-    }
+    /* dispatch to segment reader */
+    reader->delete_doc_i(reader, doc_num - MR(ir)->starts[i]);
+    MR(ir)->has_deletions = true;
+    ir->has_changes = true;
 }
 
-static IndexReader *ir_setup(IndexReader *ir, Store *store, SegmentInfos *sis,
-                      FieldInfos *fis, int is_owner)
+static void mr_undelete_all_i(IndexReader *ir)
 {
-    mutex_init(&ir->mutex, NULL);
-    mutex_init(&ir->field_index_mutex, NULL);
+    int i;
+    const int mr_reader_cnt = MR(ir)->r_cnt;
 
-    if (store) {
-        ir->store = store;
-        REF(store);
+    MR(ir)->num_docs_cache = -1;                     /* invalidate cache */
+    for (i = 0; i < mr_reader_cnt; i++) {
+        IndexReader *reader = MR(ir)->sub_readers[i];
+        reader->undelete_all_i(reader);
     }
-    ir->sis = sis;
-    ir->fis = fis;
-    ir->ref_cnt = 1;
+    MR(ir)->has_deletions = false;
+    ir->has_changes = true;
+}
 
-    ir->is_owner = is_owner;
-    if (is_owner) {
-        ir->acquire_write_lock = &ir_acquire_write_lock;
-    }
-    else {
-        ir->acquire_write_lock = &ir_acquire_not_necessary;
+static void mr_set_deleter_i(IndexReader *ir, Deleter *deleter)
+{
+    int i;
+    ir->deleter = deleter;
+    for (i = MR(ir)->r_cnt - 1; i >= 0; i--) {
+        IndexReader *reader = MR(ir)->sub_readers[i];
+        reader->set_deleter_i(reader, deleter);
     }
-
-    return ir;
 }
 
-bool ir_index_exists(Store *store)
+static bool mr_is_latest_i(IndexReader *ir)
 {
-    return sis_current_segment_generation(store) != 1;
+    int i;
+    const int mr_reader_cnt = MR(ir)->r_cnt;
+    for (i = 0; i < mr_reader_cnt; i++) {
+        if (!ir_is_latest(MR(ir)->sub_readers[i])) {
+            return false;
+        }
+    }
+    return true;
 }
 
-int ir_get_field_num(IndexReader *ir, Symbol field)
+static void mr_commit_i(IndexReader *ir)
 {
-    int field_num = fis_get_field_num(ir->fis, field);
-    if (field_num < 0) {
-        RAISE(ARG_ERROR,
-              "Field :%s does not exist in this index", (char *)field);
+    int i;
+    const int mr_reader_cnt = MR(ir)->r_cnt;
+    for (i = 0; i < mr_reader_cnt; i++) {
+        IndexReader *reader = MR(ir)->sub_readers[i];
+        ir_commit_i(reader);
     }
-    return field_num;
 }
 
-int ir_doc_freq(IndexReader *ir, Symbol field, const char *term)
+static void mr_close_i(IndexReader *ir)
 {
-    int field_num = fis_get_field_num(ir->fis, field);
-    if (field_num >= 0) {
-        return ir->doc_freq(ir, field_num, term);
+    int i;
+    const int mr_reader_cnt = MR(ir)->r_cnt;
+    for (i = 0; i < mr_reader_cnt; i++) {
+        IndexReader *reader = MR(ir)->sub_readers[i];
+        ir_close(reader);
     }
-    else {
+    free(MR(ir)->sub_readers);
+    h_destroy(MR(ir)->norms_cache);
+    free(MR(ir)->starts);
+    free(MR(ir)->leaves);
+    free(MR(ir)->leaf_starts);
+}
+
+int ir_get_leaves(IndexReader *ir, IndexReader ***leaves, int **starts)
+{
+    if (ir->num_docs != &mr_num_docs) {
         return 0;
     }
+    *leaves = MR(ir)->leaves;
+    *starts = MR(ir)->leaf_starts;
+    return MR(ir)->leaf_cnt;
 }
 
-static void ir_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar val)
+DocValues *ir_get_doc_values(IndexReader *ir, int field_num)
 {
-    mutex_lock(&ir->mutex);
-    ir->acquire_write_lock(ir);
-    ir->set_norm_i(ir, doc_num, field_num, val);
-    ir->has_changes = true;
-    mutex_unlock(&ir->mutex);
+    if (ir->num_docs != &sr_num_docs || NULL == SR(ir)->core->dvr) {
+        return NULL;
+    }
+    return dvr_get(SR(ir)->core->dvr, field_num);
 }
 
-void ir_set_norm(IndexReader *ir, int doc_num, Symbol field, uchar val)
+DocValues *ir_uninvert_doc_values(IndexReader *ir, int field_num)
 {
-    int field_num = fis_get_field_num(ir->fis, field);
-    if (field_num >= 0) {
-        ir_set_norm_i(ir, doc_num, field_num, val);
+    int len = 0, capa = DV_TERM_BUF_INIT_CAPA, offs_capa = 16;
+    int *offs = ALLOC_N(int, offs_capa);
+    DocValues *dv = dv_new(ir->max_doc(ir), 0);
+    TermEnum *te = ir->terms(ir, field_num);
+    TermDocEnum *tde = ir->term_docs(ir);
+
+    dv->term_buf = ALLOC_N(char, capa);
+    while (te->next(te)) {
+        const int term_len = te->curr_term_len;
+        if (dv->term_cnt == offs_capa) {
+            offs_capa <<= 1;
+            REALLOC_N(offs, int, offs_capa);
+        }
+        dv_grow_term_buf(dv, &capa, len + term_len + 1);
+        memcpy(dv->term_buf + len, te->curr_term, term_len + 1);
+        offs[dv->term_cnt++] = len;
+        len += term_len + 1;
+        tde->seek_te(tde, te);
+        while (tde->next(tde)) {
+            dv->ords[tde->doc_num(tde)] = dv->term_cnt;
+        }
     }
+    tde->close(tde);
+    te->close(te);
+
+    free(dv->terms);
+    dv->terms = ALLOC_N(char *, dv->term_cnt + 1);
+    dv_set_terms(dv, offs);
+    free(offs);
+    dv_drop_unused_terms(dv);
+    return dv;
 }
 
-uchar *ir_get_norms_i(IndexReader *ir, int field_num)
+static void mr_setup_leaves(MultiReader *mr)
 {
-    uchar *norms = NULL;
-    if (field_num >= 0) {
-        norms = ir->get_norms(ir, field_num);
+    int i, j, leaf_cnt = 0;
+    for (i = 0; i < mr->r_cnt; i++) {
+        IndexReader **sub_leaves;
+        int *sub_starts;
+        int sub_cnt = ir_get_leaves(mr->sub_readers[i], &sub_leaves,
+                                    &sub_starts);
+        leaf_cnt += sub_cnt ? sub_cnt : 1;
     }
-    if (!norms) {
-        if (NULL == ir->fake_norms) {
-            ir->fake_norms = ALLOC_AND_ZERO_N(uchar, ir->max_doc(ir));
+    mr->leaves = ALLOC_N(IndexReader *, leaf_cnt);
+    mr->leaf_starts = ALLOC_N(int, leaf_cnt);
+    mr->leaf_cnt = 0;
+    for (i = 0; i < mr->r_cnt; i++) {
+        IndexReader **sub_leaves = &mr->sub_readers[i];
+        int zero = 0, *sub_starts = &zero;
+        int sub_cnt = ir_get_leaves(mr->sub_readers[i], &sub_leaves,
+                                    &sub_starts);
+        for (j = 0; j < (sub_cnt ? sub_cnt : 1); j++) {
+            mr->leaves[mr->leaf_cnt] = sub_leaves[j];
+            mr->leaf_starts[mr->leaf_cnt] = mr->starts[i] + sub_starts[j];
+            mr->leaf_cnt++;
         }
-        norms = ir->fake_norms;
     }
-    return norms;
 }
 
-uchar *ir_get_norms(IndexReader *ir, Symbol field)
+static IndexReader *mr_new(IndexReader **sub_readers, const int r_cnt)
 {
-    int field_num = fis_get_field_num(ir->fis, field);
-    return ir_get_norms_i(ir, field_num);
-}
+    int i;
+    MultiReader *mr = ALLOC_AND_ZERO(MultiReader);
+    IndexReader *ir = IR(mr);
 
-uchar *ir_get_norms_into(IndexReader *ir, Symbol field, uchar *buf)
-{
-    int field_num = fis_get_field_num(ir->fis, field);
-    if (field_num >= 0) {
-        ir->get_norms_into(ir, field_num, buf);
-    }
-    else {
-        memset(buf, 0, ir->max_doc(ir));
+    mr->sub_readers         = sub_readers;
+    mr->r_cnt               = r_cnt;
+    mr->max_doc             = 0;
+    mr->num_docs_cache      = -1;
+    mr->has_deletions       = false;
+
+    mr->starts              = ALLOC_N(int, (r_cnt+1));
+
+    for (i = 0; i < r_cnt; i++) {
+        IndexReader *sub_reader = sub_readers[i];
+        mr->starts[i] = mr->max_doc;
+        mr->max_doc += sub_reader->max_doc(sub_reader); /* compute max_docs */
+
+        if (sub_reader->has_deletions(sub_reader)) {
+            mr->has_deletions = true;
+        }
     }
-    return buf;
+    mr->starts[r_cnt]       = mr->max_doc;
+    mr->norms_cache         = h_new_int(&free);
+    mr_setup_leaves(mr);
+
+    ir->num_docs            = &mr_num_docs;
+    ir->max_doc             = &mr_max_doc;
+    ir->get_doc             = &mr_get_doc;
+    ir->get_lazy_doc        = &mr_get_lazy_doc;
+    ir->get_norms           = &mr_get_norms;
+    ir->get_norms_into      = &mr_get_norms_into;
+    ir->terms               = &mr_terms;
+    ir->terms_from          = &mr_terms_from;
+    ir->doc_freq            = &mr_doc_freq;
+    ir->term_docs           = &mr_term_docs;
+    ir->term_positions      = &mr_term_positions;
+    ir->term_vector         = &mr_term_vector;
+    ir->term_vectors        = &mr_term_vectors;
+    ir->is_deleted          = &mr_is_deleted;
+    ir->has_deletions       = &mr_has_deletions;
+
+    ir->set_norm_i          = &mr_set_norm_i;
+    ir->delete_doc_i        = &mr_delete_doc_i;
+    ir->undelete_all_i      = &mr_undelete_all_i;
+    ir->set_deleter_i       = &mr_set_deleter_i;
+    ir->is_latest_i         = &mr_is_latest_i;
+    ir->commit_i            = &mr_commit_i;
+    ir->close_i             = &mr_close_i;
+
+    return ir;
 }
 
-void ir_undelete_all(IndexReader *ir)
+static IndexReader *mr_open_i(Store *store,
+                       SegmentInfos *sis,
+                       FieldInfos *fis,
+                       IndexReader **sub_readers,
+                       const int r_cnt)
 {
-    mutex_lock(&ir->mutex);
-    ir->acquire_write_lock(ir);
-    ir->undelete_all_i(ir);
-    ir->has_changes = true;
-    mutex_unlock(&ir->mutex);
+    IndexReader *ir = mr_new(sub_readers, r_cnt);
+    return ir_setup(ir, store, sis, fis, true);
 }
 
-void ir_delete_doc(IndexReader *ir, int doc_num)
+static void mr_close_ext_i(IndexReader *ir)
 {
-    if (doc_num >= 0 && doc_num < ir->max_doc(ir)) {
-        mutex_lock(&ir->mutex);
-        ir->acquire_write_lock(ir);
-        ir->delete_doc_i(ir, doc_num);
-        ir->has_changes = true;
-        mutex_unlock(&ir->mutex);
+    int **field_num_map = MR(ir)->field_num_map;
+    if (field_num_map) {
+        int i;
+        for (i = MR(ir)->r_cnt - 1; i >= 0; i--) {
+            free(field_num_map[i]);
+        }
+        free(field_num_map);
     }
+    fis_deref(ir->fis);
+    mr_close_i(ir);
 }
 
-Document *ir_get_doc_with_term(IndexReader *ir, Symbol field,
-                               const char *term)
+IndexReader *mr_open(IndexReader **sub_readers, const int r_cnt)
 {
-    TermDocEnum *tde = ir_term_docs_for(ir, field, term);
-    Document *doc = NULL;
+    IndexReader *ir = mr_new(sub_readers, r_cnt);
+    MultiReader *mr = MR(ir);
+    /* defaults don't matter, this is just for reading fields, not adding */
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_NO, TERM_VECTOR_NO);
+    int i, j;
+    bool need_field_map = false;
 
-    if (tde) {
-        if (tde->next(tde)) {
-            doc = ir->get_doc(ir, tde->doc_num(tde));
+    /* Merge FieldInfos */
+    for (i = 0; i < r_cnt; i++) {
+        FieldInfos *sub_fis = sub_readers[i]->fis;
+        const int sub_fis_size = sub_fis->size;
+        for (j = 0; j < sub_fis_size; j++) {
+            FieldInfo *fi = sub_fis->fields[j];
+            FieldInfo *new_fi = fis_get_or_add_field(fis, fi->name);
+            new_fi->bits |= fi->bits;
+            if (fi->number != new_fi->number) {
+                need_field_map = true;
+            }
         }
-        tde->close(tde);
     }
-    return doc;
-}
 
-TermEnum *ir_terms(IndexReader *ir, Symbol field)
-{
-    TermEnum *te = NULL;
-    int field_num = fis_get_field_num(ir->fis, field);
-    if (field_num >= 0) {
-        te = ir->terms(ir, field_num);
+    /* we only need to build a field map if some of the sub FieldInfos didn't
+     * match the new FieldInfos object */
+    if (need_field_map) {
+        mr->field_num_map = ALLOC_N(int *, r_cnt);
+        for (i = 0; i < r_cnt; i++) {
+            FieldInfos *sub_fis = sub_readers[i]->fis;
+            const int fis_size = fis->size;
+
+            mr->field_num_map[i] = ALLOC_N(int, fis_size);
+            for (j = 0; j < fis_size; j++) {
+                FieldInfo *fi = fis->fields[j];
+                FieldInfo *fi_sub = fis_get_field(sub_fis, fi->name);
+                /* set non existant field nums to -1. The MultiReader will
+                 * skip readers which don't have needed fields */
+                mr->field_num_map[i][j] = fi_sub ? fi_sub->number : -1;
+            }
+        }
+        /* print out the field map
+        for (i = 0; i < r_cnt; i++) {
+            for (j = 0; j < fis->size; j++) {
+                printf("%d ", mr->field_num_map[i][j]);
+            }
+            printf("\n");
+        }
+        */
     }
-    return te;
+    else {
+        mr->field_num_map = NULL;
+    }
+
+
+    ir->close_i = &mr_close_ext_i;
+
+    return ir_setup(ir, NULL, NULL, fis, false);
 }
 
-TermEnum *ir_terms_from(IndexReader *ir, Symbol field,
-                           const char *term)
+/****************************************************************************
+ * IndexReader
+ ****************************************************************************/
+
+
+/*
+ * Returns the reader +ir+ has on segment +si+, or NULL if it doesn't have one
+ * on the same version of the segment.
+ */
+static SegmentReader *ir_find_segment_reader(IndexReader *ir, SegmentInfo *si)
 {
-    TermEnum *te = NULL;
-    int field_num = fis_get_field_num(ir->fis, field);
-    if (field_num >= 0) {
-        te = ir->terms_from(ir, field_num, term);
+    IndexReader **leaves = &ir;
+    int *starts, i;
+    int leaf_cnt = ir_get_leaves(ir, &leaves, &starts);
+
+    for (i = 0; i < (leaf_cnt ? leaf_cnt : 1); i++) {
+        SegmentInfo *leaf_si = SR(leaves[i])->si;
+        if (0 == strcmp(leaf_si->name, si->name)
+            && leaf_si->doc_cnt == si->doc_cnt
+            && leaf_si->use_compound_file == si->use_compound_file) {
+            return SR(leaves[i]);
+        }
     }
-    return te;
+    return NULL;
 }
 
-TermDocEnum *ir_term_docs_for(IndexReader *ir, Symbol field,
-                              const char *term)
+static IndexReader *ir_open_segment(SegmentInfos *sis, FieldInfos *fis,
+                                    int si_num, bool is_owner,
+                                    IndexReader *prev_ir)
 {
-    int field_num = fis_get_field_num(ir->fis, field);
-    TermDocEnum *tde = ir->term_docs(ir);
-    if (field_num >= 0) {
-        tde->seek(tde, field_num, term);
+    SegmentReader *prev = prev_ir
+        ? ir_find_segment_reader(prev_ir, sis->segs[si_num]) : NULL;
+    IndexReader *volatile ir = NULL;
+
+    if (NULL == prev) {
+        return sr_open(sis, fis, si_num, is_owner);
     }
-    return tde;
+    /* ir_reopen already holds the top level reader's mutex */
+    if (IR(prev) != prev_ir) mutex_lock(&IR(prev)->mutex);
+    TRY
+        ir = sr_reopen(sis, fis, si_num, is_owner, prev);
+    XFINALLY
+        if (IR(prev) != prev_ir) mutex_unlock(&IR(prev)->mutex);
+    XENDTRY
+    return ir;
 }
 
-TermDocEnum *ir_term_positions_for(IndexReader *ir, Symbol field,
-                                   const char *term)
+/*
+ * Open a reader on the segments in +sis+, which the reader takes ownership
+ * of, sharing whatever it can with +prev_ir+. On error +sis+ is left for the
+ * caller to destroy.
+ */
+static IndexReader *ir_open_sis(Store *store, SegmentInfos *sis,
+                                IndexReader *prev_ir)
 {
-    int field_num = fis_get_field_num(ir->fis, field);
-    TermDocEnum *tde = ir->term_positions(ir);
-    if (field_num >= 0) {
-        tde->seek(tde, field_num, term);
+    FieldInfos *fis = sis->fis;
+    if (sis->size == 1) {
+        return ir_open_segment(sis, fis, 0, true, prev_ir);
+    }
+    else {
+        volatile int i;
+        IndexReader **readers = ALLOC_N(IndexReader *, sis->size);
+        int num_segments = sis->size;
+        for (i = num_segments - 1; i >= 0; i--) {
+            TRY
+                readers[i] = ir_open_segment(sis, fis, i, false, prev_ir);
+            XCATCHALL
+                for (i++; i < num_segments; i++) {
+                    ir_close(readers[i]);
+                }
+                free(readers);
+            XENDTRY
+        }
+        return mr_open_i(store, sis, fis, readers, sis->size);
     }
-    return tde;
 }
 
-static void ir_commit_i(IndexReader *ir)
+static void ir_open_i(Store *store, FindSegmentsFile *fsf)
 {
-    if (ir->has_changes) {
-        if (NULL == ir->deleter && NULL != ir->store) {
-            /* In the MultiReader case, we share this deleter across all
-             * SegmentReaders: */
-            ir->set_deleter_i(ir, deleter_new(ir->sis, ir->store));
-        }
-        if (ir->is_owner) {
-            char curr_seg_fn[MAX_FILE_PATH];
-            mutex_lock(&ir->store->mutex);
-
-            sis_curr_seg_file_name(curr_seg_fn, ir->store);
-
-            ir->commit_i(ir);
-            sis_write(ir->sis, ir->store, ir->deleter);
-
-            if (ir->deleter) deleter_delete_file(ir->deleter, curr_seg_fn);
-
-            mutex_unlock(&ir->store->mutex);
-
-            if (NULL != ir->write_lock) {
-                /* release write lock */
-                ir->write_lock->release(ir->write_lock);
-                close_lock(ir->write_lock);
-                ir->write_lock = NULL;
+    volatile bool success = false;
+    IndexReader *volatile ir = NULL;
+    SegmentInfos *volatile sis = NULL;
+    TRY
+    do {
+        mutex_lock(&store->mutex);
+        sis_read_i(store, fsf);
+        sis = fsf->ret.sis;
+        ir = ir_open_sis(store, sis, fsf->prev_ir);
+        fsf->ret.ir = ir;
+        success = true;
+    } while (0);
+    XFINALLY
+        if (!success) {
+            if (ir) {
+                ir_close(ir);
+            }
+            else if (sis) {
+                sis_destroy(sis);
             }
         }
-        else {
-            ir->commit_i(ir);
-        }
-    }
-    ir->has_changes = false;
+        mutex_unlock(&store->mutex);
+    XENDTRY
 }
 
-void ir_commit(IndexReader *ir)
+/**
+ * Will keep a reference to the store. To let this method delete the store
+ * make sure you deref the store that you pass to it
+ */
+IndexReader *ir_open(Store *store)
 {
-    mutex_lock(&ir->mutex);
-    ir_commit_i(ir);
-    mutex_unlock(&ir->mutex);
+    FindSegmentsFile fsf;
+    fsf.prev_ir = NULL;
+    sis_find_segments_file(store, &fsf, &ir_open_i);
+    return fsf.ret.ir;
 }
 
-void ir_close(IndexReader *ir)
+IndexReader *ir_reopen(IndexReader *ir)
 {
-    mutex_lock(&ir->mutex);
-    if (0 == --(ir->ref_cnt)) {
-        ir_commit_i(ir);
-        ir->close_i(ir);
-        if (ir->store) {
-            store_deref(ir->store);
-        }
-        if (ir->is_owner && ir->sis) {
-            sis_destroy(ir->sis);
-        }
-        if (ir->cache) {
-            h_destroy(ir->cache);
-        }
-        if (ir->field_index_cache) {
-            h_destroy(ir->field_index_cache);
-        }
-        if (ir->deleter && ir->is_owner) {
-            deleter_destroy(ir->deleter);
-        }
-        free(ir->fake_norms);
-
-        mutex_destroy(&ir->mutex);
-        mutex_destroy(&ir->field_index_mutex);
-        free(ir);
+    FindSegmentsFile fsf;
+    if (NULL == ir->sis || NULL == ir->store) {
+        RAISE(ARG_ERROR, "Only IndexReaders opened with ir_open can be "
+              "reopened");
     }
-    else {
-        mutex_unlock(&ir->mutex);
+    if (ir_is_latest(ir)) {
+        return ir;
     }
+    fsf.prev_ir = ir;
+    mutex_lock(&ir->mutex);
+    TRY
+        sis_find_segments_file(ir->store, &fsf, &ir_open_i);
+    XFINALLY
+        mutex_unlock(&ir->mutex);
+    XENDTRY
+    return fsf.ret.ir;
+}
+
+/****************************************************************************
+ *
+ * Offset
+ *
+ ****************************************************************************/
+
+Offset *offset_new(off_t start, off_t end)
+{
+    Offset *offset = ALLOC(Offset);
+    offset->start = start;
+    offset->end = end;
+    return offset;
+}
+
+/****************************************************************************
+ *
+ * ByteBlockPool
+ *
+ ****************************************************************************/
+
+/* Slices grow through these sizes. The last byte of a slice is a non-zero
+ * marker holding its level so that a writer knows when it has reached the
+ * end. */
+static const int BYTE_SLICE_SIZES[] = {5, 14, 20, 30, 40, 40, 80, 80, 120, 200};
+static const int BYTE_SLICE_NEXT_LEVEL[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 9};
+#define BYTE_SLICE_MARKER 16
 
+ByteBlockPool *bbp_new()
+{
+    ByteBlockPool *bbp = ALLOC_AND_ZERO(ByteBlockPool);
+    bbp->block_capa = 4;
+    bbp->blocks = ALLOC_N(uchar *, bbp->block_capa);
+    bbp->upto = BYTE_BLOCK_SIZE;
+    return bbp;
 }
 
-/**
- * Don't call this method if the cache already exists
- **/
-void ir_add_cache(IndexReader *ir)
+/* slices rely on unwritten bytes being zero so the used bytes are cleared */
+void bbp_reset(ByteBlockPool *bbp)
 {
-    if (NULL == ir->cache) {
-        ir->cache = co_hash_create();
+    int i;
+    for (i = 0; i < bbp->block_cnt; i++) {
+        ZEROSET_N(bbp->blocks[i], uchar,
+                  i == bbp->block_cnt - 1 ? bbp->upto : BYTE_BLOCK_SIZE);
     }
+    bbp->block_cnt = 0;
+    bbp->upto = BYTE_BLOCK_SIZE;
 }
 
-bool ir_is_latest(IndexReader *ir)
+void bbp_destroy(ByteBlockPool *bbp)
 {
-    return ir->is_latest_i(ir);
+    int i;
+    for (i = 0; i < bbp->block_alloc; i++) {
+        free(bbp->blocks[i]);
+    }
+    free(bbp->blocks);
+    free(bbp);
 }
 
-/****************************************************************************
- * Norm
- ****************************************************************************/
-
-typedef struct Norm {
-    int field_num;
-    InStream *is;
-    uchar *bytes;
-    bool is_dirty : 1;
-} Norm;
+int bbp_used(ByteBlockPool *bbp)
+{
+    return bbp->block_cnt * BYTE_BLOCK_SIZE;
+}
 
-static Norm *norm_create(InStream *is, int field_num)
+static void bbp_next_block(ByteBlockPool *bbp)
 {
-    Norm *norm = ALLOC(Norm);
+    if (bbp->block_cnt == bbp->block_alloc) {
+        if (bbp->block_alloc == bbp->block_capa) {
+            bbp->block_capa <<= 1;
+            REALLOC_N(bbp->blocks, uchar *, bbp->block_capa);
+        }
+        bbp->blocks[bbp->block_alloc++] = ALLOC_AND_ZERO_N(uchar,
+                                                           BYTE_BLOCK_SIZE);
+    }
+    bbp->block_cnt++;
+    bbp->upto = 0;
+}
 
-    norm->is = is;
-    norm->field_num = field_num;
-    norm->bytes = NULL;
-    norm->is_dirty = false;
+static int bbp_alloc_slice(ByteBlockPool *bbp, int level)
+{
+    const int size = BYTE_SLICE_SIZES[level];
+    int offset;
+    if (bbp->upto + size > BYTE_BLOCK_SIZE) {
+        bbp_next_block(bbp);
+    }
+    offset = ((bbp->block_cnt - 1) << BYTE_BLOCK_SHIFT) + bbp->upto;
+    bbp->upto += size;
+    bbp->blocks[bbp->block_cnt - 1][bbp->upto - 1] =
+        (uchar)(BYTE_SLICE_MARKER | level);
+    return offset;
+}
 
-    return norm;
+int bbp_new_slice(ByteBlockPool *bbp)
+{
+    return bbp_alloc_slice(bbp, 0);
 }
 
-static void norm_destroy(Norm *norm)
+static INLINE void bbp_write_byte(ByteBlockPool *bbp, int *upto, uchar b)
 {
-    is_close(norm->is);
-    if (NULL != norm->bytes) {
-        free(norm->bytes);
+    uchar *buf = bbp->blocks[*upto >> BYTE_BLOCK_SHIFT];
+    int i = *upto & BYTE_BLOCK_MASK;
+    if (buf[i] != 0) {
+        /* we've hit the end of the slice so move on to the next one. Its
+         * offset replaces the last 4 bytes of this slice, 3 of which are
+         * moved to the start of the next slice */
+        const int level = BYTE_SLICE_NEXT_LEVEL[buf[i] & 15];
+        const int next = bbp_alloc_slice(bbp, level);
+        uchar *next_buf = bbp->blocks[next >> BYTE_BLOCK_SHIFT];
+        const int j = next & BYTE_BLOCK_MASK;
+        memcpy(next_buf + j, buf + i - 3, 3);
+        buf[i - 3] = (uchar)(next >> 24);
+        buf[i - 2] = (uchar)(next >> 16);
+        buf[i - 1] = (uchar)(next >> 8);
+        buf[i] = (uchar)next;
+        buf = next_buf;
+        i = j + 3;
+        *upto = next + 3;
     }
-    free(norm);
+    buf[i] = b;
+    (*upto)++;
 }
 
-static void norm_rewrite(Norm *norm, Store *store, Deleter *dlr,
-                         SegmentInfo *si, int doc_count)
+void bbp_write_vint(ByteBlockPool *bbp, int *upto, register unsigned int num)
 {
-    OutStream *os;
-    char norm_file_name[SEGMENT_NAME_MAX_LENGTH];
-    const int field_num = norm->field_num;
-
-    if (si_norm_file_name(si, norm_file_name, field_num)) {
-        deleter_queue_file(dlr, norm_file_name);
+    while (num > 127) {
+        bbp_write_byte(bbp, upto, (uchar)((num & 0x7f) | 0x80));
+        num >>= 7;
     }
-    si_advance_norm_gen(si, field_num);
-    si_norm_file_name(si, norm_file_name, field_num);
-    os = store->new_output(store, norm_file_name);
-    os_write_bytes(os, norm->bytes, doc_count);
-    os_close(os);
-    norm->is_dirty = false;
+    bbp_write_byte(bbp, upto, (uchar)num);
 }
 
 /****************************************************************************
- * SegmentReader
+ *
+ * ByteSliceReader
+ *
  ****************************************************************************/
 
-typedef struct SegmentReader {
-    IndexReader ir;
-    SegmentInfo *si;
-    char *segment;
-    FieldsReader *fr;
-    BitVector *deleted_docs;
-    InStream *frq_in;
-    InStream *prx_in;
-    SegmentFieldIndex *sfi;
-    TermInfosReader *tir;
-    thread_key_t thread_fr;
-    void **fr_bucket;
-    Hash *norms;
-    Store *cfs_store;
-    bool deleted_docs_dirty : 1;
-    bool undelete_all : 1;
-    bool norms_dirty : 1;
-} SegmentReader;
+static void bsr_set_slice(ByteSliceReader *bsr, int offset)
+{
+    const int size = BYTE_SLICE_SIZES[bsr->level];
+    bsr->buf_offset = offset & ~BYTE_BLOCK_MASK;
+    bsr->buf = bsr->bbp->blocks[offset >> BYTE_BLOCK_SHIFT];
+    bsr->upto = offset & BYTE_BLOCK_MASK;
+    /* slices are allocated in order so the last one holds +end+ */
+    if (offset + size >= bsr->end) {
+        bsr->limit = bsr->end - bsr->buf_offset;
+    }
+    else {
+        bsr->limit = bsr->upto + size - 4;
+    }
+}
 
-#define IR(ir) ((IndexReader *)(ir))
+void bsr_init(ByteSliceReader *bsr, ByteBlockPool *bbp, int start, int end)
+{
+    bsr->bbp = bbp;
+    bsr->level = 0;
+    bsr->end = end;
+    bsr_set_slice(bsr, start);
+}
 
-#define SR(ir) ((SegmentReader *)(ir))
-#define SR_SIZE(ir) (SR(ir)->fr->size)
+bool bsr_eof(ByteSliceReader *bsr)
+{
+    return bsr->buf_offset + bsr->upto == bsr->end;
+}
 
-static INLINE FieldsReader *sr_fr(SegmentReader *sr)
+static void bsr_next_slice(ByteSliceReader *bsr)
 {
-    FieldsReader *fr;
+    const uchar *b = bsr->buf + bsr->limit;
+    bsr->level = BYTE_SLICE_NEXT_LEVEL[bsr->level];
+    bsr_set_slice(bsr, (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]);
+}
 
-    if (NULL == (fr = (FieldsReader *)thread_getspecific(sr->thread_fr))) {
-        fr = fr_clone(sr->fr);
-        ary_push(sr->fr_bucket, fr);
-        thread_setspecific(sr->thread_fr, fr);
+static INLINE uchar bsr_read_byte(ByteSliceReader *bsr)
+{
+    if (bsr->upto == bsr->limit) {
+        bsr_next_slice(bsr);
     }
-    return fr;
+    return bsr->buf[bsr->upto++];
 }
 
-static INLINE bool sr_is_deleted_i(SegmentReader *sr, int doc_num)
+unsigned int bsr_read_vint(ByteSliceReader *bsr)
 {
-    return (NULL != sr->deleted_docs && bv_get(sr->deleted_docs, doc_num));
+    register unsigned int res, b;
+    register int shift = 7;
+
+    b = bsr_read_byte(bsr);
+    res = b & 0x7F;
+    while ((b & 0x80) != 0) {
+        b = bsr_read_byte(bsr);
+        res |= (b & 0x7F) << shift;
+        shift += 7;
+    }
+    return res;
 }
 
-static INLINE void sr_get_norms_into_i(SegmentReader *sr, int field_num,
-                                       uchar *buf)
+void bsr_copy_vints(ByteSliceReader *bsr, OutStream *os, int cnt)
 {
-    Norm *norm = (Norm *)h_get_int(sr->norms, field_num);
-    if (NULL == norm) {
-        memset(buf, 0, SR_SIZE(sr));
-    }
-    else if (NULL != norm->bytes) { /* can copy from cache */
-        memcpy(buf, norm->bytes, SR_SIZE(sr));
-    }
-    else {
-        InStream *norm_in = is_clone(norm->is);
-        /* read from disk */
-        is_seek(norm_in, 0);
-        is_read_bytes(norm_in, buf, SR_SIZE(sr));
-        is_close(norm_in);
+    while (cnt > 0) {
+        int start;
+        if (bsr->upto == bsr->limit) {
+            bsr_next_slice(bsr);
+        }
+        start = bsr->upto;
+        while (bsr->upto < bsr->limit && cnt > 0) {
+            if ((bsr->buf[bsr->upto++] & 0x80) == 0) {
+                cnt--;
+            }
+        }
+        os_write_bytes(os, bsr->buf + start, bsr->upto - start);
     }
 }
 
-static INLINE uchar *sr_get_norms_i(SegmentReader *sr, int field_num)
+/****************************************************************************
+ *
+ * PostingList
+ *
+ ****************************************************************************/
+
+PostingList *pl_new(MemoryPool *mp, ByteBlockPool *bbp,
+                    ByteBlockPool *tv_bbp, const char *term, int term_len,
+                    int doc_num)
 {
-    Norm *norm = (Norm *)h_get_int(sr->norms, field_num);
-    if (NULL == norm) {                           /* not an indexed field */
-        return NULL;
+    PostingList *pl = MP_ALLOC(mp, PostingList);
+    pl->term = (char *)mp_memdup(mp, term, term_len + 1);
+    pl->term_len = term_len;
+    pl->prev_doc = 0;
+    pl->last_doc = doc_num;
+    pl->freq = 0;
+    pl->last_pos = 0;
+    pl->frq_start = pl->frq_upto = bbp_new_slice(bbp);
+    pl->prx_start = pl->prx_upto = bbp_new_slice(bbp);
+    if (tv_bbp) {
+        pl->tv_start = pl->tv_upto = bbp_new_slice(tv_bbp);
     }
+    return pl;
+}
 
-    if (NULL == norm->bytes) {                    /* value not yet read */
-        uchar *bytes = ALLOC_N(uchar, SR_SIZE(sr));
-        sr_get_norms_into_i(sr, field_num, bytes);
-        norm->bytes = bytes;                        /* cache it */
+/* the freq of the last document is now known so write its posting */
+void pl_add_doc(ByteBlockPool *bbp, ByteBlockPool *tv_bbp, PostingList *pl,
+                int doc_num)
+{
+    const int doc_code = (pl->last_doc - pl->prev_doc) << 1;
+    if (pl->freq == 1) {
+        bbp_write_vint(bbp, &pl->frq_upto, doc_code | 1);
+    }
+    else {
+        bbp_write_vint(bbp, &pl->frq_upto, doc_code);
+        bbp_write_vint(bbp, &pl->frq_upto, pl->freq);
+    }
+    pl->prev_doc = pl->last_doc;
+    pl->last_doc = doc_num;
+    pl->freq = 0;
+    pl->last_pos = 0;
+    if (tv_bbp) {
+        pl->tv_start = pl->tv_upto = bbp_new_slice(tv_bbp);
     }
-    return norm->bytes;
 }
 
-static void sr_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar b)
+void pl_add_pos(ByteBlockPool *bbp, ByteBlockPool *tv_bbp, PostingList *pl,
+                int pos)
 {
-    Norm *norm = (Norm *)h_get_int(SR(ir)->norms, field_num);
-    if (NULL != norm) { /* has_norms */
-        ir->has_changes = true;
-        norm->is_dirty = true; /* mark it dirty */
-        SR(ir)->norms_dirty = true;
-        sr_get_norms_i(SR(ir), field_num)[doc_num] = b;
+    bbp_write_vint(bbp, &pl->prx_upto, pos - pl->last_pos);
+    if (tv_bbp) {
+        bbp_write_vint(tv_bbp, &pl->tv_upto, pos - pl->last_pos);
     }
+    pl->last_pos = pos;
+    pl->freq++;
 }
 
-static void sr_delete_doc_i(IndexReader *ir, int doc_num)
+int pl_cmp(const PostingList **pl1, const PostingList **pl2)
 {
-    if (NULL == SR(ir)->deleted_docs) {
-        SR(ir)->deleted_docs = bv_new();
-    }
+    return strcmp((*pl1)->term, (*pl2)->term);
+}
 
-    SR(ir)->deleted_docs_dirty = true;
-    SR(ir)->undelete_all = false;
-    ir->has_changes = true;
-    bv_set(SR(ir)->deleted_docs, doc_num);
+#define PL_SORT_CUTOFF 16
+
+/* sort +pls+, whose terms all share their first +depth+ bytes */
+static void pl_insertion_sort(PostingList **pls, int cnt, int depth)
+{
+    int i, j;
+    for (i = 1; i < cnt; i++) {
+        PostingList *pl = pls[i];
+        const char *term = pl->term + depth;
+        for (j = i; j > 0 && strcmp(pls[j - 1]->term + depth, term) > 0; j--) {
+            pls[j] = pls[j - 1];
+        }
+        pls[j] = pl;
+    }
 }
 
-static void sr_undelete_all_i(IndexReader *ir)
+/*
+ * MSD radix sort on the byte at +depth+. Each term's byte is read once into
+ * +cache+ so the counting and distribution passes don't chase the term
+ * pointers again. We recurse on all but the largest bucket and loop on that
+ * one so the stack never grows deeper than log2(cnt).
+ */
+static void pl_radix_sort(PostingList **pls, PostingList **tmp, uchar *cache,
+                          int cnt, int depth)
 {
-    SR(ir)->undelete_all = true;
-    SR(ir)->deleted_docs_dirty = false;
-    ir->has_changes = true;
-    if (NULL != SR(ir)->deleted_docs) {
-        bv_destroy(SR(ir)->deleted_docs);
+    int counts[256];
+    int i, c, largest;
+
+    while (cnt >= PL_SORT_CUTOFF) {
+        for (i = 0; i < cnt; i++) {
+            cache[i] = (uchar)pls[i]->term[depth];
+        }
+        ZEROSET_N(counts, int, 256);
+        for (i = 0; i < cnt; i++) {
+            counts[cache[i]]++;
+        }
+        if (counts[cache[0]] == cnt) {
+            /* every term has the same byte here */
+            if (cache[0] == '\0') {
+                return;
+            }
+            depth++;
+            continue;
+        }
+
+        /* turn the counts into bucket ends and distribute backwards so the
+         * buckets stay stable */
+        for (c = 1; c < 256; c++) {
+            counts[c] += counts[c - 1];
+        }
+        for (i = cnt - 1; i >= 0; i--) {
+            tmp[--counts[cache[i]]] = pls[i];
+        }
+        memcpy(pls, tmp, cnt * sizeof(PostingList *));
+
+        /* counts[c] is now the start of bucket c. Bucket 0 holds the terms
+         * that have ended so it is already sorted. */
+        largest = 1;
+        for (c = 1; c < 256; c++) {
+            int end = c < 255 ? counts[c + 1] : cnt;
+            int size = end - counts[c];
+            int largest_end = largest < 255 ? counts[largest + 1] : cnt;
+            if (size > largest_end - counts[largest]) {
+                largest = c;
+            }
+        }
+        for (c = 1; c < 256; c++) {
+            int end = c < 255 ? counts[c + 1] : cnt;
+            if (c != largest && end - counts[c] > 1) {
+                pl_radix_sort(pls + counts[c], tmp, cache,
+                              end - counts[c], depth + 1);
+            }
+        }
+        i = counts[largest];
+        cnt = (largest < 255 ? counts[largest + 1] : cnt) - i;
+        pls += i;
+        depth++;
     }
-    SR(ir)->deleted_docs = NULL;
+    pl_insertion_sort(pls, cnt, depth);
 }
 
-static void sr_set_deleter_i(IndexReader *ir, Deleter *deleter)
+void pl_sort(PostingList **pls, int cnt)
 {
-  ir->deleter = deleter;
+    if (cnt < PL_SORT_CUTOFF) {
+        pl_insertion_sort(pls, cnt, 0);
+    }
+    else {
+        PostingList **tmp = ALLOC_N(PostingList *, cnt);
+        uchar *cache = ALLOC_N(uchar, cnt);
+        pl_radix_sort(pls, tmp, cache, cnt, 0);
+        free(cache);
+        free(tmp);
+    }
 }
 
-static void bv_write(BitVector *bv, Store *store, char *name)
+/****************************************************************************
+ *
+ * FieldInverter
+ *
+ ****************************************************************************/
+
+static FieldInverter *fld_inv_new(DocWriter *dw, FieldInfo *fi)
 {
-    int i;
-    OutStream *os = store->new_output(store, name);
-    os_write_vint(os, bv->size);
-    for (i = ((bv->size-1) >> 5); i >= 0; i--) {
-        os_write_u32(os, bv->bits[i]);
+    FieldInverter *fld_inv = MP_ALLOC(dw->mp, FieldInverter);
+    fld_inv->is_tokenized = fi_is_tokenized(fi);
+    fld_inv->store_term_vector = fi_store_term_vector(fi);
+    fld_inv->store_offsets = fi_store_offsets(fi);
+    if ((fld_inv->has_norms = fi_has_norms(fi)) == true) {
+        fld_inv->norms = MP_ALLOC_AND_ZERO_N(dw->mp, uchar,
+                                             dw->max_buffered_docs);
     }
-    os_close(os);
+    fld_inv->fi = fi;
+
+    /* this will alloc it's own memory so must be destroyed */
+    fld_inv->plists = h_new_str(NULL, NULL);
+
+    return fld_inv;
 }
 
-static BitVector *bv_read(Store *store, char *name)
+static void fld_inv_destroy(FieldInverter *fld_inv)
 {
-    int i;
-    bool success = false;
-    InStream *volatile is = store->open_input(store, name);
-    BitVector *volatile bv = ALLOC_AND_ZERO(BitVector);
-    bv->size = (int)is_read_vint(is);
-    bv->capa = (bv->size >> 5) + 1;
-    bv->bits = ALLOC_AND_ZERO_N(u32, bv->capa);
-    bv->ref_cnt = 1;
-    TRY
-        for (i = ((bv->size-1) >> 5); i >= 0; i--) {
-            bv->bits[i] = is_read_u32(is);
-        }
-        bv_recount(bv);
-        success = true;
-    XFINALLY
-        is_close(is);
-        if (!success && bv) bv_destroy(bv);
-    XENDTRY
-    return bv;
+    h_destroy(fld_inv->plists);
 }
 
-static bool sr_is_latest_i(IndexReader *ir)
+/****************************************************************************
+ *
+ * SkipBuffer
+ *
+ ****************************************************************************/
+
+/*
+ * The skip data for a term is a skip list with up to max_levels levels.
+ * Level 0 has an entry for every skip_buf_add and level k has an entry for
+ * every multiplier entries of level k - 1, holding the position of the
+ * matching entry in level k - 1 so that a reader can descend from the top
+ * level. The levels are written top down, each prefixed with its
+ * length, except for level 0 which is written last exactly as single level
+ * skip data used to be. If write_max_freq is set the skip data starts with the
+ * maximum freq of the term.
+ */
+typedef struct SkipBuffer
+{
+    OutStream *bufs[MAX_SKIP_LEVELS];
+    OutStream *frq_out;
+    OutStream *prx_out;
+    int max_levels;
+    int multiplier;
+    int entry_cnt;
+    bool write_max_freq;
+    int last_doc[MAX_SKIP_LEVELS];
+    off_t last_frq_ptr[MAX_SKIP_LEVELS];
+    off_t last_prx_ptr[MAX_SKIP_LEVELS];
+} SkipBuffer;
+
+static void skip_buf_reset(SkipBuffer *skip_buf)
 {
-    return (sis_read_current_version(ir->store) == ir->sis->version);
+    int i;
+    off_t frq_ptr = os_pos(skip_buf->frq_out);
+    off_t prx_ptr = os_pos(skip_buf->prx_out);
+    for (i = 0; i < skip_buf->max_levels; i++) {
+        ramo_reset(skip_buf->bufs[i]);
+        skip_buf->last_doc[i] = 0;
+        skip_buf->last_frq_ptr[i] = frq_ptr;
+        skip_buf->last_prx_ptr[i] = prx_ptr;
+    }
+    skip_buf->entry_cnt = 0;
 }
 
-static void sr_commit_i(IndexReader *ir)
+static SkipBuffer *skip_buf_new(OutStream *frq_out, OutStream *prx_out,
+                                int max_levels, int multiplier,
+                                bool write_max_freq)
 {
-    SegmentInfo *si = SR(ir)->si;
-    char *segment = SR(ir)->si->name;
-    char tmp_file_name[SEGMENT_NAME_MAX_LENGTH];
-
-    if (SR(ir)->undelete_all || SR(ir)->deleted_docs_dirty) {
-        if (si->del_gen >= 0) {
-            fn_for_generation(tmp_file_name, segment, "del", si->del_gen);
-            deleter_queue_file(ir->deleter, tmp_file_name);
-        }
-        if (SR(ir)->undelete_all) {
-            si->del_gen = -1;
-            SR(ir)->undelete_all = false;
-        }
-        else {
-            /* (SR(ir)->deleted_docs_dirty) re-write deleted */
-            si->del_gen++;
-            fn_for_generation(tmp_file_name, segment, "del", si->del_gen);
-            bv_write(SR(ir)->deleted_docs, ir->store, tmp_file_name);
-            SR(ir)->deleted_docs_dirty = false;
-        }
+    int i;
+    SkipBuffer *skip_buf = ALLOC(SkipBuffer);
+    skip_buf->write_max_freq = write_max_freq;
+    skip_buf->max_levels = multiplier > 1
+        ? MAX(1, MIN(max_levels, MAX_SKIP_LEVELS)) : 1;
+    skip_buf->multiplier = multiplier;
+    for (i = 0; i < skip_buf->max_levels; i++) {
+        skip_buf->bufs[i] = ram_new_buffer();
     }
-    if (SR(ir)->norms_dirty) { /* re-write norms */
-        int i;
-        const int field_cnt = ir->fis->size;
-        FieldInfo *fi;
-        for (i = field_cnt - 1; i >= 0; i--) {
-            fi = ir->fis->fields[i];
-            if (fi_is_indexed(fi)) {
-                Norm *norm = (Norm *)h_get_int(SR(ir)->norms, fi->number);
-                if (norm && norm->is_dirty) {
-                    norm_rewrite(norm, ir->store, ir->deleter, SR(ir)->si,
-                                 SR_SIZE(ir));
-                }
-            }
+    skip_buf->frq_out = frq_out;
+    skip_buf->prx_out = prx_out;
+    return skip_buf;
+}
+
+static void skip_buf_add(SkipBuffer *skip_buf, int doc)
+{
+    off_t frq_ptr = os_pos(skip_buf->frq_out);
+    off_t prx_ptr = os_pos(skip_buf->prx_out);
+    int level, entry_num = ++skip_buf->entry_cnt;
+    OutStream *buf = skip_buf->bufs[0];
+    off_t child_ptr = os_pos(buf), entry_ptr;
+
+    os_write_vint(buf, doc - skip_buf->last_doc[0]);
+    os_write_vint(buf, frq_ptr - skip_buf->last_frq_ptr[0]);
+    os_write_vint(buf, prx_ptr - skip_buf->last_prx_ptr[0]);
+    skip_buf->last_doc[0] = doc;
+    skip_buf->last_frq_ptr[0] = frq_ptr;
+    skip_buf->last_prx_ptr[0] = prx_ptr;
+
+    for (level = 1; level < skip_buf->max_levels; level++) {
+        if (0 != (entry_num % skip_buf->multiplier)) {
+            break;
         }
-        SR(ir)->norms_dirty = false;
+        entry_num /= skip_buf->multiplier;
+        buf = skip_buf->bufs[level];
+        entry_ptr = os_pos(buf);
+        os_write_vint(buf, doc - skip_buf->last_doc[level]);
+        os_write_voff_t(buf, frq_ptr - skip_buf->last_frq_ptr[level]);
+        os_write_voff_t(buf, prx_ptr - skip_buf->last_prx_ptr[level]);
+        os_write_voff_t(buf, child_ptr);
+        child_ptr = entry_ptr;
+        skip_buf->last_doc[level] = doc;
+        skip_buf->last_frq_ptr[level] = frq_ptr;
+        skip_buf->last_prx_ptr[level] = prx_ptr;
     }
 }
 
-static void sr_close_i(IndexReader *ir)
+static off_t skip_buf_write(SkipBuffer *skip_buf, int max_freq)
 {
-    SegmentReader *sr = SR(ir);
+    off_t skip_ptr = os_pos(skip_buf->frq_out);
+    int level = skip_buf->max_levels - 1;
+    if (skip_buf->write_max_freq && skip_buf->entry_cnt > 0) {
+        os_write_vint(skip_buf->frq_out, max_freq);
+    }
+    while (level > 0 && 0 == os_pos(skip_buf->bufs[level])) {
+        level--;
+    }
+    for (; level > 0; level--) {
+        os_write_voff_t(skip_buf->frq_out, os_pos(skip_buf->bufs[level]));
+        ramo_write_to(skip_buf->bufs[level], skip_buf->frq_out);
+    }
+    ramo_write_to(skip_buf->bufs[0], skip_buf->frq_out);
+    return skip_ptr;
+}
 
-    if (sr->fr)           fr_close(sr->fr);
-    if (sr->tir)          tir_close(sr->tir);
-    if (sr->sfi)          sfi_close(sr->sfi);
-    if (sr->frq_in)       is_close(sr->frq_in);
-    if (sr->prx_in)       is_close(sr->prx_in);
-    if (sr->norms)        h_destroy(sr->norms);
-    if (sr->deleted_docs) bv_destroy(sr->deleted_docs);
-    if (sr->cfs_store)    store_deref(sr->cfs_store);
-    if (sr->fr_bucket) {
-        thread_setspecific(sr->thread_fr, NULL);
-        thread_key_delete(sr->thread_fr);
-        ary_destroy(sr->fr_bucket, (free_ft)&fr_close);
+static void skip_buf_destroy(SkipBuffer *skip_buf)
+{
+    int i;
+    for (i = 0; i < skip_buf->max_levels; i++) {
+        ram_destroy_buffer(skip_buf->bufs[i]);
     }
+    free(skip_buf);
 }
 
-static int sr_num_docs(IndexReader *ir)
+/****************************************************************************
+ *
+ * PostingsWriter
+ *
+ * Writes the .frq and .prx files for a segment in the segment's
+ * PostingsFormat. The caller writes the positions for each document to
+ * prx_out directly after adding the document, unless pw_add_doc asks for
+ * the position to be held in +pulsed_pos+ instead. That happens for a
+ * term's first document when it has a freq of one. If no other document
+ * follows, the term is pulsed and pw_end_term puts the posting in the
+ * TermInfo, otherwise it is written when the next document is added.
+ *
+ ****************************************************************************/
+
+typedef struct PostingsWriter
 {
-    int num_docs;
+    OutStream *frq_out;
+    OutStream *prx_out;
+    SkipBuffer *skip_buf;
+    PostingsFormat format;
+    int skip_interval;
+    int doc_freq;
+    int max_freq;
+    int last_doc;
+    off_t frq_ptr;
+    off_t prx_ptr;
+    int buf_cnt;
+    bool pulsing;
+    int pulsed_doc;
+    int pulsed_pos;
+    unsigned int doc_buf[POSTINGS_BLOCK_SIZE];  /* doc deltas */
+    unsigned int freq_buf[POSTINGS_BLOCK_SIZE]; /* freqs - 1 */
+} PostingsWriter;
+
+/* write the postings of +si+ to +segment+.frq and +segment+.prx */
+static PostingsWriter *pw_open(Store *store, const char *segment,
+                               SegmentInfo *si, int skip_interval)
+{
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    PostingsWriter *pw = ALLOC_AND_ZERO(PostingsWriter);
 
-    mutex_lock(&ir->mutex);
-    num_docs = SR(ir)->fr->size;
-    if (NULL != SR(ir)->deleted_docs) {
-        num_docs -= SR(ir)->deleted_docs->count;
-    }
-    mutex_unlock(&ir->mutex);
-    return num_docs;
+    sprintf(file_name, "%s.frq", segment);
+    pw->frq_out = store->new_output(store, file_name);
+    sprintf(file_name, "%s.prx", segment);
+    pw->prx_out = store->new_output(store, file_name);
+    pw->skip_buf = skip_buf_new(pw->frq_out, pw->prx_out,
+                                si->max_skip_levels, skip_interval,
+                                si->has_max_freqs);
+    pw->format = si->postings_format;
+    pw->skip_interval = (POSTINGS_FORMAT_BLOCK == pw->format)
+        ? POSTINGS_BLOCK_SIZE : skip_interval;
+    return pw;
 }
 
-static int sr_max_doc(IndexReader *ir)
+static void pw_start_term(PostingsWriter *pw)
 {
-    return SR(ir)->fr->size;
+    pw->frq_ptr = os_pos(pw->frq_out);
+    pw->prx_ptr = os_pos(pw->prx_out);
+    pw->doc_freq = 0;
+    pw->max_freq = 0;
+    pw->last_doc = 0;
+    pw->buf_cnt = 0;
+    pw->pulsing = false;
+    skip_buf_reset(pw->skip_buf);
 }
 
-static Document *sr_get_doc(IndexReader *ir, int doc_num)
+static void pw_write_vint_posting(OutStream *frq_out, int doc_delta, int freq)
 {
-    Document *doc;
-    mutex_lock(&ir->mutex);
-    if (sr_is_deleted_i(SR(ir), doc_num)) {
-        mutex_unlock(&ir->mutex);
-        RAISE(STATE_ERROR, "Document %d has already been deleted", doc_num);
+    int doc_code = doc_delta << 1;          /* use low bit to flag freq=1 */
+    if (freq == 1) {
+        os_write_vint(frq_out, doc_code | 1);
+    }
+    else {
+        os_write_vint(frq_out, doc_code);
+        os_write_vint(frq_out, freq);
     }
-    doc = fr_get_doc(SR(ir)->fr, doc_num);
-    mutex_unlock(&ir->mutex);
-    return doc;
 }
 
-static LazyDoc *sr_get_lazy_doc(IndexReader *ir, int doc_num)
+/* Blocks are written lazily, on the next document, so that the prx pointer
+ * in the skip entry is past the positions of the block's last document */
+static void pw_flush_block(PostingsWriter *pw)
 {
-    LazyDoc *lazy_doc;
-    mutex_lock(&ir->mutex);
-    if (sr_is_deleted_i(SR(ir), doc_num)) {
-        mutex_unlock(&ir->mutex);
-        RAISE(STATE_ERROR, "Document %d has already been deleted", doc_num);
-    }
-    lazy_doc = fr_get_lazy_doc(SR(ir)->fr, doc_num);
-    mutex_unlock(&ir->mutex);
-    return lazy_doc;
+    pfor_write_block(pw->frq_out, pw->doc_buf);
+    pfor_write_block(pw->frq_out, pw->freq_buf);
+    pw->buf_cnt = 0;
+    skip_buf_add(pw->skip_buf, pw->last_doc);
 }
 
-static uchar *sr_get_norms(IndexReader *ir, int field_num)
+static void pw_write_doc(PostingsWriter *pw, int doc, int freq)
 {
-    uchar *norms;
-    mutex_lock(&ir->mutex);
-    norms = sr_get_norms_i(SR(ir), field_num);
-    mutex_unlock(&ir->mutex);
-    return norms;
+    if (POSTINGS_FORMAT_BLOCK == pw->format) {
+        if (POSTINGS_BLOCK_SIZE == pw->buf_cnt) {
+            pw_flush_block(pw);
+        }
+        pw->doc_buf[pw->buf_cnt] = doc - pw->last_doc;
+        pw->freq_buf[pw->buf_cnt] = freq - 1;
+        pw->buf_cnt++;
+    }
+    else {
+        if (0 == ((pw->doc_freq + 1) % pw->skip_interval)) {
+            skip_buf_add(pw->skip_buf, pw->last_doc);
+        }
+        pw_write_vint_posting(pw->frq_out, doc - pw->last_doc, freq);
+    }
+    pw->doc_freq++;
+    pw->last_doc = doc;
+    if (freq > pw->max_freq) {
+        pw->max_freq = freq;
+    }
 }
 
-static uchar *sr_get_norms_into(IndexReader *ir, int field_num,
-                              uchar *buf)
+/* Add a document to the current term. Returns true if the caller should put
+ * the document's position in +pulsed_pos+ rather than write it. */
+static bool pw_add_doc(PostingsWriter *pw, int doc, int freq)
 {
-    mutex_lock(&ir->mutex);
-    sr_get_norms_into_i(SR(ir), field_num, buf);
-    mutex_unlock(&ir->mutex);
-    return buf;
+    if (pw->pulsing) {
+        /* a second document so the first can't be pulsed after all */
+        pw->pulsing = false;
+        pw_write_doc(pw, pw->pulsed_doc, 1);
+        os_write_vint(pw->prx_out, pw->pulsed_pos);
+    }
+    else if (0 == pw->doc_freq && 1 == freq && pw->skip_interval > 1) {
+        pw->pulsing = true;
+        pw->pulsed_doc = doc;
+        return true;
+    }
+    pw_write_doc(pw, doc, freq);
+    return false;
 }
 
-static TermEnum *sr_terms(IndexReader *ir, int field_num)
+/* Finish the postings for the current term and fill in +ti+. Returns the
+ * number of documents added. */
+static int pw_end_term(PostingsWriter *pw, TermInfo *ti)
 {
-    TermEnum *te = SR(ir)->tir->orig_te;
-    te = ste_clone(te);
-    return ste_set_field(te, field_num);
+    if (pw->pulsing) {
+        ti_set(*ti, 1, pw->frq_ptr, pw->prx_ptr, 0);
+        ti->pulsed = true;
+        ti->pulsed_doc = pw->pulsed_doc;
+        ti->pulsed_pos = pw->pulsed_pos;
+        pw->pulsing = false;
+        return 1;
+    }
+    if (pw->buf_cnt == POSTINGS_BLOCK_SIZE) {
+        pw_flush_block(pw);
+    }
+    else if (pw->buf_cnt > 0) {
+        int i;
+        for (i = 0; i < pw->buf_cnt; i++) {
+            pw_write_vint_posting(pw->frq_out, (int)pw->doc_buf[i],
+                                  (int)pw->freq_buf[i] + 1);
+        }
+        pw->buf_cnt = 0;
+    }
+    ti_set(*ti, pw->doc_freq, pw->frq_ptr, pw->prx_ptr,
+           skip_buf_write(pw->skip_buf, pw->max_freq) - pw->frq_ptr);
+    return pw->doc_freq;
 }
 
-static TermEnum *sr_terms_from(IndexReader *ir, int field_num, const char *term)
+static void pw_close(PostingsWriter *pw)
 {
-    TermEnum *te = SR(ir)->tir->orig_te;
-    te = ste_clone(te);
-    ste_set_field(te, field_num);
-    ste_scan_to(te, term);
-    return te;
+    os_close(pw->frq_out);
+    os_close(pw->prx_out);
+    skip_buf_destroy(pw->skip_buf);
+    free(pw);
 }
 
-static int sr_doc_freq(IndexReader *ir, int field_num, const char *term)
+/****************************************************************************
+ *
+ * DocWriter
+ *
+ ****************************************************************************/
+
+static void dw_write_norms(DocWriter *dw, FieldInverter *fld_inv)
 {
-    TermInfo *ti = tir_get_ti(tir_set_field(SR(ir)->tir, field_num), term);
-    return ti ? ti->doc_freq : 0;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    OutStream *norms_out;
+    si_advance_norm_gen(dw->si, fld_inv->fi->number);
+    si_norm_file_name(dw->si, file_name, fld_inv->fi->number);
+    norms_out = dw->store->new_output(dw->store, file_name);
+    os_write_bytes(norms_out, fld_inv->norms, dw->doc_num);
+    os_close(norms_out);
 }
 
-static TermDocEnum *sr_term_docs(IndexReader *ir)
+/* we'll use the postings Hash's table area to sort the postings as it is
+ * going to be zeroset soon anyway */
+static PostingList **dw_sort_postings(Hash *plists_ht)
 {
-    return stde_new(SR(ir)->tir, SR(ir)->frq_in, SR(ir)->deleted_docs,
-                    STE(SR(ir)->tir->orig_te)->skip_interval);
+    int i, j;
+    HashEntry *he;
+    PostingList **plists = (PostingList **)plists_ht->table;
+    const int num_entries = plists_ht->mask + 1;
+    for (i = 0, j = 0; i < num_entries; i++) {
+        he = &plists_ht->table[i];
+        if (he->value) {
+            plists[j++] = (PostingList *)he->value;
+        }
+    }
+
+    pl_sort(plists, plists_ht->size);
+
+    return plists;
 }
 
-static TermDocEnum *sr_term_positions(IndexReader *ir)
+static void dw_flush_streams(DocWriter *dw)
 {
-    SegmentReader *sr = SR(ir);
-    return stpe_new(sr->tir, sr->frq_in, sr->prx_in, sr->deleted_docs,
-                    STE(sr->tir->orig_te)->skip_interval);
+    mp_reset(dw->mp);
+    bbp_reset(dw->bbp);
+    fw_close(dw->fw);
+    dw->fw = NULL;
+    h_clear(dw->fields);
+    dw->doc_num = 0;
 }
 
-static TermVector *sr_term_vector(IndexReader *ir, int doc_num,
-                                  Symbol field)
+static void dw_flush(DocWriter *dw)
 {
-    FieldInfo *fi = (FieldInfo *)h_get(ir->fis->field_dict, field);
-    FieldsReader *fr;
+    int i, j, doc_num, freq, posting_count;
+    int skip_interval = dw->skip_interval;
+    FieldInfos *fis = dw->fis;
+    const int fields_count = fis->size;
+    FieldInverter *fld_inv;
+    FieldInfo *fi;
+    PostingList **pls, *pl;
+    ByteSliceReader frq_reader, prx_reader;
+    Store *store = dw->store;
+    TermInfosWriter *tiw = tiw_open(store, dw->si->name, dw->fis,
+                                    dw->index_interval, skip_interval);
+    TermInfo ti;
+    PostingsWriter *pw = pw_open(store, dw->si->name, dw->si, skip_interval);
+    OutStream *prx_out = pw->prx_out;
+    DocValuesWriter *dvw = dvw_new(store, dw->si->name);
+    DocValues *dv;
 
-    if (!fi || !fi_store_term_vector(fi) || !SR(ir)->fr ||
-        !(fr = sr_fr(SR(ir)))) {
-        return NULL;
+    for (i = 0; i < fields_count; i++) {
+        fi = fis->fields[i];
+        if (!fi_is_indexed(fi) || NULL ==
+            (fld_inv = (FieldInverter*)h_get_int(dw->fields, fi->number))) {
+            continue;
+        }
+        if (!fi_omit_norms(fi)) {
+            dw_write_norms(dw, fld_inv);
+        }
+
+        pls = dw_sort_postings(fld_inv->plists);
+        tiw_start_field(tiw, fi->number);
+        posting_count = fld_inv->plists->size;
+        /* the terms are in order so each document's last is its greatest */
+        dv = fi_has_doc_values(fi) ? dv_new(dw->doc_num, posting_count) : NULL;
+        for (j = 0; j < posting_count; j++) {
+            pl = pls[j];
+            if (dv) {
+                dv->terms[j] = (char *)pl->term;
+            }
+            pw_start_term(pw);
+            bsr_init(&frq_reader, dw->bbp, pl->frq_start, pl->frq_upto);
+            bsr_init(&prx_reader, dw->bbp, pl->prx_start, pl->prx_upto);
+            doc_num = 0;
+            while (!bsr_eof(&frq_reader)) {
+                int doc_code = bsr_read_vint(&frq_reader);
+                doc_num += doc_code >> 1;
+                freq = (doc_code & 1) ? 1 : (int)bsr_read_vint(&frq_reader);
+                if (dv) {
+                    dv->ords[doc_num] = j + 1;
+                }
+                if (pw_add_doc(pw, doc_num, freq)) {
+                    pw->pulsed_pos = bsr_read_vint(&prx_reader);
+                }
+                else {
+                    bsr_copy_vints(&prx_reader, prx_out, freq);
+                }
+            }
+            /* the last document's posting is still in the PostingList */
+            if (dv) {
+                dv->ords[pl->last_doc] = j + 1;
+            }
+            if (pw_add_doc(pw, pl->last_doc, pl->freq)) {
+                pw->pulsed_pos = bsr_read_vint(&prx_reader);
+            }
+            else {
+                bsr_copy_vints(&prx_reader, prx_out, pl->freq);
+            }
+            pw_end_term(pw, &ti);
+            tiw_add(tiw, pl->term, pl->term_len, &ti);
+        }
+        if (dv) {
+            dv_drop_unused_terms(dv);
+            dvw_add(dvw, fi->number, dv);
+            dv_destroy(dv);
+        }
     }
+    pw_close(pw);
+    tiw_close(tiw);
+    dvw_close(dvw);
+    dw_flush_streams(dw);
+}
+
+DocWriter *dw_open(IndexWriter *iw, SegmentInfo *si)
+{
+    Store *store = iw->store;
+    MemoryPool *mp = mp_new_capa(iw->config.chunk_size,
+        iw->config.max_buffer_memory/iw->config.chunk_size);
+
+    DocWriter *dw = ALLOC(DocWriter);
+
+    dw->mp          = mp;
+    dw->bbp         = bbp_new();
+    dw->tv_bbp      = bbp_new();
+    dw->analyzer    = iw->analyzer;
+    dw->fis         = iw->fis;
+    dw->store       = store;
+    dw->fw          = fw_open(store, si->name, iw->fis);
+    dw->si          = si;
+
+    dw->curr_plists = h_new_str(NULL, NULL);
+    dw->doc_plists  = ALLOC_N(PostingList *, DW_PLISTS_INIT_CAPA);
+    dw->doc_plists_capa = DW_PLISTS_INIT_CAPA;
+    dw->fields      = h_new_int((free_ft)fld_inv_destroy);
+    dw->doc_num     = 0;
 
-    return fr_get_field_tv(fr, doc_num, fi->number);
-}
+    dw->index_interval      = iw->config.index_interval;
+    dw->skip_interval       = iw->config.skip_interval;
+    dw->max_field_length    = iw->config.max_field_length;
+    dw->max_buffered_docs   = iw->config.max_buffered_docs;
 
-static Hash *sr_term_vectors(IndexReader *ir, int doc_num)
-{
-    FieldsReader *fr;
-    if (!SR(ir)->fr || NULL == (fr = sr_fr(SR(ir)))) {
-        return NULL;
-    }
+    dw->offsets             = ALLOC_AND_ZERO_N(Offset, DW_OFFSET_INIT_CAPA);
+    dw->offsets_size        = 0;
+    dw->offsets_capa        = DW_OFFSET_INIT_CAPA;
 
-    return fr_get_tv(fr, doc_num);
+    dw->similarity          = iw->similarity;
+    dw->analyzer_mutex      = NULL;
+    return dw;
 }
 
-static bool sr_is_deleted(IndexReader *ir, int doc_num)
+void dw_new_segment(DocWriter *dw, SegmentInfo *si)
 {
-    bool is_del;
-
-    mutex_lock(&ir->mutex);
-    is_del = sr_is_deleted_i(SR(ir), doc_num);
-    mutex_unlock(&ir->mutex);
-
-    return is_del;
+    dw->fw = fw_open(dw->store, si->name, dw->fis);
+    dw->si = si;
 }
 
-static bool sr_has_deletions(IndexReader *ir)
+void dw_close(DocWriter *dw)
 {
-    return NULL != SR(ir)->deleted_docs;
+    if (dw->doc_num) {
+        dw_flush(dw);
+    }
+    if (dw->fw) {
+        fw_close(dw->fw);
+    }
+    h_destroy(dw->curr_plists);
+    free(dw->doc_plists);
+    h_destroy(dw->fields);
+    mp_destroy(dw->mp);
+    bbp_destroy(dw->bbp);
+    bbp_destroy(dw->tv_bbp);
+    free(dw->offsets);
+    free(dw);
 }
 
-static void sr_open_norms(IndexReader *ir, Store *cfs_store)
+FieldInverter *dw_get_fld_inv(DocWriter *dw, FieldInfo *fi)
 {
-    int i;
-    SegmentInfo *si = SR(ir)->si;
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    FieldInverter *fld_inv = (FieldInverter*)h_get_int(dw->fields, fi->number);
 
-    for (i = si->norm_gens_size - 1; i >= 0; i--) {
-        Store *store = (si->use_compound_file && si->norm_gens[i] == 0) ?
-            cfs_store : ir->store;
-        if (si_norm_file_name(si, file_name, i)) {
-            h_set_int(SR(ir)->norms, i,
-                      norm_create(store->open_input(store, file_name), i));
-        }
+    if (!fld_inv) {
+        fld_inv = fld_inv_new(dw, fi);
+        h_set_int(dw->fields, fi->number, fld_inv);
     }
-    SR(ir)->norms_dirty = false;
+    return fld_inv;
 }
 
-static IndexReader *sr_setup_i(SegmentReader *sr)
+static void dw_add_posting(DocWriter *dw,
+                           ByteBlockPool *tv_bbp,
+                           Hash *fld_plists,
+                           int doc_num,
+                           const char *text,
+                           int len,
+                           int pos)
 {
-    Store *volatile store = sr->si->store;
-    IndexReader *ir = IR(sr);
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    char *sr_segment = sr->si->name;
-
-    ir->num_docs            = &sr_num_docs;
-    ir->max_doc             = &sr_max_doc;
-    ir->get_doc             = &sr_get_doc;
-    ir->get_lazy_doc        = &sr_get_lazy_doc;
-    ir->get_norms           = &sr_get_norms;
-    ir->get_norms_into      = &sr_get_norms_into;
-    ir->terms               = &sr_terms;
-    ir->terms_from          = &sr_terms_from;
-    ir->doc_freq            = &sr_doc_freq;
-    ir->term_docs           = &sr_term_docs;
-    ir->term_positions      = &sr_term_positions;
-    ir->term_vector         = &sr_term_vector;
-    ir->term_vectors        = &sr_term_vectors;
-    ir->is_deleted          = &sr_is_deleted;
-    ir->has_deletions       = &sr_has_deletions;
-
-    ir->set_norm_i          = &sr_set_norm_i;
-    ir->delete_doc_i        = &sr_delete_doc_i;
-    ir->undelete_all_i      = &sr_undelete_all_i;
-    ir->set_deleter_i       = &sr_set_deleter_i;
-    ir->is_latest_i         = &sr_is_latest_i;
-    ir->commit_i            = &sr_commit_i;
-    ir->close_i             = &sr_close_i;
-
-    sr->cfs_store   = NULL;
+    MemoryPool *mp = dw->mp;
+    ByteBlockPool *bbp = dw->bbp;
+    Hash *curr_plists = dw->curr_plists;
+    HashEntry *pl_he;
+    PostingList *pl;
+    if (h_set_ext(curr_plists, text, &pl_he)) {
+        HashEntry *fld_pl_he;
 
-    TRY
-        if (sr->si->use_compound_file) {
-            sprintf(file_name, "%s.cfs", sr_segment);
-            sr->cfs_store = open_cmpd_store(store, file_name);
-            store = sr->cfs_store;
+        if (h_set_ext(fld_plists, text, &fld_pl_he)) {
+            fld_pl_he->value = pl = pl_new(mp, bbp, tv_bbp, text, len,
+                                           doc_num);
+            pl_he->key = fld_pl_he->key = (char *)pl->term;
         }
-
-        sr->fr = fr_open(store, sr_segment, ir->fis);
-        sr->sfi = sfi_open(store, sr_segment);
-        sr->tir = tir_open(store, sr->sfi, sr_segment);
-
-        sr->deleted_docs = NULL;
-        sr->deleted_docs_dirty = false;
-        sr->undelete_all = false;
-        if (si_has_deletions(sr->si)) {
-            fn_for_generation(file_name, sr_segment, "del", sr->si->del_gen);
-            sr->deleted_docs = bv_read(sr->si->store, file_name);
+        else {
+            pl = (PostingList *)fld_pl_he->value;
+            pl_add_doc(bbp, tv_bbp, pl, doc_num);
+            pl_he->key = (char *)pl->term;
         }
-
-        sprintf(file_name, "%s.frq", sr_segment);
-        sr->frq_in = store->open_input(store, file_name);
-        sprintf(file_name, "%s.prx", sr_segment);
-        sr->prx_in = store->open_input(store, file_name);
-        sr->norms = h_new_int((free_ft)&norm_destroy);
-        sr_open_norms(ir, store);
-        if (fis_has_vectors(ir->fis)) {
-            thread_key_create(&sr->thread_fr, NULL);
-            sr->fr_bucket = ary_new();
+        pl_he->value = pl;
+        /* keep the document's terms in an array too so term vectors can be
+         * sorted without scanning the whole hash table */
+        if (curr_plists->size > dw->doc_plists_capa) {
+            dw->doc_plists_capa <<= 1;
+            REALLOC_N(dw->doc_plists, PostingList *, dw->doc_plists_capa);
         }
-    XCATCHALL
-        ir->sis = NULL;
-        ir_close(ir);
-    XENDTRY
-
-    return ir;
+        dw->doc_plists[curr_plists->size - 1] = pl;
+    }
+    else {
+        pl = (PostingList *)pl_he->value;
+    }
+    pl_add_pos(bbp, tv_bbp, pl, pos);
 }
 
-static IndexReader *sr_open(SegmentInfos *sis, FieldInfos *fis, int si_num,
-                            bool is_owner)
+static INLINE void dw_add_offsets(DocWriter *dw, int pos, off_t start, off_t end)
 {
-    SegmentReader *sr = ALLOC_AND_ZERO(SegmentReader);
-    sr->si = sis->segs[si_num];
-    ir_setup(IR(sr), sr->si->store, sis, fis, is_owner);
-    return sr_setup_i(sr);
+    if (pos >= dw->offsets_capa) {
+        int old_capa = dw->offsets_capa;
+        while (pos >= dw->offsets_capa) {
+            dw->offsets_capa <<= 1;
+        }
+        REALLOC_N(dw->offsets, Offset, dw->offsets_capa);
+        ZEROSET_N(dw->offsets + old_capa, Offset, dw->offsets_capa - old_capa);
+    }
+    dw->offsets[pos].start = start;
+    dw->offsets[pos].end = end;
+    dw->offsets_size = pos + 1;
 }
 
-/****************************************************************************
- * MultiReader
- ****************************************************************************/
-
-#define MR(ir) ((MultiReader *)(ir))
-
-static int mr_reader_index_i(MultiReader *mr, int doc_num)
+Hash *dw_invert_field(DocWriter *dw,
+                           FieldInverter *fld_inv,
+                           DocField *df)
 {
-    int lo = 0;                       /* search @starts array */
-    int hi = mr->r_cnt - 1;            /* for first element less */
-    int mid;
-    int mid_value;
+    ByteBlockPool *tv_bbp = fld_inv->store_term_vector
+        && fi_store_positions(fld_inv->fi) ? dw->tv_bbp : NULL;
+    Analyzer *a = dw->analyzer;
+    Hash *curr_plists = dw->curr_plists;
+    Hash *fld_plists = fld_inv->plists;
+    const bool store_offsets = fld_inv->store_offsets;
+    int doc_num = dw->doc_num;
+    int i;
+    const int df_size = df->size;
+    off_t start_offset = 0;
 
-    while (hi >= lo) {
-        mid = (lo + hi) >> 1;
-        mid_value = mr->starts[mid];
-        if (doc_num < mid_value) {
-            hi = mid - 1;
-        }
-        else if (doc_num > mid_value) {
-            lo = mid + 1;
-        }
-        else { /* found a match */
-            while ((mid+1 < mr->r_cnt) && (mr->starts[mid+1] == mid_value)) {
-                mid += 1; /* scan to last match in case we have empty segments */
+    if (fld_inv->is_tokenized) {
+        Token *tk;
+        int pos = -1, num_terms = 0;
+
+        for (i = 0; i < df_size; i++) {
+            TokenStream *ts;
+            /* cloning a TokenStream isn't thread safe but using one is */
+            if (dw->analyzer_mutex) mutex_lock(dw->analyzer_mutex);
+            ts = a_get_ts(a, df->name, df->data[i]);
+            if (dw->analyzer_mutex) mutex_unlock(dw->analyzer_mutex);
+            /* ts->reset(ts, df->data[i]); no longer being called */
+            if (store_offsets) {
+                while (NULL != (tk = ts->next(ts))) {
+                    pos += tk->pos_inc;
+                    /* if for some reason pos gets set to some number less
+                     * than 0 the we'll start pos at 0 */
+                    if (pos < 0) {
+                        pos = 0;
+                    }
+                    dw_add_posting(dw, tv_bbp, fld_plists,
+                                   doc_num, tk->text, tk->len, pos);
+                    dw_add_offsets(dw, pos,
+                                   start_offset + tk->start,
+                                   start_offset + tk->end);
+                    if (num_terms++ >= dw->max_field_length) {
+                        break;
+                    }
+                }
             }
-            return mid;
+            else {
+                while (NULL != (tk = ts->next(ts))) {
+                    pos += tk->pos_inc;
+                    dw_add_posting(dw, tv_bbp, fld_plists,
+                                   doc_num, tk->text, tk->len, pos);
+                    if (num_terms++ >= dw->max_field_length) {
+                        break;
+                    }
+                }
+            }
+            if (dw->analyzer_mutex) mutex_lock(dw->analyzer_mutex);
+            ts_deref(ts);
+            if (dw->analyzer_mutex) mutex_unlock(dw->analyzer_mutex);
+            start_offset += df->lengths[i] + 1;
         }
+        fld_inv->length = num_terms;
     }
-    return hi;
-}
-
-static int mr_num_docs(IndexReader *ir)
-{
-    int i, num_docs;
-    mutex_lock(&ir->mutex);
-    if (MR(ir)->num_docs_cache == -1) {
-        const int mr_reader_cnt = MR(ir)->r_cnt;
-        MR(ir)->num_docs_cache = 0;
-        for (i = 0; i < mr_reader_cnt; i++) {
-            IndexReader *reader = MR(ir)->sub_readers[i];
-            MR(ir)->num_docs_cache += reader->num_docs(reader);
+    else {
+        char buf[MAX_WORD_SIZE];
+        buf[MAX_WORD_SIZE - 1] = '\0';
+        for (i = 0; i < df_size; i++) {
+            int len = df->lengths[i];
+            char *data_ptr = df->data[i];
+            if (len > MAX_WORD_SIZE) {
+                len = MAX_WORD_SIZE - 1;
+                data_ptr = (char *)memcpy(buf, df->data[i], len);
+            }
+            dw_add_posting(dw, tv_bbp, fld_plists,
+                           doc_num, data_ptr, len, i);
+            if (store_offsets) {
+                dw_add_offsets(dw, i, start_offset,
+                               start_offset + df->lengths[i]);
+            }
+            start_offset += df->lengths[i] + 1;
         }
+        fld_inv->length = i;
     }
-    num_docs = MR(ir)->num_docs_cache;
-    mutex_unlock(&ir->mutex);
-
-    return num_docs;
+    return curr_plists;
 }
 
-static int mr_max_doc(IndexReader *ir)
+/*
+ * A tokenized field analyzed ahead of inversion by iw_add_docs. Each token's
+ * text is kept null terminated in +text+ and its offsets already include
+ * the lengths of the field's earlier values.
+ */
+typedef struct BufferedToken
 {
-    return MR(ir)->max_doc;
-}
-
-#define GET_READER()\
-    int i = mr_reader_index_i(MR(ir), doc_num);\
-    IndexReader *reader = MR(ir)->sub_readers[i]
+    int text_at;
+    int len;
+    int pos_inc;
+    off_t start;
+    off_t end;
+} BufferedToken;
 
-static Document *mr_get_doc(IndexReader *ir, int doc_num)
+typedef struct TokenBuffer
 {
-    GET_READER();
-    return reader->get_doc(reader, doc_num - MR(ir)->starts[i]);
-}
+    char *text;
+    int text_size;
+    int text_capa;
+    BufferedToken *tokens;
+    int size;
+    int capa;
+} TokenBuffer;
 
-static LazyDoc *mr_get_lazy_doc(IndexReader *ir, int doc_num)
+static void tb_destroy(TokenBuffer *tb)
 {
-    GET_READER();
-    return reader->get_lazy_doc(reader, doc_num - MR(ir)->starts[i]);
+    free(tb->text);
+    free(tb->tokens);
+    free(tb);
 }
 
-int mr_get_field_num(MultiReader *mr, int ir_num, int f_num)
+static void tb_add(TokenBuffer *tb, Token *tk, off_t start_offset)
 {
-    if (mr->field_num_map) {
-        return mr->field_num_map[ir_num][f_num];
+    BufferedToken *btk;
+    if (tb->size == tb->capa) {
+        tb->capa = tb->capa ? tb->capa << 1 : 64;
+        REALLOC_N(tb->tokens, BufferedToken, tb->capa);
     }
-    else {
-        return f_num;
+    if (tb->text_size + tk->len + 1 > tb->text_capa) {
+        tb->text_capa = tb->text_capa ? tb->text_capa << 1 : 512;
+        while (tb->text_size + tk->len + 1 > tb->text_capa) {
+            tb->text_capa <<= 1;
+        }
+        REALLOC_N(tb->text, char, tb->text_capa);
     }
+    btk = &tb->tokens[tb->size++];
+    btk->text_at = tb->text_size;
+    btk->len = tk->len;
+    btk->pos_inc = tk->pos_inc;
+    btk->start = start_offset + tk->start;
+    btk->end = start_offset + tk->end;
+    memcpy(tb->text + tb->text_size, tk->text, tk->len);
+    tb->text[tb->text_size + tk->len] = '\0';
+    tb->text_size += tk->len + 1;
 }
 
-static uchar *mr_get_norms(IndexReader *ir, int field_num)
+/*
+ * Analyze +df+ into a TokenBuffer, stopping at the same token
+ * dw_invert_field would.
+ */
+static TokenBuffer *tb_analyze(Analyzer *a, mutex_t *analyzer_mutex,
+                               DocField *df, int max_field_length)
 {
-    uchar *bytes;
-
-    mutex_lock(&ir->mutex);
-    bytes = (uchar *)h_get_int(MR(ir)->norms_cache, field_num);
-    if (NULL == bytes) {
-        int i;
-        const int mr_reader_cnt = MR(ir)->r_cnt;
-
-        bytes = ALLOC_AND_ZERO_N(uchar, MR(ir)->max_doc);
-
-        for (i = 0; i < mr_reader_cnt; i++) {
-            int fnum = mr_get_field_num(MR(ir), i, field_num);
-            if (fnum >= 0) {
-                IndexReader *reader = MR(ir)->sub_readers[i];
-                reader->get_norms_into(reader, fnum, bytes + MR(ir)->starts[i]);
+    TokenBuffer *tb = ALLOC_AND_ZERO(TokenBuffer);
+    TokenStream *volatile ts = NULL;
+    off_t start_offset = 0;
+    int i, num_terms = 0;
+    Token *tk;
+    TRY
+        for (i = 0; i < df->size; i++) {
+            mutex_lock(analyzer_mutex);
+            ts = a_get_ts(a, df->name, df->data[i]);
+            mutex_unlock(analyzer_mutex);
+            while (NULL != (tk = ts->next(ts))) {
+                tb_add(tb, tk, start_offset);
+                if (num_terms++ >= max_field_length) {
+                    break;
+                }
             }
+            mutex_lock(analyzer_mutex);
+            ts_deref(ts);
+            mutex_unlock(analyzer_mutex);
+            ts = NULL;
+            start_offset += df->lengths[i] + 1;
         }
-        h_set_int(MR(ir)->norms_cache, field_num, bytes); /* update cache */
-    }
-    mutex_unlock(&ir->mutex);
-
-    return bytes;
+    XCATCHALL
+        if (ts) {
+            mutex_lock(analyzer_mutex);
+            ts_deref(ts);
+            mutex_unlock(analyzer_mutex);
+        }
+        tb_destroy(tb);
+    XENDTRY
+    return tb;
 }
 
-static uchar *mr_get_norms_into(IndexReader *ir, int field_num, uchar *buf)
+/* invert a field analyzed ahead of time by tb_analyze */
+static Hash *dw_invert_tokens(DocWriter *dw,
+                              FieldInverter *fld_inv,
+                              TokenBuffer *tb)
 {
-    uchar *bytes;
+    ByteBlockPool *tv_bbp = fld_inv->store_term_vector
+        && fi_store_positions(fld_inv->fi) ? dw->tv_bbp : NULL;
+    Hash *fld_plists = fld_inv->plists;
+    const bool store_offsets = fld_inv->store_offsets;
+    int doc_num = dw->doc_num;
+    int i, pos = -1;
 
-    mutex_lock(&ir->mutex);
-    bytes = (uchar *)h_get_int(MR(ir)->norms_cache, field_num);
-    if (NULL != bytes) {
-        memcpy(buf, bytes, MR(ir)->max_doc);
-    }
-    else {
-        int i;
-        const int mr_reader_cnt = MR(ir)->r_cnt;
-        for (i = 0; i < mr_reader_cnt; i++) {
-            int fnum = mr_get_field_num(MR(ir), i, field_num);
-            if (fnum >= 0) {
-                IndexReader *reader = MR(ir)->sub_readers[i];
-                reader->get_norms_into(reader, fnum, buf + MR(ir)->starts[i]);
+    for (i = 0; i < tb->size; i++) {
+        BufferedToken *btk = &tb->tokens[i];
+        pos += btk->pos_inc;
+        if (store_offsets) {
+            if (pos < 0) {
+                pos = 0;
             }
+            dw_add_posting(dw, tv_bbp, fld_plists, doc_num,
+                           tb->text + btk->text_at, btk->len, pos);
+            dw_add_offsets(dw, pos, btk->start, btk->end);
+        }
+        else {
+            dw_add_posting(dw, tv_bbp, fld_plists, doc_num,
+                           tb->text + btk->text_at, btk->len, pos);
         }
     }
-    mutex_unlock(&ir->mutex);
-    return buf;
+    fld_inv->length = tb->size;
+    return dw->curr_plists;
 }
 
-static TermEnum *mr_terms(IndexReader *ir, int field_num)
+void dw_reset_postings(Hash *postings)
 {
-    return mte_new(MR(ir), field_num, NULL);
+    ZEROSET_N(postings->table, HashEntry, postings->mask + 1);
+    postings->fill = postings->size = 0;
 }
 
-static TermEnum *mr_terms_from(IndexReader *ir, int field_num, const char *term)
+/*
+ * +tbs+ holds the tokenized fields of +doc+, by position in the document,
+ * if iw_add_docs analyzed them ahead of time. Otherwise it is NULL.
+ */
+static void dw_add_doc_i(DocWriter *dw, Document *doc, TokenBuffer **tbs)
 {
-    return mte_new(MR(ir), field_num, term);
-}
+    int i;
+    float boost;
+    DocField *df;
+    FieldInverter *fld_inv;
+    Hash *postings;
+    FieldInfo *fi;
+    const int doc_size = doc->size;
 
-static int mr_doc_freq(IndexReader *ir, int field_num, const char *t)
-{
-    int total = 0;          /* sum freqs in segments */
-    int i = MR(ir)->r_cnt;
-    for (i = MR(ir)->r_cnt - 1; i >= 0; i--) {
-        int fnum = mr_get_field_num(MR(ir), i, field_num);
-        if (fnum >= 0) {
-            IndexReader *reader = MR(ir)->sub_readers[i];
-            total += reader->doc_freq(reader, fnum, t);
+    /* fw_add_doc will add new fields as necessary */
+    fw_add_doc(dw->fw, doc);
+
+    for (i = 0; i < doc_size; i++) {
+        df = doc->fields[i];
+        fi = fis_get_field(dw->fis, df->name);
+        if (!fi_is_indexed(fi)) {
+            continue;
+        }
+        fld_inv = dw_get_fld_inv(dw, fi);
+
+        if (tbs && tbs[i] && fld_inv->is_tokenized) {
+            postings = dw_invert_tokens(dw, fld_inv, tbs[i]);
+        }
+        else {
+            postings = dw_invert_field(dw, fld_inv, df);
+        }
+        if (fld_inv->store_term_vector) {
+            pl_sort(dw->doc_plists, postings->size);
+            fw_add_postings(dw->fw, fld_inv->fi->number, dw->tv_bbp,
+                            dw->doc_plists, postings->size,
+                            dw->offsets, dw->offsets_size);
+        }
+
+        if (fld_inv->has_norms) {
+            boost = fld_inv->fi->boost * doc->boost * df->boost *
+                sim_length_norm(dw->similarity, fi->name, fld_inv->length);
+            fld_inv->norms[dw->doc_num] =
+                sim_encode_norm(dw->similarity, boost);
+        }
+        dw_reset_postings(postings);
+        bbp_reset(dw->tv_bbp);
+        if (dw->offsets_size > 0) {
+            ZEROSET_N(dw->offsets, Offset, dw->offsets_size);
+            dw->offsets_size = 0;
         }
     }
-    return total;
+    fw_write_tv_index(dw->fw);
+    dw->doc_num++;
 }
 
-static TermDocEnum *mr_term_docs(IndexReader *ir)
+void dw_add_doc(DocWriter *dw, Document *doc)
 {
-    return mtde_new(MR(ir));
+    dw_add_doc_i(dw, doc, NULL);
 }
 
-static TermDocEnum *mr_term_positions(IndexReader *ir)
+static int dw_ram_used(DocWriter *dw)
 {
-    return mtpe_new(MR(ir));
+    return mp_used(dw->mp) + bbp_used(dw->bbp);
 }
 
-static TermVector *mr_term_vector(IndexReader *ir, int doc_num,
-                                  Symbol field)
-{
-    GET_READER();
-    return reader->term_vector(reader, doc_num - MR(ir)->starts[i], field);
-}
+/****************************************************************************
+ *
+ * IndexWriter
+ *
+ ****************************************************************************/
+/****************************************************************************
+ * SegmentMergeInfo
+ ****************************************************************************/
 
-static Hash *mr_term_vectors(IndexReader *ir, int doc_num)
-{
-    GET_READER();
-    return reader->term_vectors(reader, doc_num - MR(ir)->starts[i]);
-}
+typedef struct SegmentMergeInfo {
+    int base;
+    int max_doc;
+    int doc_cnt;
+    SegmentInfo *si;
+    Store *store;
+    Store *orig_store;
+    BitVector *deleted_docs;
+    SegmentFieldIndex *sfi;
+    TermEnum *te;
+    TermDocEnum *tde;
+    char *term;
+    int *doc_map;
+    InStream *frq_in;
+    InStream *prx_in;
+} SegmentMergeInfo;
 
-static bool mr_is_deleted(IndexReader *ir, int doc_num)
+static bool smi_lt(const SegmentMergeInfo *smi1, const SegmentMergeInfo *smi2)
 {
-    GET_READER();
-    return reader->is_deleted(reader, doc_num - MR(ir)->starts[i]);
+    int cmpres = strcmp(smi1->term, smi2->term);
+    if (0 == cmpres) {
+        return smi1->base < smi2->base;
+    }
+    else {
+        return cmpres < 0;
+    }
 }
 
-static bool mr_has_deletions(IndexReader *ir)
+static void smi_load_doc_map(SegmentMergeInfo *smi)
 {
-    return MR(ir)->has_deletions;
+    BitVector *deleted_docs = smi->deleted_docs;
+    const int max_doc = smi->max_doc;
+    int j = 0, i;
+
+    smi->doc_map = ALLOC_N(int, max_doc);
+    for (i = 0; i < max_doc; i++) {
+        if (bv_get(deleted_docs, i)) {
+            smi->doc_map[i] = -1;
+        }
+        else {
+            smi->doc_map[i] = j++;
+        }
+    }
+    smi->doc_cnt = j;
 }
 
-static void mr_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar val)
+/* +deleted_docs+ belongs to the caller and must outlive the SegmentMergeInfo */
+static SegmentMergeInfo *smi_new(int base, Store *store, SegmentInfo *si,
+                                 BitVector *deleted_docs)
 {
-    int i = mr_reader_index_i(MR(ir), doc_num);
-    int fnum = mr_get_field_num(MR(ir), i, field_num);
-    if (fnum >= 0) {
-        IndexReader *reader = MR(ir)->sub_readers[i];
-        ir->has_changes = true;
-        h_del_int(MR(ir)->norms_cache, fnum);/* clear cache */
-        ir_set_norm_i(reader, doc_num - MR(ir)->starts[i], fnum, val);
+    SegmentMergeInfo *smi = ALLOC_AND_ZERO(SegmentMergeInfo);
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    char *segment = si->name;
+    smi->base = base;
+    smi->si = si;
+    smi->orig_store = smi->store = store;
+    sprintf(file_name, "%s.cfs", segment);
+    if (store->exists(store, file_name)) {
+        smi->store = open_cmpd_store(store, file_name);
+    }
+
+
+    sprintf(file_name, "%s.fdx", segment);
+    smi->doc_cnt = smi->max_doc
+        = smi->store->length(smi->store, file_name) / FIELDS_IDX_PTR_SIZE;
+    /* shared by every stage of the merge */
+    smi->sfi = sfi_open(smi->store, segment);
+
+    if (deleted_docs) {
+        smi->deleted_docs = deleted_docs;
+        smi_load_doc_map(smi);
     }
+    return smi;
 }
 
-static void mr_delete_doc_i(IndexReader *ir, int doc_num)
+static void smi_load_term_input(SegmentMergeInfo *smi)
 {
-    GET_READER();
-    MR(ir)->num_docs_cache = -1; /* invalidate cache */
-
-    /* dispatch to segment reader */
-    reader->delete_doc_i(reader, doc_num - MR(ir)->starts[i]);
-    MR(ir)->has_deletions = true;
-    ir->has_changes = true;
+    Store *store = smi->store;
+    char *segment = smi->si->name;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    sprintf(file_name, "%s.tis", segment);
+    smi->te = TE(ste_new(store->open_input(store, file_name), smi->sfi));
+    sprintf(file_name, "%s.frq", segment);
+    smi->frq_in = store->open_input(store, file_name);
+    sprintf(file_name, "%s.prx", segment);
+    smi->prx_in = store->open_input(store, file_name);
+    is_advise(STE(smi->te)->is, IS_SEQUENTIAL);
+    is_advise(smi->frq_in, IS_SEQUENTIAL);
+    is_advise(smi->prx_in, IS_SEQUENTIAL);
+    smi->tde = stpe_new(NULL, smi->frq_in, smi->prx_in, smi->deleted_docs,
+                        STE(smi->te)->skip_interval, smi->si);
 }
 
-static void mr_undelete_all_i(IndexReader *ir)
+static void smi_close_term_input(SegmentMergeInfo *smi)
 {
-    int i;
-    const int mr_reader_cnt = MR(ir)->r_cnt;
+    ste_close(smi->te);
+    stpe_close(smi->tde);
+    is_close(smi->frq_in);
+    is_close(smi->prx_in);
+}
 
-    MR(ir)->num_docs_cache = -1;                     /* invalidate cache */
-    for (i = 0; i < mr_reader_cnt; i++) {
-        IndexReader *reader = MR(ir)->sub_readers[i];
-        reader->undelete_all_i(reader);
+static void smi_destroy(SegmentMergeInfo *smi)
+{
+    sfi_close(smi->sfi);
+    if (smi->store != smi->orig_store) {
+        store_deref(smi->store);
     }
-    MR(ir)->has_deletions = false;
-    ir->has_changes = true;
+    free(smi->doc_map);
+    free(smi);
 }
 
-static void mr_set_deleter_i(IndexReader *ir, Deleter *deleter)
+static char *smi_next(SegmentMergeInfo *smi)
 {
-    int i;
-    ir->deleter = deleter;
-    for (i = MR(ir)->r_cnt - 1; i >= 0; i--) {
-        IndexReader *reader = MR(ir)->sub_readers[i];
-        reader->set_deleter_i(reader, deleter);
-    }
+    return (smi->term = ste_next(smi->te));
 }
 
-static bool mr_is_latest_i(IndexReader *ir)
+/****************************************************************************
+ * SegmentMerger
+ ****************************************************************************/
+
+typedef struct SegmentMerger {
+    Store *store;
+    FieldInfos *fis;
+    SegmentInfo *si;
+    SegmentMergeInfo **smis;
+    int seg_cnt;
+    int doc_cnt;
+    Config *config;
+    ThreadPool *pool;
+    int stage_cnt;
+    TermInfosWriter *tiw;
+    char *term_buf;
+    int term_buf_ptr;
+    int term_buf_size;
+} SegmentMerger;
+
+static SegmentMerger *sm_create(IndexWriter *iw, FieldInfos *fis,
+                                SegmentInfo *si, SegmentInfo **seg_infos,
+                                BitVector **deleted_docs, const int seg_cnt)
 {
     int i;
-    const int mr_reader_cnt = MR(ir)->r_cnt;
-    for (i = 0; i < mr_reader_cnt; i++) {
-        if (!ir_is_latest(MR(ir)->sub_readers[i])) {
-            return false;
-        }
+    SegmentMerger *sm = ALLOC_AND_ZERO_N(SegmentMerger, seg_cnt);
+    sm->store = iw->store;
+    sm->fis = fis;
+    sm->si = si;
+    sm->doc_cnt = 0;
+    sm->smis = ALLOC_N(SegmentMergeInfo *, seg_cnt);
+    for (i = 0; i < seg_cnt; i++) {
+        sm->smis[i] = smi_new(sm->doc_cnt, seg_infos[i]->store,
+                              seg_infos[i], deleted_docs[i]);
+        sm->doc_cnt += sm->smis[i]->doc_cnt;
     }
-    return true;
+    sm->seg_cnt = seg_cnt;
+    sm->config = &iw->config;
+    sm->pool = iw->merge_pool;
+    sm->stage_cnt = 1;
+    return sm;
 }
 
-static void mr_commit_i(IndexReader *ir)
+static void sm_destroy(SegmentMerger *sm)
 {
     int i;
-    const int mr_reader_cnt = MR(ir)->r_cnt;
-    for (i = 0; i < mr_reader_cnt; i++) {
-        IndexReader *reader = MR(ir)->sub_readers[i];
-        ir_commit_i(reader);
+    const int seg_cnt = sm->seg_cnt;
+    for (i = 0; i < seg_cnt; i++) {
+        smi_destroy(sm->smis[i]);
     }
+    free(sm->smis);
+    free(sm);
 }
 
-static void mr_close_i(IndexReader *ir)
+/*
+ * A step of the merge. Each stage writes its own files so the stages can run
+ * at the same time. +throttled+ is the number of bytes written by the stage
+ * which it has already been throttled for.
+ */
+typedef struct MergeStage MergeStage;
+struct MergeStage {
+    void (*merge)(MergeStage *stage);
+    SegmentMerger *sm;
+    off_t throttled;
+};
+
+static void sm_run_stage(MergeStage *stage)
 {
-    int i;
-    const int mr_reader_cnt = MR(ir)->r_cnt;
-    for (i = 0; i < mr_reader_cnt; i++) {
-        IndexReader *reader = MR(ir)->sub_readers[i];
-        ir_close(reader);
+    stage->merge(stage);
+}
+
+#define SM_THROTTLE_BYTES 0x10000
+
+/*
+ * Called as a stage writes. +written+ is the number of bytes the stage has
+ * written so far. For every SM_THROTTLE_BYTES written we sleep for as long as
+ * writing them should take at config->merge_rate_limit bytes per second,
+ * shared evenly between the stages running at once.
+ */
+static void sm_throttle(MergeStage *stage, off_t written)
+{
+    SegmentMerger *sm = stage->sm;
+    const int rate = sm->config->merge_rate_limit;
+    if (rate > 0 && written - stage->throttled >= SM_THROTTLE_BYTES) {
+        double usecs = (double)(written - stage->throttled) * 1000000.0
+            * sm->stage_cnt / rate;
+        for (; usecs > 1000000.0; usecs -= 1000000.0) {
+            micro_sleep(1000000);
+        }
+        micro_sleep((int)usecs);
+        stage->throttled = written;
     }
-    free(MR(ir)->sub_readers);
-    h_destroy(MR(ir)->norms_cache);
-    free(MR(ir)->starts);
 }
 
-static IndexReader *mr_new(IndexReader **sub_readers, const int r_cnt)
+static void sm_merge_fields(MergeStage *stage)
 {
-    int i;
-    MultiReader *mr = ALLOC_AND_ZERO(MultiReader);
-    IndexReader *ir = IR(mr);
+    int i, j;
+    off_t start, end = 0;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    OutStream *fdt_out, *fdx_out;
+    SegmentMerger *sm = stage->sm;
+    Store *store = sm->store;
+    const int seg_cnt = sm->seg_cnt;
 
-    mr->sub_readers         = sub_readers;
-    mr->r_cnt               = r_cnt;
-    mr->max_doc             = 0;
-    mr->num_docs_cache      = -1;
-    mr->has_deletions       = false;
+    sprintf(file_name, "%s.fdt", sm->si->name);
+    fdt_out = store->new_output(store, file_name);
 
-    mr->starts              = ALLOC_N(int, (r_cnt+1));
+    sprintf(file_name, "%s.fdx", sm->si->name);
+    fdx_out = store->new_output(store, file_name);
 
-    for (i = 0; i < r_cnt; i++) {
-        IndexReader *sub_reader = sub_readers[i];
-        mr->starts[i] = mr->max_doc;
-        mr->max_doc += sub_reader->max_doc(sub_reader); /* compute max_docs */
+    for (i = 0; i < seg_cnt; i++) {
+        SegmentMergeInfo *smi = sm->smis[i];
+        const int max_doc = smi->max_doc;
+        InStream *fdt_in, *fdx_in;
+        char *segment = smi->si->name;
+        store = smi->store;
+        sprintf(file_name, "%s.fdt", segment);
+        fdt_in = store->open_input(store, file_name);
+        sprintf(file_name, "%s.fdx", segment);
+        fdx_in = store->open_input(store, file_name);
+        is_advise(fdt_in, IS_SEQUENTIAL);
+        is_advise(fdx_in, IS_SEQUENTIAL);
 
-        if (sub_reader->has_deletions(sub_reader)) {
-            mr->has_deletions = true;
+        if (max_doc > 0) {
+            end = (off_t)is_read_u64(fdx_in);
+        }
+        for (j = 0; j < max_doc; j++) {
+            u32 tv_idx_offset = is_read_u32(fdx_in);
+            start = end;
+            if (j == max_doc - 1) {
+                end = is_length(fdt_in);
+            }
+            else {
+                end = (off_t)is_read_u64(fdx_in);
+            }
+            /* skip deleted docs */
+            if (!smi->deleted_docs || !bv_get(smi->deleted_docs, j)) {
+                os_write_u64(fdx_out, os_pos(fdt_out));
+                os_write_u32(fdx_out, tv_idx_offset);
+                is_seek(fdt_in, start);
+                is2os_copy_bytes(fdt_in, fdt_out, end - start);
+                sm_throttle(stage, os_pos(fdt_out) + os_pos(fdx_out));
+            }
         }
+        is_close(fdt_in);
+        is_close(fdx_in);
     }
-    mr->starts[r_cnt]       = mr->max_doc;
-    mr->norms_cache         = h_new_int(&free);
-
-    ir->num_docs            = &mr_num_docs;
-    ir->max_doc             = &mr_max_doc;
-    ir->get_doc             = &mr_get_doc;
-    ir->get_lazy_doc        = &mr_get_lazy_doc;
-    ir->get_norms           = &mr_get_norms;
-    ir->get_norms_into      = &mr_get_norms_into;
-    ir->terms               = &mr_terms;
-    ir->terms_from          = &mr_terms_from;
-    ir->doc_freq            = &mr_doc_freq;
-    ir->term_docs           = &mr_term_docs;
-    ir->term_positions      = &mr_term_positions;
-    ir->term_vector         = &mr_term_vector;
-    ir->term_vectors        = &mr_term_vectors;
-    ir->is_deleted          = &mr_is_deleted;
-    ir->has_deletions       = &mr_has_deletions;
+    os_close(fdt_out);
+    os_close(fdx_out);
+}
 
-    ir->set_norm_i          = &mr_set_norm_i;
-    ir->delete_doc_i        = &mr_delete_doc_i;
-    ir->undelete_all_i      = &mr_undelete_all_i;
-    ir->set_deleter_i       = &mr_set_deleter_i;
-    ir->is_latest_i         = &mr_is_latest_i;
-    ir->commit_i            = &mr_commit_i;
-    ir->close_i             = &mr_close_i;
+/*
+ * The terms of fields +min_field+ up to but not including +max_field+. Each
+ * partition reads the segments through its own copies of the
+ * SegmentMergeInfos. The first partition writes straight to the segment's
+ * term files. The others write their postings to temporary files along with
+ * a list of their terms, which sm_append_partition adds to the segment once
+ * every partition is done.
+ */
+typedef struct TermPartition {
+    MergeStage stage;
+    int num;
+    int min_field;
+    int max_field;
+    SegmentMergeInfo **smis;
+    PriorityQueue *queue;
+    PostingsWriter *pw;
+    OutStream *terms_out;
+    TermInfo ti;
+} TermPartition;
 
-    return ir;
-}
+/* the temporary files written by all but the first partition */
+static const char *PARTITION_EXTENSIONS[] = {"frq", "prx", "trm"};
 
-static IndexReader *mr_open_i(Store *store,
-                       SegmentInfos *sis,
-                       FieldInfos *fis,
-                       IndexReader **sub_readers,
-                       const int r_cnt)
+static char *sm_partition_file_name(SegmentMerger *sm, char *buf, int num,
+                                    const char *ext)
 {
-    IndexReader *ir = mr_new(sub_readers, r_cnt);
-    return ir_setup(ir, store, sis, fis, true);
+    sprintf(buf, "%s_%d.%s", sm->si->name, num, ext);
+    return buf;
 }
 
-static void mr_close_ext_i(IndexReader *ir)
+static int sm_append_postings(TermPartition *part, SegmentMergeInfo **matches,
+                              const int match_size, TermInfo *ti)
 {
-    int **field_num_map = MR(ir)->field_num_map;
-    if (field_num_map) {
-        int i;
-        for (i = MR(ir)->r_cnt - 1; i >= 0; i--) {
-            free(field_num_map[i]);
-        }
-        free(field_num_map);
-    }
-    fis_deref(ir->fis);
-    mr_close_i(ir);
-}
+    int i, j, cnt;
+    int base, doc, freq;
+    int *doc_map = NULL;
+    int docs[STDE_READ_BLOCK];
+    int freqs[STDE_READ_BLOCK];
+    SegmentTermDocEnum *stde;
+    BitVector *deleted_docs;
+    SegmentMergeInfo *smi;
+    PostingsWriter *pw = part->pw;
+    pw_start_term(pw);
 
-IndexReader *mr_open(IndexReader **sub_readers, const int r_cnt)
-{
-    IndexReader *ir = mr_new(sub_readers, r_cnt);
-    MultiReader *mr = MR(ir);
-    /* defaults don't matter, this is just for reading fields, not adding */
-    FieldInfos *fis = fis_new(STORE_NO, INDEX_NO, TERM_VECTOR_NO);
-    int i, j;
-    bool need_field_map = false;
+    for (i = 0; i < match_size; i++) {
+        smi = matches[i];
+        base = smi->base;
+        doc_map = smi->doc_map;
+        stde = STDE(smi->tde);
+        deleted_docs = stde->deleted_docs;
+        stpe_seek_ti(stde, &smi->te->curr_ti);
+
+        /* decode the postings in bulk and use copy_bytes below to copy the
+         * proximities rather than going through stpe_next */
+        while (0 < (cnt = stde->read_postings(stde, docs, freqs,
+                                              STDE_READ_BLOCK))) {
+            for (j = 0; j < cnt; j++) {
+                freq = freqs[j];
+                if (NULL != deleted_docs && bv_get(deleted_docs, docs[j])) {
+                    if (!stde->pulsed) {
+                        is_skip_vints(stde->prx_in, freq);
+                    }
+                    continue;
+                }
+                doc = docs[j];
+                if (NULL != doc_map) {
+                    doc = doc_map[doc]; /* work around deletions */
+                }
+                doc += base;          /* convert to merged space */
+                assert(doc == 0 || doc > pw->last_doc);
 
-    /* Merge FieldInfos */
-    for (i = 0; i < r_cnt; i++) {
-        FieldInfos *sub_fis = sub_readers[i]->fis;
-        const int sub_fis_size = sub_fis->size;
-        for (j = 0; j < sub_fis_size; j++) {
-            FieldInfo *fi = sub_fis->fields[j];
-            FieldInfo *new_fi = fis_get_or_add_field(fis, fi->name);
-            new_fi->bits |= fi->bits;
-            if (fi->number != new_fi->number) {
-                need_field_map = true;
+                /* copy position deltas */
+                if (pw_add_doc(pw, doc, freq)) {
+                    pw->pulsed_pos = stde->pulsed
+                        ? stde->pulsed_pos : (int)is_read_vint(stde->prx_in);
+                }
+                else if (stde->pulsed) {
+                    os_write_vint(pw->prx_out, stde->pulsed_pos);
+                }
+                else {
+                    is2os_copy_vints(stde->prx_in, pw->prx_out, freq);
+                }
             }
         }
     }
+    return pw_end_term(pw, ti);
+}
 
-    /* we only need to build a field map if some of the sub FieldInfos didn't
-     * match the new FieldInfos object */
-    if (need_field_map) {
-        mr->field_num_map = ALLOC_N(int *, r_cnt);
-        for (i = 0; i < r_cnt; i++) {
-            FieldInfos *sub_fis = sub_readers[i]->fis;
-            const int fis_size = fis->size;
-
-            mr->field_num_map[i] = ALLOC_N(int, fis_size);
-            for (j = 0; j < fis_size; j++) {
-                FieldInfo *fi = fis->fields[j];
-                FieldInfo *fi_sub = fis_get_field(sub_fis, fi->name);
-                /* set non existant field nums to -1. The MultiReader will
-                 * skip readers which don't have needed fields */
-                mr->field_num_map[i][j] = fi_sub ? fi_sub->number : -1;
-            }
-        }
-        /* print out the field map
-        for (i = 0; i < r_cnt; i++) {
-            for (j = 0; j < fis->size; j++) {
-                printf("%d ", mr->field_num_map[i][j]);
-            }
-            printf("\n");
-        }
-        */
-    }
-    else {
-        mr->field_num_map = NULL;
+static char *sm_cache_term(SegmentMerger *sm, char *term, int term_len)
+{
+    term = (char *)memcpy(sm->term_buf + sm->term_buf_ptr, term, term_len + 1);
+    sm->term_buf_ptr += term_len + 1;
+    if (sm->term_buf_ptr > sm->term_buf_size) {
+        sm->term_buf_ptr = 0;
     }
+    return term;
+}
 
+static void sm_merge_term_info(TermPartition *part, SegmentMergeInfo **matches,
+                               int match_size)
+{
+    /* append posting data */
+    int df = sm_append_postings(part, matches, match_size, &part->ti);
 
-    ir->close_i = &mr_close_ext_i;
+    if (df > 0) {
+        /* add an entry to the dictionary with ptrs to prox and freq files */
+        SegmentMergeInfo *first_match = matches[0];
+        int term_len = first_match->te->curr_term_len;
 
-    return ir_setup(ir, NULL, NULL, fis, false);
+        if (part->terms_out) {
+            OutStream *os = part->terms_out;
+            os_write_vint(os, term_len + 1);
+            os_write_bytes(os, (uchar *)first_match->term, term_len);
+            ti_write_doc_code(os, &part->ti);
+            os_write_voff_t(os, part->ti.frq_ptr);
+            os_write_voff_t(os, part->ti.prx_ptr);
+            os_write_voff_t(os, part->ti.skip_offset);
+            ti_write_pulsed(os, &part->ti);
+        }
+        else {
+            SegmentMerger *sm = part->stage.sm;
+            tiw_add(sm->tiw, sm_cache_term(sm, first_match->term, term_len),
+                    term_len, &part->ti);
+        }
+    }
 }
 
-/****************************************************************************
- * IndexReader
- ****************************************************************************/
-
-
-static void ir_open_i(Store *store, FindSegmentsFile *fsf)
+static void sm_merge_term_infos(TermPartition *part)
 {
-    volatile bool success = false;
-    IndexReader *volatile ir = NULL;
-    SegmentInfos *volatile sis = NULL;
-    TRY
-    do {
-        FieldInfos *fis;
+    int i, j, match_size;
+    SegmentMergeInfo *smi, *top, **matches;
+    char *term;
+    SegmentMerger *sm = part->stage.sm;
+    PriorityQueue *queue = part->queue;
+    const int seg_cnt = sm->seg_cnt;
 
-        mutex_lock(&store->mutex);
-        sis_read_i(store, fsf);
-        sis = fsf->ret.sis;
-        fis = sis->fis;
+    matches = ALLOC_N(SegmentMergeInfo *, seg_cnt);
 
-        if (sis->size == 1) {
-            ir = sr_open(sis, fis, 0, true);
+    for (j = 0; j < seg_cnt; j++) {
+        smi_load_term_input(part->smis[j]);
+    }
+
+    for (i = part->min_field; i < part->max_field; i++) {
+        if (NULL == part->terms_out) {
+            tiw_start_field(sm->tiw, i);
         }
-        else {
-            volatile int i;
-            IndexReader **readers = ALLOC_N(IndexReader *, sis->size);
-            int num_segments = sis->size;
-            for (i = num_segments - 1; i >= 0; i--) {
-                TRY
-                    readers[i] = sr_open(sis, fis, i, false);
-                XCATCHALL
-                    for (i++; i < num_segments; i++) {
-                        ir_close(readers[i]);
-                    }
-                    free(readers);
-                XENDTRY
+        for (j = 0; j < seg_cnt; j++) {
+            smi = part->smis[j];
+            ste_set_field(smi->te, i);
+            if (NULL != smi_next(smi)) {
+                pq_push(queue, smi); /* initialize @queue */
             }
-            ir = mr_open_i(store, sis, fis, readers, sis->size);
         }
-        fsf->ret.ir = ir;
-        success = true;
-    } while (0);
-    XFINALLY
-        if (!success) {
-            if (ir) {
-                ir_close(ir);
+        while (queue->size > 0) {
+            match_size = 0;     /* pop matching terms */
+            matches[0] = (SegmentMergeInfo *)pq_pop(queue);
+            match_size++;
+            term = matches[0]->term;
+            top = (SegmentMergeInfo *)pq_top(queue);
+            while ((NULL != top) && (0 == strcmp(term, top->term))) {
+                matches[match_size] = (SegmentMergeInfo *)pq_pop(queue);
+                match_size++;
+                top = (SegmentMergeInfo *)pq_top(queue);
             }
-            else if (sis) {
-                sis_destroy(sis);
+
+            sm_merge_term_info(part, matches, match_size);/* add new TermInfo */
+            sm_throttle(&part->stage, os_pos(part->pw->frq_out)
+                        + os_pos(part->pw->prx_out));
+
+            while (match_size > 0) {
+                match_size--;
+                smi = matches[match_size];
+                if (NULL != smi_next(smi)) {
+                    pq_push(queue, smi);   /* restore queue */
+                }
             }
         }
-        mutex_unlock(&store->mutex);
-    XENDTRY
+        if (part->terms_out) {
+            os_write_vint(part->terms_out, 0); /* end of field */
+        }
+    }
+    free(matches);
+    for (j = 0; j < seg_cnt; j++) {
+        smi_close_term_input(part->smis[j]);
+    }
 }
 
-/**
- * Will keep a reference to the store. To let this method delete the store
- * make sure you deref the store that you pass to it
- */
-IndexReader *ir_open(Store *store)
+static void sm_merge_partition(MergeStage *stage)
 {
-    FindSegmentsFile fsf;
-    sis_find_segments_file(store, &fsf, &ir_open_i);
-    return fsf.ret.ir;
-}
-
-/****************************************************************************
- *
- * Offset
- *
- ****************************************************************************/
+    TermPartition *part = (TermPartition *)stage;
+    SegmentMerger *sm = stage->sm;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
 
-Offset *offset_new(off_t start, off_t end)
-{
-    Offset *offset = ALLOC(Offset);
-    offset->start = start;
-    offset->end = end;
-    return offset;
-}
+    if (0 == part->num) {
+        part->pw = pw_open(sm->store, sm->si->name, sm->si,
+                           sm->config->skip_interval);
+    }
+    else {
+        char segment[SEGMENT_NAME_MAX_LENGTH];
+        sprintf(segment, "%s_%d", sm->si->name, part->num);
+        part->pw = pw_open(sm->store, segment, sm->si,
+                           sm->config->skip_interval);
+        part->terms_out = sm->store->new_output(sm->store,
+            sm_partition_file_name(sm, file_name, part->num, "trm"));
+    }
 
-/****************************************************************************
- *
- * Occurence
- *
- ****************************************************************************/
+    sm_merge_term_infos(part);
 
-static Occurence *occ_new(MemoryPool *mp, int pos)
-{
-    Occurence *occ = MP_ALLOC(mp, Occurence);
-    occ->pos = pos;
-    occ->next = NULL;
-    return occ;
+    /* the first partition's postings are appended to by the others */
+    if (part->num > 0) {
+        pw_close(part->pw);
+        part->pw = NULL;
+        os_close(part->terms_out);
+        part->terms_out = NULL;
+    }
 }
 
-/****************************************************************************
- *
- * Posting
- *
- ****************************************************************************/
-
-Posting *p_new(MemoryPool *mp, int doc_num, int pos)
+static TermPartition *sm_partition_new(SegmentMerger *sm, int num,
+                                       int min_field, int max_field)
 {
-    Posting *p = MP_ALLOC(mp, Posting);
-    p->doc_num = doc_num;
-    p->first_occ = occ_new(mp, pos);
-    p->freq = 1;
-    p->next = NULL;
-    return p;
+    int i;
+    TermPartition *part = ALLOC_AND_ZERO(TermPartition);
+    part->stage.merge = &sm_merge_partition;
+    part->stage.sm = sm;
+    part->num = num;
+    part->min_field = min_field;
+    part->max_field = max_field;
+    part->smis = ALLOC_N(SegmentMergeInfo *, sm->seg_cnt);
+    for (i = 0; i < sm->seg_cnt; i++) {
+        part->smis[i] = ALLOC(SegmentMergeInfo);
+        *part->smis[i] = *sm->smis[i];
+    }
+    part->queue = pq_new(sm->seg_cnt, (lt_ft)&smi_lt, NULL);
+    return part;
 }
 
-/****************************************************************************
- *
- * PostingList
- *
- ****************************************************************************/
-
-PostingList *pl_new(MemoryPool *mp, const char *term,
-                           int term_len, Posting *p)
+static void sm_partition_destroy(SegmentMerger *sm, TermPartition *part)
 {
-    PostingList *pl = MP_ALLOC(mp, PostingList);
-    pl->term = (char *)mp_memdup(mp, term, term_len + 1);
-    pl->term_len = term_len;
-    pl->first = pl->last = p;
-    pl->last_occ = p->first_occ;
-    return pl;
+    int i;
+    if (part->pw) {
+        pw_close(part->pw);
+    }
+    if (part->terms_out) {
+        os_close(part->terms_out);
+    }
+    if (part->num > 0) {
+        char file_name[SEGMENT_NAME_MAX_LENGTH];
+        Store *store = sm->store;
+        for (i = 0; i < NELEMS(PARTITION_EXTENSIONS); i++) {
+            sm_partition_file_name(sm, file_name, part->num,
+                                   PARTITION_EXTENSIONS[i]);
+            if (store->exists(store, file_name)) {
+                store->remove(store, file_name);
+            }
+        }
+    }
+    for (i = 0; i < sm->seg_cnt; i++) {
+        free(part->smis[i]);
+    }
+    free(part->smis);
+    pq_destroy(part->queue);
+    free(part);
 }
 
-void pl_add_occ(MemoryPool *mp, PostingList *pl, int pos)
+/*
+ * Split the fields into at most +part_cnt+ partitions with about the same
+ * number of terms, going by the term counts in the segments' field indexes.
+ * Returns the number of partitions, whose first fields are put in
+ * +min_fields+.
+ */
+static int sm_partition_fields(SegmentMerger *sm, int part_cnt,
+                               int *min_fields)
 {
-    pl->last_occ = pl->last_occ->next = occ_new(mp, pos);
-    pl->last->freq++;
-}
+    int i, j, cnt = 1;
+    const int fis_size = sm->fis->size;
+    double tot_terms = 0.0, terms = 0.0;
+    double *field_terms = ALLOC_AND_ZERO_N(double, fis_size + 1);
+
+    for (i = 0; i < sm->seg_cnt; i++) {
+        SegmentFieldIndex *sfi = sm->smis[i]->sfi;
+        for (j = 0; j < fis_size; j++) {
+            SegmentTermIndex *sti = (SegmentTermIndex *)
+                h_get_int(sfi->field_dict, j);
+            if (sti) {
+                field_terms[j] += sti->size;
+                tot_terms += sti->size;
+            }
+        }
+    }
 
-static void pl_add_posting(PostingList *pl, Posting *p)
-{
-    pl->last = pl->last->next = p;
-    pl->last_occ = p->first_occ;
+    min_fields[0] = 0;
+    for (j = 0; j < fis_size && cnt < part_cnt; j++) {
+        /* start a new partition once this one has its share of the terms */
+        if (terms >= tot_terms * cnt / part_cnt && field_terms[j] > 0) {
+            min_fields[cnt++] = j;
+        }
+        terms += field_terms[j];
+    }
+    free(field_terms);
+    return cnt;
 }
 
-int pl_cmp(const PostingList **pl1, const PostingList **pl2)
+/* add the postings and terms of +part+ to those of the first partition */
+static void sm_append_partition(SegmentMerger *sm, TermPartition *first,
+                                TermPartition *part)
 {
-    return strcmp((*pl1)->term, (*pl2)->term);
-}
+    int i, term_len;
+    char term[MAX_WORD_SIZE];
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    Store *store = sm->store;
+    const off_t frq_base = os_pos(first->pw->frq_out);
+    const off_t prx_base = os_pos(first->pw->prx_out);
+    InStream *is;
+    TermInfo ti;
 
-/****************************************************************************
- *
- * FieldInverter
- *
- ****************************************************************************/
+    is = store->open_input(store,
+                           sm_partition_file_name(sm, file_name, part->num,
+                                                  "frq"));
+    is2os_copy_bytes(is, first->pw->frq_out, is_length(is));
+    is_close(is);
+    is = store->open_input(store,
+                           sm_partition_file_name(sm, file_name, part->num,
+                                                  "prx"));
+    is2os_copy_bytes(is, first->pw->prx_out, is_length(is));
+    is_close(is);
 
-static FieldInverter *fld_inv_new(DocWriter *dw, FieldInfo *fi)
-{
-    FieldInverter *fld_inv = MP_ALLOC(dw->mp, FieldInverter);
-    fld_inv->is_tokenized = fi_is_tokenized(fi);
-    fld_inv->store_term_vector = fi_store_term_vector(fi);
-    fld_inv->store_offsets = fi_store_offsets(fi);
-    if ((fld_inv->has_norms = fi_has_norms(fi)) == true) {
-        fld_inv->norms = MP_ALLOC_AND_ZERO_N(dw->mp, uchar,
-                                             dw->max_buffered_docs);
+    is = store->open_input(store,
+                           sm_partition_file_name(sm, file_name, part->num,
+                                                  "trm"));
+    is_advise(is, IS_SEQUENTIAL);
+    for (i = part->min_field; i < part->max_field; i++) {
+        tiw_start_field(sm->tiw, i);
+        while (0 < (term_len = is_read_vint(is))) {
+            term_len--;
+            is_read_bytes(is, (uchar *)term, term_len);
+            term[term_len] = '\0';
+            ti.doc_freq = is_read_vint(is);
+            ti.pulsed = (ti.doc_freq & 1) != 0;
+            ti.doc_freq >>= 1;
+            ti.frq_ptr = frq_base + is_read_voff_t(is);
+            ti.prx_ptr = prx_base + is_read_voff_t(is);
+            ti.skip_offset = is_read_voff_t(is);
+            if (ti.pulsed) {
+                ti.pulsed_doc = is_read_vint(is);
+                ti.pulsed_pos = is_read_vint(is);
+            }
+            tiw_add(sm->tiw, sm_cache_term(sm, term, term_len), term_len, &ti);
+        }
     }
-    fld_inv->fi = fi;
-
-    /* this will alloc it's own memory so must be destroyed */
-    fld_inv->plists = h_new_str(NULL, NULL);
-
-    return fld_inv;
+    is_close(is);
 }
 
-static void fld_inv_destroy(FieldInverter *fld_inv)
+static void sm_merge_norms(MergeStage *stage)
 {
-    h_destroy(fld_inv->plists);
+    SegmentInfo *si;
+    int i, j, k;
+    Store *store;
+    uchar byte;
+    FieldInfo *fi;
+    OutStream *os;
+    InStream *is;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    SegmentMergeInfo *smi;
+    SegmentMerger *sm = stage->sm;
+    const int seg_cnt = sm->seg_cnt;
+    off_t written = 0;
+    for (i = sm->fis->size - 1; i >= 0; i--) {
+        fi = sm->fis->fields[i];
+        if (fi_has_norms(fi))  {
+            si = sm->si;
+            si_advance_norm_gen(si, i);
+            si_norm_file_name(si, file_name, i);
+            os = sm->store->new_output(sm->store, file_name);
+            for (j = 0; j < seg_cnt; j++) {
+                smi = sm->smis[j];
+                si = smi->si;
+                if (si_norm_file_name(si, file_name, i)) {
+                    const int max_doc = smi->max_doc;
+                    BitVector *deleted_docs =  smi->deleted_docs;
+                    store = (si->use_compound_file && si->norm_gens[i])
+                             ? smi->orig_store : smi->store;
+                    is = store->open_input(store, file_name);
+                    is_advise(is, IS_SEQUENTIAL);
+                    if (deleted_docs) {
+                        for (k = 0; k < max_doc; k++) {
+                            byte = is_read_byte(is);
+                            if (!bv_get(deleted_docs, k)) {
+                                os_write_byte(os, byte);
+                            }
+                        }
+                    }
+                    else {
+                        is2os_copy_bytes(is, os, max_doc);
+                    }
+                    is_close(is);
+                }
+                else {
+                    const int doc_cnt = smi->doc_cnt;
+                    for (k = 0; k < doc_cnt; k++) {
+                        os_write_byte(os, '\0');
+                    }
+                }
+                sm_throttle(stage, written + os_pos(os));
+            }
+            written += os_pos(os);
+            os_close(os);
+        }
+    }
 }
 
-/****************************************************************************
- *
- * SkipBuffer
- *
- ****************************************************************************/
-
-typedef struct SkipBuffer
+/* false if +smi+'s segment has no terms in field +field_num+ */
+static bool smi_has_terms(SegmentMergeInfo *smi, int field_num)
 {
-    OutStream *buf;
-    OutStream *frq_out;
-    OutStream *prx_out;
-    int last_doc;
-    off_t last_frq_ptr;
-    off_t last_prx_ptr;
-} SkipBuffer;
+    SegmentTermIndex *sti = (SegmentTermIndex *)
+        h_get_int(smi->sfi->field_dict, field_num);
+    return sti && sti->size > 0;
+}
 
-static void skip_buf_reset(SkipBuffer *skip_buf)
+/*
+ * Merge the columns of each field with doc values. A segment without a
+ * column for a field is fine if it has no terms in the field but otherwise
+ * the merged segment doesn't get a column for it either.
+ */
+static void sm_merge_doc_values(MergeStage *stage)
 {
-    ramo_reset(skip_buf->buf);
-    skip_buf->last_doc = 0;
-    skip_buf->last_frq_ptr = os_pos(skip_buf->frq_out);
-    skip_buf->last_prx_ptr = os_pos(skip_buf->prx_out);
+    int i, j, k;
+    SegmentMerger *sm = stage->sm;
+    const int seg_cnt = sm->seg_cnt;
+    DocValuesReader **dvrs = ALLOC_N(DocValuesReader *, seg_cnt);
+    DocValues **dvs = ALLOC_N(DocValues *, seg_cnt);
+    DocValuesWriter *dvw = dvw_new(sm->store, sm->si->name);
+
+    stage->throttled = 0;
+    for (j = 0; j < seg_cnt; j++) {
+        dvrs[j] = dvr_open(sm->smis[j]->store, sm->smis[j]->si->name);
+    }
+    for (i = 0; i < sm->fis->size; i++) {
+        FieldInfo *fi = sm->fis->fields[i];
+        if (!fi_has_doc_values(fi) || !fi_is_indexed(fi)) {
+            continue;
+        }
+        for (j = 0; j < seg_cnt; j++) {
+            SegmentMergeInfo *smi = sm->smis[j];
+            dvs[j] = dvrs[j] ? dvr_read(dvrs[j], i) : NULL;
+            if (NULL == dvs[j]) {
+                if (smi_has_terms(smi, i)) {
+                    break;
+                }
+                dvs[j] = dv_new(smi->max_doc, 0);
+            }
+        }
+        if (j == seg_cnt) {
+            DocValues *dv = dv_merge(dvs, seg_cnt);
+            int base = 0, size = 0;
+            for (j = 0; j < seg_cnt; j++) {
+                BitVector *deleted_docs = sm->smis[j]->deleted_docs;
+                for (k = 0; k < dvs[j]->size; k++) {
+                    if (!deleted_docs || !bv_get(deleted_docs, k)) {
+                        dv->ords[size++] = dv->ords[base + k];
+                    }
+                }
+                base += dvs[j]->size;
+            }
+            dv->size = size;
+            dv_drop_unused_terms(dv);
+            dvw_add(dvw, i, dv);
+            dv_destroy(dv);
+            sm_throttle(stage, os_pos(dvw->os));
+        }
+        for (k = 0; k < j; k++) {
+            dv_destroy(dvs[k]);
+        }
+    }
+    dvw_close(dvw);
+    for (j = 0; j < seg_cnt; j++) {
+        if (dvrs[j]) {
+            dvr_close(dvrs[j]);
+        }
+    }
+    free(dvs);
+    free(dvrs);
 }
 
-static SkipBuffer *skip_buf_new(OutStream *frq_out, OutStream *prx_out)
+/* the norms and doc values are both a value per document so share a stage */
+static void sm_merge_per_doc(MergeStage *stage)
 {
-    SkipBuffer *skip_buf = ALLOC(SkipBuffer);
-    skip_buf->buf = ram_new_buffer();
-    skip_buf->frq_out = frq_out;
-    skip_buf->prx_out = prx_out;
-    return skip_buf;
+    sm_merge_norms(stage);
+    sm_merge_doc_values(stage);
 }
 
-static void skip_buf_add(SkipBuffer *skip_buf, int doc)
+/*
+ * Copy the stored fields, merge the terms and merge the norms and doc
+ * values. When the merger has a ThreadPool these stages run at the same
+ * time, with the terms split into a partition per group of fields.
+ */
+static int sm_merge(SegmentMerger *sm)
 {
-    off_t frq_ptr = os_pos(skip_buf->frq_out);
-    off_t prx_ptr = os_pos(skip_buf->prx_out);
+    const int max_threads = sm->config->merge_stage_threads;
+    int i, part_cnt = 1, stage_cnt;
+    int *min_fields;
+    MergeStage fields_stage, norms_stage;
+    TermPartition **parts;
+    void **stages;
+
+    /* leave two threads for the stored fields and norms */
+    if (sm->pool && max_threads > 3) {
+        part_cnt = max_threads - 2;
+    }
+    min_fields = ALLOC_N(int, part_cnt + 1);
+    min_fields[0] = 0;
+    if (part_cnt > 1) {
+        part_cnt = sm_partition_fields(sm, part_cnt, min_fields);
+    }
+    min_fields[part_cnt] = sm->fis->size;
+
+    stage_cnt = part_cnt + 2;
+    parts = ALLOC_N(TermPartition *, part_cnt);
+    stages = ALLOC_N(void *, stage_cnt);
+    for (i = 0; i < part_cnt; i++) {
+        stages[i] = parts[i] = sm_partition_new(sm, i, min_fields[i],
+                                                min_fields[i + 1]);
+    }
+    fields_stage.merge = &sm_merge_fields;
+    fields_stage.sm = sm;
+    fields_stage.throttled = 0;
+    norms_stage = fields_stage;
+    norms_stage.merge = &sm_merge_per_doc;
+    stages[part_cnt] = &fields_stage;
+    stages[part_cnt + 1] = &norms_stage;
+    free(min_fields);
+
+    if (sm->pool) {
+        sm->stage_cnt = stage_cnt < max_threads ? stage_cnt : max_threads;
+    }
+    sm->tiw = tiw_open(sm->store, sm->si->name, sm->fis,
+                       sm->config->index_interval,
+                       sm->config->skip_interval);
 
-    os_write_vint(skip_buf->buf, doc - skip_buf->last_doc);
-    os_write_vint(skip_buf->buf, frq_ptr - skip_buf->last_frq_ptr);
-    os_write_vint(skip_buf->buf, prx_ptr - skip_buf->last_prx_ptr);
+    /* terms_buf_ptr holds a buffer of terms since the TermInfosWriter needs
+     * to keep the last index_interval terms so that it can compare the last
+     * term put in the index with the next one. So the size of the buffer must
+     * by index_interval + 2. */
+    sm->term_buf_ptr = 0;
+    sm->term_buf_size = (sm->config->index_interval + 1) * MAX_WORD_SIZE;
+    sm->term_buf = ALLOC_N(char, sm->term_buf_size + MAX_WORD_SIZE);
 
-    skip_buf->last_doc = doc;
-    skip_buf->last_frq_ptr = frq_ptr;
-    skip_buf->last_prx_ptr = prx_ptr;
+    TRY
+        tp_run(sm->pool, (task_ft)&sm_run_stage, stages, stage_cnt,
+               max_threads);
+        for (i = 1; i < part_cnt; i++) {
+            sm_append_partition(sm, parts[0], parts[i]);
+        }
+    XFINALLY
+        for (i = 0; i < part_cnt; i++) {
+            sm_partition_destroy(sm, parts[i]);
+        }
+        tiw_close(sm->tiw);
+        free(sm->term_buf);
+        free(parts);
+        free(stages);
+    XENDTRY
+    return sm->doc_cnt;
 }
 
-static off_t skip_buf_write(SkipBuffer *skip_buf)
+/****************************************************************************
+ * MergePolicy
+ ****************************************************************************/
+
+void merge_policy_destroy(MergePolicy *mp)
 {
-  off_t skip_ptr = os_pos(skip_buf->frq_out);
-  ramo_write_to(skip_buf->buf, skip_buf->frq_out);
-  return skip_ptr;
+    mp->destroy_i(mp);
 }
 
-static void skip_buf_destroy(SkipBuffer *skip_buf)
+static void mp_destroy_i(MergePolicy *mp)
 {
-    ram_destroy_buffer(skip_buf->buf);
-    free(skip_buf);
+    free(mp);
 }
 
-/****************************************************************************
- *
- * DocWriter
- *
- ****************************************************************************/
-
-static void dw_write_norms(DocWriter *dw, FieldInverter *fld_inv)
+/*
+ * Add merges of +run_len+ consecutive segments starting at +start+ in chunks
+ * of at most +max_cnt+ segments, returning the new merge count.
+ */
+static int mp_add_run(MergeSpec *merges, int merge_cnt, int start,
+                      int run_len, int max_cnt)
 {
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    OutStream *norms_out;
-    si_advance_norm_gen(dw->si, fld_inv->fi->number);
-    si_norm_file_name(dw->si, file_name, fld_inv->fi->number);
-    norms_out = dw->store->new_output(dw->store, file_name);
-    os_write_bytes(norms_out, fld_inv->norms, dw->doc_num);
-    os_close(norms_out);
+    while (run_len > 0) {
+        int cnt = run_len < max_cnt ? run_len : max_cnt;
+        merges[merge_cnt].min_seg = start;
+        merges[merge_cnt].max_seg = start + cnt;
+        merge_cnt++;
+        start += cnt;
+        run_len -= cnt;
+    }
+    return merge_cnt;
 }
 
-/* we'll use the postings Hash's table area to sort the postings as it is
- * going to be zeroset soon anyway */
-static PostingList **dw_sort_postings(Hash *plists_ht)
+/*************************/
+/*** LogDocMergePolicy ***/
+/*************************/
+
+static int ldmp_find_merges(MergePolicy *mp, const Config *config,
+                            SegmentStats *stats, int seg_cnt,
+                            MergeSpec *merges)
 {
-    int i, j;
-    HashEntry *he;
-    PostingList **plists = (PostingList **)plists_ht->table;
-    const int num_entries = plists_ht->mask + 1;
-    for (i = 0, j = 0; i < num_entries; i++) {
-        he = &plists_ht->table[i];
-        if (he->value) {
-            plists[j++] = (PostingList *)he->value;
+    int target_merge_docs = config->merge_factor;
+    int min_segment, merge_docs;
+    (void)mp;
+
+    while (target_merge_docs > 0
+           && target_merge_docs <= config->max_merge_docs) {
+        /* find segments smaller than current target size */
+        min_segment = seg_cnt - 1;
+        merge_docs = 0;
+        while (min_segment >= 0) {
+            /* segments already being merged end the run */
+            if (stats[min_segment].doc_cnt >= target_merge_docs
+                || stats[min_segment].merging) {
+                break;
+            }
+            merge_docs += stats[min_segment].doc_cnt;
+            min_segment--;
         }
-    }
 
-    qsort(plists, plists_ht->size, sizeof(PostingList *),
-          (int (*)(const void *, const void *))&pl_cmp);
+        if (merge_docs >= target_merge_docs) { /* found a merge to do */
+            merges[0].min_seg = min_segment + 1;
+            merges[0].max_seg = seg_cnt;
+            return 1;
+        }
+        else if (min_segment <= 0) {
+            break;
+        }
 
-    return plists;
+        target_merge_docs *= config->merge_factor;
+    }
+    return 0;
 }
 
-static void dw_flush_streams(DocWriter *dw)
+static int ldmp_find_forced_merges(MergePolicy *mp, const Config *config,
+                                   SegmentStats *stats, int seg_cnt,
+                                   int max_seg_cnt, MergeSpec *merges)
 {
-    mp_reset(dw->mp);
-    fw_close(dw->fw);
-    dw->fw = NULL;
-    h_clear(dw->fields);
-    dw->doc_num = 0;
+    int merge_cnt = seg_cnt - max_seg_cnt + 1;
+    (void)mp; (void)stats;
+    if (seg_cnt <= max_seg_cnt) {
+        return 0;
+    }
+    if (merge_cnt > config->merge_factor && config->merge_factor > 1) {
+        merge_cnt = config->merge_factor;
+    }
+    merges[0].min_seg = seg_cnt - merge_cnt;
+    merges[0].max_seg = seg_cnt;
+    return 1;
 }
 
-static void dw_flush(DocWriter *dw)
+static int ldmp_find_deletes_merges(MergePolicy *mp, const Config *config,
+                                    SegmentStats *stats, int seg_cnt,
+                                    MergeSpec *merges)
 {
-    int i, j, last_doc, doc_code, doc_freq, last_pos, posting_count;
-    int skip_interval = dw->skip_interval;
-    FieldInfos *fis = dw->fis;
-    const int fields_count = fis->size;
-    FieldInverter *fld_inv;
-    FieldInfo *fi;
-    PostingList **pls, *pl;
-    Posting *p;
-    Occurence *occ;
-    Store *store = dw->store;
-    TermInfosWriter *tiw = tiw_open(store, dw->si->name,
-                                    dw->index_interval, skip_interval);
-    TermInfo ti;
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    OutStream *frq_out, *prx_out;
-    SkipBuffer *skip_buf;
-
-    sprintf(file_name, "%s.frq", dw->si->name);
-    frq_out = store->new_output(store, file_name);
-    sprintf(file_name, "%s.prx", dw->si->name);
-    prx_out = store->new_output(store, file_name);
-    skip_buf = skip_buf_new(frq_out, prx_out);
-
-    for (i = 0; i < fields_count; i++) {
-        fi = fis->fields[i];
-        if (!fi_is_indexed(fi) || NULL ==
-            (fld_inv = (FieldInverter*)h_get_int(dw->fields, fi->number))) {
-            continue;
+    int i = 0, merge_cnt = 0;
+    const int max_cnt = config->merge_factor > 1 ? config->merge_factor : 2;
+    (void)mp;
+    while (i < seg_cnt) {
+        int start = i;
+        while (i < seg_cnt && stats[i].del_cnt > 0) {
+            i++;
         }
-        if (!fi_omit_norms(fi)) {
-            dw_write_norms(dw, fld_inv);
+        if (i > start) {
+            merge_cnt = mp_add_run(merges, merge_cnt, start, i - start,
+                                   max_cnt);
         }
-
-        pls = dw_sort_postings(fld_inv->plists);
-        tiw_start_field(tiw, fi->number);
-        posting_count = fld_inv->plists->size;
-        for (j = 0; j < posting_count; j++) {
-            pl = pls[j];
-            ti.frq_ptr = os_pos(frq_out);
-            ti.prx_ptr = os_pos(prx_out);
-            last_doc = 0;
-            doc_freq = 0;
-            skip_buf_reset(skip_buf);
-            for (p = pl->first; NULL != p; p = p->next) {
-                doc_freq++;
-                if (0 == (doc_freq % dw->skip_interval)) {
-                    skip_buf_add(skip_buf, last_doc);
-                }
-
-                doc_code = (p->doc_num - last_doc) << 1;
-                last_doc = p->doc_num;
-
-                if (p->freq == 1) {
-                    os_write_vint(frq_out, 1|doc_code);
-                }
-                else {
-                    os_write_vint(frq_out, doc_code);
-                    os_write_vint(frq_out, p->freq);
-                }
-
-                last_pos = 0;
-                for (occ = p->first_occ; NULL != occ; occ = occ->next) {
-                    os_write_vint(prx_out, occ->pos - last_pos);
-                    last_pos = occ->pos;
-                }
-            }
-            ti.skip_offset = skip_buf_write(skip_buf) - ti.frq_ptr;
-            ti.doc_freq = doc_freq;
-            tiw_add(tiw, pl->term, pl->term_len, &ti);
+        else {
+            i++;
         }
     }
-    os_close(prx_out);
-    os_close(frq_out);
-    tiw_close(tiw);
-    skip_buf_destroy(skip_buf);
-    dw_flush_streams(dw);
+    return merge_cnt;
 }
 
-DocWriter *dw_open(IndexWriter *iw, SegmentInfo *si)
+MergePolicy *log_doc_merge_policy_new()
 {
-    Store *store = iw->store;
-    MemoryPool *mp = mp_new_capa(iw->config.chunk_size,
-        iw->config.max_buffer_memory/iw->config.chunk_size);
-
-    DocWriter *dw = ALLOC(DocWriter);
-
-    dw->mp          = mp;
-    dw->analyzer    = iw->analyzer;
-    dw->fis         = iw->fis;
-    dw->store       = store;
-    dw->fw          = fw_open(store, si->name, iw->fis);
-    dw->si          = si;
-
-    dw->curr_plists = h_new_str(NULL, NULL);
-    dw->fields      = h_new_int((free_ft)fld_inv_destroy);
-    dw->doc_num     = 0;
-
-    dw->index_interval      = iw->config.index_interval;
-    dw->skip_interval       = iw->config.skip_interval;
-    dw->max_field_length    = iw->config.max_field_length;
-    dw->max_buffered_docs   = iw->config.max_buffered_docs;
-
-    dw->offsets             = ALLOC_AND_ZERO_N(Offset, DW_OFFSET_INIT_CAPA);
-    dw->offsets_size        = 0;
-    dw->offsets_capa        = DW_OFFSET_INIT_CAPA;
-
-    dw->similarity          = iw->similarity;
-    return dw;
+    MergePolicy *mp = ALLOC(MergePolicy);
+    mp->find_merges = &ldmp_find_merges;
+    mp->find_forced_merges = &ldmp_find_forced_merges;
+    mp->find_deletes_merges = &ldmp_find_deletes_merges;
+    mp->destroy_i = &mp_destroy_i;
+    return mp;
 }
 
-void dw_new_segment(DocWriter *dw, SegmentInfo *si)
-{
-    dw->fw = fw_open(dw->store, si->name, dw->fis);
-    dw->si = si;
-}
+/*************************/
+/*** TieredMergePolicy ***/
+/*************************/
 
-void dw_close(DocWriter *dw)
+/* the segment's size without its deleted documents */
+static double tmp_live_size(SegmentStats *stats)
 {
-    if (dw->doc_num) {
-        dw_flush(dw);
-    }
-    if (dw->fw) {
-        fw_close(dw->fw);
+    if (stats->doc_cnt <= 0) {
+        return (double)stats->size;
     }
-    h_destroy(dw->curr_plists);
-    h_destroy(dw->fields);
-    mp_destroy(dw->mp);
-    free(dw->offsets);
-    free(dw);
+    return (double)stats->size
+        * (double)(stats->doc_cnt - stats->del_cnt) / stats->doc_cnt;
 }
 
-FieldInverter *dw_get_fld_inv(DocWriter *dw, FieldInfo *fi)
+static double tmp_floored_size(TieredMergePolicy *tmp, double size)
 {
-    FieldInverter *fld_inv = (FieldInverter*)h_get_int(dw->fields, fi->number);
-
-    if (!fld_inv) {
-        fld_inv = fld_inv_new(dw, fi);
-        h_set_int(dw->fields, fi->number, fld_inv);
-    }
-    return fld_inv;
+    return size < (double)tmp->floor_segment_size
+        ? (double)tmp->floor_segment_size : size;
 }
 
-static void dw_add_posting(MemoryPool *mp,
-                           Hash *curr_plists,
-                           Hash *fld_plists,
-                           int doc_num,
-                           const char *text,
-                           int len,
-                           int pos)
+static bool tmp_is_eligible(TieredMergePolicy *tmp, SegmentStats *stats)
 {
-    HashEntry *pl_he;
-    if (h_set_ext(curr_plists, text, &pl_he)) {
-        Posting *p =  p_new(mp, doc_num, pos);
-        HashEntry *fld_pl_he;
-        PostingList *pl;
+    /* segments already half the maximum size are left alone */
+    return !stats->merging
+        && tmp_live_size(stats) <= (double)tmp->max_merged_segment_size / 2;
+}
 
-        if (h_set_ext(fld_plists, text, &fld_pl_he)) {
-            fld_pl_he->value = pl = pl_new(mp, text, len, p);
-            pl_he->key = fld_pl_he->key = (char *)pl->term;
-        }
-        else {
-            pl = (PostingList *)fld_pl_he->value;
-            pl_add_posting(pl, p);
-            pl_he->key = (char *)pl->term;
+/*
+ * The number of segments an index of +tot_size+ bytes may have when its
+ * smallest segment is +min_size+ bytes, allowing segs_per_tier segments in
+ * each tier and each tier's segments max_merge_at_once times as big as the
+ * previous tier's. Small indexes may always have segs_per_tier segments.
+ */
+static int tmp_allowed_seg_cnt(TieredMergePolicy *tmp, double tot_size,
+                               double min_size)
+{
+    double level_size = tmp_floored_size(tmp, min_size);
+    double size_left = tot_size;
+    int allowed_cnt = 0;
+    while (true) {
+        double level_seg_cnt = size_left / level_size;
+        if (level_seg_cnt < tmp->segs_per_tier) {
+            allowed_cnt += (int)ceil(level_seg_cnt);
+            break;
         }
-        pl_he->value = pl;
-    }
-    else {
-        pl_add_occ(mp, (PostingList *)pl_he->value, pos);
+        allowed_cnt += tmp->segs_per_tier;
+        size_left -= tmp->segs_per_tier * level_size;
+        level_size *= tmp->max_merge_at_once;
     }
+    return allowed_cnt > tmp->segs_per_tier ? allowed_cnt : tmp->segs_per_tier;
 }
 
-static INLINE void dw_add_offsets(DocWriter *dw, int pos, off_t start, off_t end)
+/*
+ * Lower scores are better. Merges of evenly sized segments score lower, as
+ * do small merges and merges which reclaim many deleted documents.
+ */
+static double tmp_score(TieredMergePolicy *tmp, SegmentStats *stats,
+                        int min_seg, int max_seg)
 {
-    if (pos >= dw->offsets_capa) {
-        int old_capa = dw->offsets_capa;
-        while (pos >= dw->offsets_capa) {
-            dw->offsets_capa <<= 1;
+    double tot_size = 0.0, tot_live_size = 0.0;
+    double tot_floored_size = 0.0, max_floored_size = 0.0;
+    double skew, live_ratio;
+    int i;
+    for (i = min_seg; i < max_seg; i++) {
+        double live_size = tmp_live_size(&stats[i]);
+        double floored_size = tmp_floored_size(tmp, live_size);
+        tot_size += (double)stats[i].size;
+        tot_live_size += live_size;
+        tot_floored_size += floored_size;
+        if (floored_size > max_floored_size) {
+            max_floored_size = floored_size;
         }
-        REALLOC_N(dw->offsets, Offset, dw->offsets_capa);
-        ZEROSET_N(dw->offsets + old_capa, Offset, dw->offsets_capa - old_capa);
     }
-    dw->offsets[pos].start = start;
-    dw->offsets[pos].end = end;
-    dw->offsets_size = pos + 1;
+    skew = max_floored_size / tot_floored_size;
+    live_ratio = tot_size > 0.0 ? tot_live_size / tot_size : 1.0;
+    return skew * pow(tot_live_size > 1.0 ? tot_live_size : 1.0, 0.05)
+        * pow(live_ratio, tmp->reclaim_deletes_weight);
 }
 
-Hash *dw_invert_field(DocWriter *dw,
-                           FieldInverter *fld_inv,
-                           DocField *df)
+static int tmp_find_merges(MergePolicy *mp, const Config *config,
+                           SegmentStats *stats, int seg_cnt,
+                           MergeSpec *merges)
 {
-    MemoryPool *mp = dw->mp;
-    Analyzer *a = dw->analyzer;
-    Hash *curr_plists = dw->curr_plists;
-    Hash *fld_plists = fld_inv->plists;
-    const bool store_offsets = fld_inv->store_offsets;
-    int doc_num = dw->doc_num;
-    int i;
-    const int df_size = df->size;
-    off_t start_offset = 0;
-
-    if (fld_inv->is_tokenized) {
-        Token *tk;
-        int pos = -1, num_terms = 0;
+    TieredMergePolicy *tmp = TIERED_MP(mp);
+    double tot_size = 0.0, min_size = -1.0, best_score = 0.0;
+    int i, j, eligible_cnt = 0, best_min = -1, best_max = -1;
+    (void)config;
 
-        for (i = 0; i < df_size; i++) {
-            TokenStream *ts = a_get_ts(a, df->name, df->data[i]);
-            /* ts->reset(ts, df->data[i]); no longer being called */
-            if (store_offsets) {
-                while (NULL != (tk = ts->next(ts))) {
-                    pos += tk->pos_inc;
-                    /* if for some reason pos gets set to some number less
-                     * than 0 the we'll start pos at 0 */
-                    if (pos < 0) {
-                        pos = 0;
-                    }
-                    dw_add_posting(mp, curr_plists, fld_plists, doc_num,
-                                   tk->text, tk->len, pos);
-                    dw_add_offsets(dw, pos,
-                                   start_offset + tk->start,
-                                   start_offset + tk->end);
-                    if (num_terms++ >= dw->max_field_length) {
-                        break;
-                    }
-                }
+    for (i = 0; i < seg_cnt; i++) {
+        if (tmp_is_eligible(tmp, &stats[i])) {
+            double live_size = tmp_live_size(&stats[i]);
+            tot_size += live_size;
+            if (min_size < 0.0 || live_size < min_size) {
+                min_size = live_size;
+            }
+            eligible_cnt++;
+        }
+    }
+    if (eligible_cnt < 2
+        || eligible_cnt <= tmp_allowed_seg_cnt(tmp, tot_size, min_size)) {
+        return 0;
+    }
+
+    /* score every window of consecutive eligible segments */
+    for (i = 0; i < seg_cnt; i++) {
+        double merged_size = 0.0;
+        for (j = i; j < seg_cnt && j - i < tmp->max_merge_at_once; j++) {
+            if (!tmp_is_eligible(tmp, &stats[j])) {
+                break;
             }
-            else {
-                while (NULL != (tk = ts->next(ts))) {
-                    pos += tk->pos_inc;
-                    dw_add_posting(mp, curr_plists, fld_plists, doc_num,
-                                   tk->text, tk->len, pos);
-                    if (num_terms++ >= dw->max_field_length) {
-                        break;
-                    }
+            merged_size += tmp_live_size(&stats[j]);
+            if (merged_size > (double)tmp->max_merged_segment_size) {
+                break;
+            }
+            if (j > i) {
+                double score = tmp_score(tmp, stats, i, j + 1);
+                if (best_min < 0 || score < best_score) {
+                    best_score = score;
+                    best_min = i;
+                    best_max = j + 1;
                 }
             }
-            ts_deref(ts);
-            start_offset += df->lengths[i] + 1;
         }
-        fld_inv->length = num_terms;
     }
-    else {
-        char buf[MAX_WORD_SIZE];
-        buf[MAX_WORD_SIZE - 1] = '\0';
-        for (i = 0; i < df_size; i++) {
-            int len = df->lengths[i];
-            char *data_ptr = df->data[i];
-            if (len > MAX_WORD_SIZE) {
-                len = MAX_WORD_SIZE - 1;
-                data_ptr = (char *)memcpy(buf, df->data[i], len);
-            }
-            dw_add_posting(mp, curr_plists, fld_plists, doc_num, data_ptr,
-                           len, i);
-            if (store_offsets) {
-                dw_add_offsets(dw, i, start_offset,
-                               start_offset + df->lengths[i]);
+    if (best_min < 0) {
+        return 0;
+    }
+    merges[0].min_seg = best_min;
+    merges[0].max_seg = best_max;
+    return 1;
+}
+
+static int tmp_find_forced_merges(MergePolicy *mp, const Config *config,
+                                  SegmentStats *stats, int seg_cnt,
+                                  int max_seg_cnt, MergeSpec *merges)
+{
+    TieredMergePolicy *tmp = TIERED_MP(mp);
+    int i, j, merge_cnt = seg_cnt - max_seg_cnt + 1, best_min = 0;
+    double best_size = 0.0;
+    (void)config;
+
+    if (seg_cnt <= max_seg_cnt) {
+        return 0;
+    }
+    if (merge_cnt > tmp->max_merge_at_once && tmp->max_merge_at_once > 1) {
+        merge_cnt = tmp->max_merge_at_once;
+    }
+    /* merge the smallest window. The size cap doesn't apply here */
+    for (i = 0; i + merge_cnt <= seg_cnt; i++) {
+        double size = 0.0;
+        for (j = i; j < i + merge_cnt; j++) {
+            size += tmp_live_size(&stats[j]);
+        }
+        if (i == 0 || size < best_size) {
+            best_size = size;
+            best_min = i;
+        }
+    }
+    merges[0].min_seg = best_min;
+    merges[0].max_seg = best_min + merge_cnt;
+    return 1;
+}
+
+static int tmp_find_deletes_merges(MergePolicy *mp, const Config *config,
+                                   SegmentStats *stats, int seg_cnt,
+                                   MergeSpec *merges)
+{
+    TieredMergePolicy *tmp = TIERED_MP(mp);
+    int i = 0, merge_cnt = 0;
+    (void)config;
+
+    while (i < seg_cnt) {
+        int start = i;
+        double merged_size = 0.0;
+        while (i < seg_cnt && i - start < tmp->max_merge_at_once
+               && stats[i].del_cnt > 0
+               && stats[i].del_cnt * 100.0 / stats[i].doc_cnt
+                  > tmp->deletes_pct_allowed) {
+            double live_size = tmp_live_size(&stats[i]);
+            /* a segment too large to merge with others is merged alone */
+            if (i > start && merged_size + live_size
+                > (double)tmp->max_merged_segment_size) {
+                break;
             }
-            start_offset += df->lengths[i] + 1;
+            merged_size += live_size;
+            i++;
+        }
+        if (i > start) {
+            merges[merge_cnt].min_seg = start;
+            merges[merge_cnt].max_seg = i;
+            merge_cnt++;
+        }
+        else {
+            i++;
         }
-        fld_inv->length = i;
     }
-    return curr_plists;
+    return merge_cnt;
 }
 
-void dw_reset_postings(Hash *postings)
+MergePolicy *tiered_merge_policy_new()
 {
-    ZEROSET_N(postings->table, HashEntry, postings->mask + 1);
-    postings->fill = postings->size = 0;
+    TieredMergePolicy *tmp = ALLOC(TieredMergePolicy);
+    tmp->super.find_merges = &tmp_find_merges;
+    tmp->super.find_forced_merges = &tmp_find_forced_merges;
+    tmp->super.find_deletes_merges = &tmp_find_deletes_merges;
+    tmp->super.destroy_i = &mp_destroy_i;
+    tmp->segs_per_tier = 10;
+    tmp->max_merge_at_once = 10;
+    tmp->max_merged_segment_size = (off_t)5 * 1024 * 1024 * 1024;
+    tmp->floor_segment_size = (off_t)2 * 1024 * 1024;
+    tmp->deletes_pct_allowed = 10.0;
+    tmp->reclaim_deletes_weight = 2.0;
+    return (MergePolicy *)tmp;
 }
 
-void dw_add_doc(DocWriter *dw, Document *doc)
+
+/****************************************************************************
+ * IndexWriter
+ ****************************************************************************/
+
+/* prepare an index ready for writing */
+void index_create(Store *store, FieldInfos *fis)
+{
+    SegmentInfos *sis = sis_new(fis);
+    store->clear_all(store);
+    sis_write(sis, store, NULL);
+    sis_destroy(sis);
+}
+
+bool index_is_locked(Store *store)
+{
+    Lock *write_lock = open_lock(store, WRITE_LOCK_NAME);
+    bool is_locked = write_lock->is_locked(write_lock);
+    close_lock(write_lock);
+    return is_locked;
+}
+
+int iw_doc_count(IndexWriter *iw)
+{
+    int i, doc_cnt = 0;
+    mutex_lock(&iw->mutex);
+    for (i = iw->sis->size - 1; i >= 0; i--) {
+        doc_cnt += iw->sis->segs[i]->doc_cnt;
+    }
+    if (iw->dw) {
+        doc_cnt += iw->dw->doc_num;
+    }
+    for (i = iw->dw_cnt - 1; i >= 0; i--) {
+        doc_cnt += iw->dws[i]->doc_num;
+    }
+    mutex_unlock(&iw->mutex);
+    return doc_cnt;
+}
+
+#define MOVE_TO_COMPOUND_DIR(file_name)\
+    deleter_queue_file(dlr, file_name);\
+    cw_add_file(cw, file_name)
+
+static void iw_create_compound_file(Store *store, FieldInfos *fis,
+                                    SegmentInfo *si, char *cfs_file_name,
+                                    Deleter *dlr)
 {
     int i;
-    float boost;
-    DocField *df;
-    FieldInverter *fld_inv;
-    Hash *postings;
-    FieldInfo *fi;
-    const int doc_size = doc->size;
+    CompoundWriter *cw;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    char *ext;
+    int seg_len = strlen(si->name);
 
-    /* fw_add_doc will add new fields as necessary */
-    fw_add_doc(dw->fw, doc);
+    memcpy(file_name, si->name, seg_len);
+    file_name[seg_len] = '.';
+    ext = file_name + seg_len + 1;
 
-    for (i = 0; i < doc_size; i++) {
-        df = doc->fields[i];
-        fi = fis_get_field(dw->fis, df->name);
-        if (!fi_is_indexed(fi)) {
+    cw = open_cw(store, cfs_file_name);
+    for (i = 0; i < NELEMS(COMPOUND_EXTENSIONS); i++) {
+        memcpy(ext, COMPOUND_EXTENSIONS[i], 4);
+        /* segments added from indexes written before the .fst file existed
+         * won't have one and only segments with bloom filters or doc values
+         * have a .blm or .dvs */
+        if ((0 == strcmp(ext, "fst") || 0 == strcmp(ext, "blm")
+             || 0 == strcmp(ext, "dvs"))
+            && !store->exists(store, file_name)) {
             continue;
         }
-        fld_inv = dw_get_fld_inv(dw, fi);
-
-        postings = dw_invert_field(dw, fld_inv, df);
-        if (fld_inv->store_term_vector) {
-            fw_add_postings(dw->fw, fld_inv->fi->number,
-                            dw_sort_postings(postings), postings->size,
-                            dw->offsets, dw->offsets_size);
-        }
+        MOVE_TO_COMPOUND_DIR(file_name);
+    }
 
-        if (fld_inv->has_norms) {
-            boost = fld_inv->fi->boost * doc->boost * df->boost *
-                sim_length_norm(dw->similarity, fi->name, fld_inv->length);
-            fld_inv->norms[dw->doc_num] =
-                sim_encode_norm(dw->similarity, boost);
-        }
-        dw_reset_postings(postings);
-        if (dw->offsets_size > 0) {
-            ZEROSET_N(dw->offsets, Offset, dw->offsets_size);
-            dw->offsets_size = 0;
+    /* Field norm file_names */
+    for (i = fis->size - 1; i >= 0; i--) {
+        if (fi_has_norms(fis->fields[i])
+            && si_norm_file_name(si, file_name, i)) {
+            MOVE_TO_COMPOUND_DIR(file_name);
         }
     }
-    fw_write_tv_index(dw->fw);
-    dw->doc_num++;
+
+    /* Perform the merge */
+    cw_close(cw);
 }
 
-/****************************************************************************
- *
- * IndexWriter
- *
- ****************************************************************************/
-/****************************************************************************
- * SegmentMergeInfo
- ****************************************************************************/
+static void iw_commit_compound_file(IndexWriter *iw, SegmentInfo *si)
+{
+    char cfs_name[SEGMENT_NAME_MAX_LENGTH];
+    sprintf(cfs_name, "%s.cfs", si->name);
 
-typedef struct SegmentMergeInfo {
-    int base;
-    int max_doc;
-    int doc_cnt;
+    iw_create_compound_file(iw->store, iw->fis, si, cfs_name, iw->deleter);
+}
+
+/* a segment which isn't added to iw->sis until its DocWriter is flushed */
+static SegmentInfo *iw_new_pending_segment(IndexWriter *iw)
+{
+    SegmentInfo *si = si_new(new_segment(iw->sis->counter++), 0, iw->store);
+    si->postings_format = iw->config.postings_format;
+    return si;
+}
+
+/*
+ * Build the compound file for the pending segment +si+. Its files aren't
+ * referenced by the index yet so we don't need the store's mutex and use our
+ * own Deleter to remove them once they've been copied.
+ */
+static void iw_create_pending_compound_file(IndexWriter *iw, FieldInfos *fis,
+                                            SegmentInfo *si)
+{
+    char cfs_name[SEGMENT_NAME_MAX_LENGTH];
+    Deleter *dlr = deleter_new(iw->sis, iw->store);
+    sprintf(cfs_name, "%s.cfs", si->name);
+    TRY
+        iw_create_compound_file(iw->store, fis, si, cfs_name, dlr);
+        deleter_commit_pending_deletions(dlr);
+    XFINALLY
+        deleter_destroy(dlr);
+    XENDTRY
+    si->use_compound_file = true;
+}
+
+/***************/
+/*** Merging ***/
+/***************/
+
+/*
+ * A merge of +seg_cnt+ consecutive segments starting at +segs+[0] into the
+ * pending segment +si+. +fis+ is a copy of the writer's FieldInfos with its
+ * own fields array as new fields may be added while the merge runs.
+ * +deleted_docs+ and +del_gens+ are the segments' deletions when the merge
+ * was started. Documents deleted after that are still in the merged segment
+ * and are deleted from it by iw_commit_merged_deletes.
+ */
+struct FrtMergeJob
+{
+    SegmentInfo **segs;
+    BitVector **deleted_docs;
+    int *del_gens;
+    int seg_cnt;
     SegmentInfo *si;
-    Store *store;
-    Store *orig_store;
-    BitVector *deleted_docs;
-    SegmentFieldIndex *sfi;
-    TermEnum *te;
-    TermDocEnum *tde;
-    char *term;
-    int *doc_map;
-    InStream *frq_in;
-    InStream *prx_in;
-} SegmentMergeInfo;
+    FieldInfos fis;
+    bool running;
+    MergeJob *next;
+};
 
-static bool smi_lt(const SegmentMergeInfo *smi1, const SegmentMergeInfo *smi2)
+/* iw->mutex must be held */
+static MergeJob *iw_merge_job_new(IndexWriter *iw, const int min_seg,
+                                  const int max_seg)
 {
-    int cmpres = strcmp(smi1->term, smi2->term);
-    if (0 == cmpres) {
-        return smi1->base < smi2->base;
+    int i;
+    MergeJob *job = ALLOC_AND_ZERO(MergeJob);
+    job->seg_cnt = max_seg - min_seg;
+    job->segs = ALLOC_N(SegmentInfo *, job->seg_cnt);
+    memcpy(job->segs, &iw->sis->segs[min_seg],
+           job->seg_cnt * sizeof(SegmentInfo *));
+    job->deleted_docs = ALLOC_AND_ZERO_N(BitVector *, job->seg_cnt);
+    job->del_gens = ALLOC_N(int, job->seg_cnt);
+    for (i = 0; i < job->seg_cnt; i++) {
+        SegmentInfo *si = job->segs[i];
+        job->del_gens[i] = si->del_gen;
+        if (si->del_gen >= 0) {
+            char file_name[SEGMENT_NAME_MAX_LENGTH];
+            fn_for_generation(file_name, si->name, "del", si->del_gen);
+            job->deleted_docs[i] = bv_read(si->store, file_name);
+        }
     }
-    else {
-        return cmpres < 0;
+    job->si = iw_new_pending_segment(iw);
+    job->fis = *iw->fis;
+    job->fis.capa = iw->fis->size;
+    job->fis.fields = ALLOC_N(FieldInfo *, iw->fis->size);
+    memcpy(job->fis.fields, iw->fis->fields,
+           iw->fis->size * sizeof(FieldInfo *));
+    return job;
+}
+
+static void iw_merge_job_destroy(MergeJob *job)
+{
+    int i;
+    for (i = 0; i < job->seg_cnt; i++) {
+        if (job->deleted_docs[i]) {
+            bv_destroy(job->deleted_docs[i]);
+        }
     }
+    free(job->deleted_docs);
+    free(job->del_gens);
+    free(job->fis.fields);
+    free(job->segs);
+    free(job);
 }
 
-static void smi_load_doc_map(SegmentMergeInfo *smi)
+/*
+ * Write the merged segment, including its compound file. This only reads the
+ * segments being merged and nothing else changes them while they're being
+ * merged so it doesn't need iw->mutex.
+ */
+static void iw_run_merge(IndexWriter *iw, MergeJob *job)
 {
-    BitVector *deleted_docs = smi->deleted_docs;
-    const int max_doc = smi->max_doc;
-    int j = 0, i;
+    SegmentMerger *merger = sm_create(iw, &job->fis, job->si, job->segs,
+                                      job->deleted_docs, job->seg_cnt);
+    TRY
+        /* This is where all the action happens. */
+        job->si->doc_cnt = sm_merge(merger);
+        if (iw->config.use_compound_file) {
+            iw_create_pending_compound_file(iw, &job->fis, job->si);
+        }
+    XFINALLY
+        sm_destroy(merger);
+    XENDTRY
+}
 
-    smi->doc_map = ALLOC_N(int, max_doc);
-    for (i = 0; i < max_doc; i++) {
-        if (bv_get(deleted_docs, i)) {
-            smi->doc_map[i] = -1;
+/*
+ * The documents deleted from the segments of +job+ while they were being
+ * merged, numbered as they are in the merged segment, or NULL if there are
+ * none. iw->mutex must be held.
+ */
+static BitVector *iw_merged_deletes(MergeJob *job)
+{
+    BitVector *merged_deletes = NULL;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    int i, j, doc_num = 0;
+
+    for (i = 0; i < job->seg_cnt; i++) {
+        SegmentInfo *si = job->segs[i];
+        BitVector *merged_bv = job->deleted_docs[i];
+        if (si->del_gen != job->del_gens[i] && si->del_gen >= 0) {
+            BitVector *bv;
+            fn_for_generation(file_name, si->name, "del", si->del_gen);
+            bv = bv_read(si->store, file_name);
+            if (NULL == merged_deletes) {
+                merged_deletes = bv_new();
+            }
+            for (j = 0; j < si->doc_cnt; j++) {
+                if (merged_bv && bv_get(merged_bv, j)) {
+                    continue;
+                }
+                if (bv_get(bv, j)) {
+                    bv_set(merged_deletes, doc_num);
+                }
+                doc_num++;
+            }
+            bv_destroy(bv);
         }
         else {
-            smi->doc_map[i] = j++;
+            doc_num += si->doc_cnt - (merged_bv ? merged_bv->count : 0);
         }
     }
-    smi->doc_cnt = j;
+    return merged_deletes;
 }
 
-static SegmentMergeInfo *smi_new(int base, Store *store, SegmentInfo *si)
+/*
+ * Swap the merged segment in for the segments it replaces and commit the
+ * segments file. Segments may have been flushed after them so they aren't
+ * necessarily at the end any more. iw->mutex must be held.
+ */
+static void iw_commit_merge(IndexWriter *iw, MergeJob *job)
 {
-    SegmentMergeInfo *smi = ALLOC_AND_ZERO(SegmentMergeInfo);
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    char *segment = si->name;
-    smi->base = base;
-    smi->si = si;
-    smi->orig_store = smi->store = store;
-    sprintf(file_name, "%s.cfs", segment);
-    if (store->exists(store, file_name)) {
-        smi->store = open_cmpd_store(store, file_name);
+    int i, min_seg = 0;
+    BitVector *merged_deletes;
+    SegmentInfos *sis = iw->sis;
+    while (sis->segs[min_seg] != job->segs[0]) {
+        min_seg++;
+    }
+
+    merged_deletes = iw_merged_deletes(job);
+
+    mutex_lock(&iw->store->mutex);
+    /* delete merged segments */
+    for (i = 0; i < job->seg_cnt; i++) {
+        si_delete_files(job->segs[i], iw->fis, iw->deleter);
     }
 
+    si_deref(sis->segs[min_seg]);
+    sis->segs[min_seg] = job->si;
+    sis_del_from_to(sis, min_seg + 1, min_seg + job->seg_cnt);
 
-    sprintf(file_name, "%s.fdx", segment);
-    smi->doc_cnt = smi->max_doc
-        = smi->store->length(smi->store, file_name) / FIELDS_IDX_PTR_SIZE;
-
-    if (si->del_gen >= 0) {
-        fn_for_generation(file_name, segment, "del", si->del_gen);
-        smi->deleted_docs = bv_read(store, file_name);
-        smi_load_doc_map(smi);
+    /* carry over the deletes made while the segments were being merged */
+    if (merged_deletes) {
+        IndexReader *ir = sr_open(sis, iw->fis, min_seg, false);
+        ir->deleter = iw->deleter;
+        for (i = bv_scan_next_from(merged_deletes, 0); i >= 0;
+             i = bv_scan_next_from(merged_deletes, i + 1)) {
+            sr_delete_doc_i(ir, i);
+        }
+        sr_commit_i(ir);
+        ir_close(ir);
+        bv_destroy(merged_deletes);
     }
-    return smi;
+
+    sis_write(sis, iw->store, iw->deleter);
+    deleter_commit_pending_deletions(iw->deleter);
+    iw->has_uncommitted = false;
+
+    mutex_unlock(&iw->store->mutex);
 }
 
-static void smi_load_term_input(SegmentMergeInfo *smi)
+/* merge segments +min_seg+ to +max_seg+ now. iw->mutex must be held */
+static void iw_merge_segments(IndexWriter *iw, const int min_seg,
+                              const int max_seg)
 {
-    Store *store = smi->store;
-    char *segment = smi->si->name;
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    smi->sfi = sfi_open(store, segment);
-    sprintf(file_name, "%s.tis", segment);
-    smi->te = TE(ste_new(store->open_input(store, file_name), smi->sfi));
-    sprintf(file_name, "%s.frq", segment);
-    smi->frq_in = store->open_input(store, file_name);
-    sprintf(file_name, "%s.prx", segment);
-    smi->prx_in = store->open_input(store, file_name);
-    smi->tde = stpe_new(NULL, smi->frq_in, smi->prx_in, smi->deleted_docs,
-                        STE(smi->te)->skip_interval);
+    MergeJob *job = iw_merge_job_new(iw, min_seg, max_seg);
+    TRY
+        iw_run_merge(iw, job);
+        iw_commit_merge(iw, job);
+    XCATCHALL
+        si_deref(job->si);
+        iw_merge_job_destroy(job);
+    XENDTRY
+    iw_merge_job_destroy(job);
 }
 
-static void smi_close_term_input(SegmentMergeInfo *smi)
+static void iw_merge_segments_from(IndexWriter *iw, int min_segment)
 {
-    ste_close(smi->te);
-    sfi_close(smi->sfi);
-    stpe_close(smi->tde);
-    is_close(smi->frq_in);
-    is_close(smi->prx_in);
+    iw_merge_segments(iw, min_segment, iw->sis->size);
 }
 
-static void smi_destroy(SegmentMergeInfo *smi)
+/* queue a merge for the merge threads. iw->mutex must be held */
+static void iw_schedule_merge(IndexWriter *iw, const int min_seg,
+                              const int max_seg)
 {
-    if (smi->store != smi->orig_store) {
-        store_deref(smi->store);
-    }
-    if (smi->deleted_docs) {
-        bv_destroy(smi->deleted_docs);
-        free(smi->doc_map);
+    MergeJob *job = iw_merge_job_new(iw, min_seg, max_seg);
+    MergeJob **last = &iw->merges;
+    while (*last) {
+        last = &(*last)->next;
     }
-    free(smi);
+    *last = job;
+    iw->merge_cnt++;
+    iw->pending_merge_cnt++;
+    cond_broadcast(&iw->merge_cond);
 }
 
-static char *smi_next(SegmentMergeInfo *smi)
+static bool iw_is_merging(IndexWriter *iw, SegmentInfo *si)
 {
-    return (smi->term = ste_next(smi->te));
+    MergeJob *job;
+    int i;
+    for (job = iw->merges; job; job = job->next) {
+        for (i = 0; i < job->seg_cnt; i++) {
+            if (job->segs[i] == si) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-/****************************************************************************
- * SegmentMerger
- ****************************************************************************/
-
-typedef struct SegmentMerger {
-    TermInfo ti;
-    Store *store;
-    FieldInfos *fis;
-    SegmentInfo *si;
-    SegmentMergeInfo **smis;
-    int seg_cnt;
-    int doc_cnt;
-    Config *config;
-    TermInfosWriter *tiw;
-    char *term_buf;
-    int term_buf_ptr;
-    int term_buf_size;
-    PriorityQueue *queue;
-    SkipBuffer *skip_buf;
-    OutStream *frq_out;
-    OutStream *prx_out;
-} SegmentMerger;
-
-static SegmentMerger *sm_create(IndexWriter *iw, SegmentInfo *si,
-                                SegmentInfo **seg_infos, const int seg_cnt)
+/* the number of bytes used by +si+'s files */
+static off_t si_size(SegmentInfo *si)
 {
+    Store *store = si->store;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    off_t size = 0;
     int i;
-    SegmentMerger *sm = ALLOC_AND_ZERO_N(SegmentMerger, seg_cnt);
-    sm->store = iw->store;
-    sm->fis = iw->fis;
-    sm->si = si;
-    sm->doc_cnt = 0;
-    sm->smis = ALLOC_N(SegmentMergeInfo *, seg_cnt);
-    for (i = 0; i < seg_cnt; i++) {
-        sm->smis[i] = smi_new(sm->doc_cnt, seg_infos[i]->store,
-                              seg_infos[i]);
-        sm->doc_cnt += sm->smis[i]->doc_cnt;
+
+    if (si->use_compound_file) {
+        sprintf(file_name, "%s.cfs", si->name);
+        if (store->exists(store, file_name)) {
+            size += store->length(store, file_name);
+        }
     }
-    sm->seg_cnt = seg_cnt;
-    sm->config = &iw->config;
-    return sm;
+    else {
+        for (i = 0; i < NELEMS(INDEX_EXTENSIONS); i++) {
+            sprintf(file_name, "%s.%s", si->name, INDEX_EXTENSIONS[i]);
+            if (store->exists(store, file_name)) {
+                size += store->length(store, file_name);
+            }
+        }
+    }
+    for (i = 0; i < si->norm_gens_size; i++) {
+        if (si_norm_file_name(si, file_name, i)
+            && store->exists(store, file_name)) {
+            size += store->length(store, file_name);
+        }
+    }
+    if (si->del_gen >= 0) {
+        fn_for_generation(file_name, si->name, "del", si->del_gen);
+        if (store->exists(store, file_name)) {
+            size += store->length(store, file_name);
+        }
+    }
+    return size;
 }
 
-static void sm_destroy(SegmentMerger *sm)
+/* update the stats cached in +si+ if it has changed since they were read */
+static void si_update_stats(SegmentInfo *si)
 {
-    int i;
-    const int seg_cnt = sm->seg_cnt;
-    for (i = 0; i < seg_cnt; i++) {
-        smi_destroy(sm->smis[i]);
+    if (si->has_stats && si->stats_del_gen == si->del_gen) {
+        return;
     }
-    free(sm->smis);
-    free(sm);
+    si->del_cnt = 0;
+    if (si->del_gen >= 0) {
+        char file_name[SEGMENT_NAME_MAX_LENGTH];
+        BitVector *bv;
+        fn_for_generation(file_name, si->name, "del", si->del_gen);
+        bv = bv_read(si->store, file_name);
+        si->del_cnt = bv->count;
+        bv_destroy(bv);
+    }
+    si->size = si_size(si);
+    si->stats_del_gen = si->del_gen;
+    si->has_stats = true;
 }
 
-static void sm_merge_fields(SegmentMerger *sm)
+/* the stats of every segment for the merge policy. iw->mutex must be held */
+static SegmentStats *iw_segment_stats(IndexWriter *iw)
 {
-    int i, j;
-    off_t start, end = 0;
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    OutStream *fdt_out, *fdx_out;
-    Store *store = sm->store;
-    const int seg_cnt = sm->seg_cnt;
+    SegmentInfos *sis = iw->sis;
+    SegmentStats *stats = ALLOC_N(SegmentStats, sis->size > 0 ? sis->size : 1);
+    int i;
+    for (i = 0; i < sis->size; i++) {
+        SegmentInfo *si = sis->segs[i];
+        si_update_stats(si);
+        stats[i].si = si;
+        stats[i].doc_cnt = si->doc_cnt;
+        stats[i].del_cnt = si->del_cnt;
+        stats[i].size = si->size;
+        stats[i].merging = iw_is_merging(iw, si);
+    }
+    return stats;
+}
 
-    sprintf(file_name, "%s.fdt", sm->si->name);
-    fdt_out = store->new_output(store, file_name);
+/*
+ * Run or schedule the +merge_cnt+ merges chosen by the merge policy,
+ * returning the number started. Merges are started from the last so that
+ * the earlier merges' segment numbers stay valid. iw->mutex must be held.
+ */
+static int iw_start_merges(IndexWriter *iw, SegmentStats *stats,
+                           MergeSpec *merges, int merge_cnt, bool background)
+{
+    int i, j, started = 0;
+    for (i = merge_cnt - 1; i >= 0; i--) {
+        const int min_seg = merges[i].min_seg, max_seg = merges[i].max_seg;
+        bool valid = 0 <= min_seg && min_seg < max_seg
+            && max_seg <= iw->sis->size;
+        for (j = min_seg; valid && j < max_seg; j++) {
+            valid = !stats[j].merging;
+        }
+        if (!valid) {
+            continue;
+        }
+        if (background) {
+            iw_schedule_merge(iw, min_seg, max_seg);
+        }
+        else {
+            iw_merge_segments(iw, min_seg, max_seg);
+        }
+        started++;
+    }
+    return started;
+}
 
-    sprintf(file_name, "%s.fdx", sm->si->name);
-    fdx_out = store->new_output(store, file_name);
+/*
+ * Start the merges the merge policy wants, asking it again after each round
+ * as the merged segments may complete a merge at the next level.
+ */
+static void iw_maybe_merge_segments(IndexWriter *iw)
+{
+    MergePolicy *mp = iw->merge_policy;
+    while (true) {
+        SegmentStats *stats = iw_segment_stats(iw);
+        MergeSpec *merges = ALLOC_N(MergeSpec, iw->sis->size + 1);
+        volatile int started = 0;
+        int merge_cnt;
+        TRY
+            merge_cnt = mp->find_merges(mp, &iw->config, stats,
+                                        iw->sis->size, merges);
+            started = iw_start_merges(iw, stats, merges, merge_cnt,
+                                      iw->merge_thread_cnt > 0);
+        XFINALLY
+            free(merges);
+            free(stats);
+        XENDTRY
+        if (started == 0) {
+            break;
+        }
+    }
+}
 
-    for (i = 0; i < seg_cnt; i++) {
-        SegmentMergeInfo *smi = sm->smis[i];
-        const int max_doc = smi->max_doc;
-        InStream *fdt_in, *fdx_in;
-        char *segment = smi->si->name;
-        store = smi->store;
-        sprintf(file_name, "%s.fdt", segment);
-        fdt_in = store->open_input(store, file_name);
-        sprintf(file_name, "%s.fdx", segment);
-        fdx_in = store->open_input(store, file_name);
+static void iw_merge_failed(IndexWriter *iw, int excode, const char *msg)
+{
+    if (!iw->merge_excode) {
+        iw->merge_excode = excode;
+        iw->merge_msg = estrdup(msg ? msg : "");
+    }
+}
 
-        if (max_doc > 0) {
-            end = (off_t)is_read_u64(fdx_in);
+static void *iw_merge_worker(void *p)
+{
+    IndexWriter *iw = (IndexWriter *)p;
+    mutex_lock(&iw->mutex);
+    while (true) {
+        MergeJob *volatile job = iw->merges;
+        volatile bool merged = false;
+        while (job && job->running) {
+            job = job->next;
         }
-        for (j = 0; j < max_doc; j++) {
-            u32 tv_idx_offset = is_read_u32(fdx_in);
-            start = end;
-            if (j == max_doc - 1) {
-                end = is_length(fdt_in);
+        if (NULL == job) {
+            if (iw->merge_stopping) {
+                break;
             }
-            else {
-                end = (off_t)is_read_u64(fdx_in);
+            cond_wait(&iw->merge_cond, &iw->mutex);
+            continue;
+        }
+        job->running = true;
+        iw->pending_merge_cnt--;
+        cond_broadcast(&iw->merge_cond);
+        mutex_unlock(&iw->mutex);
+
+        TRY
+            iw_run_merge(iw, job);
+            merged = true;
+        XCATCHALL
+            mutex_lock(&iw->mutex);
+            iw_merge_failed(iw, xcontext.excode, xcontext.msg);
+            mutex_unlock(&iw->mutex);
+            HANDLED();
+        XENDTRY
+
+        mutex_lock(&iw->mutex);
+        TRY
+            if (merged) {
+                iw_commit_merge(iw, job);
             }
-            /* skip deleted docs */
-            if (!smi->deleted_docs || !bv_get(smi->deleted_docs, j)) {
-                os_write_u64(fdx_out, os_pos(fdt_out));
-                os_write_u32(fdx_out, tv_idx_offset);
-                is_seek(fdt_in, start);
-                is2os_copy_bytes(fdt_in, fdt_out, end - start);
+        XCATCHALL
+            iw_merge_failed(iw, xcontext.excode, xcontext.msg);
+            merged = false;
+            HANDLED();
+        XENDTRY
+        if (!merged) {
+            si_deref(job->si);
+        }
+
+        /* take the job off the list */
+        {
+            MergeJob **link = &iw->merges;
+            while (*link != job) {
+                link = &(*link)->next;
             }
+            *link = job->next;
+        }
+        iw_merge_job_destroy(job);
+        iw->merge_cnt--;
+        cond_broadcast(&iw->merge_cond);
+
+        /* the merged segment may complete a merge at the next level */
+        if (merged) {
+            TRY
+                iw_maybe_merge_segments(iw);
+            XCATCHALL
+                iw_merge_failed(iw, xcontext.excode, xcontext.msg);
+                HANDLED();
+            XENDTRY
         }
-        is_close(fdt_in);
-        is_close(fdx_in);
     }
-    os_close(fdt_out);
-    os_close(fdx_out);
+    mutex_unlock(&iw->mutex);
+    return NULL;
 }
 
-static int sm_append_postings(SegmentMerger *sm, SegmentMergeInfo **matches,
-                              const int match_size)
+/* wait until every queued merge has finished. iw->mutex must be held */
+static void iw_wait_merges(IndexWriter *iw)
 {
-    int i;
-    int last_doc = 0, base, doc, doc_code, freq;
-    int skip_interval = sm->config->skip_interval;
-    int *doc_map = NULL;
-    int df = 0;            /* number of docs w/ term */
-    TermDocEnum *tde;
-    SegmentMergeInfo *smi;
-    SkipBuffer *skip_buf = sm->skip_buf;
-    skip_buf_reset(skip_buf);
+    while (iw->merge_cnt > 0) {
+        cond_wait(&iw->merge_cond, &iw->mutex);
+    }
+}
 
-    for (i = 0; i < match_size; i++) {
-        smi = matches[i];
-        base = smi->base;
-        doc_map = smi->doc_map;
-        tde = smi->tde;
-        stpe_seek_ti(STDE(tde), &smi->te->curr_ti);
+/* don't let the merge backlog grow any further. iw->mutex must be held */
+static void iw_wait_merge_backlog(IndexWriter *iw)
+{
+    while (iw->pending_merge_cnt > iw->config.max_pending_merges) {
+        cond_wait(&iw->merge_cond, &iw->mutex);
+    }
+}
 
-        /* since we are using copy_bytes below to copy the proximities we use
-         * stde_next rather than stpe_next here */
-        while (stde_next(tde)) {
-            doc = stde_doc_num(tde);
-            if (NULL != doc_map) {
-                doc = doc_map[doc]; /* work around deletions */
-            }
-            doc += base;          /* convert to merged space */
-            assert(doc == 0 || doc > last_doc);
+/* raise the first error from a background merge. iw->mutex must be held */
+static void iw_raise_merge_error(IndexWriter *iw)
+{
+    if (iw->merge_excode) {
+        char msg[XMSG_BUFFER_SIZE];
+        int excode = iw->merge_excode;
+        strncpy(msg, iw->merge_msg, XMSG_BUFFER_SIZE - 1);
+        msg[XMSG_BUFFER_SIZE - 1] = '\0';
+        free(iw->merge_msg);
+        iw->merge_msg = NULL;
+        iw->merge_excode = 0;
+        RAISE(excode, "%s", msg);
+    }
+}
 
-            df++;
-            if (0 == (df % skip_interval)) {
-                skip_buf_add(skip_buf, last_doc);
-            }
+/****************/
+/*** Deleting ***/
+/****************/
 
-            doc_code = (doc - last_doc) << 1;    /* use low bit to flag freq=1 */
-            last_doc = doc;
+/*
+ * A delete by term or by query buffered until the next flush. Documents
+ * added after the delete must survive it so +doc_limits+ holds the number of
+ * documents each DocWriter had buffered when it was made, indexed like
+ * iw->dws (slot 0 is iw->dw when there is only one DocWriter). +applied+ is
+ * set once the delete has been applied to the segments already in the index.
+ */
+struct FrtBufferedDelete
+{
+    int field_num;
+    char *term;
+    Query *query;
+    int *doc_limits;
+    bool applied;
+};
 
-            freq = stde_freq(tde);
-            if (freq == 1) {
-                os_write_vint(sm->frq_out, doc_code | 1); /* doc & freq=1 */
-            }
-            else {
-                os_write_vint(sm->frq_out, doc_code); /* write doc */
-                os_write_vint(sm->frq_out, freq);     /* write freqency in doc */
-            }
+static int iw_dw_slot_cnt(IndexWriter *iw)
+{
+    return iw->config.max_doc_writers > 1 ? iw->config.max_doc_writers : 1;
+}
 
-            /* copy position deltas */
-            is2os_copy_vints(STDE(tde)->prx_in, sm->prx_out, freq);
-        }
+static void bd_destroy(BufferedDelete *bd)
+{
+    if (bd->query) {
+        q_deref(bd->query);
     }
-    return df;
+    free(bd->term);
+    free(bd->doc_limits);
+    free(bd);
 }
 
-static char *sm_cache_term(SegmentMerger *sm, char *term, int term_len)
+/* term deletes sorted by field and term so a segment is read in order */
+static int bd_cmp(const void *p1, const void *p2)
 {
-    term = (char *)memcpy(sm->term_buf + sm->term_buf_ptr, term, term_len + 1);
-    sm->term_buf_ptr += term_len + 1;
-    if (sm->term_buf_ptr > sm->term_buf_size) {
-        sm->term_buf_ptr = 0;
+    BufferedDelete *bd1 = *(BufferedDelete **)p1;
+    BufferedDelete *bd2 = *(BufferedDelete **)p2;
+    if (bd1->query || bd2->query) {
+        return (bd1->query != NULL) - (bd2->query != NULL);
     }
-    return term;
+    if (bd1->field_num != bd2->field_num) {
+        return bd1->field_num - bd2->field_num;
+    }
+    return strcmp(bd1->term, bd2->term);
 }
 
-static void sm_merge_term_info(SegmentMerger *sm, SegmentMergeInfo **matches,
-                               int match_size)
-{
-    off_t frq_ptr = os_pos(sm->frq_out);
-    off_t prx_ptr = os_pos(sm->prx_out);
+typedef struct QueryDeleteArg {
+    BitVector *docs;
+    int limit;
+} QueryDeleteArg;
 
-    int df = sm_append_postings(sm, matches, match_size); /* append posting data */
+static void iw_collect_query_delete(Searcher *sea, int doc_num, float score,
+                                    void *arg)
+{
+    QueryDeleteArg *qda = (QueryDeleteArg *)arg;
+    (void)sea; (void)score;
+    if (doc_num < qda->limit) {
+        bv_set(qda->docs, doc_num);
+    }
+}
 
-    off_t skip_ptr = skip_buf_write(sm->skip_buf);
+/*
+ * The documents +bd+ reaches in a segment flushed from DocWriter +slot+, or
+ * in a segment which was already in the index if +slot+ is -1.
+ */
+static int bd_limit(BufferedDelete *bd, const int slot)
+{
+    if (slot < 0) {
+        return bd->applied ? 0 : INT_MAX;
+    }
+    return bd->doc_limits[slot];
+}
 
-    if (df > 0) {
-        /* add an entry to the dictionary with ptrs to prox and freq files */
-        SegmentMergeInfo *first_match = matches[0];
-        int term_len = first_match->te->curr_term_len;
+/*
+ * Apply the +del_cnt+ sorted +deletes+ to segment +seg+ using a single
+ * TermDocEnum. A +slot+ of -1 means the segment was in the index before the
+ * deletes so the unapplied ones delete every matching document. Otherwise the
+ * segment was just flushed from that DocWriter slot and each delete only
+ * reaches the documents added before it. Returns true if any were deleted.
+ */
+static bool iw_apply_deletes_to_segment(IndexWriter *iw, const int seg,
+                                        BufferedDelete **deletes,
+                                        const int del_cnt, const int slot)
+{
+    IndexReader *ir;
+    TermDocEnum *volatile tde = NULL;
+    Searcher *volatile sea = NULL;
+    QueryDeleteArg qda;
+    volatile bool did_delete = false;
+    int i;
 
-        ti_set(sm->ti, df, frq_ptr, prx_ptr,
-               (skip_ptr - frq_ptr));
-        tiw_add(sm->tiw, sm_cache_term(sm, first_match->term, term_len),
-                term_len, &sm->ti);
+    /* don't open the segment if none of the deletes reach it */
+    for (i = 0; i < del_cnt && bd_limit(deletes[i], slot) == 0; i++) {
+    }
+    if (i == del_cnt) {
+        return false;
     }
-}
 
-static void sm_merge_term_infos(SegmentMerger *sm)
-{
-    int i, j, match_size;
-    SegmentMergeInfo *smi, *top, **matches;
-    char *term;
-    const int seg_cnt = sm->seg_cnt;
-    const int fis_size = sm->fis->size;
+    ir = sr_open(iw->sis, iw->fis, seg, false);
+    ir->deleter = iw->deleter;
+    qda.docs = NULL;
+    TRY
+        for (i = 0; i < del_cnt; i++) {
+            BufferedDelete *bd = deletes[i];
+            const int limit = bd_limit(bd, slot);
+            if (limit == 0) {
+                continue;
+            }
+            if (bd->query) {
+                if (NULL == sea) {
+                    sea = isea_new(ir);
+                    ((IndexSearcher *)sea)->close_ir = false;
+                    qda.docs = bv_new();
+                }
+                qda.limit = limit;
+                searcher_search_each(sea, bd->query, NULL, NULL,
+                                     &iw_collect_query_delete, &qda);
+                continue;
+            }
+            if (NULL == tde) {
+                tde = ir->term_docs(ir);
+            }
+            stde_seek(tde, bd->field_num, bd->term);
+            while (tde->next(tde) && STDE(tde)->doc_num < limit) {
+                did_delete = true;
+                sr_delete_doc_i(ir, STDE(tde)->doc_num);
+            }
+        }
+        /* the query deletes are collected first so the searcher's view of
+         * the segment doesn't change under it */
+        if (qda.docs) {
+            int doc_num;
+            for (doc_num = bv_scan_next_from(qda.docs, 0); doc_num >= 0;
+                 doc_num = bv_scan_next_from(qda.docs, doc_num + 1)) {
+                did_delete = true;
+                sr_delete_doc_i(ir, doc_num);
+            }
+        }
+        sr_commit_i(ir);
+    XFINALLY
+        if (tde) tde_destroy(tde);
+        if (sea) searcher_close(sea);
+        if (qda.docs) bv_destroy(qda.docs);
+        ir_close(ir);
+    XENDTRY
+    return did_delete;
+}
 
-    matches = ALLOC_N(SegmentMergeInfo *, seg_cnt);
+/*
+ * Apply the buffered deletes once the last +new_seg_cnt+ segments in iw->sis
+ * have been flushed from the DocWriters in +slots+. Deletes which haven't
+ * been applied yet delete every matching document in the segments before
+ * them, and each delete is applied to the new segments' documents which were
+ * added before it. Deletes which can't reach any more documents are dropped.
+ * Returns true if any segment's deletions changed. iw->mutex must be held.
+ */
+static bool iw_apply_deletes(IndexWriter *iw, const int new_seg_cnt,
+                             const int *slots)
+{
+    const int old_seg_cnt = iw->sis->size - new_seg_cnt;
+    const int slot_cnt = iw_dw_slot_cnt(iw);
+    const int del_cnt = iw->del_cnt;
+    BufferedDelete **deletes;
+    volatile bool did_delete = false;
+    int i, j, k;
 
-    for (j = 0; j < seg_cnt; j++) {
-        smi_load_term_input(sm->smis[j]);
+    if (del_cnt == 0) {
+        return false;
     }
-
-    for (i = 0; i < fis_size; i++) {
-        tiw_start_field(sm->tiw, i);
-        for (j = 0; j < seg_cnt; j++) {
-            smi = sm->smis[j];
-            ste_set_field(smi->te, i);
-            if (NULL != smi_next(smi)) {
-                pq_push(sm->queue, smi); /* initialize @queue */
+    deletes = ALLOC_N(BufferedDelete *, del_cnt);
+    memcpy(deletes, iw->deletes, del_cnt * sizeof(BufferedDelete *));
+    qsort(deletes, del_cnt, sizeof(BufferedDelete *), &bd_cmp);
+    TRY
+        for (i = 0; i < old_seg_cnt; i++) {
+            if (iw_apply_deletes_to_segment(iw, i, deletes, del_cnt, -1)) {
+                did_delete = true;
             }
         }
-        while (sm->queue->size > 0) {
-            /*
-               for (i = 1; i <= sm->queue->count; i++) {
-               printf("<{%s:%s}>", ((SegmentMergeInfo *)sm->queue->heap[i])->tb->field,
-               ((SegmentMergeInfo *)sm->queue->heap[i])->tb->text);
-               }printf("\n\n");
-               */
-            match_size = 0;     /* pop matching terms */
-            matches[0] = (SegmentMergeInfo *)pq_pop(sm->queue);
-            match_size++;
-            term = matches[0]->term;
-            top = (SegmentMergeInfo *)pq_top(sm->queue);
-            while ((NULL != top) && (0 == strcmp(term, top->term))) {
-                matches[match_size] = (SegmentMergeInfo *)pq_pop(sm->queue);
-                match_size++;
-                top = (SegmentMergeInfo *)pq_top(sm->queue);
+        for (i = 0; i < new_seg_cnt; i++) {
+            if (iw_apply_deletes_to_segment(iw, old_seg_cnt + i, deletes,
+                                            del_cnt, slots[i])) {
+                did_delete = true;
             }
+        }
+    XFINALLY
+        free(deletes);
+    XENDTRY
 
-            /* printf(">%s:%s<\n", matches[0]->tb->field, matches[0]->tb->text); */
-            sm_merge_term_info(sm, matches, match_size);/* add new TermInfo */
-
-            while (match_size > 0) {
-                match_size--;
-                smi = matches[match_size];
-                if (NULL != smi_next(smi)) {
-                    pq_push(sm->queue, smi);   /* restore queue */
-                }
+    for (i = j = 0; i < del_cnt; i++) {
+        BufferedDelete *bd = iw->deletes[i];
+        bool live = false;
+        bd->applied = true;
+        for (k = 0; k < new_seg_cnt; k++) {
+            bd->doc_limits[slots[k]] = 0;
+        }
+        for (k = 0; k < slot_cnt; k++) {
+            if (bd->doc_limits[k] > 0) {
+                live = true;
             }
         }
+        if (live) {
+            iw->deletes[j++] = bd;
+        }
+        else {
+            bd_destroy(bd);
+        }
     }
-    free(matches);
-    for (j = 0; j < seg_cnt; j++) {
-        smi_close_term_input(sm->smis[j]);
-    }
+    iw->del_cnt = j;
+    return did_delete;
 }
 
-static void sm_merge_terms(SegmentMerger *sm)
+/****************/
+/*** Flushing ***/
+/****************/
+
+/* commit the segments file and the fields file. iw->mutex must be held */
+static void iw_commit_sis(IndexWriter *iw)
 {
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    mutex_lock(&iw->store->mutex);
+    sis_write(iw->sis, iw->store, iw->deleter);
+    deleter_commit_pending_deletions(iw->deleter);
+    mutex_unlock(&iw->store->mutex);
+    iw->has_uncommitted = false;
+}
 
-    sprintf(file_name, "%s.frq", sm->si->name);
-    sm->frq_out = sm->store->new_output(sm->store, file_name);
-    sprintf(file_name, "%s.prx", sm->si->name);
-    sm->prx_out = sm->store->new_output(sm->store, file_name);
+/*
+ * Flush the single DocWriter to a new segment. Unless +commit+ is set the
+ * segment is only recorded in iw->sis until the next commit.
+ */
+static void iw_flush_ram_segment(IndexWriter *iw, bool commit)
+{
+    SegmentInfo *si = iw->dw->si;
+    const int slot = 0;
 
-    sm->tiw = tiw_open(sm->store, sm->si->name, sm->config->index_interval,
-                       sm->config->skip_interval);
-    sm->skip_buf = skip_buf_new(sm->frq_out, sm->prx_out);
+    si->doc_cnt = iw->dw->doc_num;
+    dw_flush(iw->dw);
 
-    /* terms_buf_ptr holds a buffer of terms since the TermInfosWriter needs
-     * to keep the last index_interval terms so that it can compare the last
-     * term put in the index with the next one. So the size of the buffer must
-     * by index_interval + 2. */
-    sm->term_buf_ptr = 0;
-    sm->term_buf_size = (sm->config->index_interval + 1) * MAX_WORD_SIZE;
-    sm->term_buf = ALLOC_N(char, sm->term_buf_size + MAX_WORD_SIZE);
+    mutex_lock(&iw->store->mutex);
+    sis_add_si(iw->sis, si);
+    if (iw->config.use_compound_file) {
+        iw_commit_compound_file(iw, si);
+        si->use_compound_file = true;
+    }
+    mutex_unlock(&iw->store->mutex);
 
-    sm->queue = pq_new(sm->seg_cnt, (lt_ft)&smi_lt, NULL);
+    iw_apply_deletes(iw, 1, &slot);
 
-    sm_merge_term_infos(sm);
+    if (commit) {
+        iw_commit_sis(iw);
+    }
+    else {
+        iw->has_uncommitted = true;
+    }
 
-    os_close(sm->frq_out);
-    os_close(sm->prx_out);
-    tiw_close(sm->tiw);
-    pq_destroy(sm->queue);
-    skip_buf_destroy(sm->skip_buf);
-    free(sm->term_buf);
+    iw_maybe_merge_segments(iw);
 }
 
-static void sm_merge_norms(SegmentMerger *sm)
+/*
+ * Flush +dw+ to its pending segment, including the compound file. Nothing
+ * else knows about the segment yet so this doesn't need iw->mutex.
+ */
+static void iw_flush_pending_segment(IndexWriter *iw, DocWriter *dw)
 {
-    SegmentInfo *si;
-    int i, j, k;
-    Store *store;
-    uchar byte;
-    FieldInfo *fi;
-    OutStream *os;
-    InStream *is;
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    SegmentMergeInfo *smi;
-    const int seg_cnt = sm->seg_cnt;
-    for (i = sm->fis->size - 1; i >= 0; i--) {
-        fi = sm->fis->fields[i];
-        if (fi_has_norms(fi))  {
-            si = sm->si;
-            si_advance_norm_gen(si, i);
-            si_norm_file_name(si, file_name, i);
-            os = sm->store->new_output(sm->store, file_name);
-            for (j = 0; j < seg_cnt; j++) {
-                smi = sm->smis[j];
-                si = smi->si;
-                if (si_norm_file_name(si, file_name, i)) {
-                    const int max_doc = smi->max_doc;
-                    BitVector *deleted_docs =  smi->deleted_docs;
-                    store = (si->use_compound_file && si->norm_gens[i])
-                             ? smi->orig_store : smi->store;
-                    is = store->open_input(store, file_name);
-                    if (deleted_docs) {
-                        for (k = 0; k < max_doc; k++) {
-                            byte = is_read_byte(is);
-                            if (!bv_get(deleted_docs, k)) {
-                                os_write_byte(os, byte);
-                            }
-                        }
-                    }
-                    else {
-                        is2os_copy_bytes(is, os, max_doc);
-                    }
-                    is_close(is);
-                }
-                else {
-                    const int doc_cnt = smi->doc_cnt;
-                    for (k = 0; k < doc_cnt; k++) {
-                        os_write_byte(os, '\0');
-                    }
-                }
-            }
-            os_close(os);
-        }
+    SegmentInfo *si = dw->si;
+    si->doc_cnt = dw->doc_num;
+    dw_flush(dw);
+
+    if (iw->config.use_compound_file) {
+        iw_create_pending_compound_file(iw, iw->fis, si);
     }
 }
 
-static int sm_merge(SegmentMerger *sm)
+/*
+ * Add pending segments flushed from the DocWriters in +slots+ to the index,
+ * writing the segments file if +commit+ is set. iw->mutex must be held.
+ */
+static void iw_commit_pending_segments(IndexWriter *iw, SegmentInfo **segs,
+                                       const int *slots, int seg_cnt,
+                                       bool commit)
 {
-    sm_merge_fields(sm);
-    sm_merge_terms(sm);
-    sm_merge_norms(sm);
-    return sm->doc_cnt;
-}
+    int i;
+    for (i = 0; i < seg_cnt; i++) {
+        sis_add_si(iw->sis, segs[i]);
+    }
+    iw_apply_deletes(iw, seg_cnt, slots);
 
+    if (commit) {
+        iw_commit_sis(iw);
+    }
+    else {
+        iw->has_uncommitted = true;
+    }
 
-/****************************************************************************
- * IndexWriter
- ****************************************************************************/
+    iw_maybe_merge_segments(iw);
+}
 
-/* prepare an index ready for writing */
-void index_create(Store *store, FieldInfos *fis)
+static bool iw_has_fields(IndexWriter *iw, Document *doc)
 {
-    SegmentInfos *sis = sis_new(fis);
-    store->clear_all(store);
-    sis_write(sis, store, NULL);
-    sis_destroy(sis);
+    int i;
+    for (i = doc->size - 1; i >= 0; i--) {
+        if (!fis_get_field(iw->fis, doc->fields[i]->name)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-bool index_is_locked(Store *store)
+/* wait until no DocWriters are in use. iw->mutex must be held */
+static void iw_drain_dws(IndexWriter *iw)
 {
-    Lock *write_lock = open_lock(store, WRITE_LOCK_NAME);
-    bool is_locked = write_lock->is_locked(write_lock);
-    close_lock(write_lock);
-    return is_locked;
+    iw->drain_cnt++;
+    while (iw->idle_dw_cnt < iw->dw_cnt) {
+        cond_wait(&iw->dw_cond, &iw->mutex);
+    }
+    iw->drain_cnt--;
 }
 
-int iw_doc_count(IndexWriter *iw)
+/*
+ * Take an idle DocWriter with an open pending segment, opening a new one if
+ * there are fewer than max_doc_writers. DocWriters read iw->fis without
+ * locking so any new fields in +doc+ are added while none are in use.
+ */
+static DocWriter *iw_checkout_dw(IndexWriter *iw, Document *doc)
 {
-    int i, doc_cnt = 0;
+    DocWriter *dw;
     mutex_lock(&iw->mutex);
-    for (i = iw->sis->size - 1; i >= 0; i--) {
-        doc_cnt += iw->sis->segs[i]->doc_cnt;
+    iw_wait_merge_backlog(iw);
+    if (!iw_has_fields(iw, doc)) {
+        int i;
+        iw_drain_dws(iw);
+        for (i = 0; i < doc->size; i++) {
+            fis_get_or_add_field(iw->fis, doc->fields[i]->name);
+        }
     }
-    if (iw->dw) {
-        doc_cnt += iw->dw->doc_num;
+    while (iw->drain_cnt > 0
+           || (iw->idle_dw_cnt == 0
+               && iw->dw_cnt >= iw->config.max_doc_writers)) {
+        cond_wait(&iw->dw_cond, &iw->mutex);
+    }
+    if (iw->idle_dw_cnt > 0) {
+        dw = iw->idle_dws[--iw->idle_dw_cnt];
+        if (NULL == dw->fw) {
+            dw_new_segment(dw, iw_new_pending_segment(iw));
+        }
+    }
+    else {
+        dw = dw_open(iw, iw_new_pending_segment(iw));
+        dw->analyzer_mutex = &iw->analyzer_mutex;
+        iw->dws[iw->dw_cnt++] = dw;
     }
     mutex_unlock(&iw->mutex);
-    return doc_cnt;
+    return dw;
 }
 
-#define MOVE_TO_COMPOUND_DIR(file_name)\
-    deleter_queue_file(dlr, file_name);\
-    cw_add_file(cw, file_name)
-
-static void iw_create_compound_file(Store *store, FieldInfos *fis,
-                                    SegmentInfo *si, char *cfs_file_name,
-                                    Deleter *dlr)
+/* return +dw+ to the idle DocWriters. iw->mutex must be held */
+static void iw_checkin_dw(IndexWriter *iw, DocWriter *dw)
 {
-    int i;
-    CompoundWriter *cw;
-    char file_name[SEGMENT_NAME_MAX_LENGTH];
-    char *ext;
-    int seg_len = strlen(si->name);
+    iw->idle_dws[iw->idle_dw_cnt++] = dw;
+    cond_broadcast(&iw->dw_cond);
+}
 
-    memcpy(file_name, si->name, seg_len);
-    file_name[seg_len] = '.';
-    ext = file_name + seg_len + 1;
+static void iw_add_doc_concurrent(IndexWriter *iw, Document *doc,
+                                  TokenBuffer **tbs)
+{
+    DocWriter *volatile dw = iw_checkout_dw(iw, doc);
+    SegmentInfo *volatile si = NULL;
 
-    cw = open_cw(store, cfs_file_name);
-    for (i = 0; i < NELEMS(COMPOUND_EXTENSIONS); i++) {
-        memcpy(ext, COMPOUND_EXTENSIONS[i], 4);
-        MOVE_TO_COMPOUND_DIR(file_name);
-    }
+    TRY
+        dw_add_doc_i(dw, doc, tbs);
+        if (dw_ram_used(dw) > iw->config.max_buffer_memory
+            || dw->doc_num >= iw->config.max_buffered_docs) {
+            si = dw->si;
+            iw_flush_pending_segment(iw, dw);
+        }
+    XCATCHALL
+        mutex_lock(&iw->mutex);
+        iw_checkin_dw(iw, dw);
+        mutex_unlock(&iw->mutex);
+    XENDTRY
 
-    /* Field norm file_names */
-    for (i = fis->size - 1; i >= 0; i--) {
-        if (fi_has_norms(fis->fields[i])
-            && si_norm_file_name(si, file_name, i)) {
-            MOVE_TO_COMPOUND_DIR(file_name);
+    mutex_lock(&iw->mutex);
+    iw_checkin_dw(iw, dw);
+    if (si) {
+        SegmentInfo *seg = si;
+        int slot = 0;
+        while (iw->dws[slot] != dw) {
+            slot++;
         }
+        iw_commit_pending_segments(iw, &seg, &slot, 1, true);
     }
-
-    /* Perform the merge */
-    cw_close(cw);
-}
-
-static void iw_commit_compound_file(IndexWriter *iw, SegmentInfo *si)
-{
-    char cfs_name[SEGMENT_NAME_MAX_LENGTH];
-    sprintf(cfs_name, "%s.cfs", si->name);
-
-    iw_create_compound_file(iw->store, iw->fis, si, cfs_name, iw->deleter);
+    mutex_unlock(&iw->mutex);
 }
 
-static void iw_merge_segments(IndexWriter *iw, const int min_seg,
-                              const int max_seg)
+static void iw_add_doc_i(IndexWriter *iw, Document *doc, TokenBuffer **tbs)
 {
-    int i;
-    SegmentInfos *sis = iw->sis;
-    SegmentInfo *si = sis_new_segment(sis, 0, iw->store);
-
-    SegmentMerger *merger = sm_create(iw, si, &sis->segs[min_seg],
-                                      max_seg - min_seg);
-
-    /* This is where all the action happens. */
-    si->doc_cnt = sm_merge(merger);
-
-    mutex_lock(&iw->store->mutex);
-    /* delete merged segments */
-    for (i = min_seg; i < max_seg; i++) {
-        si_delete_files(sis->segs[i], iw->fis, iw->deleter);
+    if (iw->config.max_doc_writers > 1) {
+        iw_add_doc_concurrent(iw, doc, tbs);
+        return;
     }
-
-    sis_del_from_to(sis, min_seg, max_seg);
-
-    if (iw->config.use_compound_file) {
-        iw_commit_compound_file(iw, si);
-        si->use_compound_file = true;
+    mutex_lock(&iw->mutex);
+    iw_wait_merge_backlog(iw);
+    if (NULL == iw->dw) {
+        iw->dw = dw_open(iw, iw_new_pending_segment(iw));
+        if (iw->analysis_pool) {
+            iw->dw->analyzer_mutex = &iw->analyzer_mutex;
+        }
+    }
+    else if (NULL == iw->dw->fw) {
+        dw_new_segment(iw->dw, iw_new_pending_segment(iw));
     }
+    dw_add_doc_i(iw->dw, doc, tbs);
+    if (dw_ram_used(iw->dw) > iw->config.max_buffer_memory
+        || iw->dw->doc_num >= iw->config.max_buffered_docs) {
+        iw_flush_ram_segment(iw, true);
+    }
+    mutex_unlock(&iw->mutex);
+}
 
-    sis_write(sis, iw->store, iw->deleter);
-    deleter_commit_pending_deletions(iw->deleter);
+void iw_add_doc(IndexWriter *iw, Document *doc)
+{
+    iw_add_doc_i(iw, doc, NULL);
+}
 
-    mutex_unlock(&iw->store->mutex);
+/*
+ * iw_add_docs analyzes documents on iw->analysis_pool while a single
+ * inverter task adds them in order. Analyzers stay at most +window+
+ * documents ahead of the inverter, which analyzes a document itself if no
+ * analyzer has started on it, so it never waits on a task that hasn't
+ * started. A document whose analysis fails is analyzed again by the
+ * inverter so the error is raised from iw_add_docs.
+ */
+typedef struct AnalyzedDoc
+{
+    bool *tokenize;
+    TokenBuffer **tbs;
+    bool done;
+} AnalyzedDoc;
 
-    sm_destroy(merger);
-}
+typedef struct AnalysisBatch
+{
+    IndexWriter *iw;
+    Document **docs;
+    AnalyzedDoc *analyzed;
+    int doc_cnt;
+    int next_doc;
+    int inverted_cnt;
+    int window;
+    bool stopping;
+    mutex_t mutex;
+    cond_t cond;
+} AnalysisBatch;
 
-static void iw_merge_segments_from(IndexWriter *iw, int min_segment)
+typedef struct AnalysisTask
 {
-    iw_merge_segments(iw, min_segment, iw->sis->size);
-}
+    AnalysisBatch *batch;
+    bool invert;
+} AnalysisTask;
 
-static void iw_maybe_merge_segments(IndexWriter *iw)
+static void iw_free_tbs(TokenBuffer **tbs, int size)
 {
-    int target_merge_docs = iw->config.merge_factor;
-    int min_segment, merge_docs;
-    SegmentInfo *si;
+    int i;
+    for (i = 0; i < size; i++) {
+        if (tbs[i]) {
+            tb_destroy(tbs[i]);
+        }
+    }
+    free(tbs);
+}
 
-    while (target_merge_docs > 0
-           && target_merge_docs <= iw->config.max_merge_docs) {
-        /* find segments smaller than current target size */
-        min_segment = iw->sis->size - 1;
-        merge_docs = 0;
-        while (min_segment >= 0) {
-            si = iw->sis->segs[min_segment];
-            if (si->doc_cnt >= target_merge_docs) {
-                break;
+/* returns NULL if analysis fails */
+static TokenBuffer **iw_analyze_doc(IndexWriter *iw, Document *doc,
+                                    bool *tokenize)
+{
+    TokenBuffer **volatile tbs = ALLOC_AND_ZERO_N(TokenBuffer *, doc->size);
+    int i;
+    TRY
+        for (i = 0; i < doc->size; i++) {
+            if (tokenize[i]) {
+                tbs[i] = tb_analyze(iw->analyzer, &iw->analyzer_mutex,
+                                    doc->fields[i],
+                                    iw->config.max_field_length);
             }
-            merge_docs += si->doc_cnt;
-            min_segment--;
         }
+    XCATCHALL
+        HANDLED();
+        iw_free_tbs(tbs, doc->size);
+        tbs = NULL;
+    XENDTRY
+    return tbs;
+}
 
-        if (merge_docs >= target_merge_docs) { /* found a merge to do */
-            iw_merge_segments_from(iw, min_segment + 1);
+static void iw_analyze_batch(AnalysisBatch *batch)
+{
+    mutex_lock(&batch->mutex);
+    while (true) {
+        AnalyzedDoc *ad;
+        TokenBuffer **tbs;
+        int i;
+        while (!batch->stopping && batch->next_doc < batch->doc_cnt
+               && batch->next_doc >= batch->inverted_cnt + batch->window) {
+            cond_wait(&batch->cond, &batch->mutex);
         }
-        else if (min_segment <= 0) {
+        if (batch->stopping || batch->next_doc >= batch->doc_cnt) {
             break;
         }
+        i = batch->next_doc++;
+        ad = &batch->analyzed[i];
+        mutex_unlock(&batch->mutex);
+
+        tbs = iw_analyze_doc(batch->iw, batch->docs[i], ad->tokenize);
 
-        target_merge_docs *= iw->config.merge_factor;
+        mutex_lock(&batch->mutex);
+        ad->tbs = tbs;
+        ad->done = true;
+        cond_broadcast(&batch->cond);
     }
+    mutex_unlock(&batch->mutex);
 }
 
-static void iw_flush_ram_segment(IndexWriter *iw)
+static void iw_invert_batch(AnalysisBatch *batch)
 {
-    SegmentInfos *sis = iw->sis;
-    SegmentInfo *si;
+    int i;
+    TRY
+        for (i = 0; i < batch->doc_cnt; i++) {
+            AnalyzedDoc *ad = &batch->analyzed[i];
+            TokenBuffer **tbs = NULL;
+            mutex_lock(&batch->mutex);
+            if (batch->next_doc == i) {
+                batch->next_doc++;
+            }
+            else {
+                while (!ad->done) {
+                    cond_wait(&batch->cond, &batch->mutex);
+                }
+                tbs = ad->tbs;
+                ad->tbs = NULL;
+            }
+            mutex_unlock(&batch->mutex);
 
-    si = sis->segs[sis->size - 1];
-    si->doc_cnt = iw->dw->doc_num;
-    dw_flush(iw->dw);
+            TRY
+                iw_add_doc_i(batch->iw, batch->docs[i], tbs);
+            XFINALLY
+                if (tbs) {
+                    iw_free_tbs(tbs, batch->docs[i]->size);
+                }
+            XENDTRY
 
-    mutex_lock(&iw->store->mutex);
+            mutex_lock(&batch->mutex);
+            batch->inverted_cnt++;
+            cond_broadcast(&batch->cond);
+            mutex_unlock(&batch->mutex);
+        }
+    XFINALLY
+        mutex_lock(&batch->mutex);
+        batch->stopping = true;
+        cond_broadcast(&batch->cond);
+        mutex_unlock(&batch->mutex);
+    XENDTRY
+}
 
-    if (iw->config.use_compound_file) {
-        iw_commit_compound_file(iw, si);
-        si->use_compound_file = true;
+static void iw_analysis_task(void *arg)
+{
+    AnalysisTask *task = (AnalysisTask *)arg;
+    if (task->invert) {
+        iw_invert_batch(task->batch);
+    }
+    else {
+        iw_analyze_batch(task->batch);
     }
-    /* commit the segments file and the fields file */
-    sis_write(iw->sis, iw->store, iw->deleter);
-    deleter_commit_pending_deletions(iw->deleter);
-
-    mutex_unlock(&iw->store->mutex);
-
-    iw_maybe_merge_segments(iw);
 }
 
-void iw_add_doc(IndexWriter *iw, Document *doc)
+/*
+ * Note which fields in the batch will be tokenized so the analyzers never
+ * need to look at iw->fis. Fields which don't exist yet will be added with
+ * the defaults in iw->fis. The inverter checks again before using a field's
+ * tokens so a wrong guess only wastes the analysis.
+ */
+static void iw_prepare_batch(IndexWriter *iw, AnalysisBatch *batch)
 {
+    FieldInfos *fis = iw->fis;
+    int i, j;
     mutex_lock(&iw->mutex);
-    if (NULL == iw->dw) {
-        iw->dw = dw_open(iw, sis_new_segment(iw->sis, 0, iw->store));
+    for (i = 0; i < batch->doc_cnt; i++) {
+        Document *doc = batch->docs[i];
+        AnalyzedDoc *ad = &batch->analyzed[i];
+        ad->tokenize = ALLOC_N(bool, doc->size);
+        for (j = 0; j < doc->size; j++) {
+            FieldInfo *fi = fis_get_field(fis, doc->fields[j]->name);
+            ad->tokenize[j] = fi
+                ? fi_is_indexed(fi) && fi_is_tokenized(fi)
+                : fis->index == INDEX_YES
+                  || fis->index == INDEX_YES_OMIT_NORMS;
+        }
     }
-    else if (NULL == iw->dw->fw) {
-        dw_new_segment(iw->dw, sis_new_segment(iw->sis, 0, iw->store));
+    mutex_unlock(&iw->mutex);
+}
+
+void iw_add_docs(IndexWriter *iw, Document **docs, const int doc_cnt)
+{
+    AnalysisBatch batch;
+    AnalysisTask *tasks;
+    void **args;
+    int i, task_cnt;
+
+    if (!iw->analysis_pool || doc_cnt <= 1) {
+        for (i = 0; i < doc_cnt; i++) {
+            iw_add_doc(iw, docs[i]);
+        }
+        return;
     }
-    dw_add_doc(iw->dw, doc);
-    if (mp_used(iw->dw->mp) > iw->config.max_buffer_memory
-        || iw->dw->doc_num >= iw->config.max_buffered_docs) {
-        iw_flush_ram_segment(iw);
+
+    task_cnt = tp_thread_cnt(iw->analysis_pool) + 1;
+    batch.iw = iw;
+    batch.docs = docs;
+    batch.analyzed = ALLOC_AND_ZERO_N(AnalyzedDoc, doc_cnt);
+    batch.doc_cnt = doc_cnt;
+    batch.next_doc = 0;
+    batch.inverted_cnt = 0;
+    batch.window = 4 * task_cnt;
+    batch.stopping = false;
+    mutex_init(&batch.mutex, NULL);
+    cond_init(&batch.cond, NULL);
+    tasks = ALLOC_N(AnalysisTask, task_cnt);
+    args = ALLOC_N(void *, task_cnt);
+    for (i = 0; i < task_cnt; i++) {
+        tasks[i].batch = &batch;
+        /* tasks are started in order so the inverter always runs */
+        tasks[i].invert = (i == 0);
+        args[i] = &tasks[i];
     }
-    mutex_unlock(&iw->mutex);
+
+    TRY
+        iw_prepare_batch(iw, &batch);
+        tp_run(iw->analysis_pool, &iw_analysis_task, args, task_cnt, 0);
+    XFINALLY
+        for (i = 0; i < doc_cnt; i++) {
+            free(batch.analyzed[i].tokenize);
+            if (batch.analyzed[i].tbs) {
+                iw_free_tbs(batch.analyzed[i].tbs, docs[i]->size);
+            }
+        }
+        free(batch.analyzed);
+        free(args);
+        free(tasks);
+        cond_destroy(&batch.cond);
+        mutex_destroy(&batch.mutex);
+    XENDTRY
 }
 
-static void iw_commit_i(IndexWriter *iw)
+/*
+ * Flush every DocWriter and apply the buffered deletes. Unless +commit+ is
+ * set the new segments are left uncommitted in iw->sis. iw->mutex must be
+ * held.
+ */
+static void iw_flush_i(IndexWriter *iw, bool commit)
 {
     if (iw->dw && iw->dw->doc_num > 0) {
-        iw_flush_ram_segment(iw);
+        iw_flush_ram_segment(iw, commit);
+    }
+    if (iw->dw_cnt > 0) {
+        int i, seg_cnt = 0;
+        SegmentInfo **segs = ALLOC_N(SegmentInfo *, iw->dw_cnt);
+        int *slots = ALLOC_N(int, iw->dw_cnt);
+        iw_drain_dws(iw);
+        for (i = 0; i < iw->dw_cnt; i++) {
+            DocWriter *dw = iw->dws[i];
+            if (dw->doc_num > 0) {
+                slots[seg_cnt] = i;
+                segs[seg_cnt++] = dw->si;
+                iw_flush_pending_segment(iw, dw);
+            }
+        }
+        if (seg_cnt > 0) {
+            iw_commit_pending_segments(iw, segs, slots, seg_cnt, commit);
+        }
+        free(slots);
+        free(segs);
     }
+    /* deletes made since the last flush with no documents added after them */
+    if (iw_apply_deletes(iw, 0, NULL)) {
+        iw->has_uncommitted = true;
+    }
+    if (commit && iw->has_uncommitted) {
+        iw_commit_sis(iw);
+    }
+}
+
+static void iw_commit_i(IndexWriter *iw)
+{
+    iw_flush_i(iw, true);
 }
 
 void iw_commit(IndexWriter *iw)
 {
     mutex_lock(&iw->mutex);
-    iw_commit_i(iw);
-    mutex_unlock(&iw->mutex);
+    TRY
+        iw_commit_i(iw);
+        iw_raise_merge_error(iw);
+    XFINALLY
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+}
+
+/*
+ * The reader gets its own copy of the segments and fields so the writer can
+ * carry on changing them. Its segment files can't be deleted from under it
+ * while iw->mutex is held since merges are committed under it.
+ */
+IndexReader *iw_get_reader(IndexWriter *iw, IndexReader *prev_ir)
+{
+    IndexReader *volatile ir = NULL;
+    SegmentInfos *volatile sis = NULL;
+    mutex_lock(&iw->mutex);
+    if (prev_ir) {
+        mutex_lock(&prev_ir->mutex);
+    }
+    TRY
+        iw_flush_i(iw, false);
+        sis = sis_clone(iw->sis);
+        mutex_lock(&iw->store->mutex);
+        TRY
+            ir = ir_open_sis(iw->store, sis, prev_ir);
+        XFINALLY
+            mutex_unlock(&iw->store->mutex);
+        XENDTRY
+    XFINALLY
+        if (!ir && sis) {
+            sis_destroy(sis);
+        }
+        if (prev_ir) {
+            mutex_unlock(&prev_ir->mutex);
+        }
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+    return ir;
+}
+
+/*
+ * Buffer a delete until the next flush, noting how many documents each
+ * DocWriter has buffered so the delete won't reach documents added after it.
+ * iw->mutex must be held.
+ */
+static void iw_buffer_delete(IndexWriter *iw, int field_num, const char *term,
+                             Query *query)
+{
+    BufferedDelete *bd = ALLOC_AND_ZERO(BufferedDelete);
+    bd->doc_limits = ALLOC_AND_ZERO_N(int, iw_dw_slot_cnt(iw));
+    if (iw->config.max_doc_writers > 1) {
+        int i;
+        iw_drain_dws(iw);
+        for (i = 0; i < iw->dw_cnt; i++) {
+            DocWriter *dw = iw->dws[i];
+            bd->doc_limits[i] = dw->fw ? dw->doc_num : 0;
+        }
+    }
+    else if (iw->dw && iw->dw->fw) {
+        bd->doc_limits[0] = iw->dw->doc_num;
+    }
+    bd->field_num = field_num;
+    if (query) {
+        REF(query);
+        bd->query = query;
+    }
+    else {
+        bd->term = estrdup(term);
+    }
+    if (iw->del_cnt >= iw->del_capa) {
+        iw->del_capa = iw->del_capa ? iw->del_capa * 2 : 16;
+        REALLOC_N(iw->deletes, BufferedDelete *, iw->del_capa);
+    }
+    iw->deletes[iw->del_cnt++] = bd;
 }
 
 void iw_delete_term(IndexWriter *iw, Symbol field, const char *term)
 {
-    int field_num = fis_get_field_num(iw->fis, field);
+    int field_num;
+    mutex_lock(&iw->mutex);
+    field_num = fis_get_field_num(iw->fis, field);
     if (field_num >= 0) {
-        int i;
-        mutex_lock(&iw->mutex);
-        iw_commit_i(iw);
-        do {
-            SegmentInfos *sis = iw->sis;
-            const int seg_cnt = sis->size;
-            bool did_delete = false;
-            for (i = 0; i < seg_cnt; i++) {
-                IndexReader *ir = sr_open(sis, iw->fis, i, false);
-                TermDocEnum *tde = ir->term_docs(ir);
-                ir->deleter = iw->deleter;
-                stde_seek(tde, field_num, term);
-                while (tde->next(tde)) {
-                    did_delete = true;
-                    sr_delete_doc_i(ir, STDE(tde)->doc_num);
-                }
-                tde_destroy(tde);
-                sr_commit_i(ir);
-                ir_close(ir);
-            }
-            if (did_delete) {
-                mutex_lock(&iw->store->mutex);
-                sis_write(iw->sis, iw->store, iw->deleter);
-                mutex_unlock(&iw->store->mutex);
-            }
-        } while (0);
-        mutex_unlock(&iw->mutex);
+        iw_buffer_delete(iw, field_num, term, NULL);
     }
+    mutex_unlock(&iw->mutex);
 }
 
 void iw_delete_terms(IndexWriter *iw, Symbol field,
                      char **terms, const int term_cnt)
 {
-    int field_num = fis_get_field_num(iw->fis, field);
+    int field_num;
+    mutex_lock(&iw->mutex);
+    field_num = fis_get_field_num(iw->fis, field);
     if (field_num >= 0) {
         int i;
-        mutex_lock(&iw->mutex);
-        iw_commit_i(iw);
-        do {
-            SegmentInfos *sis = iw->sis;
-            const int seg_cnt = sis->size;
-            bool did_delete = false;
-            for (i = 0; i < seg_cnt; i++) {
-                IndexReader *ir = sr_open(sis, iw->fis, i, false);
-                TermDocEnum *tde = ir->term_docs(ir);
-                int j;
-                for (j = 0 ; j < term_cnt; j++) {
-                    const char *term = terms[j];
-                    ir->deleter = iw->deleter;
-                    stde_seek(tde, field_num, term);
-                    while (tde->next(tde)) {
-                        did_delete = true;
-                        sr_delete_doc_i(ir, STDE(tde)->doc_num);
-                    }
-                }
-                tde_destroy(tde);
-                sr_commit_i(ir);
-                ir_close(ir);
-            }
-            if (did_delete) {
-                mutex_lock(&iw->store->mutex);
-                sis_write(iw->sis, iw->store, iw->deleter);
-                mutex_unlock(&iw->store->mutex);
-            }
-        } while (0);
-        mutex_unlock(&iw->mutex);
+        for (i = 0; i < term_cnt; i++) {
+            iw_buffer_delete(iw, field_num, terms[i], NULL);
+        }
     }
+    mutex_unlock(&iw->mutex);
+}
+
+void iw_delete_query(IndexWriter *iw, Query *query)
+{
+    mutex_lock(&iw->mutex);
+    iw_buffer_delete(iw, -1, NULL, query);
+    mutex_unlock(&iw->mutex);
 }
 
 static void iw_optimize_i(IndexWriter *iw)
 {
     int min_segment;
     iw_commit_i(iw);
+    iw_wait_merges(iw);
     while (iw->sis->size > 1
            || (iw->sis->size == 1
                && (si_has_deletions(iw->sis->segs[0])
@@ -6452,17 +11346,137 @@ void iw_optimize(IndexWriter *iw)
     mutex_unlock(&iw->mutex);
 }
 
+/*
+ * Run the merges found by the merge policy's find_forced_merges, or
+ * find_deletes_merges if +max_seg_cnt+ is negative, until it finds no more.
+ */
+static void iw_run_policy_merges(IndexWriter *iw, int max_seg_cnt)
+{
+    MergePolicy *mp = iw->merge_policy;
+    iw_commit_i(iw);
+    iw_wait_merges(iw);
+    while (true) {
+        SegmentStats *stats = iw_segment_stats(iw);
+        MergeSpec *merges = ALLOC_N(MergeSpec, iw->sis->size + 1);
+        volatile int started = 0;
+        int merge_cnt;
+        TRY
+            if (max_seg_cnt >= 0) {
+                merge_cnt = mp->find_forced_merges(mp, &iw->config, stats,
+                                                   iw->sis->size, max_seg_cnt,
+                                                   merges);
+            }
+            else {
+                merge_cnt = mp->find_deletes_merges(mp, &iw->config, stats,
+                                                    iw->sis->size, merges);
+            }
+            started = iw_start_merges(iw, stats, merges, merge_cnt, false);
+        XFINALLY
+            free(merges);
+            free(stats);
+        XENDTRY
+        if (started == 0) {
+            break;
+        }
+    }
+}
+
+void iw_force_merge(IndexWriter *iw, int max_seg_cnt)
+{
+    if (max_seg_cnt < 1) {
+        RAISE(ARG_ERROR, "can't merge an index down to %d segments",
+              max_seg_cnt);
+    }
+    mutex_lock(&iw->mutex);
+    TRY
+        iw_run_policy_merges(iw, max_seg_cnt);
+    XFINALLY
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+}
+
+void iw_expunge_deletes(IndexWriter *iw)
+{
+    mutex_lock(&iw->mutex);
+    TRY
+        iw_run_policy_merges(iw, -1);
+    XFINALLY
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+}
+
+void iw_set_merge_policy(IndexWriter *iw, MergePolicy *mp)
+{
+    mutex_lock(&iw->mutex);
+    merge_policy_destroy(iw->merge_policy);
+    iw->merge_policy = mp;
+    mutex_unlock(&iw->mutex);
+}
+
+static void iw_stop_merge_threads(IndexWriter *iw)
+{
+    int i;
+    iw_wait_merges(iw);
+    iw->merge_stopping = true;
+    cond_broadcast(&iw->merge_cond);
+    mutex_unlock(&iw->mutex);
+    for (i = 0; i < iw->merge_thread_cnt; i++) {
+        thread_join(iw->merge_threads[i]);
+    }
+    mutex_lock(&iw->mutex);
+}
+
 void iw_close(IndexWriter *iw)
 {
+    char merge_msg[XMSG_BUFFER_SIZE];
+    int merge_excode;
     mutex_lock(&iw->mutex);
     iw_commit_i(iw);
+    if (iw->merge_thread_cnt > 0) {
+        iw_stop_merge_threads(iw);
+    }
+    while (iw->del_cnt > 0) {
+        bd_destroy(iw->deletes[--iw->del_cnt]);
+    }
+    free(iw->deletes);
+    free(iw->merge_threads);
+    cond_destroy(&iw->merge_cond);
+    if ((merge_excode = iw->merge_excode) != 0) {
+        strncpy(merge_msg, iw->merge_msg, XMSG_BUFFER_SIZE - 1);
+        merge_msg[XMSG_BUFFER_SIZE - 1] = '\0';
+        free(iw->merge_msg);
+    }
     if (iw->dw) {
+        /* a pending segment which was never added to the index */
+        SegmentInfo *si = iw->dw->fw ? iw->dw->si : NULL;
         dw_close(iw->dw);
+        if (si) si_deref(si);
     }
+    if (iw->dws) {
+        int i;
+        for (i = 0; i < iw->dw_cnt; i++) {
+            DocWriter *dw = iw->dws[i];
+            /* a pending segment which was never added to the index */
+            SegmentInfo *si = dw->fw ? dw->si : NULL;
+            dw_close(dw);
+            if (si) si_deref(si);
+        }
+        free(iw->dws);
+        free(iw->idle_dws);
+        cond_destroy(&iw->dw_cond);
+    }
+    mutex_destroy(&iw->analyzer_mutex);
     a_deref(iw->analyzer);
     sis_destroy(iw->sis);
     fis_deref(iw->fis);
+    if (iw->merge_pool) {
+        tp_destroy(iw->merge_pool);
+    }
+    if (iw->analysis_pool) {
+        tp_destroy(iw->analysis_pool);
+    }
     sim_destroy(iw->similarity);
+    merge_policy_destroy(iw->merge_policy);
 
     iw->write_lock->release(iw->write_lock);
     close_lock(iw->write_lock);
@@ -6472,6 +11486,10 @@ void iw_close(IndexWriter *iw)
 
     mutex_destroy(&iw->mutex);
     free(iw);
+
+    if (merge_excode) {
+        RAISE(merge_excode, "%s", merge_msg);
+    }
 }
 
 IndexWriter *iw_open(Store *store, Analyzer *volatile analyzer,
@@ -6507,12 +11525,40 @@ IndexWriter *iw_open(Store *store, Analyzer *volatile analyzer,
     XENDTRY
 
     iw->similarity = sim_create_default();
+    iw->merge_policy = log_doc_merge_policy_new();
     iw->analyzer = analyzer ? (Analyzer *)analyzer
                             : mb_standard_analyzer_new(true);
 
     iw->deleter = deleter_new(iw->sis, store);
     deleter_delete_deletable_files(iw->deleter);
 
+    if (iw->config.max_doc_writers > 1) {
+        iw->dws = ALLOC_N(DocWriter *, iw->config.max_doc_writers);
+        iw->idle_dws = ALLOC_N(DocWriter *, iw->config.max_doc_writers);
+        cond_init(&iw->dw_cond, NULL);
+    }
+    mutex_init(&iw->analyzer_mutex, NULL);
+
+    cond_init(&iw->merge_cond, NULL);
+    if (iw->config.max_merge_threads > 0) {
+        int i;
+        iw->merge_threads = ALLOC_N(thread_t, iw->config.max_merge_threads);
+        for (i = 0; i < iw->config.max_merge_threads; i++) {
+            if (thread_create(&iw->merge_threads[i], &iw_merge_worker,
+                              iw) != 0) {
+                break;
+            }
+        }
+        /* if no threads could be started we merge in the calling thread */
+        iw->merge_thread_cnt = i;
+    }
+    if (iw->config.merge_stage_threads > 1) {
+        iw->merge_pool = tp_new(iw->config.merge_stage_threads - 1);
+    }
+    if (iw->config.analysis_threads > 1) {
+        iw->analysis_pool = tp_new(iw->config.analysis_threads - 1);
+    }
+
     REF(store);
     return iw;
 }
@@ -6526,7 +11572,7 @@ static void iw_cp_fields(IndexWriter *iw, SegmentReader *sr,
     char file_name[SEGMENT_NAME_MAX_LENGTH];
     OutStream *fdt_out, *fdx_out;
     InStream *fdt_in, *fdx_in;
-    Store *store_in = sr->cfs_store ? sr->cfs_store : sr->ir.store;
+    Store *store_in = sr->core->cfs_store ? sr->core->cfs_store : sr->ir.store;
     Store *store_out = iw->store;
     char *sr_segment = sr->si->name;
 
@@ -6611,10 +11657,11 @@ static void iw_cp_terms(IndexWriter *iw, SegmentReader *sr,
                         const char *segment, int *map)
 {
     char file_name[SEGMENT_NAME_MAX_LENGTH];
-    OutStream *tix_out, *tis_out, *tfx_out, *frq_out, *prx_out;
-    InStream *tix_in, *tis_in, *tfx_in, *frq_in, *prx_in;
+    OutStream *tix_out, *tis_out, *tfx_out, *frq_out, *prx_out, *fst_out;
+    OutStream *blm_out;
+    InStream *tix_in, *tis_in, *tfx_in, *frq_in, *prx_in, *fst_in, *blm_in;
     Store *store_out = iw->store;
-    Store *store_in = sr->cfs_store ? sr->cfs_store : sr->ir.store;
+    Store *store_in = sr->core->cfs_store ? sr->core->cfs_store : sr->ir.store;
     char *sr_segment = sr->si->name;
 
     sprintf(file_name, "%s.tix", segment);
@@ -6642,10 +11689,36 @@ static void iw_cp_terms(IndexWriter *iw, SegmentReader *sr,
     sprintf(file_name, "%s.prx", sr_segment);
     prx_in = store_in->open_input(store_in, file_name);
 
+    /* the FSTs are in field order so they don't need to be mapped */
+    sprintf(file_name, "%s.fst", sr_segment);
+    if (store_in->exists(store_in, file_name)) {
+        fst_in = store_in->open_input(store_in, file_name);
+        sprintf(file_name, "%s.fst", segment);
+        fst_out = store_out->new_output(store_out, file_name);
+        is2os_copy_bytes(fst_in, fst_out, is_length(fst_in));
+        is_close(fst_in);
+        os_close(fst_out);
+    }
+    sprintf(file_name, "%s.blm", sr_segment);
+    if (store_in->exists(store_in, file_name)) {
+        blm_in = store_in->open_input(store_in, file_name);
+        sprintf(file_name, "%s.blm", segment);
+        blm_out = store_out->new_output(store_out, file_name);
+        is2os_copy_bytes(blm_in, blm_out, is_length(blm_in));
+        is_close(blm_in);
+        os_close(blm_out);
+    }
+
     if (map) {
         int field_cnt = is_read_u32(tfx_in);
+        int index_interval;
         os_write_u32(tfx_out, field_cnt);
-        os_write_vint(tfx_out, is_read_vint(tfx_in)); /* index_interval */
+        index_interval = is_read_vint(tfx_in);
+        os_write_vint(tfx_out, index_interval);
+        if (0 == index_interval) {
+            os_write_vint(tfx_out, is_read_vint(tfx_in)); /* format */
+            os_write_vint(tfx_out, is_read_vint(tfx_in)); /* index_interval */
+        }
         os_write_vint(tfx_out, is_read_vint(tfx_in)); /* skip_interval */
 
         for (; field_cnt > 0; field_cnt--) {
@@ -6692,7 +11765,7 @@ static void iw_cp_norms(IndexWriter *iw, SegmentReader *sr,
         if (fi_has_norms(fis->fields[i])
             && si_norm_file_name(sr->si, file_name_in, i)) {
             Store *store = (sr->si->use_compound_file
-                            && sr->si->norm_gens[i] == 0) ? sr->cfs_store
+                            && sr->si->norm_gens[i] == 0) ? sr->core->cfs_store
                                                           : IR(sr)->store;
             int field_num = map ? map[i] : i;
 
@@ -6707,6 +11780,36 @@ static void iw_cp_norms(IndexWriter *iw, SegmentReader *sr,
     }
 }
 
+/* the columns are copied as they are with the directory's fields mapped */
+static void iw_cp_doc_values(IndexWriter *iw, SegmentReader *sr,
+                             const char *segment, int *map)
+{
+    int i;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    Store *store_in = sr->core->cfs_store ? sr->core->cfs_store : sr->ir.store;
+    DocValuesReader *dvr = dvr_open(store_in, sr->si->name);
+    OutStream *dvs_out;
+    off_t dir_ptr;
+
+    if (NULL == dvr) {
+        return;
+    }
+    sprintf(file_name, "%s.dvs", segment);
+    dvs_out = iw->store->new_output(iw->store, file_name);
+    is_seek(dvr->is, is_length(dvr->is) - 8);
+    dir_ptr = (off_t)is_read_u64(dvr->is);
+    is_seek(dvr->is, 0);
+    is2os_copy_bytes(dvr->is, dvs_out, dir_ptr);
+    if (map) {
+        for (i = 0; i < dvr->field_cnt; i++) {
+            dvr->field_nums[i] = map[dvr->field_nums[i]];
+        }
+    }
+    dv_write_directory(dvs_out, dvr->field_cnt, dvr->field_nums, dvr->ptrs);
+    os_close(dvs_out);
+    dvr_close(dvr);
+}
+
 static void iw_cp_map_files(IndexWriter *iw, SegmentReader *sr,
                             SegmentInfo *si)
 {
@@ -6723,6 +11826,7 @@ static void iw_cp_map_files(IndexWriter *iw, SegmentReader *sr,
     iw_cp_fields(iw, sr, si->name, field_map);
     iw_cp_terms( iw, sr, si->name, field_map);
     iw_cp_norms( iw, sr, si,       field_map);
+    iw_cp_doc_values(iw, sr, si->name, field_map);
 
     free(field_map);
 }
@@ -6733,6 +11837,7 @@ static void iw_cp_files(IndexWriter *iw, SegmentReader *sr,
     iw_cp_fields(iw, sr, si->name, NULL);
     iw_cp_terms( iw, sr, si->name, NULL);
     iw_cp_norms( iw, sr, si,       NULL);
+    iw_cp_doc_values(iw, sr, si->name, NULL);
 }
 
 static void iw_add_segment(IndexWriter *iw, SegmentReader *sr)
@@ -6745,6 +11850,10 @@ static void iw_add_segment(IndexWriter *iw, SegmentReader *sr)
     bool must_map_fields = false;
 
     si->doc_cnt = IR(sr)->max_doc(IR(sr));
+    /* the postings are copied as is */
+    si->postings_format = sr->si->postings_format;
+    si->max_skip_levels = sr->si->max_skip_levels;
+    si->has_max_freqs = sr->si->has_max_freqs;
     /* Merge FieldInfos */
     for (j = 0; j < fis_size; j++) {
         FieldInfo *fi = sub_fis->fields[j];
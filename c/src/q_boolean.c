@@ -1,4 +1,5 @@
 #include <string.h>
+#include <float.h>
 #include "search.h"
 #include "array.h"
 #include "internal.h"
@@ -260,6 +261,284 @@ static Scorer *counting_disjunction_sum_scorer_new(
     return self;
 }
 
+/***************************************************************************
+ * MaxScoreScorer
+ *
+ * A counting disjunction used when only the best scoring documents are
+ * wanted. Once the searcher sets a minimum score, the sub-scorers with the
+ * smallest max_scores which together can't lift a document above it are no
+ * longer "essential". Candidates are only taken from the essential
+ * sub-scorers and the others are skipped to only while the candidate can
+ * still beat the minimum score.
+ ***************************************************************************/
+
+#define MSSc(scorer) ((MaxScoreScorer *)(scorer))
+
+typedef struct MaxScoreSub
+{
+    Scorer *scorer;
+    float   max_score;
+    bool    exhausted;
+} MaxScoreSub;
+
+typedef struct MaxScoreScorer
+{
+    Scorer          super;
+    float           cum_score;
+    int             num_matches;
+    float           min_score;
+    /* largest coord factor, padded to cover float rounding in the sums */
+    float           max_coord_factor;
+    /* sorted by max_score, lowest first */
+    MaxScoreSub    *subs;
+    /* cum_max_scores[i] is the sum of the max_scores of subs[0..i] */
+    float          *cum_max_scores;
+    int             ss_cnt;
+    int             first_essential;
+    PriorityQueue  *scorer_queue;
+    Coordinator    *coordinator;
+} MaxScoreScorer;
+
+static bool mss_doc_less_than(const MaxScoreSub *sub1, const MaxScoreSub *sub2)
+{
+    return sub1->scorer->doc < sub2->scorer->doc;
+}
+
+static int mss_max_score_cmp(const void *p1, const void *p2)
+{
+    float ms1 = ((MaxScoreSub *)p1)->max_score;
+    float ms2 = ((MaxScoreSub *)p2)->max_score;
+    return ms1 < ms2 ? -1 : (ms1 > ms2 ? 1 : 0);
+}
+
+static void mssc_fill_scorer_queue(MaxScoreScorer *mssc)
+{
+    int i;
+    pq_clear(mssc->scorer_queue);
+    for (i = mssc->first_essential; i < mssc->ss_cnt; i++) {
+        if (!mssc->subs[i].exhausted) {
+            pq_insert(mssc->scorer_queue, &mssc->subs[i]);
+        }
+    }
+}
+
+static void mssc_init_scorer_queue(MaxScoreScorer *mssc)
+{
+    int i;
+    mssc->scorer_queue
+        = pq_new(mssc->ss_cnt, (lt_ft)&mss_doc_less_than, NULL);
+    for (i = 0; i < mssc->ss_cnt; i++) {
+        Scorer *sub_scorer = mssc->subs[i].scorer;
+        mssc->subs[i].exhausted = !sub_scorer->next(sub_scorer);
+    }
+    mssc_fill_scorer_queue(mssc);
+}
+
+static float mssc_score(Scorer *self)
+{
+    MSSc(self)->coordinator->num_matches += MSSc(self)->num_matches;
+    return MSSc(self)->cum_score;
+}
+
+static bool mssc_next(Scorer *self)
+{
+    MaxScoreScorer *mssc = MSSc(self);
+    PriorityQueue *scorer_queue;
+    int i;
+
+    if (mssc->scorer_queue == NULL) {
+        mssc_init_scorer_queue(mssc);
+    }
+    scorer_queue = mssc->scorer_queue;
+
+    while (scorer_queue->size > 0) {
+        MaxScoreSub *top = (MaxScoreSub *)pq_top(scorer_queue);
+        const int doc = top->scorer->doc;
+        float score = 0.0;
+        int num_matches = 0;
+
+        /* collect the essential sub-scorers on doc */
+        do {
+            score += top->scorer->score(top->scorer);
+            num_matches++;
+            if (top->scorer->next(top->scorer)) {
+                pq_down(scorer_queue);
+            }
+            else {
+                top->exhausted = true;
+                pq_pop(scorer_queue);
+            }
+        } while (scorer_queue->size > 0
+                 && (top = (MaxScoreSub *)pq_top(scorer_queue))->scorer->doc
+                    == doc);
+
+        /* then the rest, best first, while doc can still beat min_score */
+        for (i = mssc->first_essential - 1; i >= 0; i--) {
+            MaxScoreSub *sub = &mssc->subs[i];
+            if ((score + mssc->cum_max_scores[i]) * mssc->max_coord_factor
+                <= mssc->min_score) {
+                break;
+            }
+            if (sub->exhausted) {
+                continue;
+            }
+            if (sub->scorer->doc < doc
+                && !sub->scorer->skip_to(sub->scorer, doc)) {
+                sub->exhausted = true;
+                continue;
+            }
+            if (sub->scorer->doc == doc) {
+                score += sub->scorer->score(sub->scorer);
+                num_matches++;
+            }
+        }
+
+        if (i < 0) {
+            self->doc = doc;
+            mssc->cum_score = score;
+            mssc->num_matches = num_matches;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool mssc_skip_to(Scorer *self, int doc_num)
+{
+    MaxScoreScorer *mssc = MSSc(self);
+    PriorityQueue *scorer_queue;
+
+    if (mssc->scorer_queue == NULL) {
+        mssc_init_scorer_queue(mssc);
+    }
+    scorer_queue = mssc->scorer_queue;
+
+    while (scorer_queue->size > 0) {
+        MaxScoreSub *top = (MaxScoreSub *)pq_top(scorer_queue);
+        if (top->scorer->doc >= doc_num) {
+            break;
+        }
+        else if (top->scorer->skip_to(top->scorer, doc_num)) {
+            pq_down(scorer_queue);
+        }
+        else {
+            top->exhausted = true;
+            pq_pop(scorer_queue);
+        }
+    }
+    return mssc_next(self);
+}
+
+static void mssc_set_min_score(Scorer *self, float min_score)
+{
+    MaxScoreScorer *mssc = MSSc(self);
+    int first_essential = mssc->first_essential;
+
+    if (min_score <= mssc->min_score) {
+        return;
+    }
+    mssc->min_score = min_score;
+    while (first_essential < mssc->ss_cnt
+           && mssc->cum_max_scores[first_essential] * mssc->max_coord_factor
+              <= min_score) {
+        first_essential++;
+    }
+    if (first_essential != mssc->first_essential) {
+        mssc->first_essential = first_essential;
+        if (mssc->scorer_queue) {
+            mssc_fill_scorer_queue(mssc);
+        }
+    }
+}
+
+static Explanation *mssc_explain(Scorer *self, int doc_num)
+{
+    int i;
+    MaxScoreScorer *mssc = MSSc(self);
+    Explanation *e = expl_new(0.0, "At least 1 of:");
+    for (i = 0; i < mssc->ss_cnt; i++) {
+        Scorer *sub_scorer = mssc->subs[i].scorer;
+        expl_add_detail(e, sub_scorer->explain(sub_scorer, doc_num));
+    }
+    return e;
+}
+
+static void mssc_destroy(Scorer *self)
+{
+    MaxScoreScorer *mssc = MSSc(self);
+    int i;
+    for (i = 0; i < mssc->ss_cnt; i++) {
+        mssc->subs[i].scorer->destroy(mssc->subs[i].scorer);
+    }
+    if (mssc->scorer_queue) {
+        pq_destroy(mssc->scorer_queue);
+    }
+    free(mssc->subs);
+    free(mssc->cum_max_scores);
+    scorer_destroy_i(self);
+}
+
+/*
+ * Returns NULL, leaving the sub-scorers untouched, unless every sub-scorer
+ * can bound its score.
+ */
+static Scorer *max_score_scorer_new(Coordinator *coordinator,
+                                    Scorer **sub_scorers, int ss_cnt)
+{
+    Scorer *self;
+    MaxScoreSub *subs;
+    float max_coord_factor = 0.0, cum_max_score = 0.0;
+    int i;
+
+    for (i = 0; i <= coordinator->max_coord; i++) {
+        if (coordinator->coord_factors[i] < 0.0) {
+            return NULL;
+        }
+        if (coordinator->coord_factors[i] > max_coord_factor) {
+            max_coord_factor = coordinator->coord_factors[i];
+        }
+    }
+
+    subs = ALLOC_N(MaxScoreSub, ss_cnt);
+    for (i = 0; i < ss_cnt; i++) {
+        Scorer *sub_scorer = sub_scorers[i];
+        subs[i].scorer = sub_scorer;
+        subs[i].exhausted = false;
+        subs[i].max_score = sub_scorer->max_score
+            ? sub_scorer->max_score(sub_scorer) : -1.0;
+        if (subs[i].max_score < 0.0) {
+            free(subs);
+            return NULL;
+        }
+    }
+    qsort(subs, ss_cnt, sizeof(MaxScoreSub), &mss_max_score_cmp);
+
+    self = scorer_new(MaxScoreScorer, NULL);
+    MSSc(self)->subs            = subs;
+    MSSc(self)->ss_cnt          = ss_cnt;
+    MSSc(self)->cum_max_scores  = ALLOC_N(float, ss_cnt);
+    for (i = 0; i < ss_cnt; i++) {
+        cum_max_score += subs[i].max_score;
+        MSSc(self)->cum_max_scores[i] = cum_max_score;
+    }
+    MSSc(self)->max_coord_factor
+        = max_coord_factor * (1.0f + 2 * (ss_cnt + 1) * FLT_EPSILON);
+    MSSc(self)->min_score       = -FLT_MAX;
+    MSSc(self)->first_essential = 0;
+    MSSc(self)->scorer_queue    = NULL;
+    MSSc(self)->coordinator     = coordinator;
+    self->doc = -1;
+
+    self->score         = &mssc_score;
+    self->next          = &mssc_next;
+    self->skip_to       = &mssc_skip_to;
+    self->explain       = &mssc_explain;
+    self->destroy       = &mssc_destroy;
+    self->set_min_score = &mssc_set_min_score;
+
+    return self;
+}
+
 /***************************************************************************
  * ConjunctionScorer
  ***************************************************************************/
@@ -747,6 +1026,14 @@ static float rxsc_score(Scorer *self)
     return req_scorer->score(req_scorer);
 }
 
+static void rxsc_set_min_score(Scorer *self, float min_score)
+{
+    Scorer *req_scorer = RXSc(self)->req_scorer;
+    if (req_scorer && req_scorer->set_min_score) {
+        req_scorer->set_min_score(req_scorer, min_score);
+    }
+}
+
 static Explanation *rxsc_explain(Scorer *self, int doc_num)
 {
     ReqExclScorer *rxsc = RXSc(self);
@@ -789,6 +1076,7 @@ static Scorer *req_excl_scorer_new(Scorer *req_scorer, Scorer *excl_scorer)
     self->skip_to           = &rxsc_skip_to;
     self->explain           = &rxsc_explain;
     self->destroy           = &rxsc_destroy;
+    self->set_min_score     = &rxsc_set_min_score;
 
     return self;
 }
@@ -851,6 +1139,8 @@ typedef struct BooleanScorer
     int             ps_capa;
     Scorer         *counting_sum_scorer;
     Coordinator    *coordinator;
+    float           min_score;
+    bool            prune;
 } BooleanScorer;
 
 static Scorer *counting_sum_scorer_create3(BooleanScorer *bsc,
@@ -937,11 +1227,17 @@ static Scorer *counting_sum_scorer_create(BooleanScorer *bsc)
         }
         else {
             /* more than 1 optional_scorers, no required scorers */
+            Scorer *disjunction_scorer = NULL;
+            if (bsc->prune) {
+                disjunction_scorer = max_score_scorer_new(
+                    bsc->coordinator, bsc->optional_scorers, bsc->os_cnt);
+            }
+            if (disjunction_scorer == NULL) {
+                disjunction_scorer = counting_disjunction_sum_scorer_new(
+                    bsc->coordinator, bsc->optional_scorers, bsc->os_cnt, 1);
+            }
             return counting_sum_scorer_create2(
-                bsc,
-                counting_disjunction_sum_scorer_new(bsc->coordinator,
-                                                       bsc->optional_scorers,
-                                                       bsc->os_cnt, 1), 
+                bsc, disjunction_scorer,
                 NULL, 0); /* no optional scorers left */
         }
     }
@@ -965,8 +1261,13 @@ static Scorer *counting_sum_scorer_create(BooleanScorer *bsc)
 
 static Scorer *bsc_init_counting_sum_scorer(BooleanScorer *bsc)
 {
+    Scorer *cnt_sum_sc;
     coord_init(bsc->coordinator);
-    return bsc->counting_sum_scorer = counting_sum_scorer_create(bsc);
+    cnt_sum_sc = bsc->counting_sum_scorer = counting_sum_scorer_create(bsc);
+    if (bsc->prune && cnt_sum_sc->set_min_score) {
+        cnt_sum_sc->set_min_score(cnt_sum_sc, bsc->min_score);
+    }
+    return cnt_sum_sc;
 }
 
 static void bsc_add_scorer(Scorer *self, Scorer *scorer, unsigned int occur) 
@@ -1037,6 +1338,51 @@ static bool bsc_skip_to(Scorer *self, int doc_num)
     }
 }
 
+static void bsc_set_min_score(Scorer *self, float min_score)
+{
+    BooleanScorer *bsc = BSc(self);
+    Scorer *cnt_sum_sc = bsc->counting_sum_scorer;
+
+    if (!cnt_sum_sc) {
+        /* only pure disjunctions can make use of min_score for now */
+        bsc->prune = true;
+        bsc->min_score = min_score;
+    }
+    else if (cnt_sum_sc->set_min_score) {
+        cnt_sum_sc->set_min_score(cnt_sum_sc, min_score);
+    }
+}
+
+static float bsc_max_score(Scorer *self)
+{
+    BooleanScorer *bsc = BSc(self);
+    Coordinator *coord = bsc->coordinator;
+    float sum = 0.0, max_coord_factor = 0.0;
+    int i;
+
+    for (i = 0; i < bsc->rs_cnt + bsc->os_cnt; i++) {
+        Scorer *sub_scorer = i < bsc->rs_cnt
+            ? bsc->required_scorers[i]
+            : bsc->optional_scorers[i - bsc->rs_cnt];
+        float max_score = sub_scorer->max_score
+            ? sub_scorer->max_score(sub_scorer) : -1.0;
+        if (max_score < 0.0) {
+            return -1.0;
+        }
+        sum += max_score;
+    }
+    for (i = 0; i <= coord->max_coord; i++) {
+        float coord_factor = sim_coord(coord->similarity, i, coord->max_coord);
+        if (coord_factor < 0.0) {
+            return -1.0;
+        }
+        if (coord_factor > max_coord_factor) {
+            max_coord_factor = coord_factor;
+        }
+    }
+    return sum * max_coord_factor;
+}
+
 static void bsc_destroy(Scorer *self)
 {
     BooleanScorer *bsc = BSc(self);
@@ -1079,12 +1425,16 @@ static Scorer *bsc_new(Similarity *similarity)
     Scorer *self = scorer_new(BooleanScorer, similarity);
     BSc(self)->coordinator          = coord_new(similarity);
     BSc(self)->counting_sum_scorer  = NULL;
-
-    self->score     = &bsc_score;
-    self->next      = &bsc_next;
-    self->skip_to   = &bsc_skip_to;
-    self->explain   = &bsc_explain;
-    self->destroy   = &bsc_destroy;
+    BSc(self)->min_score            = -FLT_MAX;
+    BSc(self)->prune                = false;
+
+    self->score         = &bsc_score;
+    self->next          = &bsc_next;
+    self->skip_to       = &bsc_skip_to;
+    self->explain       = &bsc_explain;
+    self->destroy       = &bsc_destroy;
+    self->max_score     = &bsc_max_score;
+    self->set_min_score = &bsc_set_min_score;
     return self;
 }
 
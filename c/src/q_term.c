@@ -1,5 +1,6 @@
 #include "symbol.h"
 #include <string.h>
+#include <limits.h>
 #include "search.h"
 #include "internal.h"
 
@@ -27,6 +28,8 @@ typedef struct TermScorer
     TermDocEnum    *tde;
     uchar          *norms;
     float           weight_value;
+    IndexReader    *ir;
+    float           max_score;
 } TermScorer;
 
 static float tsc_score(Scorer *self)
@@ -108,13 +111,35 @@ static Explanation *tsc_explain(Scorer *self, int doc_num)
                     S(TQ(query)->field), TQ(query)->term, tf);
 }
 
+/*
+ * The score is bounded by the tf of the term's max freq times the largest
+ * norm in the field, assuming that tf never decreases as freq grows.
+ */
+static float tsc_max_score(Scorer *self)
+{
+    TermScorer *ts = TSc(self);
+    if (ts->weight_value < 0.0) {
+        return -1.0;
+    }
+    if (ts->max_score < 0.0) {
+        TermDocEnum *tde = ts->tde;
+        Query *query = ts->weight->get_query(ts->weight);
+        int max_freq = tde->max_freq ? tde->max_freq(tde) : INT_MAX;
+        ts->max_score = sim_tf(self->similarity, (float)max_freq)
+            * ts->weight_value
+            * ir_get_max_norm(ts->ir, TQ(query)->field, self->similarity);
+    }
+    return ts->max_score;
+}
+
 static void tsc_destroy(Scorer *self)
 {
     TSc(self)->tde->close(TSc(self)->tde);
     scorer_destroy_i(self);
 }
 
-static Scorer *tsc_new(Weight *weight, TermDocEnum *tde, uchar *norms)
+static Scorer *tsc_new(Weight *weight, TermDocEnum *tde, uchar *norms,
+                       IndexReader *ir)
 {
     int i;
     Scorer *self            = scorer_new(TermScorer, weight->similarity);
@@ -122,6 +147,8 @@ static Scorer *tsc_new(Weight *weight, TermDocEnum *tde, uchar *norms)
     TSc(self)->tde          = tde;
     TSc(self)->norms        = norms;
     TSc(self)->weight_value = weight->value;
+    TSc(self)->ir           = ir;
+    TSc(self)->max_score    = -1.0;
 
     for (i = 0; i < SCORE_CACHE_SIZE; i++) {
         TSc(self)->score_cache[i]
@@ -133,6 +160,7 @@ static Scorer *tsc_new(Weight *weight, TermDocEnum *tde, uchar *norms)
     self->skip_to           = &tsc_skip_to;
     self->explain           = &tsc_explain;
     self->destroy           = &tsc_destroy;
+    self->max_score         = &tsc_max_score;
     return self;
 }
 
@@ -149,7 +177,7 @@ static Scorer *tw_scorer(Weight *self, IndexReader *ir)
     /* ir_term_docs_for should always return a TermDocEnum */
     assert(NULL != tde);
 
-    return tsc_new(self, tde, ir_get_norms(ir, tq->field));
+    return tsc_new(self, tde, ir_get_norms(ir, tq->field), ir);
 }
 
 static Explanation *tw_explain(Weight *self, IndexReader *ir, int doc_num)
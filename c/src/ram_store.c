@@ -37,42 +37,54 @@ static void rf_close(void *p)
     free(rf);
 }
 
+/*
+ * Guards the directories and the RAMFile reference counts so that several
+ * DocWriters can create, read and remove files at the same time. RAMFiles
+ * outlive their directory entries while streams are open on them so a
+ * single lock is used for all RAM stores rather than store->mutex_i.
+ */
+static mutex_t ram_mutex = MUTEX_INITIALIZER;
+
 static void ram_touch(Store *store, const char *filename)
 {
+    mutex_lock(&ram_mutex);
     if (h_get(store->dir.ht, filename) == NULL) {
         h_set(store->dir.ht, filename, rf_new(filename));
     }
+    mutex_unlock(&ram_mutex);
 }
 
 static int ram_exists(Store *store, const char *filename)
 {
-    if (h_get(store->dir.ht, filename) != NULL) {
-        return true;
-    }
-    else {
-        return false;
-    }
+    bool exists;
+    mutex_lock(&ram_mutex);
+    exists = h_get(store->dir.ht, filename) != NULL;
+    mutex_unlock(&ram_mutex);
+    return exists;
 }
 
 static int ram_remove(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_rem(store->dir.ht, filename, false);
+    RAMFile *rf;
+    mutex_lock(&ram_mutex);
+    rf = (RAMFile *)h_rem(store->dir.ht, filename, false);
     if (rf != NULL) {
         DEREF(rf);
         rf_close(rf);
-        return true;
-    }
-    else {
-        return false;
     }
+    mutex_unlock(&ram_mutex);
+    return rf != NULL;
 }
 
 static void ram_rename(Store *store, const char *from, const char *to)
 {
-    RAMFile *rf = (RAMFile *)h_rem(store->dir.ht, from, false);
+    RAMFile *rf;
     RAMFile *tmp;
 
+    mutex_lock(&ram_mutex);
+    rf = (RAMFile *)h_rem(store->dir.ht, from, false);
     if (rf == NULL) {
+        mutex_unlock(&ram_mutex);
         RAISE(IO_ERROR, "couldn't rename \"%s\" to \"%s\". \"%s\""
               " doesn't exist", from, to, from);
     }
@@ -88,6 +100,7 @@ static void ram_rename(Store *store, const char *from, const char *to)
     }
 
     h_set(store->dir.ht, rf->name, rf);
+    mutex_unlock(&ram_mutex);
 }
 
 static int ram_count(Store *store)
@@ -132,6 +145,7 @@ static void ram_clear(Store *store)
 {
     int i;
     Hash *ht = store->dir.ht;
+    mutex_lock(&ram_mutex);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf && !file_is_lock(rf->name)) {
@@ -139,12 +153,14 @@ static void ram_clear(Store *store)
             h_del(ht, rf->name);
         }
     }
+    mutex_unlock(&ram_mutex);
 }
 
 static void ram_clear_locks(Store *store)
 {
     int i;
     Hash *ht = store->dir.ht;
+    mutex_lock(&ram_mutex);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf && file_is_lock(rf->name)) {
@@ -152,12 +168,14 @@ static void ram_clear_locks(Store *store)
             h_del(ht, rf->name);
         }
     }
+    mutex_unlock(&ram_mutex);
 }
 
 static void ram_clear_all(Store *store)
 {
     int i;
     Hash *ht = store->dir.ht;
+    mutex_lock(&ram_mutex);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf) {
@@ -165,17 +183,20 @@ static void ram_clear_all(Store *store)
             h_del(ht, rf->name);
         }
     }
+    mutex_unlock(&ram_mutex);
 }
 
 static off_t ram_length(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_get(store->dir.ht, filename);
+    RAMFile *rf;
+    off_t len = 0;
+    mutex_lock(&ram_mutex);
+    rf = (RAMFile *)h_get(store->dir.ht, filename);
     if (rf != NULL) {
-        return rf->len;
-    }
-    else {
-        return 0;
+        len = rf->len;
     }
+    mutex_unlock(&ram_mutex);
+    return len;
 }
 
 off_t ramo_length(OutStream *os)
@@ -231,8 +252,10 @@ void ramo_reset(OutStream *os)
 static void ramo_close_i(OutStream *os)
 {
     RAMFile *rf = os->file.rf;
+    mutex_lock(&ram_mutex);
     DEREF(rf);
     rf_close(rf);
+    mutex_unlock(&ram_mutex);
 }
 
 void ramo_write_to(OutStream *os, OutStream *other_o)
@@ -277,28 +300,30 @@ void ram_destroy_buffer(OutStream *os)
 
 static OutStream *ram_new_output(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_get(store->dir.ht, filename);
+    RAMFile *rf;
     OutStream *os = os_new();
 
+    mutex_lock(&ram_mutex);
+    rf = (RAMFile *)h_get(store->dir.ht, filename);
     if (rf == NULL) {
         rf = rf_new(filename);
         h_set(store->dir.ht, rf->name, rf);
     }
     REF(rf);
+    mutex_unlock(&ram_mutex);
     os->pointer = 0;
     os->file.rf = rf;
     os->m = &RAM_OUT_STREAM_METHODS;
     return os;
 }
 
-static void rami_read_i(InStream *is, uchar *b, int len)
+static void rami_read_i(InStream *is, off_t start, uchar *b, int len)
 {
     RAMFile *rf = is->file.rf;
 
     int offset = 0;
     int buffer_number, buffer_offset, bytes_in_buffer, bytes_to_copy;
     int remainder = len;
-    off_t start = is->d.pointer;
     uchar *buffer;
 
     while (remainder > 0) {
@@ -318,8 +343,6 @@ static void rami_read_i(InStream *is, uchar *b, int len)
         start += bytes_to_copy;
         remainder -= bytes_to_copy;
     }
-
-    is->d.pointer += len;
 }
 
 static off_t rami_length_i(InStream *is)
@@ -327,31 +350,31 @@ static off_t rami_length_i(InStream *is)
     return is->file.rf->len;
 }
 
-static void rami_seek_i(InStream *is, off_t pos)
-{
-    is->d.pointer = pos;
-}
-
 static void rami_close_i(InStream *is)
 {
     RAMFile *rf = is->file.rf;
+    mutex_lock(&ram_mutex);
     DEREF(rf);
     rf_close(rf);
+    mutex_unlock(&ram_mutex);
 }
 
 static const struct InStreamMethods RAM_IN_STREAM_METHODS = {
     rami_read_i,
-    rami_seek_i,
     rami_length_i,
+    NULL,
     rami_close_i
 };
 
 static InStream *ram_open_input(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_get(store->dir.ht, filename);
+    RAMFile *rf;
     InStream *is = NULL;
 
+    mutex_lock(&ram_mutex);
+    rf = (RAMFile *)h_get(store->dir.ht, filename);
     if (rf == NULL) {
+        mutex_unlock(&ram_mutex);
         /*
         Hash *ht = store->dir.ht;
         int i;
@@ -366,10 +389,11 @@ static InStream *ram_open_input(Store *store, const char *filename)
               "tried to open \"%s\" but it doesn't exist", filename);
     }
     REF(rf);
+    mutex_unlock(&ram_mutex);
     is = is_new();
     is->file.rf = rf;
-    is->d.pointer = 0;
     is->m = &RAM_IN_STREAM_METHODS;
+    is_set_buffer_size(is, file_buffer_size(filename));
 
     return is;
 }
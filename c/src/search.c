@@ -1,5 +1,6 @@
 #include <string.h>
 #include <limits.h>
+#include <float.h>
 #include "search.h"
 #include "array.h"
 #include "internal.h"
@@ -1017,6 +1018,24 @@ static int isea_max_doc(Searcher *self)
     return ir->max_doc(ir);
 }
 
+/*
+ * Queries are scored one segment at a time, each segment's document numbers
+ * offset by the start of the segment. This spares the scorers the merging
+ * MultiReader enums and lets them use each segment's own norms.
+ */
+static int isea_get_leaves(Searcher *self, IndexReader ***leaves,
+                           int **starts)
+{
+    static int zero_start = 0;
+    int leaf_cnt = ir_get_leaves(ISEA(self)->ir, leaves, starts);
+    if (0 == leaf_cnt) {
+        *leaves = &ISEA(self)->ir;
+        *starts = &zero_start;
+        leaf_cnt = 1;
+    }
+    return leaf_cnt;
+}
+
 #define IS_FILTERED(bits, post_filter, scorer, searcher) \
 ((bits && !bv_get(bits, scorer->doc))\
  || (post_filter \
@@ -1024,6 +1043,128 @@ static int isea_max_doc(Searcher *self)
           post_filter->filter_func(scorer->doc, scorer->score(scorer),\
                                    searcher, post_filter->arg))))
 
+/*
+ * Collects the hits for a single segment's scorer into a hit queue. When
+ * segments are searched in parallel each one gets its own IseaCollector and
+ * hit queue, which are merged once all segments are done.
+ */
+typedef struct IseaCollector
+{
+    Searcher       *searcher;
+    Scorer         *scorer;
+    int             start;
+    BitVector      *bits;
+    PostFilter     *post_filter;
+    PriorityQueue  *hq;
+    void          (*hq_insert)(PriorityQueue *pq, Hit *hit);
+    int             max_size;
+    int             total_hits;
+    float           max_score;
+    float           min_score;
+    bool            prune;
+} IseaCollector;
+
+static PriorityQueue *isea_hq_new(int max_size, Sort *sort, IndexReader *ir)
+{
+    if (sort) {
+        return fshq_pq_new(max_size, sort, ir);
+    }
+    else {
+        return pq_new(max_size, (lt_ft)&hit_less_than, &free);
+    }
+}
+
+static void isea_collect(IseaCollector *coll)
+{
+    Scorer *scorer = coll->scorer;
+    PriorityQueue *hq = coll->hq;
+    PostFilter *post_filter = coll->post_filter;
+    float score, filter_factor = 1.0;
+    Hit hit;
+    int doc;
+
+    /* Once the queue is full a new hit has to beat the lowest one in it, and
+     * it can't do that on a tie as later documents lose ties. So the scorer
+     * may skip every document scoring no more than that. */
+    if (coll->prune) {
+        scorer->set_min_score(scorer, coll->min_score);
+    }
+
+    while (scorer->next(scorer)) {
+        doc = coll->start + scorer->doc;
+        if (coll->bits && !bv_get(coll->bits, doc)) continue;
+        score = scorer->score(scorer);
+        if (post_filter &&
+            !(filter_factor = post_filter->filter_func(doc,
+                                                       score,
+                                                       coll->searcher,
+                                                       post_filter->arg))) {
+            continue;
+        }
+        coll->total_hits++;
+        if (filter_factor < 1.0) score *= filter_factor;
+        if (score > coll->max_score) coll->max_score = score;
+        hit.doc = doc; hit.score = score;
+        coll->hq_insert(hq, &hit);
+        if (coll->prune && hq->size == coll->max_size
+            && ((Hit *)pq_top(hq))->score > coll->min_score) {
+            coll->min_score = ((Hit *)pq_top(hq))->score;
+            scorer->set_min_score(scorer, coll->min_score);
+        }
+    }
+}
+
+/*
+ * Scores each segment in the searcher's thread pool. The scorers and hit
+ * queues are all set up by the calling thread so only the scoring itself
+ * runs in parallel.
+ */
+static void isea_collect_parallel(Searcher *self, Weight *weight,
+                                  IseaCollector *coll, Sort *sort,
+                                  IndexReader **leaves, int *starts,
+                                  int leaf_cnt)
+{
+    IseaCollector *colls = ALLOC_N(IseaCollector, leaf_cnt);
+    void **args = ALLOC_N(void *, leaf_cnt);
+    void (*hq_destroy)(PriorityQueue *self) = sort ? &fshq_pq_destroy
+                                                   : &pq_destroy;
+    int i, j, coll_cnt = 0;
+
+    for (i = 0; i < leaf_cnt; i++) {
+        Scorer *scorer = weight->scorer(weight, leaves[i]);
+        if (!scorer) continue;
+        colls[coll_cnt] = *coll;
+        colls[coll_cnt].scorer = scorer;
+        colls[coll_cnt].start = starts[i];
+        colls[coll_cnt].prune = coll->prune && scorer->set_min_score;
+        colls[coll_cnt].hq = isea_hq_new(coll->max_size, sort,
+                                         ISEA(self)->ir);
+        args[coll_cnt] = &colls[coll_cnt];
+        coll_cnt++;
+    }
+
+    TRY
+        tp_run(ISEA(self)->pool, (task_ft)&isea_collect, args, coll_cnt,
+               ISEA(self)->parallelism);
+    XFINALLY
+        for (i = 0; i < coll_cnt; i++) {
+            PriorityQueue *hq = colls[i].hq;
+            for (j = 1; j <= hq->size; j++) {
+                coll->hq_insert(coll->hq, (Hit *)hq->heap[j]);
+            }
+            coll->total_hits += colls[i].total_hits;
+            if (colls[i].max_score > coll->max_score) {
+                coll->max_score = colls[i].max_score;
+            }
+            pq_clear(hq);
+            hq_destroy(hq);
+            colls[i].scorer->destroy(colls[i].scorer);
+        }
+        free(args);
+        free(colls);
+    XENDTRY
+}
+
 static TopDocs *isea_search_w(Searcher *self,
                               Weight *weight,
                               int first_doc,
@@ -1035,31 +1176,24 @@ static TopDocs *isea_search_w(Searcher *self,
 {
     int max_size = num_docs + (num_docs == INT_MAX ? 0 : first_doc);
     int i;
-    Scorer *scorer;
     Hit **score_docs = NULL;
-    Hit hit;
-    int total_hits = 0;
-    float score, max_score = 0.0;
-    float filter_factor = 1.0;
-    BitVector *bits = (filter
-                       ? filt_get_bv(filter, ISEA(self)->ir)
-                       : NULL);
+    IseaCollector coll;
     Hit *(*hq_pop)(PriorityQueue *pq);
-    void (*hq_insert)(PriorityQueue *pq, Hit *hit);
     void (*hq_destroy)(PriorityQueue *self);
     PriorityQueue *hq;
+    IndexReader **leaves;
+    int *starts;
+    const int leaf_cnt = isea_get_leaves(self, &leaves, &starts);
 
     sea_check_args(num_docs, first_doc);
 
-    scorer = weight->scorer(weight, ISEA(self)->ir);
-    if (!scorer || 0 == ISEA(self)->ir->num_docs(ISEA(self)->ir)) {
-        if (scorer) scorer->destroy(scorer);
+    if (0 == ISEA(self)->ir->num_docs(ISEA(self)->ir)) {
         return td_new(0, 0, NULL, 0.0);
     }
 
+    hq = isea_hq_new(max_size, sort, ISEA(self)->ir);
     if (sort) {
-        hq = fshq_pq_new(max_size, sort, ISEA(self)->ir);
-        hq_insert = &fshq_pq_insert;
+        coll.hq_insert = &fshq_pq_insert;
         hq_destroy = &fshq_pq_destroy;
         if (load_fields) {
             hq_pop = &fshq_pq_pop_fd;
@@ -1069,29 +1203,35 @@ static TopDocs *isea_search_w(Searcher *self,
         }
     }
     else {
-        hq = pq_new(max_size, (lt_ft)&hit_less_than, &free);
         hq_pop = &hit_pq_pop;
-        hq_insert = &hit_pq_insert;
+        coll.hq_insert = &hit_pq_insert;
         hq_destroy = &pq_destroy;
     }
 
-    while (scorer->next(scorer)) {
-        if (bits && !bv_get(bits, scorer->doc)) continue;
-        score = scorer->score(scorer);
-        if (post_filter &&
-            !(filter_factor = post_filter->filter_func(scorer->doc,
-                                                       score,
-                                                       self,
-                                                       post_filter->arg))) {
-            continue;
+    coll.searcher = self;
+    coll.bits = filter ? filt_get_bv(filter, ISEA(self)->ir) : NULL;
+    coll.post_filter = post_filter;
+    coll.hq = hq;
+    coll.max_size = max_size;
+    coll.total_hits = 0;
+    coll.max_score = 0.0;
+    coll.min_score = -FLT_MAX;
+    coll.prune = ISEA(self)->approx_total_hits && !sort && !post_filter;
+
+    if (ISEA(self)->pool && leaf_cnt > 1) {
+        isea_collect_parallel(self, weight, &coll, sort, leaves, starts,
+                              leaf_cnt);
+    }
+    else {
+        const bool prune = coll.prune;
+        for (i = 0; i < leaf_cnt; i++) {
+            if (!(coll.scorer = weight->scorer(weight, leaves[i]))) continue;
+            coll.start = starts[i];
+            coll.prune = prune && coll.scorer->set_min_score;
+            isea_collect(&coll);
+            coll.scorer->destroy(coll.scorer);
         }
-        total_hits++;
-        if (filter_factor < 1.0) score *= filter_factor;
-        if (score > max_score) max_score = score;
-        hit.doc = scorer->doc; hit.score = score;
-        hq_insert(hq, &hit);
     }
-    scorer->destroy(scorer);
 
     if (hq->size > first_doc) {
         if ((hq->size - first_doc) < num_docs) {
@@ -1112,7 +1252,7 @@ static TopDocs *isea_search_w(Searcher *self,
     pq_clear(hq);
     hq_destroy(hq);
 
-    return td_new(total_hits, num_docs, score_docs, max_score);
+    return td_new(coll.total_hits, num_docs, score_docs, coll.max_score);
 }
 
 static TopDocs *isea_search(Searcher *self,
@@ -1138,29 +1278,35 @@ static void isea_search_each_w(Searcher *self, Weight *weight, Filter *filter,
                                void *arg)
 {
     Scorer *scorer;
+    int i, doc;
     float filter_factor = 1.0;
     BitVector *bits = (filter
                        ? filt_get_bv(filter, ISEA(self)->ir)
                        : NULL);
-
-    scorer = weight->scorer(weight, ISEA(self)->ir);
-    if (!scorer) {
-        return;
-    }
-
-    while (scorer->next(scorer)) {
-        if (bits && !bv_get(bits, scorer->doc)) continue;
-        float score = scorer->score(scorer);
-        if (post_filter &&
-            !(filter_factor = post_filter->filter_func(scorer->doc,
-                                                       score,
-                                                       self,
-                                                       post_filter->arg))) {
-            continue;
+    IndexReader **leaves;
+    int *starts;
+    const int leaf_cnt = isea_get_leaves(self, &leaves, &starts);
+
+    for (i = 0; i < leaf_cnt; i++) {
+        const int start = starts[i];
+        if (!(scorer = weight->scorer(weight, leaves[i]))) continue;
+
+        while (scorer->next(scorer)) {
+            float score;
+            doc = start + scorer->doc;
+            if (bits && !bv_get(bits, doc)) continue;
+            score = scorer->score(scorer);
+            if (post_filter &&
+                !(filter_factor = post_filter->filter_func(doc,
+                                                           score,
+                                                           self,
+                                                           post_filter->arg))) {
+                continue;
+            }
+            fn(self, doc, filter_factor * score, arg);
         }
-        fn(self, scorer->doc, filter_factor * score, arg);
+        scorer->destroy(scorer);
     }
-    scorer->destroy(scorer);
 }
 
 static void isea_search_each(Searcher *self, Query *query, Filter *filter,
@@ -1187,12 +1333,20 @@ static int isea_search_unscored_w(Searcher *self,
                                   int limit,
                                   int offset_docnum)
 {
-    int count = 0;
-    Scorer *scorer = weight->scorer(weight, ISEA(self)->ir);
-    if (scorer) {
-        if (scorer->skip_to(scorer, offset_docnum)) {
+    int i, count = 0;
+    Scorer *scorer;
+    IndexReader **leaves;
+    int *starts;
+    const int leaf_cnt = isea_get_leaves(self, &leaves, &starts);
+
+    for (i = 0; i < leaf_cnt && count < limit; i++) {
+        const int start = starts[i];
+        if (i + 1 < leaf_cnt && starts[i + 1] <= offset_docnum) continue;
+        if (!(scorer = weight->scorer(weight, leaves[i]))) continue;
+        if (scorer->skip_to(scorer, offset_docnum > start
+                                    ? offset_docnum - start : 0)) {
             do {
-                buf[count++] = scorer->doc;
+                buf[count++] = start + scorer->doc;
             } while (count < limit && scorer->next(scorer));
         }
         scorer->destroy(scorer);
@@ -1264,6 +1418,9 @@ Searcher *isea_new(IndexReader *ir)
 
     ISEA(self)->ir          = ir;
     ISEA(self)->close_ir    = true;
+    ISEA(self)->approx_total_hits = false;
+    ISEA(self)->pool        = NULL;
+    ISEA(self)->parallelism = 0;
 
     self->similarity        = sim_create_default();
     self->doc_freq          = &isea_doc_freq;
@@ -1287,6 +1444,12 @@ Searcher *isea_new(IndexReader *ir)
     return self;
 }
 
+void isea_set_thread_pool(Searcher *self, ThreadPool *pool, int parallelism)
+{
+    ISEA(self)->pool = pool;
+    ISEA(self)->parallelism = parallelism;
+}
+
 /***************************************************************************
  *
  * CachedDFSearcher
@@ -1659,6 +1822,28 @@ static void msea_search_i(Searcher *self, int doc_num, float score, void *arg)
 }
 */
 
+/*
+ * Search a single sub-searcher for msea_search_w. Kept separate so that the
+ * sub-searchers can be searched in the MultiSearcher's thread pool.
+ */
+typedef struct MseaSearchTask
+{
+    Searcher   *searcher;
+    Weight     *weight;
+    int         max_size;
+    Filter     *filter;
+    Sort       *sort;
+    PostFilter *post_filter;
+    TopDocs    *td;
+} MseaSearchTask;
+
+static void msea_search_task(MseaSearchTask *task)
+{
+    Searcher *s = task->searcher;
+    task->td = s->search_w(s, task->weight, 0, task->max_size, task->filter,
+                           task->sort, task->post_filter, true);
+}
+
 static TopDocs *msea_search_w(Searcher *self,
                               Weight *weight,
                               int first_doc,
@@ -1676,6 +1861,8 @@ static TopDocs *msea_search_w(Searcher *self,
     void (*hq_insert)(PriorityQueue *pq, Hit *hit);
     PriorityQueue *hq;
     float max_score = 0.0;
+    const int s_cnt = MSEA(self)->s_cnt;
+    MseaSearchTask *tasks;
     (void)load_fields; /* does it automatically */
 
     sea_check_args(num_docs, first_doc);
@@ -1692,10 +1879,42 @@ static TopDocs *msea_search_w(Searcher *self,
     }
 
     /*if (sort) printf("sort = %s\n", sort_to_s(sort)); */
-    for (i = 0; i < MSEA(self)->s_cnt; i++) {
-        Searcher *s = MSEA(self)->searchers[i];
-        TopDocs *td = s->search_w(s, weight, 0, max_size,
-                                  filter, sort, post_filter, true);
+    tasks = ALLOC_N(MseaSearchTask, s_cnt);
+    for (i = 0; i < s_cnt; i++) {
+        tasks[i].searcher = MSEA(self)->searchers[i];
+        tasks[i].weight = weight;
+        tasks[i].max_size = max_size;
+        tasks[i].filter = filter;
+        tasks[i].sort = sort;
+        tasks[i].post_filter = post_filter;
+        tasks[i].td = NULL;
+    }
+    if (MSEA(self)->pool) {
+        void **args = ALLOC_N(void *, s_cnt);
+        for (i = 0; i < s_cnt; i++) {
+            args[i] = &tasks[i];
+        }
+        TRY
+            tp_run(MSEA(self)->pool, (task_ft)&msea_search_task, args, s_cnt,
+                   MSEA(self)->parallelism);
+        XCATCHALL
+            for (i = 0; i < s_cnt; i++) {
+                if (tasks[i].td) td_destroy(tasks[i].td);
+            }
+            free(tasks);
+            free(args);
+            pq_destroy(hq);
+        XENDTRY
+        free(args);
+    }
+    else {
+        for (i = 0; i < s_cnt; i++) {
+            msea_search_task(&tasks[i]);
+        }
+    }
+
+    for (i = 0; i < s_cnt; i++) {
+        TopDocs *td = tasks[i].td;
         /*if (sort) printf("sort = %s\n", sort_to_s(sort)); */
         if (td->size > 0) {
             /*printf("td->size = %d %d\n", td->size, num_docs); */
@@ -1715,6 +1934,7 @@ static TopDocs *msea_search_w(Searcher *self,
         total_hits += td->total_hits;
         td_destroy(td);
     }
+    free(tasks);
 
     if (hq->size > first_doc) {
         if ((hq->size - first_doc) < num_docs) {
@@ -1825,6 +2045,12 @@ static void msea_close(Searcher *self)
     free(self);
 }
 
+void msea_set_thread_pool(Searcher *self, ThreadPool *pool, int parallelism)
+{
+    MSEA(self)->pool = pool;
+    MSEA(self)->parallelism = parallelism;
+}
+
 Searcher *msea_new(Searcher **searchers, int s_cnt, bool close_subs)
 {
     int i, max_doc = 0;
@@ -1841,6 +2067,8 @@ Searcher *msea_new(Searcher **searchers, int s_cnt, bool close_subs)
     MSEA(self)->starts          = starts;
     MSEA(self)->max_doc         = max_doc;
     MSEA(self)->close_subs      = close_subs;
+    MSEA(self)->pool            = NULL;
+    MSEA(self)->parallelism     = 0;
 
     self->similarity            = sim_create_default();
     self->doc_freq              = &msea_doc_freq;
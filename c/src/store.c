@@ -94,6 +94,8 @@ void store_destroy(Store *store)
 OutStream *os_new()
 {
     OutStream *os = ALLOC(OutStream);
+    os->buf.buf = os->buf.data;
+    os->buf.size = BUFFER_SIZE;
     os->buf.start = 0;
     os->buf.pos = 0;
     os->buf.len = 0;
@@ -187,10 +189,14 @@ void os_write_bytes(OutStream *os, const uchar *buf, int len)
 InStream *is_new()
 {
     InStream *is = ALLOC(InStream);
+    is->buf.buf = is->buf.data;
+    is->buf.size = BUFFER_SIZE;
     is->buf.start = 0;
     is->buf.pos = 0;
     is->buf.len = 0;
-    is->ref_cnt_ptr = ALLOC_AND_ZERO(int);
+    is->ref = ALLOC(InStreamRef);
+    is->ref->cnt = 0;
+    mutex_init(&is->ref->mutex, NULL);
     return is;
 }
 
@@ -204,9 +210,15 @@ InStream *is_new()
 static void is_refill(InStream *is)
 {
     off_t start = is->buf.start + is->buf.pos;
-    off_t last = start + BUFFER_SIZE;
-    off_t flen = is->m->length_i(is);
+    off_t last = start + is->buf.size;
+    off_t flen;
 
+    if (is_mapped(is)) {        /* the whole file is already in the buffer */
+        RAISE(EOF_ERROR, "current pos = %"OFF_T_PFX"d, "
+              "file length = %"OFF_T_PFX"d", start, is->buf.len);
+    }
+
+    flen = is->m->length_i(is);
     if (last > flen) {          /* don't read past EOF */
         last = flen;
     }
@@ -217,7 +229,12 @@ static void is_refill(InStream *is)
               "file length = %"OFF_T_PFX"d", start, flen);
     }
 
-    is->m->read_i(is, is->buf.buf, is->buf.len);
+    /* buffers larger than the default are allocated when first needed */
+    if (is->buf.size > BUFFER_SIZE && is->buf.buf == is->buf.data) {
+        is->buf.buf = ALLOC_N(uchar, is->buf.size);
+    }
+
+    is->m->read_i(is, start, is->buf.buf, is->buf.len);
 
     is->buf.start = start;
     is->buf.pos = 0;
@@ -254,18 +271,24 @@ off_t is_pos(InStream *is)
 
 uchar *is_read_bytes(InStream *is, uchar *buf, int len)
 {
-    int i;
     off_t start;
 
-    if ((is->buf.pos + len) < is->buf.len) {
-        for (i = 0; i < len; i++) {
-            buf[i] = read_byte(is);
+    if (is_mapped(is)) {
+        if ((is->buf.pos + len) > is->buf.len) {
+            RAISE(EOF_ERROR, "current pos = %"OFF_T_PFX"d, "
+                  "file length = %"OFF_T_PFX"d", is->buf.pos + len,
+                  is->buf.len);
         }
+        memcpy(buf, is->buf.buf + is->buf.pos, len);
+        is->buf.pos += len;
+    }
+    else if ((is->buf.pos + len) < is->buf.len) {
+        memcpy(buf, is->buf.buf + is->buf.pos, len);
+        is->buf.pos += len;
     }
     else {                              /* read all-at-once */
         start = is_pos(is);
-        is->m->seek_i(is, start);
-        is->m->read_i(is, buf, len);
+        is->m->read_i(is, start, buf, len);
 
         is->buf.start = start + len;    /* adjust stream variables */
         is->buf.pos = 0;
@@ -274,25 +297,56 @@ uchar *is_read_bytes(InStream *is, uchar *buf, int len)
     return buf;
 }
 
+const uchar *is_map_bytes(InStream *is, int len)
+{
+    const uchar *bytes = is->buf.buf + is->buf.pos;
+    if ((is->buf.pos + len) > is->buf.len) {
+        RAISE(EOF_ERROR, "current pos = %"OFF_T_PFX"d, "
+              "file length = %"OFF_T_PFX"d", is->buf.pos + len,
+              is->buf.len);
+    }
+    is->buf.pos += len;
+    return bytes;
+}
+
 void is_seek(InStream *is, off_t pos)
 {
-    if (pos >= is->buf.start && pos < (is->buf.start + is->buf.len)) {
+    if (is_mapped(is)) {
+        is->buf.pos = pos;          /* EOF is checked on the next read */
+    }
+    else if (pos >= is->buf.start && pos < (is->buf.start + is->buf.len)) {
         is->buf.pos = pos - is->buf.start;  /* seek within buffer */
     }
     else {
         is->buf.start = pos;
         is->buf.pos = 0;
         is->buf.len = 0;                    /* trigger refill() on read() */
-        is->m->seek_i(is, pos);
     }
 }
 
+/**
+ * Free the InStream's buffer if it was allocated rather than using the
+ * InStream's own +data+ or a memory-mapped file.
+ */
+#define is_free_buffer(is) do {\
+    if (!is_mapped(is) && is->buf.buf != is->buf.data) {\
+        free(is->buf.buf);\
+        is->buf.buf = is->buf.data;\
+    }\
+} while (0)
+
 void is_close(InStream *is)
 {
-    if (--(*(is->ref_cnt_ptr)) < 0) {
+    bool last;
+    mutex_lock(&is->ref->mutex);
+    last = --(is->ref->cnt) < 0;
+    mutex_unlock(&is->ref->mutex);
+    if (last) {
         is->m->close_i(is);
-        free(is->ref_cnt_ptr);
+        mutex_destroy(&is->ref->mutex);
+        free(is->ref);
     }
+    is_free_buffer(is);
     free(is);
 }
 
@@ -300,10 +354,77 @@ InStream *is_clone(InStream *is)
 {
     InStream *new_index_i = ALLOC(InStream);
     memcpy(new_index_i, is, sizeof(InStream));
-    (*(new_index_i->ref_cnt_ptr))++;
+    if (!is_mapped(is)) {
+        new_index_i->buf.buf = new_index_i->buf.data;
+        if (is->buf.buf != is->buf.data) {
+            /* don't copy large buffers. The clone will allocate its own */
+            new_index_i->buf.start = is_pos(is);
+            new_index_i->buf.pos = 0;
+            new_index_i->buf.len = 0;
+        }
+    }
+    mutex_lock(&is->ref->mutex);
+    is->ref->cnt++;
+    mutex_unlock(&is->ref->mutex);
     return new_index_i;
 }
 
+void is_set_buffer_size(InStream *is, int size)
+{
+    if (is_mapped(is) || size == is->buf.size) {
+        return;
+    }
+    if (size < VINT_MAX_LEN) {
+        size = VINT_MAX_LEN;
+    }
+    is->buf.start = is_pos(is);
+    is->buf.pos = 0;
+    is->buf.len = 0;                    /* trigger refill on read */
+    is_free_buffer(is);
+    is->buf.size = size;
+}
+
+void is_advise(InStream *is, InStreamAdvice advice)
+{
+    off_t len;
+    switch (advice) {
+        case IS_RANDOM:
+            is_set_buffer_size(is, SMALL_BUFFER_SIZE);
+            break;
+        case IS_SEQUENTIAL:
+            len = is->m->length_i(is);
+            is_set_buffer_size(is, len < BUFFER_SIZE
+                                   ? BUFFER_SIZE
+                                   : (int)MIN(len, LARGE_BUFFER_SIZE));
+            break;
+        default:
+            break;
+    }
+    if (is->m->advise_i) {
+        is->m->advise_i(is, 0, 0, advice);
+    }
+}
+
+/**
+ * Postings are scanned by queries so read them in larger chunks. Index
+ * files with fixed-size entries, like the stored fields index, are only
+ * ever read one entry at a time.
+ */
+int file_buffer_size(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    if (ext) {
+        ext++;
+        if (0 == strcmp(ext, "frq") || 0 == strcmp(ext, "prx")) {
+            return POSTINGS_BUFFER_SIZE;
+        }
+        if (0 == strcmp(ext, "fdx")) {
+            return SMALL_BUFFER_SIZE;
+        }
+    }
+    return BUFFER_SIZE;
+}
+
 i32 is_read_i32(InStream *is)
 {
     return ((i32)is_read_byte(is) << 24) |
@@ -374,6 +495,112 @@ INLINE unsigned int is_read_vint(InStream *is)
     return res;
 }
 
+/*
+ * Bulk VINT decoding
+ *
+ * Postings are mostly runs of small numbers so most VINTs fit in a single
+ * byte. The SIMD kernel loads a block of bytes, uses the high bit mask to find
+ * how many single byte VINTs lead the block and widens them all at once. The
+ * multi-byte VINT that ends the run is decoded with the scalar kernel.
+ */
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define VINT_SIMD_WIDTH 32
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define VINT_SIMD_WIDTH 16
+#endif
+
+static INLINE const uchar *vint_decode_one(const uchar *p, unsigned int *out)
+{
+    register unsigned int res, b;
+    register int shift = 7;
+
+    b = *p++;
+    res = b & 0x7F;
+    while ((b & 0x80) != 0) {
+        b = *p++;
+        res |= (b & 0x7F) << shift;
+        shift += 7;
+    }
+    *out = res;
+    return p;
+}
+
+#ifdef VINT_SIMD_WIDTH
+/*
+ * Widen VINT_SIMD_WIDTH bytes from +p+ into +out+ and return how many of them
+ * were complete single byte VINTs.
+ */
+static INLINE int vint_simd_run(const uchar *p, unsigned int *out)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    u32 mask = (u32)_mm256_movemask_epi8(v);
+    int i;
+    for (i = 0; i < 32; i += 8) {
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepu8_epi32(
+                            _mm_loadl_epi64((const __m128i *)(p + i))));
+    }
+#else
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    u32 mask = (u32)_mm_movemask_epi8(v);
+    _mm_storeu_si128((__m128i *)out,        _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(out + 4),  _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(out + 8),  _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *)(out + 12), _mm_unpackhi_epi16(hi, zero));
+#endif
+    return mask ? count_trailing_zeros(mask) : VINT_SIMD_WIDTH;
+}
+#endif
+
+/*
+ * Decode up to +n+ VINTs from the bytes between *pp and +end+, stopping when
+ * there may not be a whole VINT left. *pp is advanced past the bytes used.
+ */
+static int vints_decode(const uchar **pp, const uchar *end,
+                        unsigned int *out, int n)
+{
+    const uchar *p = *pp;
+    unsigned int *o = out, *o_end = out + n;
+
+#ifdef VINT_SIMD_WIDTH
+    while (o_end - o >= VINT_SIMD_WIDTH
+           && end - p >= VINT_SIMD_WIDTH + VINT_MAX_LEN) {
+        int run = vint_simd_run(p, o);
+        p += run;
+        o += run;
+        if (run < VINT_SIMD_WIDTH) {
+            p = vint_decode_one(p, o++);
+        }
+    }
+#endif
+    while (o < o_end && end - p >= VINT_MAX_LEN) {
+        p = vint_decode_one(p, o++);
+    }
+    *pp = p;
+    return (int)(o - out);
+}
+
+void is_read_vints(InStream *is, unsigned int *out, int n)
+{
+    while (n > 0) {
+        const uchar *p = is->buf.buf + is->buf.pos;
+        int cnt = vints_decode(&p, is->buf.buf + is->buf.len, out, n);
+        is->buf.pos = p - is->buf.buf;
+        out += cnt;
+        n -= cnt;
+        if (n > 0) {
+            /* near the end of the buffer so let is_read_vint refill it */
+            *out++ = is_read_vint(is);
+            n--;
+        }
+    }
+}
+
 /* optimized to use unchecked read_byte if there is definitely space */
 INLINE off_t is_read_voff_t(InStream *is)
 {
@@ -0,0 +1,186 @@
+#include <string.h>
+#include <limits.h>
+#include "thread_pool.h"
+#include "threading.h"
+#include "internal.h"
+
+/*
+ * The tasks handed to a single tp_run call. Batches waiting for threads are
+ * kept in a list and taken off it once their last task has been started.
+ */
+typedef struct TaskBatch
+{
+    task_ft task;
+    void **args;
+    int arg_cnt;
+    int next_arg;
+    int done_cnt;
+    int worker_cnt;
+    int max_workers;
+    int excode;
+    char msg[XMSG_BUFFER_SIZE];
+    cond_t done_cond;
+    struct TaskBatch *next;
+} TaskBatch;
+
+struct FrtThreadPool
+{
+    thread_t *threads;
+    int thread_cnt;
+    TaskBatch *first;
+    TaskBatch *last;
+    mutex_t mutex;
+    cond_t work_cond;
+    bool stopping;
+};
+
+static void tp_unlink_batch(ThreadPool *pool, TaskBatch *batch)
+{
+    TaskBatch **link = &pool->first;
+    TaskBatch *prev = NULL;
+    while (*link != batch) {
+        prev = *link;
+        link = &prev->next;
+    }
+    *link = batch->next;
+    if (pool->last == batch) {
+        pool->last = prev;
+    }
+}
+
+/*
+ * Run tasks from +batch+ until none are left to start. Must be called, and
+ * returns, with the pool's mutex held.
+ */
+static void tp_work(ThreadPool *pool, TaskBatch *batch)
+{
+    batch->worker_cnt++;
+    while (batch->next_arg < batch->arg_cnt) {
+        void *arg = batch->args[batch->next_arg++];
+        if (batch->next_arg == batch->arg_cnt) {
+            tp_unlink_batch(pool, batch);
+        }
+        mutex_unlock(&pool->mutex);
+        TRY
+            batch->task(arg);
+        XCATCHALL
+            mutex_lock(&pool->mutex);
+            if (!batch->excode) {
+                batch->excode = xcontext.excode;
+                strncpy(batch->msg, xcontext.msg ? xcontext.msg : "",
+                        XMSG_BUFFER_SIZE - 1);
+                batch->msg[XMSG_BUFFER_SIZE - 1] = '\0';
+            }
+            mutex_unlock(&pool->mutex);
+            HANDLED();
+        XENDTRY
+        mutex_lock(&pool->mutex);
+        batch->done_cnt++;
+    }
+    batch->worker_cnt--;
+    if (batch->done_cnt == batch->arg_cnt) {
+        cond_broadcast(&batch->done_cond);
+    }
+}
+
+static void *tp_worker(void *p)
+{
+    ThreadPool *pool = (ThreadPool *)p;
+    mutex_lock(&pool->mutex);
+    while (!pool->stopping) {
+        TaskBatch *batch = pool->first;
+        while (batch && batch->worker_cnt >= batch->max_workers) {
+            batch = batch->next;
+        }
+        if (batch) {
+            tp_work(pool, batch);
+        }
+        else {
+            cond_wait(&pool->work_cond, &pool->mutex);
+        }
+    }
+    mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+ThreadPool *tp_new(int thread_cnt)
+{
+    int i;
+    ThreadPool *pool = ALLOC_AND_ZERO(ThreadPool);
+    mutex_init(&pool->mutex, NULL);
+    cond_init(&pool->work_cond, NULL);
+    pool->threads = ALLOC_N(thread_t, thread_cnt > 0 ? thread_cnt : 1);
+    for (i = 0; i < thread_cnt; i++) {
+        if (thread_create(&pool->threads[i], &tp_worker, pool) != 0) {
+            break;
+        }
+    }
+    pool->thread_cnt = i;
+    return pool;
+}
+
+void tp_destroy(ThreadPool *pool)
+{
+    int i;
+    mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    cond_broadcast(&pool->work_cond);
+    mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->thread_cnt; i++) {
+        thread_join(pool->threads[i]);
+    }
+    cond_destroy(&pool->work_cond);
+    mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+int tp_thread_cnt(ThreadPool *pool)
+{
+    return pool->thread_cnt;
+}
+
+void tp_run(ThreadPool *pool, task_ft task, void **args, int arg_cnt,
+            int max_threads)
+{
+    TaskBatch batch;
+    int i;
+
+    if (!pool || pool->thread_cnt == 0 || arg_cnt <= 1 || max_threads == 1) {
+        for (i = 0; i < arg_cnt; i++) {
+            task(args[i]);
+        }
+        return;
+    }
+
+    batch.task = task;
+    batch.args = args;
+    batch.arg_cnt = arg_cnt;
+    batch.next_arg = 0;
+    batch.done_cnt = 0;
+    batch.worker_cnt = 0;
+    batch.max_workers = max_threads > 0 ? max_threads : INT_MAX;
+    batch.excode = 0;
+    batch.next = NULL;
+    cond_init(&batch.done_cond, NULL);
+
+    mutex_lock(&pool->mutex);
+    if (pool->last) {
+        pool->last->next = &batch;
+    }
+    else {
+        pool->first = &batch;
+    }
+    pool->last = &batch;
+    cond_broadcast(&pool->work_cond);
+    tp_work(pool, &batch);
+    while (batch.done_cnt < batch.arg_cnt) {
+        cond_wait(&batch.done_cond, &pool->mutex);
+    }
+    mutex_unlock(&pool->mutex);
+    cond_destroy(&batch.done_cond);
+
+    if (batch.excode) {
+        RAISE(batch.excode, "%s", batch.msg);
+    }
+}
@@ -26,6 +26,7 @@ TestSuite *ts_global(TestSuite *suite);
 TestSuite *ts_term(TestSuite *suite);
 TestSuite *ts_fields(TestSuite *suite);
 TestSuite *ts_fs_store(TestSuite *suite);
+TestSuite *ts_mmap_store(TestSuite *suite);
 TestSuite *ts_symbol(TestSuite *suite);
 TestSuite *ts_q_parser(TestSuite *suite);
 TestSuite *ts_bitvector(TestSuite *suite);
@@ -67,6 +68,7 @@ const struct test_list
     {ts_term},
     {ts_fields},
     {ts_fs_store},
+    {ts_mmap_store},
     {ts_symbol},
     {ts_q_parser},
     {ts_bitvector},
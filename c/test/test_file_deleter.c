@@ -5,17 +5,13 @@
 
 static char *content_f = "content";
 static char *id_f = "id";
-const Config lucene_config = {
-    0x100000,       /* chunk size is 1Mb */
-    0x1000000,      /* Max memory used for buffer is 16 Mb */
-    INDEX_INTERVAL, /* index interval */
-    SKIP_INTERVAL,  /* skip interval */
-    10,             /* default merge factor */
-    10,             /* max_buffered_docs */
-    INT_MAX,        /* max_merged_docs */
-    10000,          /* maximum field length (number of terms) */
-    true            /* use compound file by default */
-};
+/* the default config but flushing every 10 documents, as Lucene's does */
+static IndexWriter *lucene_iw_open(Store *store)
+{
+    Config config = default_config;
+    config.max_buffered_docs = 10;
+    return iw_open(store, whitespace_analyzer_new(false), &config);
+}
 
 
 static FieldInfos *prep_fis()
@@ -51,7 +47,7 @@ static IndexWriter *create_iw_conf(Store *store, int max_buffered_docs,
 static IndexWriter *create_iw_lucene(Store *store)
 {
     create_index(store);
-    return iw_open(store, whitespace_analyzer_new(false), &lucene_config);
+    return lucene_iw_open(store);
 }
 
 static void add_doc(IndexWriter *iw, int id)
@@ -158,7 +154,7 @@ static void test_delete_leftover_files(TestCase *tc, void *data)
 
 
     /* Open & close a writer: should delete the above files and nothing more: */
-    iw_close(iw_open(store, whitespace_analyzer_new(false), &lucene_config));
+    iw_close(lucene_iw_open(store));
 
     store_after = store_to_s(store);
 
@@ -1,7 +1,82 @@
 #include "store.h"
+#include "index.h"
 #include "test_store.h"
 #include "test.h"
 
+#define CLONE_READ_THREADS 4
+#define CLONE_READ_CNT 10000
+
+/**
+ * Read every number from a clone of the InStream, starting at a different
+ * point for each thread, and count how many are wrong.
+ */
+static void *clone_read_thread(void *p)
+{
+    InStream *is = is_clone((InStream *)p);
+    int i, j, start = rand() % CLONE_READ_CNT, errors = 0;
+
+    for (j = 0; j < CLONE_READ_CNT; j++) {
+        i = (start + j) % CLONE_READ_CNT;
+        if (j == 0 || i == 0) {
+            is_seek(is, i * 4);
+        }
+        if ((u32)i != is_read_u32(is)) {
+            errors++;
+        }
+    }
+    is_close(is);
+    return (void *)(long)errors;
+}
+
+static int read_clones_concurrently(InStream *is)
+{
+    int i, errors = 0;
+    pthread_t thread_id[CLONE_READ_THREADS];
+    void *res;
+
+    for (i = 0; i < CLONE_READ_THREADS; i++) {
+        pthread_create(&thread_id[i], NULL, &clone_read_thread, is);
+    }
+    for (i = 0; i < CLONE_READ_THREADS; i++) {
+        pthread_join(thread_id[i], &res);
+        errors += (int)(long)res;
+    }
+    return errors;
+}
+
+/**
+ * Test that clones of file-system InStreams, both plain and within a
+ * compound file, don't share a file position.
+ */
+static void test_concurrent_clone_reads(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Store *c_reader;
+    CompoundWriter *cw;
+    OutStream *os = store->new_output(store, "_concur.f1");
+    InStream *is;
+    int i;
+
+    for (i = 0; i < CLONE_READ_CNT; i++) {
+        os_write_u32(os, (u32)i);
+    }
+    os_close(os);
+
+    is = store->open_input(store, "_concur.f1");
+    Aiequal(CLONE_READ_CNT * 4, is_length(is));
+    Aiequal(0, read_clones_concurrently(is));
+    is_close(is);
+
+    cw = open_cw(store, "_concur.cfs");
+    cw_add_file(cw, "_concur.f1");
+    cw_close(cw);
+    c_reader = open_cmpd_store(store, "_concur.cfs");
+    is = c_reader->open_input(c_reader, "_concur.f1");
+    Aiequal(0, read_clones_concurrently(is));
+    is_close(is);
+    store_deref(c_reader);
+}
+
 /**
  * Test a FileSystem store
  */
@@ -18,6 +93,8 @@ TestSuite *ts_fs_store(TestSuite *suite)
     suite = ADD_SUITE(suite);
 
     create_test_store_suite(suite, store);
+    tst_run_test(suite, test_concurrent_clone_reads, store);
+    store->clear_all(store);
 
     store_deref(store);
 
@@ -1,4 +1,6 @@
 #include "index.h"
+#include "field_index.h"
+#include "search.h"
 #include "testhelper.h"
 #include "test.h"
 
@@ -545,6 +547,7 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
     char buf[TEST_WORD_LIST_MAX_LEN + 1];
     DocField *df;
     Document *docs[NUM_STDE_TEST_DOCS], *doc;
+    SegmentInfo *si = si_new(estrdup("_0"), NUM_STDE_TEST_DOCS, store);
 
     prep_stde_test_docs(docs, NUM_STDE_TEST_DOCS, MAX_TEST_WORDS, fis);
     prep_test_1seg_index(store, docs, NUM_STDE_TEST_DOCS, fis);
@@ -554,13 +557,13 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
     skip_interval = ((SegmentTermEnum *)tir->orig_te)->skip_interval;
     frq_in = store->open_input(store, "_0.frq");
     prx_in = store->open_input(store, "_0.prx");
-    tde = stde_new(tir, frq_in, bv, skip_interval);
-    tde_reader = stde_new(tir, frq_in, bv, skip_interval);
-    tde_skip_to = stde_new(tir, frq_in, bv, skip_interval);
+    tde = stde_new(tir, frq_in, bv, skip_interval, si);
+    tde_reader = stde_new(tir, frq_in, bv, skip_interval, si);
+    tde_skip_to = stde_new(tir, frq_in, bv, skip_interval, si);
 
     fi = fis_get_field(fis, I("tv"));
     for (i = 0; i < 300; i++) {
-        int cnt = 0, ind = 0, doc_nums[3], freqs[3];
+        int cnt = 0, ind = 0, doc_nums[3], freqs[3], max_freq = 0;
         const char *word = test_word_list[rand()%TEST_WORD_LIST_SIZE];
         tde->seek(tde, fi->number, word);
         tde_reader->seek(tde_reader, fi->number, word);
@@ -571,6 +574,7 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
             }
             Aiequal(doc_nums[ind], tde->doc_num(tde));
             Aiequal(freqs[ind], tde->freq(tde));
+            max_freq = MAX(max_freq, freqs[ind]);
             ind++;
 
             doc = docs[tde->doc_num(tde)];
@@ -586,6 +590,7 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
             Aiequal(tde->freq(tde), tde_skip_to->freq(tde_skip_to));
         }
         Aiequal(ind, cnt);
+        Aiequal(max_freq, tde_reader->max_freq(tde_reader));
 
         Atrue(! tde->next(tde));
         Atrue(! tde->next(tde));
@@ -597,8 +602,8 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
     tde_skip_to->close(tde_skip_to);
 
 
-    tde = stpe_new(tir, frq_in, prx_in, bv, skip_interval);
-    tde_skip_to = stpe_new(tir, frq_in, prx_in, bv, skip_interval);
+    tde = stpe_new(tir, frq_in, prx_in, bv, skip_interval, si);
+    tde_skip_to = stpe_new(tir, frq_in, prx_in, bv, skip_interval, si);
 
     fi = fis_get_field(fis, I("tv+offsets"));
     for (i = 0; i < 200; i++) {
@@ -640,6 +645,7 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
     is_close(prx_in);
     tir_close(tir);
     sfi_close(sfi);
+    si_deref(si);
 }
 
 const char *double_word = "word word";
@@ -683,7 +689,7 @@ static void test_segment_tde_deleted_docs(TestCase *tc, void *data)
     frq_in = store->open_input(store, "_0.frq");
     prx_in = store->open_input(store, "_0.prx");
     skip_interval = sfi->skip_interval;
-    tde = stpe_new(tir, frq_in, prx_in, bv, skip_interval);
+    tde = stpe_new(tir, frq_in, prx_in, bv, skip_interval, si);
 
     tde->seek(tde, 0, "word");
     doc_num_expected = 0;
@@ -709,6 +715,456 @@ static void test_segment_tde_deleted_docs(TestCase *tc, void *data)
     si_deref(si);
 }
 
+/*
+ * The freq of +term+ in the block postings test document +doc+. "big" has a
+ * large gap and a large freq so that its blocks need exceptions.
+ */
+#define BLOCK_TEST_DOC_CNT 1000
+static int block_test_freq(const char *term, int doc)
+{
+    if (0 == strcmp(term, "all")) {
+        return doc % 7 + 1;
+    }
+    else if (0 == strcmp(term, "even")) {
+        return (doc % 2) ? 0 : 1;
+    }
+    else if (0 == strcmp(term, "rare")) {
+        return (doc % 97) ? 0 : 2;
+    }
+    else if ((doc < 600 && 0 == doc % 3) || 997 == doc) {
+        return (300 == doc) ? 100 : 1;
+    }
+    return 0;
+}
+
+static void block_test_add_docs(IndexWriter *iw, int start, int end)
+{
+    static const char *terms[] = { "all", "even", "rare", "big" };
+    char text[1024];
+    int i, j, k;
+
+    for (i = start; i < end; i++) {
+        Document *doc = doc_new();
+        text[0] = '\0';
+        for (j = 0; j < 4; j++) {
+            for (k = block_test_freq(terms[j], i); k > 0; k--) {
+                strcat(text, terms[j]);
+                strcat(text, " ");
+            }
+        }
+        doc_add_field(doc, df_add_data(df_new(I("f")), text));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+}
+
+/* the next document after +doc+ containing +term+ that isn't deleted */
+static int block_test_next(const char *term, const int *orig, int doc_cnt,
+                           int doc)
+{
+    for (doc++; doc < doc_cnt; doc++) {
+        if (orig[doc] >= 0 && block_test_freq(term, orig[doc]) > 0) {
+            break;
+        }
+    }
+    return doc;
+}
+
+/*
+ * Check every term with next, read and skip_to. +orig+ maps each document
+ * number in +ir+ to the test document it was built from, or -1 if it is
+ * deleted.
+ */
+static void check_block_postings(TestCase *tc, IndexReader *ir,
+                                 const int *orig, int doc_cnt)
+{
+    static const char *terms[] = { "all", "even", "rare", "big" };
+    int field_num = fis_get_field_num(ir->fis, I("f"));
+    TermDocEnum *tde = ir->term_docs(ir);
+    TermDocEnum *tpe = ir->term_positions(ir);
+    int docs[64], freqs[64];
+    int t, i, d, cnt, target;
+
+    for (t = 0; t < 4; t++) {
+        const char *term = terms[t];
+
+        tde->seek(tde, field_num, term);
+        for (d = block_test_next(term, orig, doc_cnt, -1); d < doc_cnt;
+             d = block_test_next(term, orig, doc_cnt, d)) {
+            if (!Atrue(tde->next(tde))) break;
+            Aiequal(d, tde->doc_num(tde));
+            Aiequal(block_test_freq(term, orig[d]), tde->freq(tde));
+        }
+        Atrue(!tde->next(tde));
+
+        tde->seek(tde, field_num, term);
+        d = -1;
+        while (0 < (cnt = tde->read(tde, docs, freqs, 64))) {
+            for (i = 0; i < cnt; i++) {
+                d = block_test_next(term, orig, doc_cnt, d);
+                Aiequal(d, docs[i]);
+                if (d < doc_cnt) {
+                    Aiequal(block_test_freq(term, orig[d]), freqs[i]);
+                }
+            }
+        }
+        Aiequal(doc_cnt, block_test_next(term, orig, doc_cnt, d));
+
+        /* skip_to always moves forward at least one document */
+        tde->seek(tde, field_num, term);
+        d = -1;
+        for (target = 3; target < doc_cnt + 10; target += 29 + target / 4) {
+            d = block_test_next(term, orig, doc_cnt, MAX(d, target - 1));
+            if (d < doc_cnt) {
+                if (!Atrue(tde->skip_to(tde, target))) break;
+                Aiequal(d, tde->doc_num(tde));
+                Aiequal(block_test_freq(term, orig[d]), tde->freq(tde));
+            }
+            else {
+                Atrue(!tde->skip_to(tde, target));
+                break;
+            }
+        }
+    }
+
+    /* positions have to follow the skips, including from a document whose
+     * positions were only partly read */
+    tpe->seek(tpe, field_num, "all");
+    d = -1;
+    for (target = 0; target < doc_cnt; target += 1 + target / 3) {
+        int freq;
+        d = block_test_next("all", orig, doc_cnt, MAX(d, target - 1));
+        if (d >= doc_cnt) {
+            Atrue(!tpe->skip_to(tpe, target));
+            break;
+        }
+        if (!Atrue(tpe->skip_to(tpe, target))) break;
+        Aiequal(d, tpe->doc_num(tpe));
+        freq = block_test_freq("all", orig[d]);
+        for (i = 0; i < ((target & 1) ? 1 : freq); i++) {
+            Aiequal(i, tpe->next_position(tpe));
+        }
+    }
+    tde->close(tde);
+    tpe->close(tpe);
+}
+
+/*
+ * Test block packed postings, both on their own and mixed with VInt
+ * postings, with deletions and after merging
+ */
+static void test_block_postings(TestCase *tc, void *data)
+{
+    int i, d;
+    Store *store = (Store *)data;
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    int orig[BLOCK_TEST_DOC_CNT];
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    /* an index with VInt postings which is then extended with block postings */
+    config.max_buffered_docs = BLOCK_TEST_DOC_CNT;
+    config.merge_factor = 100;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    block_test_add_docs(iw, 0, 500);
+    iw_close(iw);
+    config.postings_format = POSTINGS_FORMAT_BLOCK;
+    config.max_buffered_docs = 250;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    block_test_add_docs(iw, 500, BLOCK_TEST_DOC_CNT);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    if (Aiequal(3, ir->sis->size)) {
+        Aiequal(POSTINGS_FORMAT_VINT, ir->sis->segs[0]->postings_format);
+        Aiequal(POSTINGS_FORMAT_BLOCK, ir->sis->segs[1]->postings_format);
+        Aiequal(POSTINGS_FORMAT_BLOCK, ir->sis->segs[2]->postings_format);
+    }
+    for (i = 0; i < BLOCK_TEST_DOC_CNT; i++) {
+        orig[i] = i;
+    }
+    check_block_postings(tc, ir, orig, BLOCK_TEST_DOC_CNT);
+
+    for (i = 5; i < BLOCK_TEST_DOC_CNT; i += 10) {
+        ir_delete_doc(ir, i);
+        orig[i] = -1;
+    }
+    check_block_postings(tc, ir, orig, BLOCK_TEST_DOC_CNT);
+    ir_close(ir);
+
+    /* merging converts everything to block postings */
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    for (i = 0, d = 0; i < BLOCK_TEST_DOC_CNT; i++) {
+        if (orig[i] >= 0) {
+            orig[d++] = orig[i];
+        }
+    }
+    ir = ir_open(store);
+    Aiequal(d, ir->max_doc(ir));
+    Aiequal(1, ir->sis->size);
+    Aiequal(POSTINGS_FORMAT_BLOCK, ir->sis->segs[0]->postings_format);
+    check_block_postings(tc, ir, orig, d);
+    ir_close(ir);
+}
+
+/*
+ * Document i has a unique "id", "x<i>" once and "y<i>" twice so the ids and
+ * the x terms are pulsed but the y terms, which have a freq of two, and "all"
+ * are not.
+ */
+#define PULSE_TEST_DOC_CNT 300
+static void pulse_test_add_docs(IndexWriter *iw, int start, int end)
+{
+    char id[32], text[128];
+    int i;
+
+    for (i = start; i < end; i++) {
+        Document *doc = doc_new();
+        sprintf(id, "id%d", i);
+        sprintf(text, "all x%d y%d y%d", i, i, i);
+        doc_add_field(doc, df_add_data(df_new(I("id")), id));
+        doc_add_field(doc, df_add_data(df_new(I("f")), text));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+}
+
+/* check the postings of every document except +deleted+ */
+static void check_pulsed_postings(TestCase *tc, IndexReader *ir, int doc_cnt,
+                                  int deleted)
+{
+    int id_num = fis_get_field_num(ir->fis, I("id"));
+    int f_num = fis_get_field_num(ir->fis, I("f"));
+    TermDocEnum *tde = ir->term_docs(ir);
+    TermDocEnum *tpe = ir->term_positions(ir);
+    int docs[8], freqs[8];
+    char term[32];
+    int i;
+
+    for (i = 0; i < doc_cnt; i++) {
+        sprintf(term, "id%d", i);
+        tpe->seek(tpe, id_num, term);
+        if (i == deleted) {
+            Atrue(!tpe->next(tpe));
+            tde->seek(tde, id_num, term);
+            Aiequal(0, tde->read(tde, docs, freqs, 8));
+            continue;
+        }
+        if (!Atrue(tpe->next(tpe))) break;
+        Aiequal(i, tpe->doc_num(tpe));
+        Aiequal(1, tpe->freq(tpe));
+        Aiequal(0, tpe->next_position(tpe));
+        Aiequal(-1, tpe->next_position(tpe));
+        Atrue(!tpe->next(tpe));
+
+        tde->seek(tde, id_num, term);
+        Aiequal(1, tde->read(tde, docs, freqs, 8));
+        Aiequal(i, docs[0]);
+        Aiequal(1, tde->max_freq(tde));
+
+        sprintf(term, "x%d", i);
+        tpe->seek(tpe, f_num, term);
+        if (!Atrue(tpe->skip_to(tpe, i))) break;
+        Aiequal(i, tpe->doc_num(tpe));
+        Aiequal(1, tpe->next_position(tpe));
+
+        sprintf(term, "y%d", i);
+        tpe->seek(tpe, f_num, term);
+        if (!Atrue(tpe->next(tpe))) break;
+        Aiequal(2, tpe->freq(tpe));
+        Aiequal(2, tpe->next_position(tpe));
+        Aiequal(3, tpe->next_position(tpe));
+    }
+
+    tde->seek(tde, f_num, "all");
+    for (i = 0; tde->next(tde); i++) {
+        Aiequal(i, tde->doc_num(tde));
+    }
+    Aiequal(deleted < doc_cnt ? doc_cnt - 1 : doc_cnt, i);
+    tde->close(tde);
+    tpe->close(tpe);
+}
+
+/*
+ * Terms in a single document once are stored in the term dictionary, both
+ * when flushed and when merged from VInt and block postings
+ */
+static void test_pulsed_postings(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    TermEnum *te;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    const int last = PULSE_TEST_DOC_CNT - 1;
+    fis_add_field(fis, fi_new(I("id"), STORE_NO, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    index_create(store, fis);
+    fis_deref(fis);
+
+    config.max_buffered_docs = 100;
+    config.merge_factor = 100;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    pulse_test_add_docs(iw, 0, 200);
+    iw_close(iw);
+    config.postings_format = POSTINGS_FORMAT_BLOCK;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    pulse_test_add_docs(iw, 200, PULSE_TEST_DOC_CNT);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(3, ir->sis->size);
+    check_pulsed_postings(tc, ir, PULSE_TEST_DOC_CNT, PULSE_TEST_DOC_CNT);
+    ir_delete_doc(ir, last);
+    check_pulsed_postings(tc, ir, PULSE_TEST_DOC_CNT, last);
+    ir_close(ir);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(1, ir->sis->size);
+    check_pulsed_postings(tc, ir, last, last);
+    te = ir_terms(ir, I("id"));
+    while (te->next(te)) {
+        Atrue(te->curr_ti.pulsed);
+    }
+    te->close(te);
+    te = ir_terms(ir, I("f"));
+    while (te->next(te)) {
+        Aiequal(te->curr_term[0] == 'x', te->curr_ti.pulsed);
+    }
+    te->close(te);
+    ir_close(ir);
+}
+
+/*
+ * Write a segment where "all" is in every document and "third" in every
+ * third one, with a skip interval of 4 so that the skip lists have several
+ * levels, and check skip_to against the expected documents.
+ */
+#define SKIP_TEST_DOC_CNT 3000
+/*
+ * Each level of the skip list should have been skipped to its last entry
+ * before +target+, starting from the entry skipped to in the level above.
+ */
+static void check_skip_levels(TestCase *tc, TermDocEnum *tde, int target)
+{
+    SegmentTermDocEnum *stde = (SegmentTermDocEnum *)tde;
+    int i;
+    if (!stde->have_skipped) {
+        return;
+    }
+    for (i = 0; i < stde->skip_level_cnt; i++) {
+        SkipLevel *skipped = &stde->skipped[i];
+        SkipLevel *next = &stde->skip_levels[i];
+        Atrue(0 == skipped->entry_num || skipped->doc < target);
+        Atrue(next->entry_num > next->entry_cnt || next->doc >= target);
+        if (i > 0) {
+            Atrue(stde->skipped[i - 1].entry_num
+                  >= skipped->entry_num * stde->skip_multiplier);
+        }
+    }
+}
+
+static void check_multi_level_skip(TestCase *tc, Store *store,
+                                   PostingsFormat format, int max_skip_levels,
+                                   bool has_max_freqs)
+{
+    static const char *terms[] = {"all", "third"};
+    int i, j, t, target, field_num;
+    char text[64];
+    Config config = default_config;
+    IndexWriter *iw;
+    DocWriter *dw;
+    Document *doc;
+    SegmentFieldIndex *sfi;
+    TermInfosReader *tir;
+    InStream *frq_in, *prx_in;
+    TermDocEnum *tde;
+    SegmentInfo *si = si_new(estrdup("_0"), SKIP_TEST_DOC_CNT, store);
+
+    config.skip_interval = 4;
+    iw = create_book_iw_conf(store, &config);
+    si->postings_format = format;
+    si->max_skip_levels = max_skip_levels;
+    si->has_max_freqs = has_max_freqs;
+    dw = dw_open(iw, si);
+    for (i = 0; i < SKIP_TEST_DOC_CNT; i++) {
+        strcpy(text, (i % 3) ? "" : "third ");
+        for (j = i % 3; j >= 0; j--) {
+            strcat(text, "all ");
+        }
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I("f")), text));
+        dw_add_doc(dw, doc);
+        doc_destroy(doc);
+    }
+    dw_close(dw);
+    field_num = fis_get_field(iw->fis, I("f"))->number;
+    iw_close(iw);
+
+    sfi = sfi_open(store, "_0");
+    tir = tir_open(store, sfi, "_0");
+    frq_in = store->open_input(store, "_0.frq");
+    prx_in = store->open_input(store, "_0.prx");
+    tde = stpe_new(tir, frq_in, prx_in, NULL, sfi->skip_interval, si);
+    for (t = 0; t < 2; t++) {
+        const int step = t ? 3 : 1;
+        for (i = 0; i < 20; i++) {
+            tde->seek(tde, field_num, terms[t]);
+            Aiequal(has_max_freqs ? 3 - 2 * t : INT_MAX, tde->max_freq(tde));
+            target = rand() % 10;
+            while (target < SKIP_TEST_DOC_CNT) {
+                int expected = (target + step - 1) / step * step;
+                if (expected >= SKIP_TEST_DOC_CNT) {
+                    Atrue(!tde->skip_to(tde, target));
+                    break;
+                }
+                Atrue(tde->skip_to(tde, target));
+                check_skip_levels(tc, tde, target);
+                Aiequal(expected, tde->doc_num(tde));
+                Aiequal(expected % 3 + 1 - t * (expected % 3),
+                        tde->freq(tde));
+                Aiequal(t ? 0 : (expected % 3 ? 0 : 1),
+                        tde->next_position(tde));
+                target = expected + 1 + rand() % ((i % 2) ? 8 : 600);
+            }
+            /* block postings skip a block at a time so have fewer levels */
+            if (max_skip_levels > 1 && POSTINGS_FORMAT_VINT == format) {
+                Atrue(((SegmentTermDocEnum *)tde)->skip_level_cnt >= 3);
+            }
+        }
+    }
+    tde->close(tde);
+
+    is_close(frq_in);
+    is_close(prx_in);
+    tir_close(tir);
+    sfi_close(sfi);
+    si_deref(si);
+}
+
+static void test_multi_level_skip(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    check_multi_level_skip(tc, store, POSTINGS_FORMAT_VINT, MAX_SKIP_LEVELS,
+                           true);
+    check_multi_level_skip(tc, store, POSTINGS_FORMAT_BLOCK, MAX_SKIP_LEVELS,
+                           true);
+    /* segments written before multi-level skip lists have a single level and
+     * no max freqs */
+    check_multi_level_skip(tc, store, POSTINGS_FORMAT_VINT, 1, false);
+}
+
 /****************************************************************************
  *
  * Index
@@ -778,6 +1234,294 @@ static void test_index_undelete_all_after_close(TestCase *tc, void *data)
     ir_close(ir);
 }
 
+static uchar *get_leaf_norms(IndexReader *ir, int leaf, Symbol field)
+{
+    IndexReader **leaves;
+    int *starts;
+    ir_get_leaves(ir, &leaves, &starts);
+    ir = leaves[leaf];
+    return ir->get_norms(ir, fis_get_field_num(ir->fis, field));
+}
+
+/**
+ * Test that ir_reopen shares what hasn't changed with the old reader and
+ * that the two readers don't see each other's changes afterwards.
+ */
+static void test_ir_reopen(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir, *new_ir;
+    Document *doc;
+    uchar *norms;
+
+    config.merge_factor = 100;
+    iw = create_book_iw_conf(store, &config);
+    add_document_with_fields(iw, 0);
+    iw_close(iw);
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    add_document_with_fields(iw, 1);
+    add_document_with_fields(iw, 2);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Apnotnull(ir);
+    Aiequal(3, ir->num_docs(ir));
+    Apequal(ir, ir_reopen(ir));
+    norms = get_leaf_norms(ir, 0, title);
+
+    /* add a segment with a new field and delete a document from the second
+     * segment */
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I("new field")), "reopened"));
+    iw_add_doc(iw, doc);
+    doc_destroy(doc);
+    iw_close(iw);
+    new_ir = ir_open(store);
+    ir_delete_doc(new_ir, 1);
+    ir_close(new_ir);
+
+    Atrue(!ir_is_latest(ir));
+    new_ir = ir_reopen(ir);
+    Atrue(new_ir != ir);
+    Atrue(ir_is_latest(new_ir));
+    Aiequal(3, ir->num_docs(ir));
+    Atrue(!ir->is_deleted(ir, 1));
+    Aiequal(4, new_ir->max_doc(new_ir));
+    Aiequal(3, new_ir->num_docs(new_ir));
+    Atrue(new_ir->is_deleted(new_ir, 1));
+    Apequal(norms, get_leaf_norms(new_ir, 0, title));
+
+    /* changes to the new reader mustn't show up in the old one */
+    ir_set_norm(new_ir, 0, title, 12);
+    Aiequal(12, get_leaf_norms(new_ir, 0, title)[0]);
+    Atrue(12 != norms[0]);
+    Apequal(norms, get_leaf_norms(ir, 0, title));
+    ir_delete_doc(new_ir, 2);
+    Atrue(!ir->is_deleted(ir, 2));
+    ir_close(ir);
+
+    doc = new_ir->get_doc(new_ir, 0);
+    Asequal("P.H. Newby", doc_get_field(doc, author)->data[0]);
+    doc_destroy(doc);
+    doc = new_ir->get_doc(new_ir, 3);
+    Apnotnull(doc_get_field(doc, I("new field")));
+    doc_destroy(doc);
+    ir_close(new_ir);
+
+    ir = ir_open(store);
+    Aiequal(2, ir->num_docs(ir));
+    Aiequal(12, ir_get_norms(ir, title)[0]);
+    ir_close(ir);
+}
+
+/**
+ * Test deleting through a reopened reader whose segment's deleted docs are
+ * still shared with the old reader. Deleting the last of 128 documents
+ * makes the deleted docs exactly four words long.
+ */
+static void test_ir_reopen_copy_deleted_docs(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir, *new_ir;
+    Document *doc;
+    int i;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &default_config);
+    for (i = 0; i < 128; i++) {
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I("field")), "value"));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_optimize(iw);
+    iw_close(iw);
+    ir = ir_open(store);
+    ir_delete_doc(ir, 127);
+    ir_close(ir);
+
+    ir = ir_open(store);
+    iw = iw_open(store, whitespace_analyzer_new(false), &default_config);
+    doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I("field")), "value"));
+    iw_add_doc(iw, doc);
+    doc_destroy(doc);
+    iw_close(iw);
+    new_ir = ir_reopen(ir);
+    Atrue(new_ir != ir);
+    ir_delete_doc(new_ir, 5);
+    Atrue(new_ir->is_deleted(new_ir, 5));
+    Atrue(new_ir->is_deleted(new_ir, 127));
+    Atrue(!ir->is_deleted(ir, 5));
+    Atrue(ir->is_deleted(ir, 127));
+    Aiequal(127, ir->num_docs(ir));
+    Aiequal(127, new_ir->num_docs(new_ir));
+    ir_close(ir);
+    ir_close(new_ir);
+}
+
+/*
+ * "dv" and "dvt" have doc values and "plain" and "plaint" hold the same
+ * values without, so the FieldIndexes of each pair should be the same
+ */
+#define DV_TEST_DOC_CNT 300
+static void dv_test_add_docs(IndexWriter *iw, int start, int end)
+{
+    char val[32], text[64];
+    int i;
+
+    for (i = start; i < end; i++) {
+        Document *doc = doc_new();
+        if (i % 5) {
+            sprintf(val, "%d", (i * 7) % 50);
+            doc_add_field(doc, df_add_data(df_new(I("dv")), val));
+            doc_add_field(doc, df_add_data(df_new(I("plain")), val));
+        }
+        sprintf(text, "w%d w%d", i % 13, (i * 3) % 17);
+        doc_add_field(doc, df_add_data(df_new(I("dvt")), text));
+        doc_add_field(doc, df_add_data(df_new(I("plaint")), text));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+}
+
+static int dv_test_cmp(long a, long b)
+{
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/* integer and float indexes are only compared if +numeric+ */
+static void check_doc_values(TestCase *tc, IndexReader *ir, Symbol dv_field,
+                             Symbol plain_field, bool numeric)
+{
+    FieldIndex *dv_ints = field_index_get(ir, dv_field,
+                                          &INTEGER_FIELD_INDEX_CLASS);
+    FieldIndex *ints = field_index_get(ir, plain_field,
+                                       &INTEGER_FIELD_INDEX_CLASS);
+    FieldIndex *dv_floats = field_index_get(ir, dv_field,
+                                            &FLOAT_FIELD_INDEX_CLASS);
+    FieldIndex *floats = field_index_get(ir, plain_field,
+                                         &FLOAT_FIELD_INDEX_CLASS);
+    FieldIndex *dv_strs = field_index_get(ir, dv_field,
+                                          &STRING_FIELD_INDEX_CLASS);
+    FieldIndex *strs = field_index_get(ir, plain_field,
+                                       &STRING_FIELD_INDEX_CLASS);
+    long *dv_bytes = (long *)field_index_get(ir, dv_field,
+                                             &BYTE_FIELD_INDEX_CLASS)->index;
+    long *bytes = (long *)field_index_get(ir, plain_field,
+                                          &BYTE_FIELD_INDEX_CLASS)->index;
+    int i, last = -1;
+
+    for (i = 0; i < ir->max_doc(ir); i++) {
+        const char *dv_str = get_string_value(dv_strs, i);
+        const char *str = get_string_value(strs, i);
+        if (ir->is_deleted(ir, i)) {
+            continue;
+        }
+        if (numeric) {
+            Aiequal(get_integer_value(ints, i), get_integer_value(dv_ints, i));
+            Atrue(get_float_value(floats, i) == get_float_value(dv_floats, i));
+        }
+        if (str) {
+            Asequal(str, dv_str);
+        }
+        else {
+            Apnull(dv_str);
+        }
+        /* the byte indexes only have to sort the documents the same way */
+        if (last >= 0) {
+            Aiequal(dv_test_cmp(bytes[last], bytes[i]),
+                    dv_test_cmp(dv_bytes[last], dv_bytes[i]));
+        }
+        last = i;
+    }
+}
+
+static void test_doc_values(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir, **leaves;
+    FieldInfo *fi;
+    int i, *starts, leaf_cnt;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    fi = fi_new(I("dv"), STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    fi->bits |= FI_DOC_VALUES_BM;
+    fis_add_field(fis, fi);
+    fis_add_field(fis, fi_new(I("plain"), STORE_NO, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    fi = fi_new(I("dvt"), STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    fi->bits |= FI_DOC_VALUES_BM;
+    fis_add_field(fis, fi);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    config.max_buffered_docs = 100;
+    config.merge_factor = 100;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    dv_test_add_docs(iw, 0, DV_TEST_DOC_CNT);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    leaf_cnt = ir_get_leaves(ir, &leaves, &starts);
+    Aiequal(3, leaf_cnt);
+    for (i = 0; i < leaf_cnt; i++) {
+        DocValues *dv = ir_get_doc_values(leaves[i],
+                                          ir_get_field_num(ir, I("dv")));
+        Apnotnull(dv);
+        if (dv) {
+            /* read columns stay packed */
+            Apnull(dv->ords);
+        }
+        Apnull(ir_get_doc_values(leaves[i],
+                                 ir_get_field_num(ir, I("plain"))));
+    }
+    ir_delete_doc(ir, 7);
+    ir_delete_doc(ir, 150);
+    check_doc_values(tc, ir, I("dv"), I("plain"), true);
+    check_doc_values(tc, ir, I("dvt"), I("plaint"), false);
+    ir_close(ir);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(1, ir->sis->size);
+    Aiequal(DV_TEST_DOC_CNT - 2, ir->max_doc(ir));
+    Apnotnull(ir_get_doc_values(ir, ir_get_field_num(ir, I("dv"))));
+    Apnotnull(ir_get_doc_values(ir, ir_get_field_num(ir, I("dvt"))));
+    check_doc_values(tc, ir, I("dv"), I("plain"), true);
+    check_doc_values(tc, ir, I("dvt"), I("plaint"), false);
+    ir_close(ir);
+}
+
+/* a memory-mapped segment's columns are used where they lie in the file */
+static void test_doc_values_mmapped(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    IndexReader *ir;
+    DocValues *dv;
+
+    test_doc_values(tc, store);
+    ir = ir_open(store);
+    dv = ir_get_doc_values(ir, ir_get_field_num(ir, I("dvt")));
+    Apnotnull(dv);
+    if (dv) {
+        Apnull(dv->term_buf);
+        Apnull(dv->ords);
+        Apnotnull(dv->packed_ords);
+    }
+    ir_close(ir);
+}
+
 /****************************************************************************
  *
  * IndexWriter
@@ -789,8 +1533,8 @@ static void test_fld_inverter(TestCase *tc, void *data)
     Store *store = (Store *)data;
     Hash *plists;
     Hash *curr_plists;
-    Posting *p;
     PostingList *pl;
+    ByteSliceReader bsr;
     DocWriter *dw;
     IndexWriter *iw = create_book_iw(store);
     DocField *df;
@@ -819,11 +1563,12 @@ static void test_fld_inverter(TestCase *tc, void *data)
         Asequal("one", pl->term);
         Aiequal(3, pl->term_len);
 
-        p = pl->last;
-        Aiequal(1, p->freq);
-        Apequal(p->first_occ, pl->last_occ);
-        Apnull(p->first_occ->next);
-        Aiequal(0, p->first_occ->pos);
+        Aiequal(0, pl->last_doc);
+        Aiequal(1, pl->freq);
+        Aiequal(pl->frq_start, pl->frq_upto);
+        bsr_init(&bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        Aiequal(0, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
         Apequal(pl, ((PostingList *)h_get(plists, "one")));
     }
 
@@ -831,14 +1576,16 @@ static void test_fld_inverter(TestCase *tc, void *data)
     if (Apnotnull(pl)) {
         Asequal("five", pl->term);
         Aiequal(4, pl->term_len);
-        Apnull(pl->last_occ->next);
-        p = pl->last;
-        Aiequal(5, p->freq);
-        Aiequal(4, p->first_occ->pos);
-        Aiequal(8, p->first_occ->next->pos);
-        Aiequal(11, p->first_occ->next->next->pos);
-        Aiequal(13, p->first_occ->next->next->next->pos);
-        Aiequal(35, p->first_occ->next->next->next->next->pos);
+        Aiequal(5, pl->freq);
+        Aiequal(35, pl->last_pos);
+        /* positions are delta encoded */
+        bsr_init(&bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        Aiequal(4, bsr_read_vint(&bsr));
+        Aiequal(4, bsr_read_vint(&bsr));
+        Aiequal(3, bsr_read_vint(&bsr));
+        Aiequal(2, bsr_read_vint(&bsr));
+        Aiequal(22, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
         Apequal(pl, ((PostingList *)h_get(plists, "five")));
     }
 
@@ -863,16 +1610,17 @@ static void test_fld_inverter(TestCase *tc, void *data)
         Asequal("one", pl->term);
         Aiequal(3, pl->term_len);
 
-        p = pl->first;
-        Aiequal(1, p->freq);
-        Apnull(p->first_occ->next);
-        Aiequal(0, p->first_occ->pos);
-
-        p = pl->last;
-        Aiequal(1, p->freq);
-        Apequal(p->first_occ, pl->last_occ);
-        Apnull(p->first_occ->next);
-        Aiequal(9, p->first_occ->pos);
+        /* doc 0 with a freq of 1 has been written to the frq slice */
+        bsr_init(&bsr, dw->bbp, pl->frq_start, pl->frq_upto);
+        Aiequal(1, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
+        bsr_init(&bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        Aiequal(0, bsr_read_vint(&bsr));
+        Aiequal(9, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
+
+        Aiequal(1, pl->last_doc);
+        Aiequal(1, pl->freq);
         Apequal(pl, ((PostingList *)h_get(plists, "one")));
     }
 
@@ -893,8 +1641,7 @@ static void test_postings_sorter(TestCase *tc, void *data)
         p_ptr[i] = &plists[i];
     }
 
-    qsort(p_ptr, NUM_POSTINGS, sizeof(PostingList *),
-          (int (*)(const void *, const void *))&pl_cmp);
+    pl_sort(p_ptr, NUM_POSTINGS);
 
     for (i = 1; i < NUM_POSTINGS; i++) {
         Assert(strcmp(p_ptr[i - 1]->term, p_ptr[i]->term) <= 0,
@@ -902,6 +1649,51 @@ static void test_postings_sorter(TestCase *tc, void *data)
     }
 }
 
+#define NUM_SORT_TERMS 5000
+/**
+ * Compare pl_sort against qsort with terms which share long prefixes, are
+ * prefixes of each other and use the high bytes.
+ */
+static void test_postings_sorter_terms(TestCase *tc, void *data)
+{
+    int i, j;
+    char terms[NUM_SORT_TERMS][40];
+    PostingList plists[NUM_SORT_TERMS];
+    PostingList *sorted[NUM_SORT_TERMS], *expected[NUM_SORT_TERMS];
+    (void)data;
+
+    for (i = 0; i < NUM_SORT_TERMS; i++) {
+        int len = rand() % 30;
+        switch (i % 3) {
+            case 0:
+                strcpy(terms[i], "prefix");
+                break;
+            case 1:
+                strcpy(terms[i], "aaaaaaaaaa");
+                break;
+            default:
+                terms[i][0] = '\0';
+        }
+        j = (int)strlen(terms[i]);
+        for (len += j; j < len; j++) {
+            terms[i][j] = (char)(i % 7 ? 'a' + rand() % 3 : 1 + rand() % 255);
+        }
+        terms[i][j] = '\0';
+        plists[i].term = terms[i];
+        sorted[i] = expected[i] = &plists[i];
+    }
+
+    qsort(expected, NUM_SORT_TERMS, sizeof(PostingList *),
+          (int (*)(const void *, const void *))&pl_cmp);
+    pl_sort(sorted, NUM_SORT_TERMS);
+
+    for (i = 0; i < NUM_SORT_TERMS; i++) {
+        if (!Asequal(expected[i]->term, sorted[i]->term)) {
+            break;
+        }
+    }
+}
+
 static void test_iw_add_doc(TestCase *tc, void *data)
 {
     Store *store = (Store *)data;
@@ -1273,6 +2065,420 @@ static void test_iw_del_terms(TestCase *tc, void *data)
     ir_close(ir);
 }
 
+/****************************************************************************
+ *
+ * MergePolicy
+ *
+ ****************************************************************************/
+
+#define MB ((off_t)1024 * 1024)
+
+static void set_seg_stats(SegmentStats *stats, int cnt, off_t size)
+{
+    int i;
+    for (i = 0; i < cnt; i++) {
+        stats[i].si = NULL;
+        stats[i].doc_cnt = 100;
+        stats[i].del_cnt = 0;
+        stats[i].size = size;
+        stats[i].merging = false;
+    }
+}
+
+static void test_tiered_merge_policy(TestCase *tc, void *data)
+{
+    SegmentStats stats[20];
+    MergeSpec merges[20];
+    MergePolicy *mp = tiered_merge_policy_new();
+    TieredMergePolicy *tmp = TIERED_MP(mp);
+    (void)data;
+
+    /* within the allowed segment count */
+    set_seg_stats(stats, 10, MB);
+    Aiequal(0, mp->find_merges(mp, &default_config, stats, 10, merges));
+
+    /* equal segments are merged max_merge_at_once at a time */
+    set_seg_stats(stats, 20, MB);
+    Aiequal(1, mp->find_merges(mp, &default_config, stats, 20, merges));
+    Aiequal(10, merges[0].max_seg - merges[0].min_seg);
+
+    /* segments being merged are left alone */
+    stats[0].merging = stats[1].merging = true;
+    Aiequal(1, mp->find_merges(mp, &default_config, stats, 20, merges));
+    Atrue(merges[0].min_seg >= 2);
+
+    /* segments with deletions are preferred */
+    tmp->segs_per_tier = 2;
+    tmp->max_merge_at_once = 2;
+    tmp->floor_segment_size = 1;
+    set_seg_stats(stats, 8, MB);
+    stats[3].del_cnt = 50;
+    Aiequal(1, mp->find_merges(mp, &default_config, stats, 8, merges));
+    Atrue(merges[0].min_seg <= 3 && 3 < merges[0].max_seg);
+
+    /* merged segments are kept below max_merged_segment_size */
+    tmp->max_merge_at_once = 10;
+    tmp->max_merged_segment_size = 3 * MB;
+    set_seg_stats(stats, 10, MB);
+    Aiequal(1, mp->find_merges(mp, &default_config, stats, 10, merges));
+    Atrue(merges[0].max_seg - merges[0].min_seg <= 3);
+
+    /* forced merges take the smallest segments and ignore the size cap */
+    set_seg_stats(stats, 6, MB);
+    stats[0].size = 100 * MB;
+    Aiequal(0, mp->find_forced_merges(mp, &default_config, stats, 6, 6,
+                                      merges));
+    Aiequal(1, mp->find_forced_merges(mp, &default_config, stats, 6, 2,
+                                      merges));
+    Aiequal(1, merges[0].min_seg);
+    Aiequal(6, merges[0].max_seg);
+
+    /* only segments over deletes_pct_allowed are expunged */
+    set_seg_stats(stats, 6, MB);
+    stats[1].del_cnt = 5;
+    stats[2].del_cnt = 50;
+    stats[3].del_cnt = 20;
+    stats[5].del_cnt = 90;
+    Aiequal(2, mp->find_deletes_merges(mp, &default_config, stats, 6,
+                                       merges));
+    Aiequal(2, merges[0].min_seg);
+    Aiequal(4, merges[0].max_seg);
+    Aiequal(5, merges[1].min_seg);
+    Aiequal(6, merges[1].max_seg);
+
+    merge_policy_destroy(mp);
+}
+
+static void test_log_doc_merge_policy(TestCase *tc, void *data)
+{
+    SegmentStats stats[20];
+    MergeSpec merges[20];
+    MergePolicy *mp = log_doc_merge_policy_new();
+    Config config = default_config;
+    (void)data;
+    config.merge_factor = 4;
+
+    set_seg_stats(stats, 7, 1);
+    stats[0].doc_cnt = 16;
+    stats[1].doc_cnt = stats[2].doc_cnt = 4;
+    stats[3].doc_cnt = stats[4].doc_cnt = stats[5].doc_cnt = 1;
+    stats[6].doc_cnt = 1;
+    Aiequal(1, mp->find_merges(mp, &config, stats, 7, merges));
+    Aiequal(3, merges[0].min_seg);
+    Aiequal(7, merges[0].max_seg);
+    stats[4].merging = true;
+    Aiequal(0, mp->find_merges(mp, &config, stats, 7, merges));
+
+    Aiequal(1, mp->find_forced_merges(mp, &config, stats, 7, 5, merges));
+    Aiequal(4, merges[0].min_seg);
+    Aiequal(7, merges[0].max_seg);
+
+    stats[1].del_cnt = stats[2].del_cnt = stats[6].del_cnt = 1;
+    Aiequal(2, mp->find_deletes_merges(mp, &config, stats, 7, merges));
+    Aiequal(1, merges[0].min_seg);
+    Aiequal(3, merges[0].max_seg);
+    Aiequal(6, merges[1].min_seg);
+    Aiequal(7, merges[1].max_seg);
+
+    merge_policy_destroy(mp);
+}
+
+static void test_iw_tiered_merges(TestCase *tc, void *data)
+{
+    int i;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    Document *doc;
+    Document **docs = prep_book_list();
+    config.max_buffered_docs = 1;
+
+    iw = create_book_iw_conf(store, &config);
+    iw_set_merge_policy(iw, tiered_merge_policy_new());
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    Aiequal(BOOK_LIST_LENGTH, iw_doc_count(iw));
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+
+    sis = sis_read(store);
+    Atrue(sis->size <= 10);
+    sis_destroy(sis);
+
+    /* the documents keep their order */
+    ir = ir_open(store);
+    Aiequal(BOOK_LIST_LENGTH, ir->num_docs(ir));
+    doc = ir->get_doc(ir, 0);
+    Asequal("P.H. Newby", doc_get_field(doc, author)->data[0]);
+    doc_destroy(doc);
+    doc = ir->get_doc(ir, BOOK_LIST_LENGTH - 1);
+    Asequal("DBC Pierre", doc_get_field(doc, author)->data[0]);
+    doc_destroy(doc);
+    ir_close(ir);
+}
+
+static void test_iw_force_merge(TestCase *tc, void *data)
+{
+    int i;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    Document **docs = prep_book_list();
+    config.merge_factor = 20;
+    config.max_buffered_docs = 2;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_force_merge(iw, 3);
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+
+    sis = sis_read(store);
+    Atrue(sis->size <= 3);
+    Atrue(sis->size > 1);
+    sis_destroy(sis);
+
+    /* the same with the tiered policy */
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_set_merge_policy(iw, tiered_merge_policy_new());
+    iw_force_merge(iw, 2);
+    iw_close(iw);
+
+    sis = sis_read(store);
+    Aiequal(2, sis->size);
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Aiequal(BOOK_LIST_LENGTH, ir->num_docs(ir));
+    ir_close(ir);
+}
+
+static void test_iw_expunge_deletes(TestCase *tc, void *data)
+{
+    int i, num_docs, del_seg_cnt = 0;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    MergePolicy *mp;
+    Document **docs = prep_book_list();
+    config.merge_factor = 4;
+    config.max_buffered_docs = 3;
+
+    iw = create_book_iw_conf(store, &config);
+    iw_set_merge_policy(iw, tiered_merge_policy_new());
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_delete_term(iw, title, "The");
+    iw_delete_term(iw, author, "Berger");
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+
+    sis = sis_read(store);
+    for (i = 0; i < sis->size; i++) {
+        if (si_has_deletions(sis->segs[i])) del_seg_cnt++;
+    }
+    Atrue(del_seg_cnt > 0);
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Atrue(ir->num_docs(ir) < ir->max_doc(ir));
+    num_docs = ir->num_docs(ir);
+    ir_close(ir);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    mp = tiered_merge_policy_new();
+    TIERED_MP(mp)->deletes_pct_allowed = 0.0;
+    iw_set_merge_policy(iw, mp);
+    iw_expunge_deletes(iw);
+    iw_close(iw);
+
+    sis = sis_read(store);
+    for (i = 0, del_seg_cnt = 0; i < sis->size; i++) {
+        if (si_has_deletions(sis->segs[i])) del_seg_cnt++;
+    }
+    Aiequal(0, del_seg_cnt);
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Aiequal(num_docs, ir->num_docs(ir));
+    Aiequal(num_docs, ir->max_doc(ir));
+    ir_close(ir);
+}
+
+static void add_key_doc(IndexWriter *iw, const char *key, const char *version)
+{
+    Document *doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(title), (char *)key));
+    doc_add_field(doc, df_add_data(df_new(author), (char *)version));
+    iw_add_doc(iw, doc);
+    doc_destroy(doc);
+}
+
+/* the version of the only live document with +key+, or NULL if there's none */
+static char *key_version(TestCase *tc, IndexReader *ir, const char *key)
+{
+    static char version[32];
+    TermDocEnum *tde = ir_term_docs_for(ir, title, key);
+    char *found = NULL;
+    if (tde->next(tde)) {
+        Document *doc = ir->get_doc(ir, tde->doc_num(tde));
+        strcpy(version, doc_get_field(doc, author)->data[0]);
+        doc_destroy(doc);
+        found = version;
+        Assert(!tde->next(tde), "%s should only be in the index once", key);
+    }
+    tde->close(tde);
+    return found;
+}
+
+static void test_iw_buffered_deletes(TestCase *tc, void *data)
+{
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    Query *q;
+    char *terms[] = {"key4", "key16"};
+    char key[32];
+    int i;
+    config.max_buffered_docs = 100;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < 20; i++) {
+        sprintf(key, "key%d", i);
+        add_key_doc(iw, key, "a");
+        if (i == 9) {
+            iw_commit(iw);
+        }
+    }
+    /* replace a committed and a buffered document */
+    iw_delete_term(iw, title, "key3");
+    add_key_doc(iw, "key3", "b");
+    iw_delete_term(iw, title, "key15");
+    add_key_doc(iw, "key15", "b");
+    iw_delete_terms(iw, title, terms, 2);
+    q = tq_new(title, "key7");
+    iw_delete_query(iw, q);
+    q_deref(q);
+
+    /* nothing is applied until the next flush */
+    sis = sis_read(store);
+    Aiequal(1, sis->size);
+    Atrue(!si_has_deletions(sis->segs[0]));
+    sis_destroy(sis);
+    iw_close(iw);
+
+    sis = sis_read(store);
+    Aiequal(2, sis->size);
+    Atrue(si_has_deletions(sis->segs[0]));
+    Atrue(si_has_deletions(sis->segs[1]));
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Aiequal(17, ir->num_docs(ir));
+    Asequal("b", key_version(tc, ir, "key3"));
+    Asequal("b", key_version(tc, ir, "key15"));
+    Asequal("a", key_version(tc, ir, "key5"));
+    Apnull(key_version(tc, ir, "key4"));
+    Apnull(key_version(tc, ir, "key16"));
+    Apnull(key_version(tc, ir, "key7"));
+    ir_close(ir);
+
+    /* deletes with no documents after them are applied on commit */
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_delete_term(iw, title, "key5");
+    iw_delete_term(iw, title, "key15");
+    iw_commit(iw);
+    iw_close(iw);
+
+    sis = sis_read(store);
+    Aiequal(2, sis->size);
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Aiequal(15, ir->num_docs(ir));
+    Apnull(key_version(tc, ir, "key5"));
+    Apnull(key_version(tc, ir, "key15"));
+    ir_close(ir);
+}
+
+/**
+ * Test that readers from iw_get_reader see flushed documents and deletes
+ * before they are committed, share unchanged segments with the previous
+ * reader and aren't affected by later changes to the writer.
+ */
+static void test_iw_get_reader(TestCase *tc, void *data)
+{
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir, *new_ir;
+    SegmentInfos *sis;
+    Document *doc;
+    uchar *norms;
+    char key[32];
+    int i;
+    config.max_buffered_docs = 100;
+    config.merge_factor = 100;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < 15; i++) {
+        sprintf(key, "key%d", i);
+        add_key_doc(iw, key, "a");
+        if (i == 9) {
+            iw_commit(iw);
+        }
+    }
+    ir = iw_get_reader(iw, NULL);
+    Aiequal(15, ir->num_docs(ir));
+    Asequal("a", key_version(tc, ir, "key12"));
+    norms = get_leaf_norms(ir, 0, title);
+
+    /* the second segment was flushed but not committed */
+    sis = sis_read(store);
+    Aiequal(1, sis->size);
+    sis_destroy(sis);
+
+    iw_delete_term(iw, title, "key12");
+    add_key_doc(iw, "key12", "b");
+    add_key_doc(iw, "key20", "a");
+    doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I("new field")), "nrt"));
+    iw_add_doc(iw, doc);
+    doc_destroy(doc);
+    Aiequal(15, ir->num_docs(ir));
+    Asequal("a", key_version(tc, ir, "key12"));
+
+    new_ir = iw_get_reader(iw, ir);
+    Aiequal(17, new_ir->num_docs(new_ir));
+    Asequal("b", key_version(tc, new_ir, "key12"));
+    Asequal("a", key_version(tc, new_ir, "key20"));
+    Apequal(norms, get_leaf_norms(new_ir, 0, title));
+    Atrue(fis_get_field_num(new_ir->fis, I("new field")) >= 0);
+    Aiequal(-1, fis_get_field_num(ir->fis, I("new field")));
+
+    /* the old reader doesn't see the new reader's segments either */
+    Aiequal(15, ir->num_docs(ir));
+    Asequal("a", key_version(tc, ir, "key12"));
+    ir_close(ir);
+    ir_close(new_ir);
+    iw_close(iw);
+
+    sis = sis_read(store);
+    Aiequal(3, sis->size);
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Aiequal(17, ir->num_docs(ir));
+    Asequal("b", key_version(tc, ir, "key12"));
+    ir_close(ir);
+}
+
 /****************************************************************************
  *
  * IndexReader
@@ -2201,20 +3407,34 @@ TestSuite *ts_index(TestSuite *suite)
     /* TermDocEnum */
     tst_run_test(suite, test_segment_term_doc_enum, store);
     tst_run_test(suite, test_segment_tde_deleted_docs, store);
+    tst_run_test(suite, test_block_postings, store);
+    tst_run_test(suite, test_pulsed_postings, store);
+    tst_run_test(suite, test_multi_level_skip, store);
 
     suite = ADD_SUITE(suite);
     /* Index */
     tst_run_test(suite, test_index_create, store);
     tst_run_test(suite, test_index_version, store);
     tst_run_test(suite, test_index_undelete_all_after_close, store);
+    tst_run_test(suite, test_ir_reopen, store);
+    tst_run_test(suite, test_ir_reopen_copy_deleted_docs, store);
+    tst_run_test(suite, test_doc_values, store);
 
     /* IndexWriter */
     tst_run_test(suite, test_fld_inverter, store);
     tst_run_test(suite, test_postings_sorter, NULL);
+    tst_run_test(suite, test_postings_sorter_terms, NULL);
     tst_run_test(suite, test_iw_add_doc, store);
     tst_run_test(suite, test_iw_add_docs, store);
     tst_run_test(suite, test_iw_add_empty_tv, store);
     tst_run_test(suite, test_iw_del_terms, store);
+    tst_run_test(suite, test_tiered_merge_policy, NULL);
+    tst_run_test(suite, test_log_doc_merge_policy, NULL);
+    tst_run_test(suite, test_iw_tiered_merges, store);
+    tst_run_test(suite, test_iw_force_merge, store);
+    tst_run_test(suite, test_iw_expunge_deletes, store);
+    tst_run_test(suite, test_iw_buffered_deletes, store);
+    tst_run_test(suite, test_iw_get_reader, store);
     tst_run_test(suite, test_create_with_reader, store);
     tst_run_test(suite, test_simulated_crashed_writer, store);
     tst_run_test(suite, test_simulated_corrupt_index1, store);
@@ -2339,6 +3559,13 @@ TestSuite *ts_index(TestSuite *suite)
     fs_store->clear_all(fs_store);
     store_deref(fs_store);
 
+#ifndef POSH_OS_WIN32
+    fs_store = open_mmap_store(TEST_DIR);
+    tst_run_test(suite, test_doc_values_mmapped, fs_store);
+    fs_store->clear_all(fs_store);
+    store_deref(fs_store);
+#endif
+
     tst_run_test(suite, test_ir_multivalue_fields, store);
 
     store_deref(store);
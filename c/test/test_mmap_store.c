@@ -0,0 +1,115 @@
+#include "store.h"
+#include "index.h"
+#include "test_store.h"
+#include "test.h"
+
+/**
+ * Test that InStreams opened from a compound file in a memory-mapped store
+ * read straight from the mapping.
+ */
+static void test_mmap_compound(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    char *p;
+    OutStream *os1 = store->new_output(store, "_mmap1.f1");
+    OutStream *os2 = store->new_output(store, "_mmap1.f2");
+    CompoundWriter *cw;
+    Store *c_reader;
+    InStream *is1, *is2;
+
+    os_write_u32(os1, 20);
+    os_write_string(os2, "this is file2");
+    os_close(os1);
+    os_close(os2);
+    cw = open_cw(store, "_mmap1.cfs");
+    cw_add_file(cw, "_mmap1.f1");
+    cw_add_file(cw, "_mmap1.f2");
+    cw_close(cw);
+
+    c_reader = open_cmpd_store(store, "_mmap1.cfs");
+    is1 = c_reader->open_input(c_reader, "_mmap1.f1");
+    is2 = c_reader->open_input(c_reader, "_mmap1.f2");
+    Assert(is_mapped(is1), "compound entry should be read from the mapping");
+    Aiequal(4, is_length(is1));
+    Aiequal(14, is_length(is2));
+    Asequal("this is file2", p = is_read_string(is2)); free(p);
+    Aiequal(20, is_read_u32(is1));
+
+    /* the entry must end where the compound file says it does */
+    TRY
+        is_read_byte(is1);
+        Assert(false, "Should have raised an EOF error");
+    XCATCHALL
+        HANDLED();
+    XENDTRY
+
+    is_close(is1);
+    is_close(is2);
+    store_deref(c_reader);
+}
+
+/**
+ * Test reading past the end of a memory-mapped file, including an empty one
+ * which can't actually be mapped.
+ */
+static void test_mmap_eof(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    uchar buf[8];
+    OutStream *os = store->new_output(store, "_mmap2.f1");
+    InStream *is;
+
+    os_write_u32(os, 0x01020304);
+    os_close(os);
+    is = store->open_input(store, "_mmap2.f1");
+    Assert(is_mapped(is), "file should be memory-mapped");
+    is_seek(is, 4);
+    Aiequal(4, is_pos(is));
+    TRY
+        is_read_bytes(is, buf, 1);
+        Assert(false, "Should have raised an EOF error");
+    XCATCHALL
+        HANDLED();
+    XENDTRY
+    is_seek(is, 0);
+    Aiequal(0x01020304, is_read_u32(is));
+    is_close(is);
+
+    store->touch(store, "_mmap2.f2");
+    is = store->open_input(store, "_mmap2.f2");
+    Aiequal(0, is_length(is));
+    TRY
+        is_read_byte(is);
+        Assert(false, "Should have raised an EOF error");
+    XCATCHALL
+        HANDLED();
+    XENDTRY
+    is_close(is);
+}
+
+/**
+ * Test a memory-mapped FileSystem store
+ */
+TestSuite *ts_mmap_store(TestSuite *suite)
+{
+
+#ifdef POSH_OS_WIN32
+    Store *store = open_mmap_store(".\\test\\testdir\\store");
+#else
+    Store *store = open_mmap_store("./test/testdir/store");
+#endif
+    store->clear(store);
+
+    suite = ADD_SUITE(suite);
+
+    create_test_store_suite(suite, store);
+#ifndef POSH_OS_WIN32
+    tst_run_test(suite, test_mmap_compound, store);
+    tst_run_test(suite, test_mmap_eof, store);
+#endif
+
+    store->clear_all(store);
+    store_deref(store);
+
+    return suite;
+}
@@ -1609,6 +1609,293 @@ static void test_search_unscored(TestCase *tc, void *data)
     q_deref(tq);
 }
 
+#define SEGMENTED_DOCS 20
+#define SEGMENTED_SEG_SIZE 5
+
+/*
+ * Write SEGMENTED_DOCS documents to +store+, SEGMENTED_SEG_SIZE to a segment.
+ */
+static void create_segmented_index(Store *store)
+{
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    Config config = default_config;
+    IndexWriter *iw = NULL;
+    char buf[64];
+    int i;
+
+    config.merge_factor = SEGMENTED_DOCS + 1;
+    index_create(store, fis);
+    fis_deref(fis);
+    for (i = 0; i < SEGMENTED_DOCS; i++) {
+        Document *doc = doc_new();
+        if (i % SEGMENTED_SEG_SIZE == 0) {
+            iw = iw_open(store, whitespace_analyzer_new(false), &config);
+        }
+        sprintf(buf, "word1 seg%d %s%s", i / SEGMENTED_SEG_SIZE,
+                i % 2 ? "odd" : "even", i % 3 ? "" : " x x x");
+        doc_add_field(doc, df_add_data(df_new(field), estrdup(buf)))
+            ->destroy_data = true;
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+        if (i % SEGMENTED_SEG_SIZE == SEGMENTED_SEG_SIZE - 1) {
+            iw_close(iw);
+        }
+    }
+}
+
+/**
+ * Test searching an index with several segments, which is done one segment
+ * at a time, checking the scores against the explanations which are worked
+ * out on the whole index.
+ */
+static void test_segmented_search(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    IndexReader *ir, **leaves;
+    Searcher *searcher;
+    Query *q;
+    int i, leaf_cnt, *starts, docs[SEGMENTED_DOCS], expected[SEGMENTED_DOCS];
+    (void)data;
+
+    create_segmented_index(store);
+    ir = ir_open(store);
+    leaf_cnt = ir_get_leaves(ir, &leaves, &starts);
+    Aiequal(SEGMENTED_DOCS / SEGMENTED_SEG_SIZE, leaf_cnt);
+    for (i = 0; i < leaf_cnt; i++) {
+        Aiequal(i * SEGMENTED_SEG_SIZE, starts[i]);
+        Aiequal(0, ir_get_leaves(leaves[i], &leaves, &starts));
+    }
+    ir_delete_doc(ir, 6);
+    searcher = isea_new(ir);
+
+    q = tq_new(field, "word1");
+    check_hits(tc, searcher, q, "0,1,2,3,4,5,7,8,9,10,11,12,13,14,15,16,17,18,"
+               "19", -1);
+    Aiequal(s2l("4, 5, 7, 8, 9", expected),
+            searcher_search_unscored(searcher, q, docs, 5, 4));
+    Aaiequal(expected, docs, 5);
+    Aiequal(s2l("15, 16, 17, 18, 19", expected),
+            searcher_search_unscored(searcher, q, docs, 10, 15));
+    Aaiequal(expected, docs, 5);
+    q_deref(q);
+
+    q = bq_new(false);
+    bq_add_query_nr(q, tq_new(field, "seg1"), BC_SHOULD);
+    bq_add_query_nr(q, tq_new(field, "x"), BC_SHOULD);
+    check_hits(tc, searcher, q, "0,3,5,7,8,9,12,15,18", -1);
+    q_deref(q);
+
+    q = bq_new(false);
+    bq_add_query_nr(q, tq_new(field, "odd"), BC_MUST);
+    bq_add_query_nr(q, tq_new(field, "seg3"), BC_MUST_NOT);
+    check_hits(tc, searcher, q, "1,3,5,7,9,11,13", -1);
+    q_deref(q);
+
+    searcher_close(searcher);
+    store_deref(store);
+}
+
+static void check_same_top_docs(TestCase *tc, TopDocs *expected,
+                                TopDocs *td)
+{
+    int i;
+    Aiequal(expected->total_hits, td->total_hits);
+    Afequal(expected->max_score, td->max_score);
+    Aiequal(expected->size, td->size);
+    for (i = 0; i < expected->size && i < td->size; i++) {
+        Aiequal(expected->hits[i]->doc, td->hits[i]->doc);
+        Afequal(expected->hits[i]->score, td->hits[i]->score);
+    }
+}
+
+static void check_parallel_search(TestCase *tc, Searcher *seq_sea,
+                                  Searcher *par_sea, Query *q, Sort *sort,
+                                  Filter *filter)
+{
+    TopDocs *expected = searcher_search(seq_sea, q, 1, 7, filter, sort, NULL);
+    TopDocs *td = searcher_search(par_sea, q, 1, 7, filter, sort, NULL);
+    check_same_top_docs(tc, expected, td);
+    td_destroy(expected);
+    td_destroy(td);
+}
+
+/*
+ * A MultiSearcher over two IndexSearchers on +ir+, with every searcher using
+ * +pool+.
+ */
+static Searcher *create_multi_searcher(IndexReader *ir, ThreadPool *pool)
+{
+    Searcher **searchers = ALLOC_N(Searcher *, 2);
+    Searcher *msea;
+    int i;
+    for (i = 0; i < 2; i++) {
+        searchers[i] = isea_new(ir);
+        ((IndexSearcher *)searchers[i])->close_ir = false;
+        isea_set_thread_pool(searchers[i], pool, 0);
+    }
+    msea = msea_new(searchers, 2, true);
+    msea_set_thread_pool(msea, pool, 0);
+    return msea;
+}
+
+/**
+ * Test that searching the segments of an index, or the sub-searchers of a
+ * MultiSearcher, in a thread pool finds the same hits as searching them one
+ * at a time.
+ */
+static void test_parallel_search(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    ThreadPool *pool = tp_new(3);
+    IndexReader *ir;
+    Searcher *seq_sea, *par_sea, *seq_msea, *par_msea;
+    Query *q, *oq;
+    Sort *sort;
+    Filter *filter;
+    int parallelism;
+    (void)data;
+
+    create_segmented_index(store);
+    ir = ir_open(store);
+    ir_delete_doc(ir, 6);
+    seq_sea = isea_new(ir);
+    ((IndexSearcher *)seq_sea)->close_ir = false;
+    par_sea = isea_new(ir);
+    ((IndexSearcher *)par_sea)->close_ir = false;
+
+    q = bq_new(false);
+    bq_add_query_nr(q, tq_new(field, "seg1"), BC_SHOULD);
+    bq_add_query_nr(q, tq_new(field, "x"), BC_SHOULD);
+    bq_add_query_nr(q, tq_new(field, "odd"), BC_SHOULD);
+    oq = tq_new(field, "odd");
+    sort = sort_new();
+    sort_add_sort_field(sort, sort_field_doc_new(true));
+    filter = qfilt_new_nr(tq_new(field, "even"));
+
+    for (parallelism = 0; parallelism <= 2; parallelism++) {
+        isea_set_thread_pool(par_sea, pool, parallelism);
+        check_parallel_search(tc, seq_sea, par_sea, q, NULL, NULL);
+        check_parallel_search(tc, seq_sea, par_sea, q, sort, NULL);
+        check_parallel_search(tc, seq_sea, par_sea, q, NULL, filter);
+        check_parallel_search(tc, seq_sea, par_sea, oq, NULL, NULL);
+        ((IndexSearcher *)seq_sea)->approx_total_hits = true;
+        ((IndexSearcher *)par_sea)->approx_total_hits = true;
+        check_parallel_search(tc, seq_sea, par_sea, q, NULL, NULL);
+        ((IndexSearcher *)seq_sea)->approx_total_hits = false;
+        ((IndexSearcher *)par_sea)->approx_total_hits = false;
+    }
+    searcher_close(par_sea);
+
+    seq_msea = create_multi_searcher(ir, NULL);
+    par_msea = create_multi_searcher(ir, pool);
+    check_parallel_search(tc, seq_msea, par_msea, q, NULL, NULL);
+    check_parallel_search(tc, seq_msea, par_msea, q, sort, NULL);
+    check_parallel_search(tc, seq_msea, par_msea, oq, NULL, filter);
+    searcher_close(seq_msea);
+    searcher_close(par_msea);
+
+    filt_deref(filter);
+    sort_destroy(sort);
+    q_deref(oq);
+    q_deref(q);
+    searcher_close(seq_sea);
+    ir_close(ir);
+    tp_destroy(pool);
+    store_deref(store);
+}
+
+#define MAX_SCORE_DOCS 3000
+#define MAX_SCORE_WORDS 12
+#define MAX_SCORE_QUERIES 100
+#define MAX_SCORE_TOP 10
+
+/**
+ * Test that a searcher allowed to skip documents which can't make it into the
+ * top hits finds the same top hits as one which scores every document.
+ */
+static void test_max_score_search(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    IndexWriter *iw;
+    IndexReader *ir;
+    Searcher *exact, *approx;
+    char buf[1024], word[8];
+    int i, j, k, exact_total = 0, approx_total = 0;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    iw = iw_open(store, whitespace_analyzer_new(false), NULL);
+    for (i = 0; i < MAX_SCORE_DOCS; i++) {
+        Document *doc = doc_new();
+        buf[0] = '\0';
+        for (j = 0; j < MAX_SCORE_WORDS; j++) {
+            /* lower numbered words are more common */
+            if (rand() % (j + 2) == 0) {
+                for (k = rand() % 4; k >= 0; k--) {
+                    sprintf(word, "w%d ", j);
+                    strcat(buf, word);
+                }
+            }
+        }
+        for (k = rand() % 16; k >= 0; k--) {
+            strcat(buf, "x ");
+        }
+        doc_add_field(doc, df_add_data(df_new(field), estrdup(buf)))
+            ->destroy_data = true;
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    exact = isea_new(ir);
+    ((IndexSearcher *)exact)->close_ir = false;
+    approx = isea_new(ir);
+    ((IndexSearcher *)approx)->approx_total_hits = true;
+
+    for (i = 0; i < MAX_SCORE_QUERIES; i++) {
+        Query *bq = bq_new(false);
+        TopDocs *exact_td, *approx_td;
+        int num_terms = 2 + rand() % 5;
+        for (j = 0; j < num_terms; j++) {
+            sprintf(word, "w%d", rand() % MAX_SCORE_WORDS);
+            bq_add_query_nr(bq, tq_new(field, word),
+                            (i % 4 == 3 && j == 0) ? BC_MUST_NOT : BC_SHOULD);
+        }
+        exact_td = searcher_search(exact, bq, 0, MAX_SCORE_TOP, NULL, NULL,
+                                   NULL);
+        approx_td = searcher_search(approx, bq, 0, MAX_SCORE_TOP, NULL, NULL,
+                                    NULL);
+        exact_total += exact_td->total_hits;
+        approx_total += approx_td->total_hits;
+        Assert(approx_td->total_hits <= exact_td->total_hits, "%d > %d",
+               approx_td->total_hits, exact_td->total_hits);
+        Afequal(exact_td->max_score, approx_td->max_score);
+        Aiequal(exact_td->size, approx_td->size);
+        for (j = 0; j < exact_td->size && j < approx_td->size; j++) {
+            Hit **hits = exact_td->hits;
+            float score = hits[j]->score;
+            Afequal(score, approx_td->hits[j]->score);
+            /* sums may round differently so only check docs without ties */
+            if ((j == 0 || hits[j - 1]->score - score > 0.0001)
+                && (j == exact_td->size - 1
+                    || score - hits[j + 1]->score > 0.0001)) {
+                Aiequal(hits[j]->doc, approx_td->hits[j]->doc);
+            }
+        }
+        td_destroy(exact_td);
+        td_destroy(approx_td);
+        q_deref(bq);
+    }
+    Assert(approx_total < exact_total, "no documents were skipped");
+
+    searcher_close(approx);
+    searcher_close(exact);
+    store_deref(store);
+}
+
 TestSuite *ts_search(TestSuite *suite)
 {
     Store *store = open_ram_store();
@@ -1664,6 +1951,10 @@ TestSuite *ts_search(TestSuite *suite)
 
     tst_run_test(suite, test_search_unscored, (void *)searcher);
 
+    tst_run_test(suite, test_segmented_search, NULL);
+    tst_run_test(suite, test_parallel_search, NULL);
+    tst_run_test(suite, test_max_score_search, NULL);
+
     store_deref(store);
     searcher_close(searcher);
     return suite;
@@ -264,6 +264,55 @@ static void test_rw_vints(TestCase *tc, void *data)
     is_close(istream);
 }
 
+/**
+ * Test that bulk reading of vints matches reading them one at a time. Runs of
+ * single byte vints are broken up by larger vints at varying offsets so that
+ * the blocks straddle both the runs and the buffer boundaries.
+ */
+static void test_read_vints(TestCase *tc, void *data)
+{
+    int i, j;
+    Store *store = (Store *)data;
+    static const int counts[] = { 1, 15, 16, 17, 33, 1000, 5000 };
+    unsigned int vints[5000], got[5000];
+    OutStream *ostream = store->new_output(store, "_rw_vints.cfs");
+    InStream *istream;
+
+    for (i = 0; i < 5000; i++) {
+        switch (i % 37) {
+            case 0:  vints[i] = UINT_MAX; break;
+            case 11: vints[i] = 0x80 + i; break;
+            case 23: vints[i] = i * 1000; break;
+            default: vints[i] = i % 0x80; break;
+        }
+        os_write_vint(ostream, vints[i]);
+    }
+    os_close(ostream);
+
+    istream = store->open_input(store, "_rw_vints.cfs");
+    for (j = 0; j < (int)(sizeof(counts)/sizeof(counts[0])); j++) {
+        int n = counts[j], done = 0;
+        is_seek(istream, 0);
+        while (done + n <= 5000) {
+            is_read_vints(istream, got + done, n);
+            done += n;
+        }
+        for (i = 0; i < done; i++) {
+            Aiequal(vints[i], got[i]);
+        }
+    }
+
+    is_seek(istream, 0);
+    is_read_vints(istream, got, 5000);
+    TRY
+        is_read_vints(istream, got, 1);
+        Assert(false, "Should have raised an EOF error");
+    XCATCHALL
+        HANDLED();
+    XENDTRY
+    is_close(istream);
+}
+
 /**
  * Test reading and writing of variable size 64-bit integers
  */
@@ -455,6 +504,55 @@ static void test_read_bytes(TestCase *tc, void *data)
     is_close(istream);
 }
 
+/**
+ * Test that reads are unaffected by the buffer size or by access advice
+ */
+static void test_buffer_size(TestCase *tc, void *data)
+{
+    int i, j;
+    Store *store = (Store *)data;
+    static const int sizes[] = { 1, SMALL_BUFFER_SIZE, BUFFER_SIZE + 1,
+                                 LARGE_BUFFER_SIZE };
+    OutStream *ostream = store->new_output(store, "_rw_bufsize.cfs");
+    InStream *istream, *clone;
+
+    for (i = 0; i < 10000; i++) {
+        os_write_vint(ostream, i * 77);
+    }
+    os_close(ostream);
+
+    istream = store->open_input(store, "_rw_bufsize.cfs");
+    for (j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++) {
+        is_seek(istream, 0);
+        is_set_buffer_size(istream, sizes[j]);
+        for (i = 0; i < 10000; i++) {
+            Aiequal(i * 77, is_read_vint(istream));
+        }
+    }
+
+    /* changing the buffer size keeps the current position */
+    is_seek(istream, 0);
+    for (i = 0; i < 5000; i++) {
+        is_read_vint(istream);
+    }
+    is_set_buffer_size(istream, SMALL_BUFFER_SIZE);
+    Aiequal(5000 * 77, is_read_vint(istream));
+
+    is_advise(istream, IS_SEQUENTIAL);
+    clone = is_clone(istream);
+    Aiequal(5001 * 77, is_read_vint(clone));
+    is_seek(istream, 0);
+    is_advise(istream, IS_RANDOM);
+    for (i = 0; i < 10000; i++) {
+        Aiequal(i * 77, is_read_vint(istream));
+    }
+    for (i = 5002; i < 10000; i++) {
+        Aiequal(i * 77, is_read_vint(clone));
+    }
+    is_close(clone);
+    is_close(istream);
+}
+
 /**
  * Create a test suite for a store. This function can be used to create a test
  * suite for both a FileSystem store and a RAM store and any other type of
@@ -473,12 +571,14 @@ void create_test_store_suite(TestSuite *suite, Store *store)
     tst_run_test(suite, test_rw_u32, store);
     tst_run_test(suite, test_rw_u64, store);
     tst_run_test(suite, test_rw_vints, store);
+    tst_run_test(suite, test_read_vints, store);
     tst_run_test(suite, test_rw_voff_ts, store);
     tst_run_test(suite, test_rw_strings, store);
     tst_run_test(suite, test_rw_funny_strings, store);
     tst_run_test(suite, test_buffer_seek, store);
     tst_run_test(suite, test_is_clone, store);
     tst_run_test(suite, test_read_bytes, store);
+    tst_run_test(suite, test_buffer_size, store);
     tst_run_test(suite, test_lock, store);
 
     store->clear_all(store);
@@ -82,12 +82,12 @@ static void test_segment_field_index_single_field(TestCase *tc, void *data)
     Store *store = (Store *)data;
     SegmentFieldIndex *sfi;
     SegmentTermIndex *sti;
-    TermInfosWriter *tiw = tiw_open(store, "_0", 32, SKIP_INTERVAL);
+    TermInfosWriter *tiw = tiw_open(store, "_0", NULL, 32, SKIP_INTERVAL);
 
     tiw_start_field(tiw, 0);
 
     for (i = 0; i < DICT_LEN; i++) {
-        TermInfo term_info = {(i % 20) + 1, i, i, 0};
+        TermInfo term_info = {(i % 20) + 1, i, i, 0, false, 0, 0};
         tiw_add(tiw, DICT[i], strlen(DICT[i]), &term_info);
     }
     tiw_close(tiw);
@@ -109,10 +109,10 @@ static void add_multi_field_terms(Store *store)
 {
     int i;
     int field_num = 0;
-    TermInfosWriter *tiw = tiw_open(store, "_0", 8, 8);
+    TermInfosWriter *tiw = tiw_open(store, "_0", NULL, 8, 8);
 
     for (i = 0; i < DICT_LEN; i++) {
-        TermInfo term_info = {(i % 20) + 1, i, i, i};
+        TermInfo term_info = {(i % 20) + 1, i, i, i, false, 0, 0};
         if (i % 40 == 0) {
             tiw_start_field(tiw, field_num);
             field_num += 2;
@@ -336,6 +336,196 @@ static void test_term_infos_reader(TestCase *tc, void *data)
     sfi_close(sfi);
 }
 
+static void check_term_index(TestCase *tc, Store *store, bool has_fst)
+{
+    int i, j, k;
+    char probe[MAX_WORD_SIZE];
+    SegmentFieldIndex *sfi = sfi_open(store, "_0");
+    TermInfosReader *tir = tir_open(store, sfi, "_0");
+    TermEnum *te = ste_new(store->open_input(store, "_0.tis"), sfi);
+    SegmentTermIndex *sti
+        = (SegmentTermIndex *)h_get_int(sfi->field_dict, 0);
+
+    Aiequal(has_fst, sti->fst_ptr >= 0);
+    Asequal(DICT[0], te->set_field(te, 0)->skip_to(te, ""));
+    Asequal(DICT[0], te->skip_to(te, "a"));
+    Apnull(te->skip_to(te, "z"));
+    for (i = 0; i < DICT_LEN; i++) {
+        const int len = (int)strlen(DICT[i]);
+        /* every prefix of each term and the term with each suffix after it */
+        for (k = 1; k <= len + 1; k++) {
+            if (k <= len) {
+                memcpy(probe, DICT[i], k);
+                probe[k] = '\0';
+            }
+            else {
+                sprintf(probe, "%sa", DICT[i]);
+            }
+            for (j = 0; j < DICT_LEN && strcmp(DICT[j], probe) < 0; j++) {
+            }
+            if (j < DICT_LEN) {
+                Asequal(DICT[j], te->skip_to(te, probe));
+                Aiequal(j, te->curr_ti.frq_ptr);
+            }
+            else {
+                Apnull(te->skip_to(te, probe));
+            }
+        }
+    }
+    tir_set_field(tir, 0);
+    for (i = DICT_LEN - 1; i >= 0; i--) {
+        Asequal(DICT[i], tir_get_term(tir, i));
+    }
+    te->close(te);
+    tir_close(tir);
+    sfi_close(sfi);
+}
+
+static void test_term_index_fst(TestCase *tc, void *data)
+{
+    int i;
+    Store *store = (Store *)data;
+    TermInfosWriter *tiw = tiw_open(store, "_0", NULL, 4, SKIP_INTERVAL);
+
+    tiw_start_field(tiw, 0);
+    for (i = 0; i < DICT_LEN; i++) {
+        TermInfo term_info = {1, i, i, 0, false, 0, 0};
+        tiw_add(tiw, DICT[i], strlen(DICT[i]), &term_info);
+    }
+    tiw_close(tiw);
+
+    check_term_index(tc, store, true);
+
+    /* segments written without an .fst file build the FST when read */
+    store->remove(store, "_0.fst");
+    check_term_index(tc, store, false);
+}
+
+static void test_term_blocks(TestCase *tc, void *data)
+{
+    int i, j;
+    Store *store = (Store *)data;
+    SegmentFieldIndex *sfi;
+    TermEnum *te;
+    TermInfosWriter *tiw = tiw_open(store, "_0", NULL, 16, 8);
+
+    tiw_start_field(tiw, 0);
+    for (i = 0; i < DICT_LEN; i++) {
+        TermInfo term_info = {i % 12 + 1, 3 * i, 5 * i, 7 * i, false, 0, 0};
+        tiw_add(tiw, DICT[i], strlen(DICT[i]), &term_info);
+    }
+    tiw_close(tiw);
+
+    sfi = sfi_open(store, "_0");
+    Atrue(sfi->term_blocks);
+    te = ste_new(store->open_input(store, "_0.tis"), sfi);
+    te->set_field(te, 0);
+
+    /* skip forwards in strides, reading a few terms after each skip */
+    for (i = 0; i < DICT_LEN; i += 7) {
+        Asequal(DICT[i], te->skip_to(te, DICT[i]));
+        for (j = i; j < MIN(i + 3, DICT_LEN); j++) {
+            if (j > i) {
+                Asequal(DICT[j], te->next(te));
+                Asequal(DICT[j - 1], te->prev_term);
+            }
+            Aiequal(j % 12 + 1, te->curr_ti.doc_freq);
+            Aiequal(3 * j, te->curr_ti.frq_ptr);
+            Aiequal(5 * j, te->curr_ti.prx_ptr);
+            if (j % 12 + 1 >= 8) {
+                Aiequal(7 * j, te->curr_ti.skip_offset);
+            }
+        }
+    }
+
+    /* and backwards, which seeks through the index each time */
+    for (i = DICT_LEN - 1; i >= 0; i -= 5) {
+        Asequal(DICT[i], te->skip_to(te, DICT[i]));
+        Aiequal(3 * i, te->curr_ti.frq_ptr);
+        Aiequal(5 * i, te->curr_ti.prx_ptr);
+    }
+    Apnull(te->skip_to(te, "zebra"));
+
+    te->close(te);
+    sfi_close(sfi);
+}
+
+static void test_term_bloom_filters(TestCase *tc, void *data)
+{
+    int i, field_num;
+    char buf[MAX_WORD_SIZE];
+    TermInfo term_info = {1, 0, 0, 0, false, 0, 0};
+    Store *store = (Store *)data;
+    SegmentFieldIndex *sfi;
+    SegmentTermIndex *sti;
+    TermInfosReader *tir;
+    TermInfosWriter *tiw;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    FieldInfo *fi = fi_new(I("b"), STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+
+    fis_add_field(fis, fi_new(I("a"), STORE_NO, INDEX_YES, TERM_VECTOR_NO));
+    fi->bits |= FI_BLOOM_FILTER_BM;
+    fis_add_field(fis, fi);
+    fis_add_field(fis, fi_new(I("c"), STORE_NO, INDEX_YES, TERM_VECTOR_NO));
+
+    tiw = tiw_open(store, "_0", fis, 16, SKIP_INTERVAL);
+    for (field_num = 0; field_num < 3; field_num++) {
+        tiw_start_field(tiw, field_num);
+        for (i = 0; i < DICT_LEN; i++) {
+            TermInfo term_info = {1, i, i, 0, false, 0, 0};
+            tiw_add(tiw, DICT[i], strlen(DICT[i]), &term_info);
+        }
+    }
+    tiw_close(tiw);
+    Atrue(store->exists(store, "_0.blm"));
+
+    sfi = sfi_open(store, "_0");
+    Atrue(sfi->bloom_filters);
+    Apnull(((SegmentTermIndex *)h_get_int(sfi->field_dict, 0))->bloom);
+    Apnull(((SegmentTermIndex *)h_get_int(sfi->field_dict, 2))->bloom);
+    sti = (SegmentTermIndex *)h_get_int(sfi->field_dict, 1);
+    Apnotnull(sti->bloom);
+    Atrue(sti->bloom_mask + 1 >= DICT_LEN * 10);
+
+    /* +ti+ points at the reader's enum so a lookup the filter rejects
+     * leaves it on the previous term while any other lookup scans past it */
+    tir = tir_open(store, sfi, "_0");
+    for (field_num = 0; field_num < 3; field_num++) {
+        int rejected = 0;
+        tir_set_field(tir, field_num);
+        for (i = 0; i < DICT_LEN - 1; i++) {
+            TermInfo *ti = tir_get_ti(tir, DICT[i]);
+            Apnotnull(ti);
+            if (ti) {
+                Aiequal(i, ti->frq_ptr);
+                sprintf(buf, "%s_", DICT[i]);
+                Apnull(tir_get_ti(tir, buf));
+                if (i == ti->frq_ptr) {
+                    rejected++;
+                }
+            }
+        }
+        if (1 == field_num) {
+            Atrue(rejected >= (DICT_LEN - 1) * 9 / 10);
+        }
+        else {
+            Aiequal(0, rejected);
+        }
+    }
+    tir_close(tir);
+    sfi_close(sfi);
+
+    /* no field wants a filter so there is no .blm file */
+    fi->bits &= ~FI_BLOOM_FILTER_BM;
+    store->remove(store, "_0.blm");
+    tiw = tiw_open(store, "_0", fis, 16, SKIP_INTERVAL);
+    tiw_start_field(tiw, 1);
+    tiw_add(tiw, DICT[0], strlen(DICT[0]), &term_info);
+    tiw_close(tiw);
+    Atrue(!store->exists(store, "_0.blm"));
+    fis_deref(fis);
+}
+
 TestSuite *ts_term(TestSuite *suite)
 {
     Store *store = open_ram_store();
@@ -346,6 +536,9 @@ TestSuite *ts_term(TestSuite *suite)
     tst_run_test(suite, test_segment_field_index_multi_field, store);
     tst_run_test(suite, test_segment_term_enum, store);
     tst_run_test(suite, test_term_infos_reader, store);
+    tst_run_test(suite, test_term_index_fst, store);
+    tst_run_test(suite, test_term_blocks, store);
+    tst_run_test(suite, test_term_bloom_filters, store);
 
     store_deref(store);
 
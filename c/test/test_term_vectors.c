@@ -8,29 +8,71 @@
 static void test_posting(TestCase *tc, void *data)
 {
     MemoryPool *mp = (MemoryPool *)data;
+    ByteBlockPool *bbp = bbp_new();
+    ByteBlockPool *tv_bbp = bbp_new();
+    ByteSliceReader bsr;
     PostingList *pl;
-    Posting *p = p_new(mp, 0, 10);
-    Aiequal(0, p->doc_num);
-    Aiequal(1, p->freq);
-    Aiequal(10, p->first_occ->pos);
-    Apnull(p->first_occ->next);
+    int i;
 
-    pl = pl_new(mp, "seven", 5, p);
+    pl = pl_new(mp, bbp, tv_bbp, "seven", 5, 0);
     Aiequal(5, pl->term_len);
     Asequal("seven", pl->term);
-    Apequal(p->first_occ, pl->last_occ);
-
-    pl_add_occ(mp, pl, 50);
-    Apequal(pl->last_occ, p->first_occ->next);
-    Aiequal(2, p->freq);
-    Aiequal(50,  pl->last_occ->pos);
-    Apnull(pl->last_occ->next);
-
-    pl_add_occ(mp, pl, 345);
-    Apequal(pl->last_occ, p->first_occ->next->next);
-    Aiequal(3, p->freq);
-    Aiequal(345, pl->last_occ->pos);
-    Apnull(pl->last_occ->next);
+    pl_add_pos(bbp, tv_bbp, pl, 10);
+    pl_add_pos(bbp, tv_bbp, pl, 50);
+    pl_add_pos(bbp, tv_bbp, pl, 345);
+    Aiequal(0, pl->last_doc);
+    Aiequal(3, pl->freq);
+    Aiequal(345, pl->last_pos);
+    bsr_init(&bsr, tv_bbp, pl->tv_start, pl->tv_upto);
+    Aiequal(10, bsr_read_vint(&bsr));
+    Aiequal(40, bsr_read_vint(&bsr));
+    Aiequal(295, bsr_read_vint(&bsr));
+    Atrue(bsr_eof(&bsr));
+
+    /* enough postings to take the slices through every level */
+    for (i = 1; i < 2000; i++) {
+        pl_add_doc(bbp, tv_bbp, pl, i * 3);
+        pl_add_pos(bbp, tv_bbp, pl, i);
+        if (i % 2) {
+            pl_add_pos(bbp, tv_bbp, pl, i + 100000);
+        }
+    }
+    Aiequal(5997, pl->last_doc);
+    Aiequal(2, pl->freq);
+
+    bsr_init(&bsr, bbp, pl->frq_start, pl->frq_upto);
+    Aiequal(0, bsr_read_vint(&bsr));
+    Aiequal(3, bsr_read_vint(&bsr));
+    for (i = 1; i < 1999; i++) {
+        if (i % 2) {
+            Aiequal(6, bsr_read_vint(&bsr));
+            Aiequal(2, bsr_read_vint(&bsr));
+        }
+        else {
+            Aiequal(7, bsr_read_vint(&bsr));
+        }
+    }
+    Atrue(bsr_eof(&bsr));
+
+    bsr_init(&bsr, bbp, pl->prx_start, pl->prx_upto);
+    Aiequal(10, bsr_read_vint(&bsr));
+    Aiequal(40, bsr_read_vint(&bsr));
+    Aiequal(295, bsr_read_vint(&bsr));
+    for (i = 1; i < 2000; i++) {
+        Aiequal(i, bsr_read_vint(&bsr));
+        if (i % 2) {
+            Aiequal(100000, bsr_read_vint(&bsr));
+        }
+    }
+    Atrue(bsr_eof(&bsr));
+
+    /* the term vector slice only holds the last document's positions */
+    bsr_init(&bsr, tv_bbp, pl->tv_start, pl->tv_upto);
+    Aiequal(1999, bsr_read_vint(&bsr));
+    Aiequal(100000, bsr_read_vint(&bsr));
+    Atrue(bsr_eof(&bsr));
+    bbp_destroy(tv_bbp);
+    bbp_destroy(bbp);
 }
 
 static FieldInfos *create_tv_fis()
@@ -66,16 +108,16 @@ static char **create_tv_terms(MemoryPool *mp)
     return terms;
 }
 
-static PostingList **create_tv_plists(MemoryPool *mp, char **terms)
+static PostingList **create_tv_plists(MemoryPool *mp, ByteBlockPool *bbp,
+                                      char **terms)
 {
     int i, j;
     PostingList **plists, *pl;
     plists = MP_ALLOC_N(mp, PostingList *, NUM_TERMS);
     for (i = 0; i < NUM_TERMS; i++) {
-        pl = plists[i] =
-            pl_new(mp, terms[i], 9, p_new(mp, 0, 0));
-        for (j = 1; j <= i; j++) {
-            pl_add_occ(mp, pl, j);
+        pl = plists[i] = pl_new(mp, bbp, bbp, terms[i], 9, 0);
+        for (j = 0; j <= i; j++) {
+            pl_add_pos(bbp, bbp, pl, j);
         }
     }
     return plists;
@@ -103,7 +145,8 @@ static void test_tv_single_doc(TestCase *tc, void *data)
     Hash *tvs;
     FieldInfos *fis = create_tv_fis();
     char **terms = create_tv_terms(mp);
-    PostingList **plists = create_tv_plists(mp, terms);
+    ByteBlockPool *bbp = bbp_new();
+    PostingList **plists = create_tv_plists(mp, bbp, terms);
     Offset *offsets = create_tv_offsets(mp);
     Document *doc = doc_new();
 
@@ -118,14 +161,14 @@ static void test_tv_single_doc(TestCase *tc, void *data)
     fw = fw_open(store, "_0", fis);
     fw_add_doc(fw, doc);
     fw_add_postings(fw, fis_get_field(fis, I("tv"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_add_postings(fw, fis_get_field(fis, I("tv_with_positions"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_add_postings(fw, fis_get_field(fis, I("tv_with_offsets"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_add_postings(fw,
                     fis_get_field(fis, I("tv_with_positions_offsets"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_write_tv_index(fw);
     fw_close(fw);
     doc_destroy(doc);
@@ -241,6 +284,7 @@ static void test_tv_single_doc(TestCase *tc, void *data)
 
     fr_close(fr);
     fis_deref(fis);
+    bbp_destroy(bbp);
     store_deref(store);
 }
 
@@ -255,42 +299,43 @@ static void test_tv_multi_doc(TestCase *tc, void *data)
     Hash *tvs;
     FieldInfos *fis = create_tv_fis();
     char **terms = create_tv_terms(mp);
-    PostingList **plists = create_tv_plists(mp, terms);
+    ByteBlockPool *bbp = bbp_new();
+    PostingList **plists = create_tv_plists(mp, bbp, terms);
     Offset *offsets = create_tv_offsets(mp);
     Document *doc = doc_new();
 
     fw = fw_open(store, "_0", fis);
     fw_add_doc(fw, doc);
     fw_add_postings(fw, fis_get_field(fis, I("tv"))->number,
-                     plists, NUM_TERMS, offsets, NUM_TERMS);
+                     bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
 
     fw_write_tv_index(fw); fw_add_doc(fw, doc);
 
     fw_add_postings(fw, fis_get_field(fis, I("tv_with_positions"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
 
     fw_write_tv_index(fw); fw_add_doc(fw, doc);
 
     fw_add_postings(fw, fis_get_field(fis, I("tv_with_offsets"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
 
     fw_write_tv_index(fw); fw_add_doc(fw, doc);
 
     fw_add_postings(fw,
                     fis_get_field(fis, I("tv_with_positions_offsets"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
 
     fw_write_tv_index(fw); fw_add_doc(fw, doc);
 
     fw_add_postings(fw, fis_get_field(fis, I("tv"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_add_postings(fw, fis_get_field(fis, I("tv_with_positions"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_add_postings(fw, fis_get_field(fis, I("tv_with_offsets"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
     fw_add_postings(fw,
                     fis_get_field(fis, I("tv_with_positions_offsets"))->number,
-                    plists, NUM_TERMS, offsets, NUM_TERMS);
+                    bbp, plists, NUM_TERMS, offsets, NUM_TERMS);
 
     fw_write_tv_index(fw);
     fw_close(fw);
@@ -399,6 +444,7 @@ static void test_tv_multi_doc(TestCase *tc, void *data)
 
     fr_close(fr);
     fis_deref(fis);
+    bbp_destroy(bbp);
     store_deref(store);
 }
 
@@ -150,6 +150,746 @@ static void test_threading(TestCase *tc, void *data)
     }
 }
 
+static void add_task(void *arg)
+{
+    int *num = (int *)arg;
+    *num += 1;
+}
+
+static void raise_task(void *arg)
+{
+    if (*(int *)arg == 3) {
+        RAISE(ARG_ERROR, "task %d failed", *(int *)arg);
+    }
+}
+
+/**
+ * Test that tp_run runs every task, with and without a thread limit, and passes
+ * on exceptions raised by a task.
+ */
+static void test_thread_pool(TestCase *tc, void *data)
+{
+    ThreadPool *pool = tp_new(4);
+    int nums[100], i, j;
+    void *args[100];
+    (void)data;
+
+    Aiequal(4, tp_thread_cnt(pool));
+    for (i = 0; i < 100; i++) {
+        nums[i] = i;
+        args[i] = &nums[i];
+    }
+    for (j = 0; j < 3; j++) {
+        tp_run(pool, &add_task, args, 100, j);
+    }
+    tp_run(NULL, &add_task, args, 100, 0);
+    for (i = 0; i < 100; i++) {
+        Aiequal(i + 4, nums[i]);
+    }
+
+    for (i = 0; i < 100; i++) {
+        nums[i] = i;
+    }
+    TRY
+        tp_run(pool, &raise_task, args, 100, 0);
+        Assert(false, "An ARG_ERROR should have been raised");
+    XCATCHALL
+        Aiequal(ARG_ERROR, xcontext.excode);
+        HANDLED();
+    XENDTRY
+    tp_destroy(pool);
+}
+
+#define CIW_THREADS 6
+#define CIW_DOCS 300
+
+struct ConcurrentAddArg
+{
+    IndexWriter *iw;
+    int thread_num;
+};
+
+static void *concurrent_add_thread(void *p)
+{
+    struct ConcurrentAddArg *arg = (struct ConcurrentAddArg *)p;
+    char field[32];
+    int i;
+
+    /* each thread adds a field of its own half way through */
+    sprintf(field, "field%d", arg->thread_num);
+    for (i = 0; i < CIW_DOCS; i++) {
+        Document *doc = doc_new();
+        int n = arg->thread_num * CIW_DOCS + i;
+        doc_add_field(doc, df_add_data(df_new(I(id)),
+                                       strfmt("%d", n)))->destroy_data = true;
+        doc_add_field(doc, df_add_data(df_new(I(contents)),
+                                       num_to_str(n)))->destroy_data = true;
+        if (i >= CIW_DOCS / 2) {
+            doc_add_field(doc, df_add_data(df_new(I(field)),
+                                           "extra"));
+        }
+        iw_add_doc(arg->iw, doc);
+        doc_destroy(doc);
+    }
+    return NULL;
+}
+
+/**
+ * Test adding documents to an IndexWriter from several threads at once with
+ * a DocWriter per thread.
+ */
+static void test_concurrent_iw_add_doc(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    TermDocEnum *tde;
+    Document *doc;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    struct ConcurrentAddArg args[CIW_THREADS];
+    pthread_t thread_ids[CIW_THREADS];
+    char buf[32];
+    int i;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_doc_writers = 4;
+    config.max_buffered_docs = 37;
+    config.merge_factor = 3;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < CIW_THREADS; i++) {
+        args[i].iw = iw;
+        args[i].thread_num = i;
+        pthread_create(&thread_ids[i], NULL, &concurrent_add_thread, &args[i]);
+    }
+    for (i = 0; i < CIW_THREADS; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    Aiequal(CIW_THREADS * CIW_DOCS, iw_doc_count(iw));
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(CIW_THREADS * CIW_DOCS, ir->num_docs(ir));
+    tde = ir->term_docs(ir);
+    for (i = 0; i < CIW_THREADS * CIW_DOCS; i += 7) {
+        sprintf(buf, "%d", i);
+        tde->seek(tde, fis_get_field_num(ir->fis, I(id)), buf);
+        Assert(tde->next(tde), "doc %d should have been indexed", i);
+        doc = ir->get_doc(ir, tde->doc_num(tde));
+        Asequal(buf, doc_get_field(doc, I(id))->data[0]);
+        doc_destroy(doc);
+        Assert(!tde->next(tde), "doc %d should only be indexed once", i);
+    }
+    for (i = 0; i < CIW_THREADS; i++) {
+        sprintf(buf, "field%d", i);
+        Aiequal(CIW_DOCS / 2,
+                ir->doc_freq(ir, fis_get_field_num(ir->fis, I(buf)), "extra"));
+    }
+    tde->close(tde);
+    ir_close(ir);
+    store_deref(store);
+}
+
+#define RGD_THREADS 4
+#define RGD_DOCS 500
+#define RGD_READS 5000
+
+struct ReopenGetDocArg
+{
+    IndexReader *ir;
+    int thread_num;
+    int wrong_docs;
+};
+
+static void *reopen_get_doc_thread(void *p)
+{
+    struct ReopenGetDocArg *arg = (struct ReopenGetDocArg *)p;
+    char buf[32];
+    int i;
+
+    for (i = 0; i < RGD_READS; i++) {
+        int n = (i * 31 + arg->thread_num * 97) % RGD_DOCS;
+        Document *doc = arg->ir->get_doc(arg->ir, n);
+        sprintf(buf, "%d", n);
+        if (strcmp(buf, doc_get_field(doc, I(id))->data[0])) {
+            arg->wrong_docs++;
+        }
+        doc_destroy(doc);
+    }
+    return NULL;
+}
+
+/**
+ * Test reading documents from a reader and the reader ir_reopen opened from
+ * it at the same time. The two share the segment's files so each has to read
+ * the stored fields through its own streams.
+ */
+static void test_reopened_reader_get_doc(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir, *ir2;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    struct ReopenGetDocArg args[RGD_THREADS];
+    pthread_t thread_ids[RGD_THREADS];
+    Document *doc;
+    int i;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_buffered_docs = RGD_DOCS;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < RGD_DOCS; i++) {
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I(id)),
+                                       strfmt("%d", i)))->destroy_data = true;
+        doc_add_field(doc, df_add_data(df_new(I(contents)),
+                                       num_to_str(i)))->destroy_data = true;
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+    ir = ir_open(store);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I(id)), "extra"));
+    iw_add_doc(iw, doc);
+    doc_destroy(doc);
+    iw_close(iw);
+    ir2 = ir_reopen(ir);
+    Atrue(ir2 != ir);
+    Aiequal(RGD_DOCS + 1, ir2->num_docs(ir2));
+
+    for (i = 0; i < RGD_THREADS; i++) {
+        args[i].ir = (i % 2) ? ir2 : ir;
+        args[i].thread_num = i;
+        args[i].wrong_docs = 0;
+        pthread_create(&thread_ids[i], NULL, &reopen_get_doc_thread, &args[i]);
+    }
+    for (i = 0; i < RGD_THREADS; i++) {
+        pthread_join(thread_ids[i], NULL);
+        Aiequal(0, args[i].wrong_docs);
+    }
+    ir_close(ir2);
+    ir_close(ir);
+    store_deref(store);
+}
+
+#define BGM_DOCS 1000
+
+/**
+ * Test merging segments on background threads. With a single DocWriter the
+ * merged segments must take the place of the ones they replace so documents
+ * keep the order they were added in, even when segments are flushed while
+ * the merges run.
+ */
+static void test_background_merges(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    Document *doc;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    const char *extra = "extra";
+    char buf[32];
+    int i;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_buffered_docs = 10;
+    config.merge_factor = 3;
+    config.max_merge_threads = 2;
+    config.max_pending_merges = 1;
+    config.merge_rate_limit = 100000000;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < BGM_DOCS; i++) {
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I(id)),
+                                       strfmt("%d", i)))->destroy_data = true;
+        doc_add_field(doc, df_add_data(df_new(I(contents)),
+                                       num_to_str(i)))->destroy_data = true;
+        if (i >= BGM_DOCS / 2) {
+            /* new fields are added while merges are running */
+            doc_add_field(doc, df_add_data(df_new(I(extra)), "extra"));
+        }
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+        if (i == BGM_DOCS / 4) {
+            iw_commit(iw);
+        }
+    }
+    Aiequal(BGM_DOCS, iw_doc_count(iw));
+    iw_delete_term(iw, I(id), "10");
+    iw_close(iw);
+
+    sis = sis_read(store);
+    Assert(sis->size < 10, "segments should have been merged, found %d",
+           sis->size);
+    sis_destroy(sis);
+
+    ir = ir_open(store);
+    Aiequal(BGM_DOCS - 1, ir->num_docs(ir));
+    Aiequal(BGM_DOCS / 2,
+            ir->doc_freq(ir, fis_get_field_num(ir->fis, I(extra)), "extra"));
+    for (i = 0; i < BGM_DOCS; i += 7) {
+        if (i == 10) continue;
+        sprintf(buf, "%d", i);
+        doc = ir->get_doc(ir, i);
+        Asequal(buf, doc_get_field(doc, I(id))->data[0]);
+        doc_destroy(doc);
+    }
+    ir_close(ir);
+    store_deref(store);
+}
+
+/**
+ * Test background merges while several DocWriters add documents at once
+ */
+static void test_concurrent_iw_add_doc_background_merges(TestCase *tc,
+                                                         void *data)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    struct ConcurrentAddArg args[CIW_THREADS];
+    pthread_t thread_ids[CIW_THREADS];
+    int i;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_doc_writers = 4;
+    config.max_buffered_docs = 23;
+    config.merge_factor = 3;
+    config.max_merge_threads = 3;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < CIW_THREADS; i++) {
+        args[i].iw = iw;
+        args[i].thread_num = i;
+        pthread_create(&thread_ids[i], NULL, &concurrent_add_thread, &args[i]);
+    }
+    for (i = 0; i < CIW_THREADS; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    Aiequal(CIW_THREADS * CIW_DOCS, iw_doc_count(iw));
+    iw_optimize(iw);
+    iw_close(iw);
+
+    sis = sis_read(store);
+    Aiequal(1, sis->size);
+    sis_destroy(sis);
+    ir = ir_open(store);
+    Aiequal(CIW_THREADS * CIW_DOCS, ir->num_docs(ir));
+    ir_close(ir);
+    store_deref(store);
+}
+
+static void add_version_doc(IndexWriter *iw, int n, const char *version)
+{
+    Document *doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I(id)),
+                                   strfmt("%d", n)))->destroy_data = true;
+    doc_add_field(doc, df_add_data(df_new(I(contents)), (char *)version));
+    iw_add_doc(iw, doc);
+    doc_destroy(doc);
+}
+
+static void *concurrent_update_thread(void *p)
+{
+    struct ConcurrentAddArg *arg = (struct ConcurrentAddArg *)p;
+    char buf[32];
+    int i;
+
+    for (i = 0; i < CIW_DOCS; i++) {
+        int n = arg->thread_num * CIW_DOCS + i;
+        add_version_doc(arg->iw, n, "one");
+        if (i % 3 == 2) {
+            /* replace one of this thread's earlier documents */
+            sprintf(buf, "%d", n - 2);
+            iw_delete_term(arg->iw, I(id), buf);
+            add_version_doc(arg->iw, n - 2, "two");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test replacing documents with a delete and an add while several
+ * DocWriters add documents and segments are merged in the background. The
+ * buffered deletes mustn't reach the replacements and deletes made while a
+ * segment is being merged must be carried over to the merged segment.
+ */
+static void test_concurrent_updates(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    TermDocEnum *tde;
+    Document *doc;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    struct ConcurrentAddArg args[CIW_THREADS];
+    pthread_t thread_ids[CIW_THREADS];
+    char buf[32];
+    int i;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_doc_writers = 4;
+    config.max_buffered_docs = 23;
+    config.merge_factor = 3;
+    config.max_merge_threads = 2;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < CIW_THREADS; i++) {
+        args[i].iw = iw;
+        args[i].thread_num = i;
+        pthread_create(&thread_ids[i], NULL, &concurrent_update_thread,
+                       &args[i]);
+    }
+    for (i = 0; i < CIW_THREADS; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(CIW_THREADS * CIW_DOCS, ir->num_docs(ir));
+    Aiequal(CIW_THREADS * (CIW_DOCS / 3),
+            ir->doc_freq(ir, fis_get_field_num(ir->fis, I(contents)), "two"));
+    tde = ir->term_docs(ir);
+    for (i = 0; i < CIW_THREADS * CIW_DOCS; i++) {
+        sprintf(buf, "%d", i);
+        tde->seek(tde, fis_get_field_num(ir->fis, I(id)), buf);
+        if (!Assert(tde->next(tde), "doc %d should be in the index", i)) {
+            continue;
+        }
+        doc = ir->get_doc(ir, tde->doc_num(tde));
+        Asequal((i % CIW_DOCS) % 3 == 0 ? "two" : "one",
+                doc_get_field(doc, I(contents))->data[0]);
+        doc_destroy(doc);
+        Assert(!tde->next(tde), "doc %d should only be indexed once", i);
+    }
+    tde->close(tde);
+    ir_close(ir);
+    store_deref(store);
+}
+
+static void add_numbered_doc(Index *index, int n)
+{
+    Document *doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I(id)),
+                                   strfmt("%d", n)))->destroy_data = true;
+    doc_add_field(doc, df_add_data(df_new(I(contents)),
+                                   num_to_str(n)))->destroy_data = true;
+    index_add_doc(index, doc);
+    doc_destroy(doc);
+}
+
+static int index_total_hits(Index *index, char *query)
+{
+    TopDocs *td = index_search_str(index, query, 0, 10, NULL, NULL, NULL);
+    int total_hits = td->total_hits;
+    td_destroy(td);
+    return total_hits;
+}
+
+/**
+ * Test an Index which keeps its IndexWriter open while it searches. Writes
+ * only show up once the reader is refreshed and the writer stays open unless
+ * a document is deleted by number.
+ */
+static void test_index_keep_writer(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    HashSet *def_fields = hs_new_str(NULL);
+    Index *index;
+    IndexWriter *iw;
+    int i;
+    (void)data;
+
+    hs_add(def_fields, (char *)I(contents));
+    index = index_new(store, NULL, def_fields, true);
+    hs_destroy(def_fields);
+    index->keep_writer = true;
+    index->refresh_writes = 10;
+    index->refresh_interval = 3600;
+
+    for (i = 0; i < 5; i++) {
+        add_numbered_doc(index, i);
+    }
+    iw = index->iw;
+    Aiequal(5, index_size(index));
+    Apequal(iw, index->iw);
+
+    /* the reader is refreshed after 10 writes */
+    for (i = 5; i < 10; i++) {
+        add_numbered_doc(index, i);
+    }
+    Aiequal(5, index_size(index));
+    Aiequal(0, index_total_hits(index, "seven"));
+    for (i = 10; i < 15; i++) {
+        add_numbered_doc(index, i);
+    }
+    Aiequal(15, index_size(index));
+    Aiequal(1, index_total_hits(index, "seven"));
+    Apequal(iw, index->iw);
+
+    /* deletes go through the writer */
+    index_delete_id(index, "3");
+    index_delete_query_str(index, "seven", NULL, NULL);
+    Aiequal(15, index_size(index));
+    index_flush(index);
+    Aiequal(13, index_size(index));
+    Aiequal(0, index_total_hits(index, "seven"));
+    Apequal(iw, index->iw);
+
+    /* deleting by number hands the write lock to the reader */
+    index_delete(index, 0);
+    Apnull(index->iw);
+    Aiequal(12, index_size(index));
+    add_numbered_doc(index, 15);
+    Atrue(index->iw != NULL);
+    index_flush(index);
+    Aiequal(13, index_size(index));
+
+    /* refresh on every search */
+    index->refresh_interval = 0;
+    add_numbered_doc(index, 16);
+    Aiequal(14, index_size(index));
+
+    index_destroy(index);
+    store_deref(store);
+}
+
+#define PMS_DOCS 600
+#define PMS_FIELDS 6
+#define PMS_SKIP_INTERVAL 4
+
+static Store *parallel_merge_stages_index(int stage_threads)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    Document *doc;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES,
+                              TERM_VECTOR_WITH_POSITIONS_OFFSETS);
+    char field[16];
+    int i, j;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_buffered_docs = 50;
+    config.skip_interval = PMS_SKIP_INTERVAL;
+    config.use_compound_file = false;
+    config.merge_stage_threads = stage_threads;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < PMS_DOCS; i++) {
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I(id)),
+                                       strfmt("%d", i)))->destroy_data = true;
+        for (j = 0; j < PMS_FIELDS; j++) {
+            if ((i + j) % (j + 1) == 0) {
+                DocField *df;
+                sprintf(field, "field%d", j);
+                df = doc_add_field(doc, df_new(I(field)));
+                df->destroy_data = true;
+                df_add_data(df, num_to_str(i * (j + 1)));
+                /* terms in many documents of every segment, so each
+                 * partition rebases skip lists with several levels */
+                df_add_data(df, strfmt("common c%d common", i % 3));
+            }
+        }
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+        if (i % 97 == 0) {
+            iw_commit(iw);
+        }
+    }
+    iw_delete_term(iw, I(id), "3");
+    iw_delete_term(iw, I(id), "300");
+    iw_optimize(iw);
+    iw_close(iw);
+    return store;
+}
+
+typedef struct SameFilesArg {
+    TestCase *tc;
+    Store *store1;
+    Store *store2;
+} SameFilesArg;
+
+/* check that +file_name+ is the same in both stores, bar the segments file */
+static void assert_same_file(const char *file_name, void *arg)
+{
+    SameFilesArg *sfa = (SameFilesArg *)arg;
+    TestCase *tc = sfa->tc;
+    InStream *is1, *is2;
+    off_t len, i;
+    if (0 == strncmp(file_name, "segments", 8)) {
+        return;
+    }
+    if (!Assert(sfa->store1->exists(sfa->store1, file_name),
+                "%s shouldn't exist", file_name)) {
+        return;
+    }
+    is1 = sfa->store1->open_input(sfa->store1, file_name);
+    is2 = sfa->store2->open_input(sfa->store2, file_name);
+    len = is_length(is1);
+    if (Aiequal(len, is_length(is2))) {
+        for (i = 0; i < len; i++) {
+            if (is_read_byte(is1) != is_read_byte(is2)) {
+                Assert(false, "%s differs at byte %d", file_name, (int)i);
+                break;
+            }
+        }
+    }
+    is_close(is1);
+    is_close(is2);
+}
+
+/**
+ * Test running the merge stages, and term partitions, in parallel. The merged
+ * segment must be exactly the same as the one merged a stage at a time and
+ * the partitions' temporary files must be gone.
+ */
+static void test_parallel_merge_stages(TestCase *tc, void *data)
+{
+    Store *serial_store = parallel_merge_stages_index(1);
+    int stage_threads[] = {2, 6};
+    SameFilesArg sfa;
+    int i;
+    (void)data;
+
+    sfa.tc = tc;
+    sfa.store1 = serial_store;
+    for (i = 0; i < NELEMS(stage_threads); i++) {
+        Store *store = parallel_merge_stages_index(stage_threads[i]);
+        SegmentInfos *sis = sis_read(store);
+        IndexReader *ir;
+        Aiequal(1, sis->size);
+        sis_destroy(sis);
+
+        sfa.store2 = store;
+        store->each(store, &assert_same_file, &sfa);
+        Aiequal(serial_store->count(serial_store), store->count(store));
+
+        ir = ir_open(store);
+        Aiequal(PMS_DOCS - 2, ir->num_docs(ir));
+        Atrue(ir->doc_freq(ir, fis_get_field_num(ir->fis, I("field5")),
+                           "common")
+              > PMS_SKIP_INTERVAL * PMS_SKIP_INTERVAL * PMS_SKIP_INTERVAL);
+        ir_close(ir);
+        store_deref(store);
+    }
+    store_deref(serial_store);
+}
+
+#define AD_DOCS 500
+#define AD_BATCH 64
+
+/* build an index with iw_add_docs, analyzing on +analysis_threads+ threads */
+static Store *add_docs_index(int analysis_threads, int max_doc_writers)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES,
+                              TERM_VECTOR_WITH_POSITIONS_OFFSETS);
+    Document *docs[AD_BATCH];
+    char field[32];
+    int i, j, cnt = 0;
+
+    fis_add_field(fis, fi_new(I(id), STORE_YES, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_buffered_docs = 70;
+    config.max_field_length = 40;
+    config.use_compound_file = false;
+    config.analysis_threads = analysis_threads;
+    config.max_doc_writers = max_doc_writers;
+    iw = iw_open(store, standard_analyzer_new(true), &config);
+    for (i = 0; i < AD_DOCS; i++) {
+        Document *doc = doc_new();
+        DocField *df;
+        doc_add_field(doc, df_add_data(df_new(I(id)),
+                                       strfmt("%d", i)))->destroy_data = true;
+        df = doc_add_field(doc, df_new(I(contents)));
+        df->destroy_data = true;
+        for (j = 0; j <= i % 3; j++) {
+            df_add_data(df, num_to_str(i * 7919 + j));
+        }
+        /* new fields keep turning up part way through batches */
+        sprintf(field, "field%d", i / 50);
+        doc_add_field(doc, df_add_data(df_new(I(field)),
+                      num_to_str(i)))->destroy_data = true;
+        docs[cnt++] = doc;
+        if (cnt == AD_BATCH || i == AD_DOCS - 1) {
+            iw_add_docs(iw, docs, cnt);
+            for (j = 0; j < cnt; j++) {
+                doc_destroy(docs[j]);
+            }
+            cnt = 0;
+        }
+    }
+    iw_close(iw);
+    return store;
+}
+
+/**
+ * Test analyzing documents added with iw_add_docs on a thread pool. With a
+ * single DocWriter the index must be exactly the same as one whose
+ * documents were analyzed as they were inverted.
+ */
+static void test_iw_add_docs(TestCase *tc, void *data)
+{
+    Store *serial_store = add_docs_index(1, 1);
+    Store *store = add_docs_index(4, 1);
+    SameFilesArg sfa;
+    IndexReader *ir;
+    TermDocEnum *tde;
+    char buf[32];
+    int i;
+    (void)data;
+
+    sfa.tc = tc;
+    sfa.store1 = serial_store;
+    sfa.store2 = store;
+    store->each(store, &assert_same_file, &sfa);
+    Aiequal(serial_store->count(serial_store), store->count(store));
+    store_deref(store);
+    store_deref(serial_store);
+
+    /* concurrent DocWriters take the analyzed documents too */
+    store = add_docs_index(3, 2);
+    ir = ir_open(store);
+    Aiequal(AD_DOCS, ir->num_docs(ir));
+    tde = ir->term_docs(ir);
+    for (i = 0; i < AD_DOCS; i += 11) {
+        Document *doc;
+        sprintf(buf, "%d", i);
+        tde->seek(tde, fis_get_field_num(ir->fis, I(id)), buf);
+        Assert(tde->next(tde), "doc %d should have been indexed", i);
+        doc = ir->get_doc(ir, tde->doc_num(tde));
+        Asequal(buf, doc_get_field(doc, I(id))->data[0]);
+        doc_destroy(doc);
+    }
+    tde->close(tde);
+    ir_close(ir);
+    store_deref(store);
+}
+
 TestSuite *ts_threading(TestSuite *suite)
 {
     Analyzer *a = letter_analyzer_new(true);
@@ -174,6 +914,15 @@ TestSuite *ts_threading(TestSuite *suite)
     a_deref(a);
 
     tst_run_test(suite, test_number_to_str, NULL);
+    tst_run_test(suite, test_thread_pool, NULL);
+    tst_run_test(suite, test_concurrent_iw_add_doc, NULL);
+    tst_run_test(suite, test_reopened_reader_get_doc, NULL);
+    tst_run_test(suite, test_background_merges, NULL);
+    tst_run_test(suite, test_concurrent_iw_add_doc_background_merges, NULL);
+    tst_run_test(suite, test_concurrent_updates, NULL);
+    tst_run_test(suite, test_index_keep_writer, NULL);
+    tst_run_test(suite, test_parallel_merge_stages, NULL);
+    tst_run_test(suite, test_iw_add_docs, NULL);
     tst_run_test(suite, test_threading_test, index);
     tst_run_test(suite, test_threading, index);
 
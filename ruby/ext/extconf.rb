@@ -5,11 +5,11 @@ if (/mswin/ =~ RUBY_PLATFORM) and ENV['make'].nil?
   create_makefile("ferret_ext")
 elsif ENV['FERRET_DEV']
   require 'mkmf'
-  $CFLAGS = " -g -Wall -fno-stack-protector -fno-common -D_FILE_OFFSET_BITS=64 -D_XOPEN_SOURCE=500"
+  $CFLAGS = " -g -Wall -fno-stack-protector -fno-common -D_FILE_OFFSET_BITS=64 -D_XOPEN_SOURCE=600"
   puts $CFLAGS
   create_makefile("ferret_ext")
 else
   require 'mkmf'
-  $CFLAGS += " -Wall -D_FILE_OFFSET_BITS=64 -D_XOPEN_SOURCE=500"
+  $CFLAGS += " -Wall -D_FILE_OFFSET_BITS=64 -D_XOPEN_SOURCE=600"
   create_makefile("ferret_ext")
 end